@@ -46,6 +46,15 @@ DAQ_LINKAGE DAQ_Module_h daq_modules_first(void);
 DAQ_LINKAGE DAQ_Module_h daq_modules_next(void);
 DAQ_LINKAGE void daq_unload_modules(void);
 
+/* Message metadata type registry.  Registering a name again returns the existing type ID as long
+    as the size matches.  The registry isn't locked: like loading modules, registering types (which
+    modules do when they are loaded) must be finished before any instances are created, after which
+    it is only read.  Unloading the modules clears it. */
+DAQ_LINKAGE int daq_meta_type_register(const char *name, size_t size);
+DAQ_LINKAGE int daq_meta_type_lookup(const char *name);
+DAQ_LINKAGE const char *daq_meta_type_name(unsigned type);
+DAQ_LINKAGE size_t daq_meta_type_size(unsigned type);
+
 /* Enumeration to String translation functions. */
 DAQ_LINKAGE const char *daq_mode_string(DAQ_Mode mode);
 DAQ_LINKAGE const char *daq_state_string(DAQ_State state);
@@ -119,6 +128,14 @@ DAQ_LINKAGE unsigned daq_instance_msg_receive(DAQ_Instance_h instance, const uns
         DAQ_Msg_h msgs[], DAQ_RecvStatus *rstat);
 DAQ_LINKAGE int daq_instance_msg_finalize(DAQ_Instance_h instance, DAQ_Msg_h msg, DAQ_Verdict verdict);
 DAQ_LINKAGE int daq_instance_get_msg_pool_info(DAQ_Instance_h instance, DAQ_MsgPoolInfo_t *info);
+/* Thread-safe injection: queued by any thread and performed by the thread that owns the instance.
+    A relative injection is performed before the next message is finalized, so its original message
+    must not have been finalized when it is queued. */
+DAQ_LINKAGE int daq_instance_queue_inject(DAQ_Instance_h instance, DAQ_MsgType type, const void *hdr,
+        const uint8_t *data, uint32_t data_len);
+DAQ_LINKAGE int daq_instance_queue_inject_relative(DAQ_Instance_h instance, DAQ_Msg_h msg,
+        const uint8_t *data, uint32_t data_len, int reverse);
+DAQ_LINKAGE int daq_instance_get_inject_queue_stats(DAQ_Instance_h instance, DAQ_InjectQueueStats_t *stats);
 
 /* DAQ Message convenience functions */
 static inline DAQ_MsgType daq_msg_get_type(DAQ_Msg_h msg)
@@ -151,9 +168,23 @@ static inline uint8_t *daq_msg_get_data(DAQ_Msg_h msg)
     return msg->data;
 }
 
-static inline const void *daq_msg_get_meta(DAQ_Msg_h msg, uint8_t slot)
+static inline const void *daq_msg_get_meta(DAQ_Msg_h msg, unsigned type)
+{
+    return daq_msg_find_meta(msg, type);
+}
+
+/* Timestamp of a packet message in nanoseconds, falling back on the microsecond timestamp in its
+    header when the module didn't attach a full resolution one.  The type ID is the one returned by
+    daq_meta_type_lookup(DAQ_META_TYPE_TIMESTAMP), which is negative when no module provides it. */
+static inline uint64_t daq_msg_get_timestamp_ns(DAQ_Msg_h msg, int ts_type)
 {
-    return msg->meta[slot];
+    const DAQ_PktTimestamp_t *pts = NULL;
+    if (ts_type >= 0)
+        pts = (const DAQ_PktTimestamp_t *) daq_msg_find_meta(msg, ts_type);
+    if (pts)
+        return pts->nsec;
+    const DAQ_PktHdr_t *hdr = (const DAQ_PktHdr_t *) msg->hdr;
+    return (uint64_t) hdr->ts.tv_sec * 1000000000 + (uint64_t) hdr->ts.tv_usec * 1000;
 }
 
 static inline int daq_napt_info_src_addr_family(const DAQ_NAPTInfo_t *napti)
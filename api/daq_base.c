@@ -53,6 +53,23 @@ static DAQ_ListNode_t *module_list = NULL;
 static DAQ_ListNode_t *module_list_iter = NULL;
 static int num_modules = 0;
 
+typedef struct _daq_meta_type
+{
+    const char *name;
+    size_t size;
+} DAQ_MetaType_t;
+
+/* The built-in metadata types occupy the IDs of the message's meta slots, some of which are spare.
+    Registered types are numbered from there on. */
+static const DAQ_MetaType_t builtin_meta_types[DAQ_MSG_META_SLOTS] = {
+    [DAQ_PKT_META_NAPT_INFO] = { "napt_info", sizeof(DAQ_NAPTInfo_t) },
+    [DAQ_PKT_META_DECODE_DATA] = { "decode_data", sizeof(DAQ_PktDecodeData_t) },
+    [DAQ_PKT_META_TCP_ACK_DATA] = { "tcp_ack_data", sizeof(DAQ_PktTcpAckData_t) },
+};
+/* Each registered type is allocated along with its name */
+static DAQ_MetaType_t **registered_meta_types = NULL;
+static unsigned num_registered_meta_types = 0;
+
 static const char *daq_verdict_strings[MAX_DAQ_VERDICT] = {
     "pass",         // DAQ_VERDICT_PASS
     "block",        // DAQ_VERDICT_BLOCK
@@ -101,6 +118,98 @@ DAQ_LINKAGE const char *daq_state_string(DAQ_State state)
     return daq_state_strings[state];
 }
 
+static const DAQ_MetaType_t *get_meta_type(unsigned type)
+{
+    if (type < DAQ_MSG_META_SLOTS)
+        return builtin_meta_types[type].name ? &builtin_meta_types[type] : NULL;
+
+    type -= DAQ_MSG_META_SLOTS;
+    if (type >= num_registered_meta_types)
+        return NULL;
+
+    return registered_meta_types[type];
+}
+
+DAQ_LINKAGE int daq_meta_type_lookup(const char *name)
+{
+    unsigned type;
+
+    if (!name)
+        return DAQ_ERROR_INVAL;
+
+    for (type = 0; type < DAQ_MSG_META_SLOTS; type++)
+    {
+        if (builtin_meta_types[type].name && !strcmp(name, builtin_meta_types[type].name))
+            return type;
+    }
+
+    for (type = 0; type < num_registered_meta_types; type++)
+    {
+        if (!strcmp(name, registered_meta_types[type]->name))
+            return DAQ_MSG_META_SLOTS + type;
+    }
+
+    return DAQ_ERROR_NOTSUP;
+}
+
+DAQ_LINKAGE int daq_meta_type_register(const char *name, size_t size)
+{
+    DAQ_MetaType_t **types, *meta_type;
+    size_t name_len;
+    int type;
+
+    if (!name || !*name || size == 0)
+        return DAQ_ERROR_INVAL;
+
+    /* Modules producing and consuming a type both register it and get the same ID, provided that
+        they agree on what it is. */
+    type = daq_meta_type_lookup(name);
+    if (type >= 0)
+    {
+        if (get_meta_type(type)->size != size)
+        {
+            DEBUG("Metadata type '%s' is already registered with size %zu (versus %zu)!\n",
+                    name, get_meta_type(type)->size, size);
+            return DAQ_ERROR_EXISTS;
+        }
+        return type;
+    }
+
+    types = realloc(registered_meta_types, (num_registered_meta_types + 1) * sizeof(DAQ_MetaType_t *));
+    if (!types)
+        return DAQ_ERROR_NOMEM;
+    registered_meta_types = types;
+
+    name_len = strlen(name) + 1;
+    meta_type = malloc(sizeof(DAQ_MetaType_t) + name_len);
+    if (!meta_type)
+        return DAQ_ERROR_NOMEM;
+    memcpy(meta_type + 1, name, name_len);
+    meta_type->name = (const char *) (meta_type + 1);
+    meta_type->size = size;
+
+    type = DAQ_MSG_META_SLOTS + num_registered_meta_types;
+    types[num_registered_meta_types++] = meta_type;
+
+    DEBUG("Registered metadata type '%s' as %d\n", name, type);
+
+    return type;
+}
+
+DAQ_LINKAGE const char *daq_meta_type_name(unsigned type)
+{
+    const DAQ_MetaType_t *mt = get_meta_type(type);
+
+    return mt ? mt->name : NULL;
+}
+
+DAQ_LINKAGE size_t daq_meta_type_size(unsigned type)
+{
+    const DAQ_MetaType_t *mt = get_meta_type(type);
+
+    return mt ? mt->size : 0;
+}
+
 DAQ_LINKAGE const DAQ_ModuleAPI_t *daq_find_module(const char *name)
 {
     DAQ_ListNode_t *node;
@@ -292,6 +401,15 @@ DAQ_LINKAGE int daq_load_dynamic_modules(const char *directory_list[])
     return DAQ_SUCCESS;
 }
 
+static void clear_meta_types(void)
+{
+    for (unsigned type = 0; type < num_registered_meta_types; type++)
+        free(registered_meta_types[type]);
+    free(registered_meta_types);
+    registered_meta_types = NULL;
+    num_registered_meta_types = 0;
+}
+
 DAQ_LINKAGE void daq_unload_modules(void)
 {
     DAQ_ListNode_t *node;
@@ -307,6 +425,9 @@ DAQ_LINKAGE void daq_unload_modules(void)
         free(node);
         num_modules--;
     }
+
+    /* The types were registered by the modules that just went away. */
+    clear_meta_types();
 }
 
 DAQ_LINKAGE const DAQ_ModuleAPI_t *daq_modules_first(void)
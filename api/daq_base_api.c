@@ -88,4 +88,5 @@ void populate_base_api(DAQ_BaseAPI_t *base_api)
     base_api->config_next_variable = daq_module_config_next_variable;
     base_api->resolve_subapi = daq_modinst_resolve_subapi;
     base_api->set_errbuf = base_api_set_errbuf;
+    base_api->meta_type_register = daq_meta_type_register;
 }
@@ -32,7 +32,7 @@ extern "C" {
 #include <unistd.h>
 
 // Comprehensive version number covering all elements of this header
-#define DAQ_COMMON_API_VERSION  0x00030002
+#define DAQ_COMMON_API_VERSION  0x00030006
 
 #ifndef DAQ_SO_PUBLIC
 #  ifdef HAVE_VISIBILITY
@@ -93,20 +93,62 @@ typedef enum
     for use by DAQ modules.  Applications should use the pseudo-opaque DAQ_Msg_h and the inline
     accessor functions (daq_msg_*) from daq.h. */
 
+/* Message metadata is identified by type IDs handed out by a registry (daq_meta_type_register() or
+    the module base API).  The IDs below DAQ_MSG_META_SLOTS are reserved for the built-in types
+    (DAQ_PKT_META_*), which are stored directly in the message.  Metadata of any other type is
+    attached as a list of these entries, typically embedded in the message descriptors of the module
+    providing it. */
+typedef struct _daq_msg_meta
+{
+    struct _daq_msg_meta *next;
+    void *data;
+    unsigned type;                  /* Registered metadata type ID */
+} DAQ_MsgMeta_t;
+
 /* The DAQ message structure.  Ordered by element size to avoid padding. */
 #define DAQ_MSG_META_SLOTS  8
 typedef struct _daq_msg
 {
     void *hdr;                      /* Pointer to the message header structure for this message */
     uint8_t *data;                  /* Pointer to the variable-length message data (Optional) */
-    void *meta[DAQ_MSG_META_SLOTS]; /* Dynamic message metadata slots */
+    void *meta[DAQ_MSG_META_SLOTS]; /* Metadata of the built-in types, indexed by type ID */
+    DAQ_MsgMeta_t *meta_ext;        /* Metadata of registered types (Optional) */
+    const struct _daq_msg *wrapped; /* Message of a wrapped module that this message was derived from,
+                                        whose metadata shows through wherever this one has none (Optional) */
     DAQ_ModuleInstance_h owner;     /* Handle for the module instance this message belongs to */
     void *priv;                     /* Pointer to module instance's private data for this message (Optional) */
     size_t hdr_len;                 /* Length of the header structure pointed to by 'hdr' */
     DAQ_MsgType type;               /* Message type (one of DAQ_MsgType or from the user-defined range) */
     uint32_t data_len;              /* Length of the data pointed to by 'data'.  Should be 0 if 'data' is NULL */
+    uint32_t meta_suppressed;       /* Bitmask of the built-in types (1 << type) that this message doesn't carry
+                                        and that must not show through from the wrapped message either */
 } DAQ_Msg_t;
 
+/* Find the metadata of the given type for a message, looking through the messages it was derived
+    from when it doesn't carry that type itself. */
+static inline const void *daq_msg_find_meta(const DAQ_Msg_t *msg, unsigned type)
+{
+    for (; msg; msg = msg->wrapped)
+    {
+        if (type < DAQ_MSG_META_SLOTS)
+        {
+            if (msg->meta[type])
+                return msg->meta[type];
+            if (msg->meta_suppressed & (1U << type))
+                return NULL;
+        }
+        else
+        {
+            for (const DAQ_MsgMeta_t *mm = msg->meta_ext; mm; mm = mm->next)
+            {
+                if (mm->type == type)
+                    return mm->data;
+            }
+        }
+    }
+    return NULL;
+}
+
 /* The DAQ packet header structure. */
 #define DAQ_PKT_FLAG_OPAQUE_IS_VALID    0x0001  /* The DAQ module actively set the opaque value in the DAQ packet header. */
 #define DAQ_PKT_FLAG_NOT_FORWARDING     0x0002  /* The DAQ module will not be actively forwarding this packet
@@ -144,9 +186,16 @@ typedef struct _daq_pkt_hdr
     uint16_t address_space_id;  /* Unique ID of the address space */
 } DAQ_PktHdr_t;
 
-#define DAQ_PKT_META_NAPT_INFO      0
-#define DAQ_PKT_META_DECODE_DATA    1
-#define DAQ_PKT_META_TCP_ACK_DATA   2
+/* Built-in metadata types, registered under the names given in the comments */
+#define DAQ_PKT_META_NAPT_INFO      0   /* "napt_info" */
+#define DAQ_PKT_META_DECODE_DATA    1   /* "decode_data" */
+#define DAQ_PKT_META_TCP_ACK_DATA   2   /* "tcp_ack_data" */
+
+/* Names of the metadata types defined here that aren't built in.  Modules providing or using one
+    register it when they are loaded; applications look up its ID with daq_meta_type_lookup(). */
+#define DAQ_META_TYPE_OFFLOAD_INFO  "offload_info"  /* DAQ_PktOffloadInfo_t */
+#define DAQ_META_TYPE_SLICE_INFO    "slice_info"    /* DAQ_PktSliceInfo_t */
+#define DAQ_META_TYPE_TIMESTAMP     "timestamp"     /* DAQ_PktTimestamp_t */
 
 /* "Real" address and port information for Network Address and Port Translated (NAPT'd) connections.
     This represents the destination addresses and ports seen on egress in both directions. */
@@ -222,6 +271,35 @@ typedef struct _daq_pkt_tcp_ack_data
     uint16_t tcp_window_size;   /* TCP Window Size for elided ACK (in network byte order) */
 } DAQ_PktTcpAckData_t;
 
+/* Segmentation and checksum offload state of a packet that was intercepted before the stack or the
+    hardware finished processing it (for example, by a netfilter queue). */
+#define DAQ_OFFLOAD_FLAG_GSO                0x01    /* Aggregated (GSO/GRO) packet that will be segmented on transmit */
+#define DAQ_OFFLOAD_FLAG_CSUM_PARTIAL       0x02    /* L4 checksum has not been computed yet (completed on transmit) */
+#define DAQ_OFFLOAD_FLAG_CSUM_NOT_VERIFIED  0x04    /* Checksums have not been verified by the hardware or stack */
+typedef struct _daq_pkt_offload_info
+{
+    uint32_t flags;             /* DAQ_OFFLOAD_FLAG_* */
+} DAQ_PktOffloadInfo_t;
+
+/* Length of a packet as captured, before a wrapper module cut the data delivered to the application
+    short (for example, to just its headers).  The original wire length remains in the packet header. */
+typedef struct _daq_pkt_slice_info
+{
+    uint32_t caplen;            /* Captured length before slicing */
+} DAQ_PktSliceInfo_t;
+
+/* Full resolution timestamp of a packet.  The timestamp in the packet header only holds microseconds,
+    so modules whose source stamps packets more precisely also attach the nanosecond value. */
+#define DAQ_PKT_TS_SOURCE_UNKNOWN       0   /* Not reported by the module */
+#define DAQ_PKT_TS_SOURCE_SOFTWARE      1   /* Stamped by the host when it received the packet */
+#define DAQ_PKT_TS_SOURCE_SYS_HARDWARE  2   /* Stamped by the NIC, converted to the host clock */
+#define DAQ_PKT_TS_SOURCE_RAW_HARDWARE  3   /* Stamped by the NIC, in the NIC's clock */
+typedef struct _daq_pkt_timestamp
+{
+    uint64_t nsec;              /* Nanoseconds since the Unix epoch */
+    uint32_t source;            /* Where the timestamp came from (DAQ_PKT_TS_SOURCE_*) */
+} DAQ_PktTimestamp_t;
+
 typedef struct _daq_flow_desc
 {
     /* Interface/Flow ID/Address Space Information */
@@ -357,6 +435,13 @@ typedef struct _daq_msg_pool_info
     size_t mem_size;
 } DAQ_MsgPoolInfo_t;
 
+typedef struct _daq_inject_queue_stats
+{
+    uint64_t queued;    /* Injections queued by any thread */
+    uint64_t injected;  /* Queued injections performed successfully by the owning thread */
+    uint64_t failed;    /* Queued injections that the module stack rejected */
+} DAQ_InjectQueueStats_t;
+
 
 /* DAQ module type flags */
 #define DAQ_TYPE_FILE_CAPABLE   0x01    /* can read from a file */
@@ -406,6 +491,8 @@ typedef enum
     DIOCTL_CREATE_EXPECTED_FLOW,
     DIOCTL_DIRECT_INJECT_PAYLOAD,
     DIOCTL_DIRECT_INJECT_RESET,
+    DIOCTL_GET_MODULE_COUNTERS,
+    DIOCTL_FLUSH_PACKET_HISTORY,
     LAST_BUILTIN_DIOCTL_CMD = 1024,     /* End of reserved space for "official" DAQ ioctl commands.
                                            Any externally defined ioctl commands should be larger than this. */
     MAX_DIOCTL_CMD = UINT16_MAX
@@ -609,6 +696,35 @@ typedef struct
     uint8_t direction;  // [in] Direction in which to inject the reset relative to the message (DAQ_DIR_*)
 } DIOCTL_DirectInjectReset;
 
+/*
+ * Command: DIOCTL_GET_MODULE_COUNTERS
+ * Description: Retrieve module-specific counters that do not fit into DAQ_Stats_t.  Each module in the
+ *              configuration stack that keeps such counters appends them to the array (stopping when it
+ *              is full) and then passes the request on to the modules it wraps.
+ * Argument: DIOCTL_GetModuleCounters
+ */
+typedef struct
+{
+    const char *module;     // Name of the module that owns the counter
+    const char *name;       // Name of the counter
+    uint64_t value;         // Current value of the counter
+} DAQ_ModuleCounter_t;
+
+typedef struct
+{
+    DAQ_ModuleCounter_t *counters;  // [in] Array of counters to be populated
+    unsigned max_counters;          // [in] Number of elements in the counter array
+    unsigned num_counters;          // [in/out] Number of elements populated so far (initialize to 0)
+} DIOCTL_GetModuleCounters;
+
+/*
+ * Command: DIOCTL_FLUSH_PACKET_HISTORY
+ * Description: Write out any recently seen packets that modules in the configuration stack are holding
+ *              in memory (for example, the dump module's flight recorder) in response to an event of
+ *              interest to the application.
+ * Argument: None
+ */
+
 #ifdef __cplusplus
 }
 #endif
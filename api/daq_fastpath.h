@@ -0,0 +1,87 @@
+/*
+** Copyright (C) 2014-2021 Cisco and/or its affiliates. All rights reserved.
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation.  You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef _DAQ_FASTPATH_H
+#define _DAQ_FASTPATH_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <daq.h>
+#include <daq_module_api.h>
+
+/*
+ * Opt-in inline fast path for the message receive and finalize calls.
+ *
+ * daq_instance_msg_receive() and daq_instance_msg_finalize() validate their arguments and then
+ * call into the top of the module stack.  An application that calls them at very high rates can
+ * instead fetch the instance's fast path dispatch once after instantiation and use the inline
+ * functions below, which compile down to a single indirect call into the module stack.  They
+ * perform no argument validation: the instance, message vector and receive status must be valid
+ * and max_recv must be non-zero.  The checked API remains available and both may be mixed freely.
+ *
+ * The dispatch structure is owned by the instance and stays valid until it is destroyed.  Its
+ * layout is versioned; fields are only ever appended, and the library refuses to hand out a
+ * version it doesn't know about.
+ */
+
+#define DAQ_FASTPATH_VERSION    1
+
+struct _daq_inject_entry;
+
+typedef struct _daq_fastpath
+{
+    uint32_t version;           /* Version of the layout the library filled in */
+    uint32_t size;              /* Size of the structure the library filled in */
+    DAQ_Instance_h instance;
+    DAQ_INSTANCE_API_STRUCT(msg_receive);
+    DAQ_INSTANCE_API_STRUCT(msg_finalize);
+    /* Head of the instance's queue of injections from other threads, non-NULL when some are
+        pending and must be performed by the owning thread before the next receive or finalize. */
+    struct _daq_inject_entry *const *inject_queue;
+} DAQ_FastPath_t;
+
+DAQ_LINKAGE const DAQ_FastPath_t *daq_instance_get_fastpath(DAQ_Instance_h instance, uint32_t version);
+DAQ_LINKAGE void daq_instance_perform_queued_injects(DAQ_Instance_h instance);
+
+static inline void daq_fastpath_check_inject_queue(const DAQ_FastPath_t *fp)
+{
+    if (__builtin_expect(__atomic_load_n(fp->inject_queue, __ATOMIC_RELAXED) != NULL, 0))
+        daq_instance_perform_queued_injects(fp->instance);
+}
+
+static inline unsigned daq_fastpath_msg_receive(const DAQ_FastPath_t *fp, const unsigned max_recv,
+        DAQ_Msg_h msgs[], DAQ_RecvStatus *rstat)
+{
+    daq_fastpath_check_inject_queue(fp);
+    return fp->msg_receive.func(fp->msg_receive.context, max_recv, msgs, rstat);
+}
+
+static inline int daq_fastpath_msg_finalize(const DAQ_FastPath_t *fp, DAQ_Msg_h msg, DAQ_Verdict verdict)
+{
+    daq_fastpath_check_inject_queue(fp);
+    return fp->msg_finalize.func(fp->msg_finalize.context, msg, verdict);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* _DAQ_FASTPATH_H */
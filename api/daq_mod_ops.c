@@ -31,6 +31,7 @@
 
 #include "daq.h"
 #include "daq_api_internal.h"
+#include "daq_fastpath.h"
 #include "daq_instance_api_defaults.h"
 #include "daq_module_api.h"
 
@@ -51,13 +52,38 @@ typedef struct _daq_module_instance
     void *context;
 } DAQ_ModuleInstance_t;
 
+/*
+ * An injection queued by a thread other than the one that owns the instance.  The header and data
+ * are copied so that the caller is free to reuse them as soon as the entry has been queued.
+ * Relative injections keep a reference to their original message instead of a header and are
+ * performed through the module stack's inject_relative, so that modules can address them the way
+ * they normally would.  That is safe because the queue is drained at the start of every finalize:
+ * a message that was still held when the entry was queued is still held when it is performed.
+ */
+typedef struct _daq_inject_entry
+{
+    struct _daq_inject_entry *next;
+    DAQ_Msg_h msg;              // Original message of a relative injection, NULL otherwise
+    int reverse;
+    DAQ_PktHdr_t hdr;
+    uint32_t data_len;
+    uint8_t data[];
+} DAQ_InjectEntry_t;
+
 #define DAQ_ERRBUF_SIZE 256
 typedef struct _daq_instance
 {
     DAQ_ModuleInstance_t *module_instances;
     DAQ_InstanceAPI_t api;
+    DAQ_FastPath_t fastpath;
     DAQ_State state;
     char errbuf[DAQ_ERRBUF_SIZE];
+    /* Pending injections, newest first.  Pushed by any thread with a compare-and-swap and taken
+        as a whole by the owning thread with an exchange, so no locks are needed on either side. */
+    DAQ_InjectEntry_t *inject_queue;
+    uint64_t injects_queued;
+    uint64_t injects_performed;
+    uint64_t injects_failed;
 } DAQ_Instance_t;
 
 
@@ -138,6 +164,95 @@ void daq_instance_set_errbuf(DAQ_Instance_t *instance, const char *format, ...)
 }
 
 
+static int queue_inject_entry(DAQ_Instance_t *instance, DAQ_InjectEntry_t *entry)
+{
+    entry->next = __atomic_load_n(&instance->inject_queue, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&instance->inject_queue, &entry->next, entry, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    __atomic_fetch_add(&instance->injects_queued, 1, __ATOMIC_RELAXED);
+
+    return DAQ_SUCCESS;
+}
+
+static DAQ_InjectEntry_t *new_inject_entry(const uint8_t *data, uint32_t data_len)
+{
+    DAQ_InjectEntry_t *entry = malloc(sizeof(*entry) + data_len);
+    if (!entry)
+        return NULL;
+    entry->msg = NULL;
+    entry->reverse = 0;
+    entry->data_len = data_len;
+    memcpy(entry->data, data, data_len);
+
+    return entry;
+}
+
+/*
+ * Throw away injections that can no longer be performed, counting them as failed.
+ */
+static void discard_inject_queue(DAQ_Instance_t *instance)
+{
+    DAQ_InjectEntry_t *entry = __atomic_exchange_n(&instance->inject_queue, NULL, __ATOMIC_ACQUIRE);
+    uint64_t failed = 0;
+
+    while (entry)
+    {
+        DAQ_InjectEntry_t *next = entry->next;
+        free(entry);
+        entry = next;
+        failed++;
+    }
+
+    __atomic_store_n(&instance->injects_failed, instance->injects_failed + failed, __ATOMIC_RELAXED);
+}
+
+/*
+ * Perform every injection queued so far, oldest first.  Only ever called by the thread that owns
+ * the instance, from the message receive and finalize paths.
+ */
+static void drain_inject_queue(DAQ_Instance_t *instance)
+{
+    DAQ_InjectEntry_t *entry = __atomic_exchange_n(&instance->inject_queue, NULL, __ATOMIC_ACQUIRE);
+
+    /* The queue is a stack, so reverse it to inject in the order the entries were queued. */
+    DAQ_InjectEntry_t *pending = NULL;
+    while (entry)
+    {
+        DAQ_InjectEntry_t *next = entry->next;
+        entry->next = pending;
+        pending = entry;
+        entry = next;
+    }
+
+    /* Each entry is injected on its own; the module API has no batched injection to hand them to. */
+    uint64_t performed = 0, failed = 0;
+    while ((entry = pending) != NULL)
+    {
+        int rval;
+        if (entry->msg)
+            rval = CALL_INSTANCE_API(instance, inject_relative, entry->msg, entry->data, entry->data_len, entry->reverse);
+        else
+            rval = CALL_INSTANCE_API(instance, inject, DAQ_MSG_TYPE_PACKET, &entry->hdr, entry->data, entry->data_len);
+        if (rval == DAQ_SUCCESS)
+            performed++;
+        else
+            failed++;
+        pending = entry->next;
+        free(entry);
+    }
+
+    __atomic_store_n(&instance->injects_performed, instance->injects_performed + performed, __ATOMIC_RELAXED);
+    __atomic_store_n(&instance->injects_failed, instance->injects_failed + failed, __ATOMIC_RELAXED);
+}
+
+static inline void check_inject_queue(DAQ_Instance_t *instance)
+{
+    if (__atomic_load_n(&instance->inject_queue, __ATOMIC_RELAXED))
+        drain_inject_queue(instance);
+}
+
+
 /*
  * Exported functions that apply to instances of DAQ modules go here.
  */
@@ -155,6 +270,7 @@ DAQ_LINKAGE int daq_instance_destroy(DAQ_Instance_t *instance)
             modinst->module->destroy(modinst->context);
         free(modinst);
     }
+    discard_inject_queue(instance);
     free(instance);
 
     return DAQ_SUCCESS;
@@ -234,6 +350,16 @@ DAQ_LINKAGE int daq_instance_instantiate(const DAQ_Config_h config, DAQ_Instance
     /* Resolve the top-level instance API from the top of the stack with defaults. */
     resolve_instance_api(&instance->api, instance->module_instances, true);
 
+    /* Mirror the receive and finalize dispatch for the inline fast path. */
+    instance->fastpath.version = DAQ_FASTPATH_VERSION;
+    instance->fastpath.size = sizeof(instance->fastpath);
+    instance->fastpath.instance = instance;
+    instance->fastpath.msg_receive.func = instance->api.msg_receive.func;
+    instance->fastpath.msg_receive.context = instance->api.msg_receive.context;
+    instance->fastpath.msg_finalize.func = instance->api.msg_finalize.func;
+    instance->fastpath.msg_finalize.context = instance->api.msg_finalize.context;
+    instance->fastpath.inject_queue = &instance->inject_queue;
+
     instance->state = DAQ_STATE_INITIALIZED;
 
     *instance_ptr = instance;
@@ -334,6 +460,9 @@ DAQ_LINKAGE int daq_instance_stop(DAQ_Instance_t *instance)
         return DAQ_ERROR;
     }
 
+    /* Nothing can be injected once stopped, so perform whatever has been queued while it still can. */
+    check_inject_queue(instance);
+
     int rval = instance->api.stop.func(instance->api.stop.context);
     if (rval == DAQ_SUCCESS)
         instance->state = DAQ_STATE_STOPPED;
@@ -460,6 +589,8 @@ DAQ_LINKAGE unsigned daq_instance_msg_receive(DAQ_Instance_t *instance, const un
         return 0;
     }
 
+    check_inject_queue(instance);
+
     return instance->api.msg_receive.func(instance->api.msg_receive.context, max_recv, msgs, rstat);
 }
 
@@ -474,6 +605,8 @@ DAQ_LINKAGE int daq_instance_msg_finalize(DAQ_Instance_t *instance, DAQ_Msg_h ms
         return DAQ_ERROR_INVAL;
     }
 
+    check_inject_queue(instance);
+
     return instance->api.msg_finalize.func(instance->api.msg_finalize.context, msg, verdict);
 }
 
@@ -488,6 +621,91 @@ DAQ_LINKAGE int daq_instance_get_msg_pool_info(DAQ_Instance_h instance, DAQ_MsgP
     return instance->api.get_msg_pool_info.func(instance->api.get_msg_pool_info.context, info);
 }
 
+/*
+ * The queued injection functions may be called from any thread.  They don't touch the module
+ * stack or the error buffer; the injection is performed by the thread that owns the instance the
+ * next time it receives or finalizes a message.
+ */
+DAQ_LINKAGE int daq_instance_queue_inject(DAQ_Instance_t *instance, DAQ_MsgType type, const void *hdr,
+                                          const uint8_t *data, uint32_t data_len)
+{
+    if (!instance)
+        return DAQ_ERROR_NOCTX;
+
+    if (!hdr || !data)
+        return DAQ_ERROR_INVAL;
+
+    /* Turn down what the module stack could never perform rather than failing it later. */
+    if (type != DAQ_MSG_TYPE_PACKET || instance->api.inject.func == daq_default_inject)
+        return DAQ_ERROR_NOTSUP;
+
+    DAQ_InjectEntry_t *entry = new_inject_entry(data, data_len);
+    if (!entry)
+        return DAQ_ERROR_NOMEM;
+    memcpy(&entry->hdr, hdr, sizeof(entry->hdr));
+
+    return queue_inject_entry(instance, entry);
+}
+
+DAQ_LINKAGE int daq_instance_queue_inject_relative(DAQ_Instance_t *instance, DAQ_Msg_h msg,
+                                                   const uint8_t *data, uint32_t data_len, int reverse)
+{
+    if (!instance)
+        return DAQ_ERROR_NOCTX;
+
+    if (!msg || !data)
+        return DAQ_ERROR_INVAL;
+
+    if (msg->type != DAQ_MSG_TYPE_PACKET || instance->api.inject_relative.func == daq_default_inject_relative)
+        return DAQ_ERROR_NOTSUP;
+
+    /* The message is still held by the application, and the owning thread performs this entry
+        before it finalizes anything, so the module gets to address it from the original. */
+    DAQ_InjectEntry_t *entry = new_inject_entry(data, data_len);
+    if (!entry)
+        return DAQ_ERROR_NOMEM;
+    entry->msg = msg;
+    entry->reverse = reverse;
+
+    return queue_inject_entry(instance, entry);
+}
+
+DAQ_LINKAGE int daq_instance_get_inject_queue_stats(DAQ_Instance_t *instance, DAQ_InjectQueueStats_t *stats)
+{
+    if (!instance)
+        return DAQ_ERROR_NOCTX;
+
+    if (!stats)
+        return DAQ_ERROR_INVAL;
+
+    stats->queued = __atomic_load_n(&instance->injects_queued, __ATOMIC_RELAXED);
+    stats->injected = __atomic_load_n(&instance->injects_performed, __ATOMIC_RELAXED);
+    stats->failed = __atomic_load_n(&instance->injects_failed, __ATOMIC_RELAXED);
+
+    return DAQ_SUCCESS;
+}
+
+DAQ_LINKAGE const DAQ_FastPath_t *daq_instance_get_fastpath(DAQ_Instance_t *instance, uint32_t version)
+{
+    if (!instance)
+        return NULL;
+
+    /* Newer layouts only append fields, so any version up to ours can be handed out as is. */
+    if (version == 0 || version > DAQ_FASTPATH_VERSION)
+    {
+        daq_instance_set_errbuf(instance, "Unsupported fast path version: %u", version);
+        return NULL;
+    }
+
+    return &instance->fastpath;
+}
+
+DAQ_LINKAGE void daq_instance_perform_queued_injects(DAQ_Instance_t *instance)
+{
+    if (instance)
+        check_inject_queue(instance);
+}
+
 
 /*
  * Functions that apply to DAQ modules themselves go here.
@@ -69,8 +69,77 @@ typedef struct _daq_instance_api {
     DAQ_INSTANCE_API_STRUCT(get_msg_pool_info);
 } DAQ_InstanceAPI_t;
 
+/*
+ * Static module stack specialization.
+ *
+ * When a static build is configured with a fixed module stack (--with-static-stack), each module
+ * in it is compiled for its position in the stack with DAQ_STATIC_STACK defined.  Its message
+ * receive and finalize functions are then given external linkage (DAQ_STACK_LINKAGE) and declared
+ * through DAQ_STACK_MSG_RECEIVE and DAQ_STACK_MSG_FINALIZE.  A wrapper is told which functions the
+ * modules beneath it provide through DAQ_STACK_NEXT_MSG_RECEIVE and DAQ_STACK_NEXT_MSG_FINALIZE.
+ * DAQ_SUBAPI_CALL() turns the wrapper's calls through its subapi into direct calls to those
+ * functions, which the compiler can inline across module boundaries.  The resolved subapi is still
+ * compared against them first, so a module stack other than the one the modules were built for
+ * keeps working through the function pointers.
+ */
+#ifdef DAQ_STATIC_STACK
+#  ifdef __cplusplus
+#    define DAQ_STACK_LINKAGE extern "C"
+#  else
+#    define DAQ_STACK_LINKAGE
+#  endif
+#else
+#  define DAQ_STACK_LINKAGE static
+#endif
+
+#ifdef DAQ_STACK_MSG_RECEIVE
+unsigned DAQ_STACK_MSG_RECEIVE(void *handle, const unsigned max_recv, const DAQ_Msg_t *msgs[], DAQ_RecvStatus *rstat);
+#endif
+#ifdef DAQ_STACK_MSG_FINALIZE
+int DAQ_STACK_MSG_FINALIZE(void *handle, const DAQ_Msg_t *msg, DAQ_Verdict verdict);
+#endif
+
+#define DAQ_SUBAPI_CALL(subapi, fname, ...) DAQ_SUBAPI_CALL_ ## fname(subapi, fname, __VA_ARGS__)
+#define DAQ_SUBAPI_CALL_DYNAMIC(subapi, fname, ...) (subapi).fname.func((subapi).fname.context, __VA_ARGS__)
+#define DAQ_SUBAPI_CALL_DIRECT(subapi, fname, next, ...)                \
+    ((subapi).fname.func == next ? next((subapi).fname.context, __VA_ARGS__) : \
+        (subapi).fname.func((subapi).fname.context, __VA_ARGS__))
+
+#define DAQ_SUBAPI_CALL_set_filter DAQ_SUBAPI_CALL_DYNAMIC
+#define DAQ_SUBAPI_CALL_start DAQ_SUBAPI_CALL_DYNAMIC
+#define DAQ_SUBAPI_CALL_inject DAQ_SUBAPI_CALL_DYNAMIC
+#define DAQ_SUBAPI_CALL_inject_relative DAQ_SUBAPI_CALL_DYNAMIC
+#define DAQ_SUBAPI_CALL_interrupt DAQ_SUBAPI_CALL_DYNAMIC
+#define DAQ_SUBAPI_CALL_stop DAQ_SUBAPI_CALL_DYNAMIC
+#define DAQ_SUBAPI_CALL_ioctl DAQ_SUBAPI_CALL_DYNAMIC
+#define DAQ_SUBAPI_CALL_get_stats DAQ_SUBAPI_CALL_DYNAMIC
+#define DAQ_SUBAPI_CALL_reset_stats DAQ_SUBAPI_CALL_DYNAMIC
+#define DAQ_SUBAPI_CALL_get_snaplen DAQ_SUBAPI_CALL_DYNAMIC
+#define DAQ_SUBAPI_CALL_get_capabilities DAQ_SUBAPI_CALL_DYNAMIC
+#define DAQ_SUBAPI_CALL_get_datalink_type DAQ_SUBAPI_CALL_DYNAMIC
+#define DAQ_SUBAPI_CALL_config_load DAQ_SUBAPI_CALL_DYNAMIC
+#define DAQ_SUBAPI_CALL_config_swap DAQ_SUBAPI_CALL_DYNAMIC
+#define DAQ_SUBAPI_CALL_config_free DAQ_SUBAPI_CALL_DYNAMIC
+#define DAQ_SUBAPI_CALL_get_msg_pool_info DAQ_SUBAPI_CALL_DYNAMIC
+
+#ifdef DAQ_STACK_NEXT_MSG_RECEIVE
+unsigned DAQ_STACK_NEXT_MSG_RECEIVE(void *handle, const unsigned max_recv, const DAQ_Msg_t *msgs[], DAQ_RecvStatus *rstat);
+#  define DAQ_SUBAPI_CALL_msg_receive(subapi, fname, ...) \
+    DAQ_SUBAPI_CALL_DIRECT(subapi, fname, DAQ_STACK_NEXT_MSG_RECEIVE, __VA_ARGS__)
+#else
+#  define DAQ_SUBAPI_CALL_msg_receive DAQ_SUBAPI_CALL_DYNAMIC
+#endif
+
+#ifdef DAQ_STACK_NEXT_MSG_FINALIZE
+int DAQ_STACK_NEXT_MSG_FINALIZE(void *handle, const DAQ_Msg_t *msg, DAQ_Verdict verdict);
+#  define DAQ_SUBAPI_CALL_msg_finalize(subapi, fname, ...) \
+    DAQ_SUBAPI_CALL_DIRECT(subapi, fname, DAQ_STACK_NEXT_MSG_FINALIZE, __VA_ARGS__)
+#else
+#  define DAQ_SUBAPI_CALL_msg_finalize DAQ_SUBAPI_CALL_DYNAMIC
+#endif
+
 
-#define DAQ_BASE_API_VERSION    0x00030002
+#define DAQ_BASE_API_VERSION    0x00030003
 
 typedef struct _daq_base_api
 {
@@ -91,6 +160,8 @@ typedef struct _daq_base_api
     /* Module/Instance operations */
     int (*resolve_subapi) (DAQ_ModuleInstance_h modinst, DAQ_InstanceAPI_t *api);
     void (*set_errbuf) (DAQ_ModuleInstance_h modinst, const char *format, ...) __attribute__((format (printf, 2, 3)));
+    /* Message metadata type registry (see daq_meta_type_register()) */
+    int (*meta_type_register) (const char *name, size_t size);
 } DAQ_BaseAPI_t;
 
 
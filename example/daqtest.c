@@ -131,6 +131,12 @@ extern const DAQ_ModuleAPI_t afpacket_daq_module_data;
 #ifdef BUILD_BPF_MODULE
 extern const DAQ_ModuleAPI_t bpf_daq_module_data;
 #endif
+#ifdef BUILD_BYPASS_MODULE
+extern const DAQ_ModuleAPI_t bypass_daq_module_data;
+#endif
+#ifdef BUILD_DEDUP_MODULE
+extern const DAQ_ModuleAPI_t dedup_daq_module_data;
+#endif
 #ifdef BUILD_DIVERT_MODULE
 extern const DAQ_ModuleAPI_t divert_daq_module_data;
 #endif
@@ -140,6 +146,9 @@ extern const DAQ_ModuleAPI_t dump_daq_module_data;
 #ifdef BUILD_FST_MODULE
 extern const DAQ_ModuleAPI_t fst_daq_module_data;
 #endif
+#ifdef BUILD_LB_MODULE
+extern const DAQ_ModuleAPI_t lb_daq_module_data;
+#endif
 #ifdef BUILD_NFQ_MODULE
 extern const DAQ_ModuleAPI_t nfq_daq_module_data;
 #endif
@@ -152,9 +161,19 @@ extern const DAQ_ModuleAPI_t pcap_daq_module_data;
 #ifdef BUILD_NETMAP_MODULE
 extern const DAQ_ModuleAPI_t netmap_daq_module_data;
 #endif
+#ifdef BUILD_SAMPLE_MODULE
+extern const DAQ_ModuleAPI_t sample_daq_module_data;
+#endif
 #ifdef BUILD_SAVEFILE_MODULE
 extern const DAQ_ModuleAPI_t savefile_daq_module_data;
 #endif
+#ifdef BUILD_SHM_MODULE
+extern const DAQ_ModuleAPI_t shmpub_daq_module_data;
+extern const DAQ_ModuleAPI_t shmsub_daq_module_data;
+#endif
+#ifdef BUILD_SLICE_MODULE
+extern const DAQ_ModuleAPI_t slice_daq_module_data;
+#endif
 #ifdef BUILD_TRACE_MODULE
 extern const DAQ_ModuleAPI_t trace_daq_module_data;
 #endif
@@ -167,6 +186,12 @@ static DAQ_Module_h static_modules[] =
 #ifdef BUILD_BPF_MODULE
     &bpf_daq_module_data,
 #endif
+#ifdef BUILD_BYPASS_MODULE
+    &bypass_daq_module_data,
+#endif
+#ifdef BUILD_DEDUP_MODULE
+    &dedup_daq_module_data,
+#endif
 #ifdef BUILD_DIVERT_MODULE
     &divert_daq_module_data,
 #endif
@@ -176,6 +201,9 @@ static DAQ_Module_h static_modules[] =
 #ifdef BUILD_FST_MODULE
     &fst_daq_module_data,
 #endif
+#ifdef BUILD_LB_MODULE
+    &lb_daq_module_data,
+#endif
 #ifdef BUILD_NFQ_MODULE
     &nfq_daq_module_data,
 #endif
@@ -185,9 +213,19 @@ static DAQ_Module_h static_modules[] =
 #ifdef BUILD_NETMAP_MODULE
     &netmap_daq_module_data,
 #endif
+#ifdef BUILD_SAMPLE_MODULE
+    &sample_daq_module_data,
+#endif
 #ifdef BUILD_SAVEFILE_MODULE
     &savefile_daq_module_data,
 #endif
+#ifdef BUILD_SHM_MODULE
+    &shmpub_daq_module_data,
+    &shmsub_daq_module_data,
+#endif
+#ifdef BUILD_SLICE_MODULE
+    &slice_daq_module_data,
+#endif
 #ifdef BUILD_TRACE_MODULE
     &trace_daq_module_data,
 #endif
@@ -1007,6 +1045,23 @@ static void print_daq_stats(DAQ_Stats_t *stats)
     printf("  Flows Ignored:      %" PRIu64 "\n", stats->verdicts[DAQ_VERDICT_IGNORE]);
 }
 
+static void print_daq_module_counters(DAQ_Instance_h instance)
+{
+    DAQ_ModuleCounter_t counters[128];
+    DIOCTL_GetModuleCounters gmc;
+
+    gmc.counters = counters;
+    gmc.max_counters = sizeof(counters) / sizeof(counters[0]);
+    gmc.num_counters = 0;
+    if (daq_instance_ioctl(instance, DIOCTL_GET_MODULE_COUNTERS, &gmc, sizeof(gmc)) != DAQ_SUCCESS ||
+            gmc.num_counters == 0)
+        return;
+
+    printf("\n*DAQ Module Counters*\n");
+    for (unsigned i = 0; i < gmc.num_counters; i++)
+        printf("  %s.%s: %" PRIu64 "\n", counters[i].module, counters[i].name, counters[i].value);
+}
+
 static void print_daq_modules(void)
 {
     DAQ_Module_h module = daq_modules_first();
@@ -1553,6 +1608,7 @@ static void *processing_thread(void *arg)
             printf("Average number of packets received per receive call: %.2f\n\n", (double)stats.packets_received / (double)recv_cnt);
 
         print_daq_stats(&stats);
+        print_daq_module_counters(ctxt->instance);
     }
 
     daq_instance_stop(ctxt->instance);
@@ -29,6 +29,8 @@
 #include <limits.h>
 #include <linux/if_ether.h>
 #include <linux/if_packet.h>
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
 #include <net/if.h>
 #include <net/if_arp.h>
 #include <netinet/in.h>
@@ -96,6 +98,9 @@ typedef struct _af_packet_instance
     int index;
     struct _af_packet_instance *peer;
     int mtu;
+    struct hwtstamp_config saved_hwconfig;  // Device timestamping configuration to restore
+    bool hw_timestamps;
+    bool hwconfig_changed;
     bool active;
 } AFPacketInstance;
 
@@ -110,6 +115,8 @@ typedef struct _af_packet_pkt_desc
 {
     DAQ_Msg_t msg;
     DAQ_PktHdr_t pkthdr;
+    DAQ_PktTimestamp_t ts;
+    DAQ_MsgMeta_t ts_meta;
     uint8_t *data;
     AFPacketInstance *instance;
     unsigned int length;
@@ -133,6 +140,7 @@ typedef struct _afpacket_context
     uint32_t ring_size;
     AFPacketFanoutCfg fanout_cfg;
     bool use_tx_ring;
+    bool hw_timestamps;
     bool debug;
     /* State */
     DAQ_ModuleInstance_h modinst;
@@ -161,10 +169,12 @@ static DAQ_VariableDesc_t afpacket_variable_descriptions[] = {
     { "fanout_type", "Fanout loadbalancing method", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
     { "fanout_flag", "Fanout loadbalancing option", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
     { "use_tx_ring", "Use memory-mapped TX ring", DAQ_VAR_DESC_FORBIDS_ARGUMENT },
+    { "hw_timestamps", "Request hardware RX timestamps, falling back to software timestamps", DAQ_VAR_DESC_FORBIDS_ARGUMENT },
 };
 
 static const int vlan_offset = 2 * ETH_ALEN;
 static DAQ_BaseAPI_t daq_base_api;
+static unsigned timestamp_meta_type;
 #ifdef LIBPCAP_AVAILABLE
 static pthread_mutex_t bpf_mutex = PTHREAD_MUTEX_INITIALIZER;
 #endif
@@ -221,6 +231,9 @@ static int create_packet_pool(AFPacket_Context_t *afpc, unsigned size)
         msg->data = desc->data;
         msg->owner = afpc->modinst;
         msg->priv = desc;
+        desc->ts_meta.data = &desc->ts;
+        desc->ts_meta.type = timestamp_meta_type;
+        msg->meta_ext = &desc->ts_meta;
 
         /* Place it on the free list */
         desc->next = pool->freelist;
@@ -299,6 +312,16 @@ static void destroy_instance(AFPacketInstance *instance)
     {
         if (instance->fd != -1)
         {
+            /* Put the device's timestamping configuration back the way we found it. */
+            if (instance->hwconfig_changed)
+            {
+                struct ifreq ifr;
+                memset(&ifr, 0, sizeof(ifr));
+                snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", instance->name);
+                ifr.ifr_data = (void *) &instance->saved_hwconfig;
+                ioctl(instance->fd, SIOCSHWTSTAMP, &ifr);
+                instance->hwconfig_changed = false;
+            }
             /* Destroy the userspace RX ring. */
             if (instance->rx_ring.entries)
             {
@@ -351,6 +374,54 @@ static int iface_get_arptype(AFPacketInstance *instance)
     return ifr.ifr_hwaddr.sa_family;
 }
 
+static int enable_timestamping(AFPacket_Context_t *afpc, AFPacketInstance *instance)
+{
+    struct hwtstamp_config hwconfig;
+    struct ifreq ifr;
+    int val;
+
+    /* Turn on RX timestamping in the device unless something else (like a PTP daemon) already has,
+        keeping its TX setting.  Devices that can't stamp packets (like veth) are left alone. */
+    memset(&hwconfig, 0, sizeof(hwconfig));
+    memset(&ifr, 0, sizeof(ifr));
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", instance->name);
+    ifr.ifr_data = (void *) &hwconfig;
+    if (ioctl(instance->fd, SIOCGHWTSTAMP, &ifr) == -1)
+    {
+        memset(&hwconfig, 0, sizeof(hwconfig));
+        hwconfig.tx_type = HWTSTAMP_TX_OFF;
+    }
+    if (hwconfig.rx_filter == HWTSTAMP_FILTER_NONE)
+    {
+        /* The configuration is device-wide and outlives the socket, so it is restored on destroy. */
+        instance->saved_hwconfig = hwconfig;
+        hwconfig.rx_filter = HWTSTAMP_FILTER_ALL;
+        instance->hw_timestamps = (ioctl(instance->fd, SIOCSHWTSTAMP, &ifr) == 0);
+        instance->hwconfig_changed = instance->hw_timestamps;
+    }
+    else
+        instance->hw_timestamps = true;
+
+    val = SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE |
+          SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE;
+    if (setsockopt(instance->fd, SOL_SOCKET, SO_TIMESTAMPING, &val, sizeof(val)) < 0)
+    {
+        SET_ERROR(afpc->modinst, "Couldn't enable timestamping on packet socket: %s", strerror(errno));
+        return DAQ_ERROR;
+    }
+
+    /* Have the kernel put the hardware timestamp in the ring whenever the device provided one.  Any
+        other packet keeps its software timestamp, and the frame status says which it got. */
+    val = SOF_TIMESTAMPING_RAW_HARDWARE | SOF_TIMESTAMPING_SYS_HARDWARE;
+    if (setsockopt(instance->fd, SOL_PACKET, PACKET_TIMESTAMP, &val, sizeof(val)) < 0)
+    {
+        SET_ERROR(afpc->modinst, "Couldn't request hardware timestamps on packet socket: %s", strerror(errno));
+        return DAQ_ERROR;
+    }
+
+    return DAQ_SUCCESS;
+}
+
 static AFPacketInstance *create_instance(AFPacket_Context_t *afpc, const char *device)
 {
     AFPacketInstance *instance = NULL;
@@ -435,6 +506,9 @@ static AFPacketInstance *create_instance(AFPacket_Context_t *afpc, const char *d
         goto err;
     }
 
+    if (afpc->hw_timestamps && enable_timestamping(afpc, instance) != DAQ_SUCCESS)
+        goto err;
+
     /* Get the interface MTU */
     memset (&ifr, 0, sizeof(ifr));
     snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", instance->name);
@@ -497,6 +571,8 @@ static AFPacketInstance *create_instance(AFPacket_Context_t *afpc, const char *d
         printf("  TPacket Header Length: %u\n", instance->tp_hdrlen);
         printf("  MTU: %d\n", instance->mtu);
         printf("  Reservation: %u\n", instance->tp_reserve);
+        if (afpc->hw_timestamps)
+            printf("  Hardware Timestamps: %s\n", instance->hw_timestamps ? "enabled" : "unavailable (software fallback)");
     }
 
     return instance;
@@ -770,6 +846,11 @@ static int afpacket_daq_module_load(const DAQ_BaseAPI_t *base_api)
     if (base_api->api_version != DAQ_BASE_API_VERSION || base_api->api_size != sizeof(DAQ_BaseAPI_t))
         return DAQ_ERROR;
 
+    int type = base_api->meta_type_register(DAQ_META_TYPE_TIMESTAMP, sizeof(DAQ_PktTimestamp_t));
+    if (type < 0)
+        return type;
+    timestamp_meta_type = type;
+
     daq_base_api = *base_api;
 
     return DAQ_SUCCESS;
@@ -884,6 +965,8 @@ static int afpacket_daq_instantiate(const DAQ_ModuleConfig_h modcfg, DAQ_ModuleI
         }
         else if (!strcmp(varKey, "use_tx_ring"))
             afpc->use_tx_ring = true;
+        else if (!strcmp(varKey, "hw_timestamps"))
+            afpc->hw_timestamps = true;
 
         daq_base_api.config_next_variable(modcfg, &varKey, &varValue);
     }
@@ -1335,7 +1418,7 @@ static inline DAQ_RecvStatus wait_for_packet(AFPacket_Context_t *afpc)
     return DAQ_RSTAT_TIMEOUT;
 }
 
-static unsigned afpacket_daq_msg_receive(void *handle, const unsigned max_recv, const DAQ_Msg_t *msgs[], DAQ_RecvStatus *rstat)
+DAQ_STACK_LINKAGE unsigned afpacket_daq_msg_receive(void *handle, const unsigned max_recv, const DAQ_Msg_t *msgs[], DAQ_RecvStatus *rstat)
 {
     AFPacket_Context_t *afpc = (AFPacket_Context_t *) handle;
     AFPacketInstance *instance;
@@ -1377,12 +1460,13 @@ static unsigned afpacket_daq_msg_receive(void *handle, const unsigned max_recv,
             continue;
         }
 
-        unsigned int tp_len, tp_mac, tp_snaplen, tp_sec, tp_usec;
+        unsigned int tp_status, tp_len, tp_mac, tp_snaplen, tp_sec, tp_nsec;
+        tp_status = entry->hdr.h2->tp_status;
         tp_len = entry->hdr.h2->tp_len;
         tp_mac = entry->hdr.h2->tp_mac;
         tp_snaplen = entry->hdr.h2->tp_snaplen;
         tp_sec = entry->hdr.h2->tp_sec;
-        tp_usec = entry->hdr.h2->tp_nsec / 1000;
+        tp_nsec = entry->hdr.h2->tp_nsec;
         instance = afpc->curr_instance;
         if (tp_mac + tp_snaplen > instance->rx_ring.layout.tp_frame_size)
         {
@@ -1442,7 +1526,15 @@ static unsigned afpacket_daq_msg_receive(void *handle, const unsigned max_recv,
         /* Then, set up the DAQ packet header. */
         DAQ_PktHdr_t *pkthdr = &desc->pkthdr;
         pkthdr->ts.tv_sec = tp_sec;
-        pkthdr->ts.tv_usec = tp_usec;
+        pkthdr->ts.tv_usec = tp_nsec / 1000;
+        desc->ts.nsec = (uint64_t) tp_sec * 1000000000 + tp_nsec;
+        /* Frames without a timestamp status bit were stamped by the kernel as it filled them in. */
+        if (tp_status & TP_STATUS_TS_RAW_HARDWARE)
+            desc->ts.source = DAQ_PKT_TS_SOURCE_RAW_HARDWARE;
+        else if (tp_status & TP_STATUS_TS_SYS_HARDWARE)
+            desc->ts.source = DAQ_PKT_TS_SOURCE_SYS_HARDWARE;
+        else
+            desc->ts.source = DAQ_PKT_TS_SOURCE_SOFTWARE;
         pkthdr->pktlen = tp_len;
         pkthdr->ingress_index = instance->index;
         pkthdr->egress_index = instance->peer ? instance->peer->index : DAQ_PKTHDR_UNKNOWN;
@@ -1479,7 +1571,7 @@ static const DAQ_Verdict verdict_translation_table[MAX_DAQ_VERDICT] = {
     DAQ_VERDICT_PASS        /* DAQ_VERDICT_IGNORE */
 };
 
-static int afpacket_daq_msg_finalize(void *handle, const DAQ_Msg_t *msg, DAQ_Verdict verdict)
+DAQ_STACK_LINKAGE int afpacket_daq_msg_finalize(void *handle, const DAQ_Msg_t *msg, DAQ_Verdict verdict)
 {
     AFPacket_Context_t *afpc = (AFPacket_Context_t *) handle;
     AFPacketPktDesc *desc = (AFPacketPktDesc *) msg->priv;
@@ -41,7 +41,7 @@
     ctxt->subapi.fname.func(ctxt->subapi.fname.context)
 
 #define CALL_SUBAPI(ctxt, fname, ...) \
-    ctxt->subapi.fname.func(ctxt->subapi.fname.context, __VA_ARGS__)
+    DAQ_SUBAPI_CALL(ctxt->subapi, fname, __VA_ARGS__)
 
 typedef struct
 {
@@ -174,7 +174,7 @@ static uint32_t bpf_daq_get_capabilities(void* handle)
     return caps;
 }
 
-static unsigned bpf_daq_msg_receive(void *handle, const unsigned max_recv, const DAQ_Msg_t *msgs[], DAQ_RecvStatus *rstat)
+DAQ_STACK_LINKAGE unsigned bpf_daq_msg_receive(void *handle, const unsigned max_recv, const DAQ_Msg_t *msgs[], DAQ_RecvStatus *rstat)
 {
     BPF_Context_t *bc = (BPF_Context_t *) handle;
     unsigned num_receive = CALL_SUBAPI(bc, msg_receive, max_recv, msgs, rstat);
@@ -0,0 +1,685 @@
+/*
+** Copyright (C) 2014-2021 Cisco and/or its affiliates. All rights reserved.
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation.  You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "daq_module_api.h"
+#include "daq_module_util.h"
+
+#define DAQ_BYPASS_VERSION 1
+
+#define BYPASS_DEFAULT_POOL_HIGH    90
+#define BYPASS_DEFAULT_HOLD_MS      500
+/* Number of held messages tracked when the wrapped module can't report the size of its message pool */
+#define BYPASS_DEFAULT_TRACKED      256
+
+#define SET_ERROR(modinst, ...)    daq_base_api.set_errbuf(modinst, __VA_ARGS__)
+
+#define CHECK_SUBAPI(ctxt, fname) \
+    (ctxt->subapi.fname.func != NULL)
+
+#define CALL_SUBAPI_NOARGS(ctxt, fname) \
+    ctxt->subapi.fname.func(ctxt->subapi.fname.context)
+
+#define CALL_SUBAPI(ctxt, fname, ...) \
+    DAQ_SUBAPI_CALL(ctxt->subapi, fname, __VA_ARGS__)
+
+#define BYPASS_NONE     UINT32_MAX
+
+/*
+ * A message held by the application.  Held messages are kept on a list in the order they were
+ * received so that the oldest one is always at its head, and are found again when finalized through
+ * an open-addressed table keyed on the message pointer.
+ */
+typedef struct
+{
+    const DAQ_Msg_t *msg;
+    uint64_t received;      // Monotonic time in nanoseconds
+    uint32_t prev;
+    uint32_t next;
+} BypassHeld;
+
+typedef enum
+{
+    BYPASS_REASON_POOL,
+    BYPASS_REASON_AGE,
+    BYPASS_REASON_LAG,
+    BYPASS_REASON_NOBUF,
+    MAX_BYPASS_REASON
+} BypassReason;
+
+static const char *bypass_reason_counters[MAX_BYPASS_REASON] = {
+    "triggered_pool",
+    "triggered_age",
+    "triggered_lag",
+    "triggered_nobuf",
+};
+
+typedef struct
+{
+    /* Configuration */
+    unsigned pool_high;
+    unsigned pool_low;
+    unsigned age_high;
+    unsigned age_low;
+    unsigned lag_high;
+    unsigned lag_low;
+    unsigned hold;
+    DAQ_Verdict verdict;
+
+    DAQ_ModuleInstance_h modinst;
+    DAQ_InstanceAPI_t subapi;
+
+    /* Held message tracking */
+    BypassHeld *held;
+    uint32_t *table;
+    uint32_t table_mask;
+    uint32_t capacity;
+    uint32_t free_list;
+    uint32_t oldest;
+    uint32_t newest;
+    unsigned pool_size;
+    unsigned num_held;
+    uint64_t finalized_age;     // Oldest age at finalization since the last receive
+
+    /* Overload state */
+    bool bypassing;
+    bool nobuf;
+    uint64_t bypass_start;
+    int64_t lag_base;
+    bool lag_base_set;
+
+    /* Counters */
+    uint64_t bypass_entries;
+    uint64_t bypass_time_ms;
+    uint64_t bypassed_packets;
+    uint64_t bypassed_bytes;
+    uint64_t nobuf_events;
+    uint64_t untracked;
+    uint64_t triggered[MAX_BYPASS_REASON];
+    unsigned max_held;
+    unsigned max_age;
+    unsigned max_lag;
+} BypassContext;
+
+static DAQ_VariableDesc_t bypass_variable_descriptions[] = {
+    { "pool-high", "Percentage of the message pool held by the application at which to start bypassing (default: 90, 0 to disable)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "pool-low", "Percentage of the message pool held by the application at which to stop bypassing (default: half of pool-high)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "age-high", "Age in milliseconds of the oldest message held by the application at which to start bypassing (default: 0, disabled)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "age-low", "Age in milliseconds of the oldest message held by the application at which to stop bypassing (default: half of age-high)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "lag-high", "Milliseconds a packet spent waiting to be received at which to start bypassing (default: 0, disabled)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "lag-low", "Milliseconds a packet spent waiting to be received at which to stop bypassing (default: half of lag-high)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "hold", "Minimum number of milliseconds to keep bypassing once started (default: 500)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "action", "Verdict to render on bypassed packets: pass or whitelist (default: pass)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+};
+
+static DAQ_BaseAPI_t daq_base_api;
+
+//-------------------------------------------------------------------------
+
+static inline uint64_t bypass_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline uint32_t bypass_home_slot(const BypassContext *bc, const DAQ_Msg_t *msg)
+{
+    uint64_t key = (uintptr_t) msg;
+    return (uint32_t) ((key * 0x9e3779b97f4a7c15ULL) >> 32) & bc->table_mask;
+}
+
+static int bypass_alloc_tracking(BypassContext *bc)
+{
+    DAQ_MsgPoolInfo_t mpool_info;
+
+    if (!CHECK_SUBAPI(bc, get_msg_pool_info) || CALL_SUBAPI(bc, get_msg_pool_info, &mpool_info) != DAQ_SUCCESS ||
+            mpool_info.size == 0)
+    {
+        /* Nothing to measure occupancy against, but the age of held messages can still be tracked. */
+        bc->pool_size = 0;
+        bc->capacity = BYPASS_DEFAULT_TRACKED;
+    }
+    else
+        bc->pool_size = bc->capacity = mpool_info.size;
+
+    uint32_t table_size = 1;
+    while (table_size < bc->capacity * 2)
+        table_size <<= 1;
+
+    bc->held = calloc(bc->capacity, sizeof(BypassHeld));
+    bc->table = calloc(table_size, sizeof(uint32_t));
+    if (!bc->held || !bc->table)
+    {
+        SET_ERROR(bc->modinst, "%s: Couldn't allocate tracking for %u held messages", __func__, bc->capacity);
+        free(bc->held);
+        bc->held = NULL;
+        free(bc->table);
+        bc->table = NULL;
+        return DAQ_ERROR_NOMEM;
+    }
+    bc->table_mask = table_size - 1;
+
+    for (uint32_t i = 0; i < bc->capacity; i++)
+        bc->held[i].next = (i + 1 < bc->capacity) ? i + 1 : BYPASS_NONE;
+    bc->free_list = 0;
+    bc->oldest = bc->newest = BYPASS_NONE;
+
+    return DAQ_SUCCESS;
+}
+
+static void bypass_track(BypassContext *bc, const DAQ_Msg_t *msg, uint64_t now)
+{
+    bc->num_held++;
+    if (bc->num_held > bc->max_held)
+        bc->max_held = bc->num_held;
+
+    if (bc->free_list == BYPASS_NONE)
+    {
+        bc->untracked++;
+        return;
+    }
+
+    uint32_t idx = bc->free_list;
+    BypassHeld *held = &bc->held[idx];
+    bc->free_list = held->next;
+
+    held->msg = msg;
+    held->received = now;
+    held->prev = bc->newest;
+    held->next = BYPASS_NONE;
+    if (bc->newest != BYPASS_NONE)
+        bc->held[bc->newest].next = idx;
+    else
+        bc->oldest = idx;
+    bc->newest = idx;
+
+    uint32_t slot = bypass_home_slot(bc, msg);
+    while (bc->table[slot])
+        slot = (slot + 1) & bc->table_mask;
+    bc->table[slot] = idx + 1;
+}
+
+static void bypass_untrack(BypassContext *bc, const DAQ_Msg_t *msg)
+{
+    if (bc->num_held > 0)
+        bc->num_held--;
+
+    if (!bc->table)
+        return;
+
+    uint32_t slot = bypass_home_slot(bc, msg);
+    while (bc->table[slot] && bc->held[bc->table[slot] - 1].msg != msg)
+        slot = (slot + 1) & bc->table_mask;
+    if (!bc->table[slot])
+        return;
+
+    uint32_t idx = bc->table[slot] - 1;
+    BypassHeld *held = &bc->held[idx];
+
+    /* An application that finalizes everything before receiving again never has anything held
+        when the state is updated, so how long it took to finalize what it had counts too. */
+    if (bc->age_high)
+    {
+        uint64_t age = bypass_now() - held->received;
+        if (age > bc->finalized_age)
+            bc->finalized_age = age;
+    }
+
+    /* Remove the table entry, shifting back any entries that probed past it. */
+    uint32_t hole = slot;
+    for (uint32_t next = (hole + 1) & bc->table_mask; bc->table[next]; next = (next + 1) & bc->table_mask)
+    {
+        uint32_t home = bypass_home_slot(bc, bc->held[bc->table[next] - 1].msg);
+        if (((next - home) & bc->table_mask) >= ((next - hole) & bc->table_mask))
+        {
+            bc->table[hole] = bc->table[next];
+            hole = next;
+        }
+    }
+    bc->table[hole] = 0;
+
+    if (held->prev != BYPASS_NONE)
+        bc->held[held->prev].next = held->next;
+    else
+        bc->oldest = held->next;
+    if (held->next != BYPASS_NONE)
+        bc->held[held->next].prev = held->prev;
+    else
+        bc->newest = held->prev;
+
+    held->msg = NULL;
+    held->next = bc->free_list;
+    bc->free_list = idx;
+}
+
+/* How long, in milliseconds, the first packet in the burst waited to be received.  This is measured
+    against the shortest wait seen so far rather than taken at face value, which copes with packet
+    timestamps from a clock other than the system's and keeps packets read from a file (whose
+    timestamps can be arbitrarily old) from counting as late. */
+static unsigned bypass_burst_lag(BypassContext *bc, const DAQ_Msg_t *msgs[], unsigned num_msgs)
+{
+    for (unsigned i = 0; i < num_msgs; i++)
+    {
+        if (msgs[i]->type != DAQ_MSG_TYPE_PACKET)
+            continue;
+
+        const DAQ_PktHdr_t *hdr = (const DAQ_PktHdr_t *) msgs[i]->hdr;
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        int64_t wait = (int64_t) (now.tv_sec - hdr->ts.tv_sec) * 1000000 + (now.tv_usec - hdr->ts.tv_usec);
+        if (!bc->lag_base_set || wait < bc->lag_base)
+        {
+            bc->lag_base = wait;
+            bc->lag_base_set = true;
+        }
+        return (unsigned) ((wait - bc->lag_base) / 1000);
+    }
+    return 0;
+}
+
+static inline void bypass_enter(BypassContext *bc, uint64_t now, BypassReason reason)
+{
+    bc->bypassing = true;
+    bc->bypass_start = now;
+    bc->bypass_entries++;
+    bc->triggered[reason]++;
+}
+
+static void bypass_update_state(BypassContext *bc, uint64_t now, unsigned lag)
+{
+    unsigned occupancy = 0;
+    if (bc->pool_size)
+        occupancy = bc->nobuf ? 100 : (unsigned) ((uint64_t) bc->num_held * 100 / bc->pool_size);
+
+    uint64_t oldest_age = bc->finalized_age;
+    if (bc->oldest != BYPASS_NONE && now - bc->held[bc->oldest].received > oldest_age)
+        oldest_age = now - bc->held[bc->oldest].received;
+    unsigned age = (unsigned) (oldest_age / 1000000);
+    bc->finalized_age = 0;
+
+    if (age > bc->max_age)
+        bc->max_age = age;
+    if (lag > bc->max_lag)
+        bc->max_lag = lag;
+
+    if (!bc->bypassing)
+    {
+        BypassReason reason;
+        if (bc->pool_high && bc->pool_size && occupancy >= bc->pool_high)
+            reason = BYPASS_REASON_POOL;
+        else if (bc->age_high && age >= bc->age_high)
+            reason = BYPASS_REASON_AGE;
+        else if (bc->lag_high && lag >= bc->lag_high)
+            reason = BYPASS_REASON_LAG;
+        else if (bc->nobuf)
+            reason = BYPASS_REASON_NOBUF;
+        else
+            return;
+
+        bypass_enter(bc, now, reason);
+        return;
+    }
+
+    /* Stay in bypass for at least the hold time and until everything is back under its low mark. */
+    if (now - bc->bypass_start < (uint64_t) bc->hold * 1000000)
+        return;
+    if (bc->nobuf || (bc->pool_high && bc->pool_size && occupancy > bc->pool_low) ||
+            (bc->age_high && age > bc->age_low) || (bc->lag_high && lag > bc->lag_low))
+        return;
+
+    bc->bypassing = false;
+    bc->bypass_time_ms += (now - bc->bypass_start) / 1000000;
+}
+
+static void bypass_add_counter(DIOCTL_GetModuleCounters *gmc, const char *name, uint64_t value)
+{
+    if (gmc->num_counters >= gmc->max_counters)
+        return;
+
+    DAQ_ModuleCounter_t *counter = &gmc->counters[gmc->num_counters++];
+    counter->module = "bypass";
+    counter->name = name;
+    counter->value = value;
+}
+
+static void bypass_add_counters(BypassContext *bc, DIOCTL_GetModuleCounters *gmc)
+{
+    uint64_t bypass_time_ms = bc->bypass_time_ms;
+    if (bc->bypassing)
+        bypass_time_ms += (bypass_now() - bc->bypass_start) / 1000000;
+
+    bypass_add_counter(gmc, "bypassing", bc->bypassing);
+    bypass_add_counter(gmc, "bypass_entries", bc->bypass_entries);
+    bypass_add_counter(gmc, "bypass_time_ms", bypass_time_ms);
+    bypass_add_counter(gmc, "bypassed_packets", bc->bypassed_packets);
+    bypass_add_counter(gmc, "bypassed_bytes", bc->bypassed_bytes);
+    for (int i = 0; i < MAX_BYPASS_REASON; i++)
+        bypass_add_counter(gmc, bypass_reason_counters[i], bc->triggered[i]);
+    bypass_add_counter(gmc, "nobuf_events", bc->nobuf_events);
+    bypass_add_counter(gmc, "held", bc->num_held);
+    bypass_add_counter(gmc, "max_held", bc->max_held);
+    bypass_add_counter(gmc, "max_age_ms", bc->max_age);
+    bypass_add_counter(gmc, "max_lag_ms", bc->max_lag);
+    bypass_add_counter(gmc, "untracked", bc->untracked);
+}
+
+//-------------------------------------------------------------------------
+
+static int bypass_daq_module_load(const DAQ_BaseAPI_t *base_api)
+{
+    if (base_api->api_version != DAQ_BASE_API_VERSION || base_api->api_size != sizeof(DAQ_BaseAPI_t))
+        return DAQ_ERROR;
+
+    daq_base_api = *base_api;
+
+    return DAQ_SUCCESS;
+}
+
+static int bypass_daq_module_unload(void)
+{
+    memset(&daq_base_api, 0, sizeof(daq_base_api));
+    return DAQ_SUCCESS;
+}
+
+static int bypass_daq_get_variable_descs(const DAQ_VariableDesc_t **var_desc_table)
+{
+    *var_desc_table = bypass_variable_descriptions;
+
+    return sizeof(bypass_variable_descriptions) / sizeof(DAQ_VariableDesc_t);
+}
+
+static int bypass_daq_instantiate(const DAQ_ModuleConfig_h modcfg, DAQ_ModuleInstance_h modinst, void **ctxt_ptr)
+{
+    BypassContext *bc = calloc(1, sizeof(BypassContext));
+    if (!bc)
+    {
+        SET_ERROR(modinst, "%s: Couldn't allocate memory for the DAQ context", __func__);
+        return DAQ_ERROR_NOMEM;
+    }
+    bc->modinst = modinst;
+    bc->oldest = bc->newest = bc->free_list = BYPASS_NONE;
+
+    if (daq_base_api.resolve_subapi(modinst, &bc->subapi) != DAQ_SUCCESS)
+    {
+        SET_ERROR(modinst, "%s: Couldn't resolve subapi. No submodule configured?", __func__);
+        free(bc);
+        return DAQ_ERROR_INVAL;
+    }
+
+    unsigned long pool_high = BYPASS_DEFAULT_POOL_HIGH, age_high = 0, lag_high = 0;
+    unsigned long pool_low = ULONG_MAX, age_low = ULONG_MAX, lag_low = ULONG_MAX;
+    unsigned long hold = BYPASS_DEFAULT_HOLD_MS;
+    bc->verdict = DAQ_VERDICT_PASS;
+
+    const char *varKey, *varValue;
+    daq_base_api.config_first_variable(modcfg, &varKey, &varValue);
+    while (varKey)
+    {
+        unsigned long *value = NULL;
+        unsigned long max = UINT_MAX;
+
+        if (!strcmp(varKey, "pool-high"))
+        {
+            value = &pool_high;
+            max = 100;
+        }
+        else if (!strcmp(varKey, "pool-low"))
+        {
+            value = &pool_low;
+            max = 100;
+        }
+        else if (!strcmp(varKey, "age-high"))
+            value = &age_high;
+        else if (!strcmp(varKey, "age-low"))
+            value = &age_low;
+        else if (!strcmp(varKey, "lag-high"))
+            value = &lag_high;
+        else if (!strcmp(varKey, "lag-low"))
+            value = &lag_low;
+        else if (!strcmp(varKey, "hold"))
+            value = &hold;
+        else if (!strcmp(varKey, "action"))
+        {
+            if (varValue && !strcmp(varValue, "pass"))
+                bc->verdict = DAQ_VERDICT_PASS;
+            else if (varValue && !strcmp(varValue, "whitelist"))
+                bc->verdict = DAQ_VERDICT_WHITELIST;
+            else
+            {
+                SET_ERROR(modinst, "%s: Invalid value for key '%s': '%s'", __func__, varKey, varValue);
+                free(bc);
+                return DAQ_ERROR_INVAL;
+            }
+        }
+
+        if (value && (util_parse_uint(varValue, value) != 0 || *value > max))
+        {
+            SET_ERROR(modinst, "%s: Invalid value for key '%s': '%s'", __func__, varKey, varValue);
+            free(bc);
+            return DAQ_ERROR_INVAL;
+        }
+
+        daq_base_api.config_next_variable(modcfg, &varKey, &varValue);
+    }
+
+    bc->pool_high = pool_high;
+    bc->pool_low = (pool_low != ULONG_MAX) ? pool_low : pool_high / 2;
+    bc->age_high = age_high;
+    bc->age_low = (age_low != ULONG_MAX) ? age_low : age_high / 2;
+    bc->lag_high = lag_high;
+    bc->lag_low = (lag_low != ULONG_MAX) ? lag_low : lag_high / 2;
+    bc->hold = hold;
+    if (bc->pool_low > bc->pool_high || bc->age_low > bc->age_high || bc->lag_low > bc->lag_high)
+    {
+        SET_ERROR(modinst, "%s: Low thresholds can't be greater than their high thresholds", __func__);
+        free(bc);
+        return DAQ_ERROR_INVAL;
+    }
+
+    *ctxt_ptr = bc;
+
+    return DAQ_SUCCESS;
+}
+
+static void bypass_daq_destroy(void *handle)
+{
+    BypassContext *bc = (BypassContext *) handle;
+
+    free(bc->held);
+    free(bc->table);
+    free(bc);
+}
+
+static int bypass_daq_start(void *handle)
+{
+    BypassContext *bc = (BypassContext *) handle;
+
+    int rval = CALL_SUBAPI_NOARGS(bc, start);
+    if (rval != DAQ_SUCCESS)
+        return rval;
+
+    /* The wrapped module's message pool is only reliably sized once it has been started. */
+    if (!bc->held && (rval = bypass_alloc_tracking(bc)) != DAQ_SUCCESS)
+    {
+        CALL_SUBAPI_NOARGS(bc, stop);
+        return rval;
+    }
+
+    return DAQ_SUCCESS;
+}
+
+static int bypass_daq_stop(void *handle)
+{
+    BypassContext *bc = (BypassContext *) handle;
+
+    if (bc->bypassing)
+    {
+        bc->bypassing = false;
+        bc->bypass_time_ms += (bypass_now() - bc->bypass_start) / 1000000;
+    }
+
+    return CALL_SUBAPI_NOARGS(bc, stop);
+}
+
+static int bypass_daq_ioctl(void *handle, DAQ_IoctlCmd cmd, void *arg, size_t arglen)
+{
+    BypassContext *bc = (BypassContext *) handle;
+
+    if (cmd == DIOCTL_GET_MODULE_COUNTERS)
+    {
+        if (arglen != sizeof(DIOCTL_GetModuleCounters))
+            return DAQ_ERROR_INVAL;
+        DIOCTL_GetModuleCounters *gmc = (DIOCTL_GetModuleCounters *) arg;
+        if (!gmc->counters && gmc->max_counters > 0)
+            return DAQ_ERROR_INVAL;
+
+        bypass_add_counters(bc, gmc);
+
+        if (CHECK_SUBAPI(bc, ioctl))
+        {
+            int rval = CALL_SUBAPI(bc, ioctl, cmd, arg, arglen);
+            if (rval != DAQ_SUCCESS && rval != DAQ_ERROR_NOTSUP)
+                return rval;
+        }
+        return DAQ_SUCCESS;
+    }
+
+    if (!CHECK_SUBAPI(bc, ioctl))
+        return DAQ_ERROR_NOTSUP;
+
+    return CALL_SUBAPI(bc, ioctl, cmd, arg, arglen);
+}
+
+static void bypass_daq_reset_stats(void *handle)
+{
+    BypassContext *bc = (BypassContext *) handle;
+
+    if (CHECK_SUBAPI(bc, reset_stats))
+        CALL_SUBAPI_NOARGS(bc, reset_stats);
+
+    bc->bypass_entries = 0;
+    bc->bypass_time_ms = 0;
+    if (bc->bypassing)
+        bc->bypass_start = bypass_now();
+    bc->bypassed_packets = 0;
+    bc->bypassed_bytes = 0;
+    bc->nobuf_events = 0;
+    bc->untracked = 0;
+    memset(bc->triggered, 0, sizeof(bc->triggered));
+    bc->max_held = bc->num_held;
+    bc->max_age = 0;
+    bc->max_lag = 0;
+}
+
+DAQ_STACK_LINKAGE unsigned bypass_daq_msg_receive(void *handle, const unsigned max_recv, const DAQ_Msg_t *msgs[], DAQ_RecvStatus *rstat)
+{
+    BypassContext *bc = (BypassContext *) handle;
+
+    unsigned num_recv = CALL_SUBAPI(bc, msg_receive, max_recv, msgs, rstat);
+
+    /* Running out of buffers means the application is holding on to everything. */
+    bc->nobuf = (num_recv == 0 && *rstat == DAQ_RSTAT_NOBUF);
+    if (bc->nobuf)
+        bc->nobuf_events++;
+
+    uint64_t now = bypass_now();
+    unsigned lag = bc->lag_high ? bypass_burst_lag(bc, msgs, num_recv) : 0;
+    bypass_update_state(bc, now, lag);
+
+    unsigned num_delivered = 0;
+    for (unsigned i = 0; i < num_recv; i++)
+    {
+        const DAQ_Msg_t *msg = msgs[i];
+
+        if (bc->bypassing && msg->type == DAQ_MSG_TYPE_PACKET)
+        {
+            bc->bypassed_packets++;
+            bc->bypassed_bytes += msg->data_len;
+            CALL_SUBAPI(bc, msg_finalize, msg, bc->verdict);
+            continue;
+        }
+
+        bypass_track(bc, msg, now);
+        msgs[num_delivered++] = msg;
+
+        /* Catch the pool filling up partway through a burst, if there's a known pool to fill. */
+        if (!bc->bypassing && bc->pool_high && bc->pool_size && bc->num_held * 100ULL >= (uint64_t) bc->pool_high * bc->pool_size)
+            bypass_enter(bc, now, BYPASS_REASON_POOL);
+    }
+
+    return num_delivered;
+}
+
+DAQ_STACK_LINKAGE int bypass_daq_msg_finalize(void *handle, const DAQ_Msg_t *msg, DAQ_Verdict verdict)
+{
+    BypassContext *bc = (BypassContext *) handle;
+
+    bypass_untrack(bc, msg);
+
+    return CALL_SUBAPI(bc, msg_finalize, msg, verdict);
+}
+
+#ifdef BUILDING_SO
+DAQ_SO_PUBLIC DAQ_ModuleAPI_t DAQ_MODULE_DATA =
+#else
+DAQ_ModuleAPI_t bypass_daq_module_data =
+#endif
+{
+    /* .api_version = */ DAQ_MODULE_API_VERSION,
+    /* .api_size = */ sizeof(DAQ_ModuleAPI_t),
+    /* .module_version = */ DAQ_BYPASS_VERSION,
+    /* .name = */ "bypass",
+    /* .type = */ DAQ_TYPE_WRAPPER | DAQ_TYPE_INLINE_CAPABLE,
+    /* .load = */ bypass_daq_module_load,
+    /* .unload = */ bypass_daq_module_unload,
+    /* .get_variable_descs = */ bypass_daq_get_variable_descs,
+    /* .instantiate = */ bypass_daq_instantiate,
+    /* .destroy = */ bypass_daq_destroy,
+    /* .set_filter = */ NULL,
+    /* .start = */ bypass_daq_start,
+    /* .inject = */ NULL,
+    /* .inject_relative = */ NULL,
+    /* .interrupt = */ NULL,
+    /* .stop = */ bypass_daq_stop,
+    /* .ioctl = */ bypass_daq_ioctl,
+    /* .get_stats = */ NULL,
+    /* .reset_stats = */ bypass_daq_reset_stats,
+    /* .get_snaplen = */ NULL,
+    /* .get_capabilities = */ NULL,
+    /* .get_datalink_type = */ NULL,
+    /* .config_load = */ NULL,
+    /* .config_swap = */ NULL,
+    /* .config_free = */ NULL,
+    /* .msg_receive = */ bypass_daq_msg_receive,
+    /* .msg_finalize = */ bypass_daq_msg_finalize,
+    /* .get_msg_pool_info = */ NULL,
+};
@@ -0,0 +1,207 @@
+/*
+** Copyright (C) 2014-2021 Cisco and/or its affiliates. All rights reserved.
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation.  You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef _DAQ_MODULE_UTIL_H
+#define _DAQ_MODULE_UTIL_H
+
+/*
+ * Helpers shared by the modules that parse their configuration or look into packets.  Everything
+ * is static inline so that each module stays a single self-contained object.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "daq_common.h"
+#include "daq_dlt.h"
+
+#define UTIL_ETHERTYPE_IPV4     0x0800
+#define UTIL_ETHERTYPE_IPV6     0x86dd
+
+/* Parse a non-negative decimal number that makes up the entire string. */
+static inline int util_parse_uint(const char *str, unsigned long *value)
+{
+    char *endptr;
+
+    if (!str || *str == '\0')
+        return -1;
+
+    errno = 0;
+    *value = strtoul(str, &endptr, 10);
+    if (*endptr != '\0' || errno != 0)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * Find the network layer header of a packet, skipping any VLAN tags of an Ethernet frame.  Returns
+ * its EtherType with its offset in 'off', or 0 if the datalink type isn't understood or the packet
+ * is too short to tell.  Raw IP packets are reported as IPv4 or IPv6 by their version alone; the
+ * caller still has to check the network layer header for itself.
+ */
+static inline uint16_t util_find_l3(const uint8_t *data, uint32_t len, int dlt, uint32_t *off)
+{
+    uint16_t ethertype = 0;
+
+    *off = 0;
+    if (dlt == DLT_EN10MB)
+    {
+        if (len < 14)
+            return 0;
+        ethertype = (data[12] << 8) | data[13];
+        *off = 14;
+        while ((ethertype == 0x8100 || ethertype == 0x88a8 || ethertype == 0x9100) && len >= *off + 4)
+        {
+            ethertype = (data[*off + 2] << 8) | data[*off + 3];
+            *off += 4;
+        }
+    }
+    else if ((dlt == DLT_RAW || dlt == DLT_IPV4 || dlt == DLT_IPV6) && len >= 1)
+        ethertype = ((data[0] >> 4) == 6) ? UTIL_ETHERTYPE_IPV6 : UTIL_ETHERTYPE_IPV4;
+
+    return ethertype;
+}
+
+static inline uint32_t util_hash_mix(uint32_t h, uint32_t w)
+{
+    w *= 0xcc9e2d51;
+    w = (w << 15) | (w >> 17);
+    w *= 0x1b873593;
+    h ^= w;
+    h = (h << 13) | (h >> 19);
+    return h * 5 + 0xe6546b64;
+}
+
+static inline uint32_t util_hash_fmix(uint32_t h)
+{
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+/* Hash a pair of endpoints the same way regardless of which one is the source.  IPv4 addresses are
+    given in their IPv4-mapped IPv6 form so that flow statistics messages hash like their packets. */
+static inline uint32_t util_flow_hash_endpoints(const uint8_t *a, uint16_t a_port, const uint8_t *b,
+        uint16_t b_port, uint8_t proto)
+{
+    int cmp = memcmp(a, b, 16);
+    if (cmp > 0 || (cmp == 0 && a_port > b_port))
+    {
+        const uint8_t *tmp = a;
+        a = b;
+        b = tmp;
+        uint16_t tmp_port = a_port;
+        a_port = b_port;
+        b_port = tmp_port;
+    }
+
+    uint32_t h = proto;
+    uint32_t w;
+    for (int i = 0; i < 16; i += 4)
+    {
+        memcpy(&w, a + i, 4);
+        h = util_hash_mix(h, w);
+    }
+    for (int i = 0; i < 16; i += 4)
+    {
+        memcpy(&w, b + i, 4);
+        h = util_hash_mix(h, w);
+    }
+    h = util_hash_mix(h, ((uint32_t) a_port << 16) | b_port);
+
+    return util_hash_fmix(h);
+}
+
+/* Symmetric hash of the 5-tuple of an IP packet, or 0 for anything else. */
+static inline uint32_t util_flow_hash_packet(const uint8_t *data, uint32_t len, int dlt)
+{
+    uint32_t off;
+    uint16_t ethertype = util_find_l3(data, len, dlt, &off);
+
+    uint8_t src[16], dst[16];
+    uint8_t proto;
+    uint32_t l4off;
+    bool fragment;
+    if (ethertype == UTIL_ETHERTYPE_IPV4)
+    {
+        if (len < off + 20)
+            return 0;
+        const uint8_t *ip = data + off;
+        memset(src, 0, 10);
+        src[10] = src[11] = 0xff;
+        memcpy(dst, src, 12);
+        memcpy(src + 12, ip + 12, 4);
+        memcpy(dst + 12, ip + 16, 4);
+        proto = ip[9];
+        l4off = off + (ip[0] & 0x0f) * 4;
+        /* Fragments are hashed on their addresses alone so that all of them go the same way */
+        fragment = (((ip[6] << 8) | ip[7]) & 0x3fff) != 0;
+    }
+    else if (ethertype == UTIL_ETHERTYPE_IPV6)
+    {
+        if (len < off + 40)
+            return 0;
+        const uint8_t *ip = data + off;
+        memcpy(src, ip + 8, 16);
+        memcpy(dst, ip + 24, 16);
+        proto = ip[6];
+        l4off = off + 40;
+        fragment = (proto == 44);
+    }
+    else
+        return 0;
+
+    uint16_t sport = 0, dport = 0;
+    if (fragment)
+        proto = 0;
+    else if ((proto == 6 || proto == 17 || proto == 132) && len >= l4off + 4)
+    {
+        sport = (data[l4off] << 8) | data[l4off + 1];
+        dport = (data[l4off + 2] << 8) | data[l4off + 3];
+    }
+
+    return util_flow_hash_endpoints(src, sport, dst, dport, proto);
+}
+
+/* Flow hash of a packet or of the flow a start/end of flow message describes, or 0 for anything
+    else. */
+static inline uint32_t util_flow_hash_msg(const DAQ_Msg_t *msg, int dlt)
+{
+    if (msg->type == DAQ_MSG_TYPE_PACKET)
+        return util_flow_hash_packet(msg->data, msg->data_len, dlt);
+
+    if ((msg->type == DAQ_MSG_TYPE_SOF || msg->type == DAQ_MSG_TYPE_EOF) && msg->hdr_len >= sizeof(DAQ_FlowStats_t))
+    {
+        const DAQ_FlowStats_t *fs = (const DAQ_FlowStats_t *) msg->hdr;
+        return util_flow_hash_endpoints(fs->initiator_ip, ntohs(fs->initiator_port),
+                fs->responder_ip, ntohs(fs->responder_port), fs->protocol);
+    }
+
+    return 0;
+}
+
+#endif /* _DAQ_MODULE_UTIL_H */
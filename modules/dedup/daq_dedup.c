@@ -0,0 +1,488 @@
+/*
+** Copyright (C) 2014-2021 Cisco and/or its affiliates. All rights reserved.
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation.  You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "daq_dlt.h"
+#include "daq_module_api.h"
+#include "daq_module_util.h"
+
+#define DAQ_DEDUP_VERSION 1
+
+#define DEDUP_DEFAULT_WINDOW_US     10000
+#define DEDUP_DEFAULT_ENTRIES       (1 << 20)
+#define DEDUP_MIN_ENTRIES           1024
+
+/* Entries are grouped into buckets of one cache line each */
+#define DEDUP_BUCKET_ENTRIES        8
+
+/* Bytes at the start of the IP header that are copied aside to mask out the mutable fields */
+#define DEDUP_MASK_LEN              128
+
+#define SET_ERROR(modinst, ...)    daq_base_api.set_errbuf(modinst, __VA_ARGS__)
+
+#define CHECK_SUBAPI(ctxt, fname) \
+    (ctxt->subapi.fname.func != NULL)
+
+#define CALL_SUBAPI_NOARGS(ctxt, fname) \
+    ctxt->subapi.fname.func(ctxt->subapi.fname.context)
+
+#define CALL_SUBAPI(ctxt, fname, ...) \
+    DAQ_SUBAPI_CALL(ctxt->subapi, fname, __VA_ARGS__)
+
+/*
+ * A packet seen recently: part of its content hash (the rest picks the bucket) and its capture time
+ * in microseconds, truncated to 32 bits.  A zero fingerprint marks an empty entry.  Entries are never
+ * removed; once they fall out of the window they are simply reused.
+ */
+typedef struct
+{
+    uint32_t fingerprint;
+    uint32_t ts;
+} DedupEntry;
+
+typedef struct
+{
+    /* Configuration */
+    uint32_t window;        // Microseconds
+    uint32_t num_entries;
+
+    DAQ_ModuleInstance_h modinst;
+    DAQ_InstanceAPI_t subapi;
+    int dlt;
+
+    DedupEntry *table;
+    uint32_t bucket_mask;
+
+    /* Counters */
+    uint64_t packets;
+    uint64_t duplicates;
+    uint64_t duplicate_bytes;
+    uint64_t evictions;
+} DedupContext;
+
+static DAQ_VariableDesc_t dedup_variable_descriptions[] = {
+    { "window", "Microseconds within which an identical packet is considered a duplicate (default: 10000)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "entries", "Number of recently seen packets to remember, rounded up to a power of two (default: 1048576)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+};
+
+static DAQ_BaseAPI_t daq_base_api;
+
+//-------------------------------------------------------------------------
+
+static inline uint64_t dedup_rotl(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t dedup_hash_bytes(uint64_t h, const uint8_t *data, uint32_t len)
+{
+    uint64_t w;
+
+    while (len >= 8)
+    {
+        memcpy(&w, data, 8);
+        h ^= dedup_rotl(w * 0x87c37b91114253d5ULL, 31) * 0x4cf5ad432745937fULL;
+        h = dedup_rotl(h, 27) * 5 + 0x52dce729;
+        data += 8;
+        len -= 8;
+    }
+    if (len > 0)
+    {
+        w = 0;
+        memcpy(&w, data, len);
+        h ^= dedup_rotl(w * 0x87c37b91114253d5ULL, 31) * 0x4cf5ad432745937fULL;
+        h = dedup_rotl(h, 27) * 5 + 0x52dce729;
+    }
+    return h;
+}
+
+static inline uint64_t dedup_fmix(uint64_t h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* Zero the L4 checksum, if it was captured, of an unfragmented TCP, UDP or ICMP packet. */
+static void dedup_mask_l4(uint8_t *buf, uint32_t l4off, uint32_t len, uint8_t proto)
+{
+    uint32_t csum_off;
+
+    switch (proto)
+    {
+        case 6:     // TCP
+            csum_off = 16;
+            break;
+        case 17:    // UDP
+            csum_off = 6;
+            break;
+        case 1:     // ICMP
+        case 58:    // ICMPv6
+            csum_off = 2;
+            break;
+        default:
+            return;
+    }
+    if (l4off + csum_off + 2 <= len)
+        memset(buf + l4off + csum_off, 0, 2);
+}
+
+/*
+ * Hash the content of a packet as it would look from any mirror port.  The link layer header is
+ * left out entirely (copies of a packet routed between VLANs differ in it) along with the IP fields
+ * that change hop by hop or that are commonly rewritten: TOS/traffic class, TTL/hop limit and the
+ * IP and L4 checksums.  The start of the IP header is copied aside to mask those out.
+ */
+static uint64_t dedup_hash_packet(const DedupContext *dc, const DAQ_Msg_t *msg)
+{
+    const DAQ_PktHdr_t *hdr = (const DAQ_PktHdr_t *) msg->hdr;
+    const uint8_t *data = msg->data;
+    uint32_t len = msg->data_len;
+    uint32_t off;
+    uint16_t ethertype = util_find_l3(data, len, dc->dlt, &off);
+
+    uint8_t buf[DEDUP_MASK_LEN];
+    uint32_t masked = 0;
+    if (ethertype == UTIL_ETHERTYPE_IPV4 && len >= off + 20 && (data[off] >> 4) == 4)
+    {
+        masked = (len - off < DEDUP_MASK_LEN) ? len - off : DEDUP_MASK_LEN;
+        memcpy(buf, data + off, masked);
+        buf[1] = 0;                 // TOS
+        buf[8] = 0;                 // TTL
+        buf[10] = buf[11] = 0;      // Header checksum
+        if ((((buf[6] << 8) | buf[7]) & 0x1fff) == 0)
+            dedup_mask_l4(buf, (buf[0] & 0x0f) * 4, masked, buf[9]);
+    }
+    else if (ethertype == UTIL_ETHERTYPE_IPV6 && len >= off + 40 && (data[off] >> 4) == 6)
+    {
+        masked = (len - off < DEDUP_MASK_LEN) ? len - off : DEDUP_MASK_LEN;
+        memcpy(buf, data + off, masked);
+        buf[0] &= 0xf0;             // Traffic class
+        buf[1] &= 0x0f;
+        buf[7] = 0;                 // Hop limit
+        dedup_mask_l4(buf, 40, masked, buf[6]);
+    }
+    else if (dc->dlt == DLT_EN10MB && off > 0)
+        off -= 2;                   // Keep the EtherType of anything else
+
+    /* The original length is hashed too so that differently truncated copies don't match, but
+        without the link layer header. */
+    uint64_t h = dedup_hash_bytes((hdr->pktlen > off) ? hdr->pktlen - off : 0, buf, masked);
+    h = dedup_hash_bytes(h, data + off + masked, len - off - masked);
+
+    return dedup_fmix(h);
+}
+
+/* Look for a recent copy of the packet, remembering it if there isn't one. */
+static bool dedup_check(DedupContext *dc, uint64_t hash, uint32_t ts)
+{
+    DedupEntry *bucket = &dc->table[((uint32_t) (hash >> 32) & dc->bucket_mask) * DEDUP_BUCKET_ENTRIES];
+    uint32_t fingerprint = (uint32_t) hash ? (uint32_t) hash : 1;
+    DedupEntry *victim = NULL;
+    uint32_t victim_age = 0;
+    bool victim_live = true;
+
+    for (int i = 0; i < DEDUP_BUCKET_ENTRIES; i++)
+    {
+        DedupEntry *entry = &bucket[i];
+
+        if (entry->fingerprint == 0)
+        {
+            if (!victim || victim_live)
+            {
+                victim = entry;
+                victim_live = false;
+            }
+            continue;
+        }
+
+        /* Copies from different ports may be timestamped slightly out of order. */
+        int32_t delta = (int32_t) (ts - entry->ts);
+        uint32_t age = (delta < 0) ? (uint32_t) -(int64_t) delta : (uint32_t) delta;
+        if (age <= dc->window)
+        {
+            if (entry->fingerprint == fingerprint)
+                return true;
+            if (victim_live && (!victim || age > victim_age))
+            {
+                victim = entry;
+                victim_age = age;
+            }
+        }
+        else if (!victim || victim_live)
+        {
+            victim = entry;
+            victim_live = false;
+        }
+    }
+
+    if (victim_live)
+        dc->evictions++;
+    victim->fingerprint = fingerprint;
+    victim->ts = ts;
+
+    return false;
+}
+
+static void dedup_add_counter(DIOCTL_GetModuleCounters *gmc, const char *name, uint64_t value)
+{
+    if (gmc->num_counters >= gmc->max_counters)
+        return;
+
+    DAQ_ModuleCounter_t *counter = &gmc->counters[gmc->num_counters++];
+    counter->module = "dedup";
+    counter->name = name;
+    counter->value = value;
+}
+
+//-------------------------------------------------------------------------
+
+static int dedup_daq_module_load(const DAQ_BaseAPI_t *base_api)
+{
+    if (base_api->api_version != DAQ_BASE_API_VERSION || base_api->api_size != sizeof(DAQ_BaseAPI_t))
+        return DAQ_ERROR;
+
+    daq_base_api = *base_api;
+
+    return DAQ_SUCCESS;
+}
+
+static int dedup_daq_module_unload(void)
+{
+    memset(&daq_base_api, 0, sizeof(daq_base_api));
+    return DAQ_SUCCESS;
+}
+
+static int dedup_daq_get_variable_descs(const DAQ_VariableDesc_t **var_desc_table)
+{
+    *var_desc_table = dedup_variable_descriptions;
+
+    return sizeof(dedup_variable_descriptions) / sizeof(DAQ_VariableDesc_t);
+}
+
+static int dedup_daq_instantiate(const DAQ_ModuleConfig_h modcfg, DAQ_ModuleInstance_h modinst, void **ctxt_ptr)
+{
+    DedupContext *dc = calloc(1, sizeof(DedupContext));
+    if (!dc)
+    {
+        SET_ERROR(modinst, "%s: Couldn't allocate memory for the DAQ context", __func__);
+        return DAQ_ERROR_NOMEM;
+    }
+    dc->modinst = modinst;
+
+    if (daq_base_api.resolve_subapi(modinst, &dc->subapi) != DAQ_SUCCESS)
+    {
+        SET_ERROR(modinst, "%s: Couldn't resolve subapi. No submodule configured?", __func__);
+        free(dc);
+        return DAQ_ERROR_INVAL;
+    }
+
+    unsigned long window = DEDUP_DEFAULT_WINDOW_US;
+    unsigned long entries = DEDUP_DEFAULT_ENTRIES;
+    const char *varKey, *varValue;
+    daq_base_api.config_first_variable(modcfg, &varKey, &varValue);
+    while (varKey)
+    {
+        if (!strcmp(varKey, "window"))
+        {
+            if (util_parse_uint(varValue, &window) != 0 || window == 0 || window > INT32_MAX)
+            {
+                SET_ERROR(modinst, "%s: Invalid value for key '%s': '%s'", __func__, varKey, varValue);
+                free(dc);
+                return DAQ_ERROR_INVAL;
+            }
+        }
+        else if (!strcmp(varKey, "entries"))
+        {
+            if (util_parse_uint(varValue, &entries) != 0 || entries < DEDUP_MIN_ENTRIES || entries > (1UL << 31))
+            {
+                SET_ERROR(modinst, "%s: Invalid value for key '%s': '%s'", __func__, varKey, varValue);
+                free(dc);
+                return DAQ_ERROR_INVAL;
+            }
+        }
+        daq_base_api.config_next_variable(modcfg, &varKey, &varValue);
+    }
+    dc->window = window;
+
+    uint32_t num_entries = DEDUP_MIN_ENTRIES;
+    while (num_entries < entries)
+        num_entries <<= 1;
+    dc->num_entries = num_entries;
+    dc->bucket_mask = num_entries / DEDUP_BUCKET_ENTRIES - 1;
+
+    if (posix_memalign((void **) &dc->table, 64, num_entries * sizeof(DedupEntry)) != 0)
+    {
+        SET_ERROR(modinst, "%s: Couldn't allocate a table of %u entries", __func__, num_entries);
+        free(dc);
+        return DAQ_ERROR_NOMEM;
+    }
+    memset(dc->table, 0, num_entries * sizeof(DedupEntry));
+
+    *ctxt_ptr = dc;
+
+    return DAQ_SUCCESS;
+}
+
+static void dedup_daq_destroy(void *handle)
+{
+    DedupContext *dc = (DedupContext *) handle;
+
+    free(dc->table);
+    free(dc);
+}
+
+static int dedup_daq_start(void *handle)
+{
+    DedupContext *dc = (DedupContext *) handle;
+
+    int rval = CALL_SUBAPI_NOARGS(dc, start);
+    if (rval != DAQ_SUCCESS)
+        return rval;
+
+    dc->dlt = CHECK_SUBAPI(dc, get_datalink_type) ? CALL_SUBAPI_NOARGS(dc, get_datalink_type) : DLT_EN10MB;
+
+    return DAQ_SUCCESS;
+}
+
+static int dedup_daq_ioctl(void *handle, DAQ_IoctlCmd cmd, void *arg, size_t arglen)
+{
+    DedupContext *dc = (DedupContext *) handle;
+
+    if (cmd == DIOCTL_GET_MODULE_COUNTERS)
+    {
+        if (arglen != sizeof(DIOCTL_GetModuleCounters))
+            return DAQ_ERROR_INVAL;
+        DIOCTL_GetModuleCounters *gmc = (DIOCTL_GetModuleCounters *) arg;
+        if (!gmc->counters && gmc->max_counters > 0)
+            return DAQ_ERROR_INVAL;
+
+        dedup_add_counter(gmc, "packets", dc->packets);
+        dedup_add_counter(gmc, "duplicates", dc->duplicates);
+        dedup_add_counter(gmc, "duplicate_bytes", dc->duplicate_bytes);
+        dedup_add_counter(gmc, "duplicate_ppm", dc->packets ? dc->duplicates * 1000000 / dc->packets : 0);
+        dedup_add_counter(gmc, "evictions", dc->evictions);
+
+        if (CHECK_SUBAPI(dc, ioctl))
+        {
+            int rval = CALL_SUBAPI(dc, ioctl, cmd, arg, arglen);
+            if (rval != DAQ_SUCCESS && rval != DAQ_ERROR_NOTSUP)
+                return rval;
+        }
+        return DAQ_SUCCESS;
+    }
+
+    if (!CHECK_SUBAPI(dc, ioctl))
+        return DAQ_ERROR_NOTSUP;
+
+    return CALL_SUBAPI(dc, ioctl, cmd, arg, arglen);
+}
+
+static void dedup_daq_reset_stats(void *handle)
+{
+    DedupContext *dc = (DedupContext *) handle;
+
+    if (CHECK_SUBAPI(dc, reset_stats))
+        CALL_SUBAPI_NOARGS(dc, reset_stats);
+
+    dc->packets = 0;
+    dc->duplicates = 0;
+    dc->duplicate_bytes = 0;
+    dc->evictions = 0;
+}
+
+DAQ_STACK_LINKAGE unsigned dedup_daq_msg_receive(void *handle, const unsigned max_recv, const DAQ_Msg_t *msgs[], DAQ_RecvStatus *rstat)
+{
+    DedupContext *dc = (DedupContext *) handle;
+
+    unsigned num_recv = CALL_SUBAPI(dc, msg_receive, max_recv, msgs, rstat);
+
+    unsigned num_delivered = 0;
+    for (unsigned i = 0; i < num_recv; i++)
+    {
+        const DAQ_Msg_t *msg = msgs[i];
+
+        if (msg->type == DAQ_MSG_TYPE_PACKET)
+        {
+            const DAQ_PktHdr_t *hdr = (const DAQ_PktHdr_t *) msg->hdr;
+            uint32_t ts = (uint32_t) ((uint64_t) hdr->ts.tv_sec * 1000000 + hdr->ts.tv_usec);
+
+            dc->packets++;
+            if (dedup_check(dc, dedup_hash_packet(dc, msg), ts))
+            {
+                dc->duplicates++;
+                dc->duplicate_bytes += msg->data_len;
+                CALL_SUBAPI(dc, msg_finalize, msg, DAQ_VERDICT_PASS);
+                continue;
+            }
+        }
+
+        msgs[num_delivered++] = msg;
+    }
+
+    return num_delivered;
+}
+
+#ifdef BUILDING_SO
+DAQ_SO_PUBLIC DAQ_ModuleAPI_t DAQ_MODULE_DATA =
+#else
+DAQ_ModuleAPI_t dedup_daq_module_data =
+#endif
+{
+    /* .api_version = */ DAQ_MODULE_API_VERSION,
+    /* .api_size = */ sizeof(DAQ_ModuleAPI_t),
+    /* .module_version = */ DAQ_DEDUP_VERSION,
+    /* .name = */ "dedup",
+    /* .type = */ DAQ_TYPE_WRAPPER,
+    /* .load = */ dedup_daq_module_load,
+    /* .unload = */ dedup_daq_module_unload,
+    /* .get_variable_descs = */ dedup_daq_get_variable_descs,
+    /* .instantiate = */ dedup_daq_instantiate,
+    /* .destroy = */ dedup_daq_destroy,
+    /* .set_filter = */ NULL,
+    /* .start = */ dedup_daq_start,
+    /* .inject = */ NULL,
+    /* .inject_relative = */ NULL,
+    /* .interrupt = */ NULL,
+    /* .stop = */ NULL,
+    /* .ioctl = */ dedup_daq_ioctl,
+    /* .get_stats = */ NULL,
+    /* .reset_stats = */ dedup_daq_reset_stats,
+    /* .get_snaplen = */ NULL,
+    /* .get_capabilities = */ NULL,
+    /* .get_datalink_type = */ NULL,
+    /* .config_load = */ NULL,
+    /* .config_swap = */ NULL,
+    /* .config_free = */ NULL,
+    /* .msg_receive = */ dedup_daq_msg_receive,
+    /* .msg_finalize = */ NULL,
+    /* .get_msg_pool_info = */ NULL,
+};
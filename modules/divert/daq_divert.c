@@ -260,7 +260,7 @@ static int divert_daq_inject_relative(void *handle, const DAQ_Msg_t *msg, const
     return DAQ_SUCCESS;
 }
 
-static unsigned divert_daq_msg_receive(void *handle, const unsigned max_recv, const DAQ_Msg_t *msgs[], DAQ_RecvStatus *rstat)
+DAQ_STACK_LINKAGE unsigned divert_daq_msg_receive(void *handle, const unsigned max_recv, const DAQ_Msg_t *msgs[], DAQ_RecvStatus *rstat)
 {
     Divert_Context_t *dc = (Divert_Context_t *) handle;
     DAQ_RecvStatus status = DAQ_RSTAT_OK;
@@ -398,7 +398,7 @@ static const DAQ_Verdict verdict_translation_table[MAX_DAQ_VERDICT] = {
     DAQ_VERDICT_PASS        /* DAQ_VERDICT_IGNORE */
 };
 
-static int divert_daq_msg_finalize(void *handle, const DAQ_Msg_t *msg, DAQ_Verdict verdict)
+DAQ_STACK_LINKAGE int divert_daq_msg_finalize(void *handle, const DAQ_Msg_t *msg, DAQ_Verdict verdict)
 {
     Divert_Context_t *dc = (Divert_Context_t *) handle;
     DivertPktDesc *desc = (DivertPktDesc *) msg->priv;
@@ -23,50 +23,1474 @@
 #include "config.h"
 #endif
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <pcap.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "daq_module_api.h"
+#include "daq_module_util.h"
 
-#define DAQ_DUMP_VERSION 5
+#define DAQ_DUMP_VERSION 10
 
 #define DEFAULT_TX_DUMP_FILE "inline-out.pcap"
 #define DEFAULT_RX_DUMP_FILE "inline-in.pcap"
+#define DEFAULT_FLIGHT_RECORDER_FILE "flight-recorder-%n.pcap"
+
+#define DEFAULT_BUFFER_SIZE_KB      1024
+#define MIN_BUFFER_SIZE_KB          128
+#define DEFAULT_NUM_BUFFERS         8
+#define DEFAULT_FLUSH_INTERVAL_MS   1000
+#define DEFAULT_FLIGHT_RECORDER_MB  64
+
+#ifndef PCAP_NETMASK_UNKNOWN // For OpenBSD
+#define PCAP_NETMASK_UNKNOWN    0xffffffff
+#endif
+
+/* Bits of the record verdict mask; injected packets have no verdict and get their own bit. */
+#define DUMP_RECORD_VERDICT(v)  (1U << (v))
+#define DUMP_RECORD_INJECTED    (1U << MAX_DAQ_VERDICT)
+#define DEFAULT_RECORD_VERDICTS (DUMP_RECORD_VERDICT(DAQ_VERDICT_PASS) | DUMP_RECORD_VERDICT(DAQ_VERDICT_REPLACE) | \
+        DUMP_RECORD_VERDICT(DAQ_VERDICT_WHITELIST) | DUMP_RECORD_VERDICT(DAQ_VERDICT_IGNORE) | DUMP_RECORD_INJECTED)
+
+/* Maximum number of buffers handed to the kernel in a single writev() */
+#define DUMP_MAX_IOV    64
+
+/* Maximum size of the file header (a classic savefile header is 24 bytes, the pcapng SHB we write is 48) */
+#define DUMP_MAX_FILE_HDR_LEN   64
+
+/* pcapng block types and options (draft-ietf-opsawg-pcapng) */
+#define PCAPNG_BT_SHB               0x0A0D0D0A
+#define PCAPNG_BT_IDB               0x00000001
+#define PCAPNG_BT_EPB               0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC     0x1A2B3C4D
+#define PCAPNG_OPT_ENDOFOPT         0
+#define PCAPNG_OPT_COMMENT          1
+#define PCAPNG_OPT_SHB_USERAPPL     4
+#define PCAPNG_OPT_IF_NAME          2
+#define PCAPNG_OPT_IF_TSRESOL       9
+#define PCAPNG_OPT_EPB_FLAGS        2
+#define PCAPNG_OPT_CUSTOM_BINARY    2989
+#define PCAPNG_EPB_FLAG_INBOUND     0x1
+#define PCAPNG_EPB_FLAG_OUTBOUND    0x2
+#define PCAPNG_PAD(len)             (((len) + 3) & ~3U)
+
+/* IANA Private Enterprise Number that scopes the DAQ packet information custom option (Cisco) */
+#define DUMP_PCAPNG_PEN             9
+#define DUMP_PCAPNG_INFO_VERSION    1
+#define DUMP_PCAPNG_NO_VERDICT      0xff
+#define DUMP_PCAPNG_INFO_HAS_REASON 0x01
+
+/* Distinct ingress interfaces described per pcapng file; any more share the first interface */
+#define DUMP_PCAPNG_MAX_IFACES  256
+/* Upper bound on the size of an IDB as generated by dump_pcapng_build_idb() */
+#define DUMP_PCAPNG_MAX_IDB_LEN 64
+
+/* Tracing data held for messages awaiting a verdict (pcapng only) */
+#define DUMP_TRACE_SLOTS        64
+#define DUMP_MAX_TRACE_LEN      1024
 
 #define SET_ERROR(modinst, ...)    daq_base_api.set_errbuf(modinst, __VA_ARGS__)
 
-#define CHECK_SUBAPI(ctxt, fname) \
-    (ctxt->subapi.fname.func != NULL)
+#define CHECK_SUBAPI(ctxt, fname) \
+    (ctxt->subapi.fname.func != NULL)
+
+#define CALL_SUBAPI_NOARGS(ctxt, fname) \
+    ctxt->subapi.fname.func(ctxt->subapi.fname.context)
+
+#define CALL_SUBAPI(ctxt, fname, ...) \
+    DAQ_SUBAPI_CALL(ctxt->subapi, fname, __VA_ARGS__)
+
+/* On-disk PCAP record header (struct pcap_sf_pkthdr in LibPCAP), written in host byte order. */
+typedef struct
+{
+    uint32_t ts_sec;
+    uint32_t ts_nsec;           // Savefiles are written with nanosecond resolution
+    uint32_t caplen;
+    uint32_t len;
+} DumpRecordHdr;
+
+/* Fixed portion of a pcapng Enhanced Packet Block */
+typedef struct
+{
+    uint32_t block_type;
+    uint32_t block_len;
+    uint32_t iface_id;
+    uint32_t ts_high;
+    uint32_t ts_low;
+    uint32_t caplen;
+    uint32_t pktlen;
+} PcapngEPBHdr;
+
+/* Value of the DAQ packet information custom option attached to each pcapng EPB */
+typedef struct
+{
+    uint32_t pen;
+    uint8_t version;
+    uint8_t verdict;            // DAQ_Verdict, or DUMP_PCAPNG_NO_VERDICT for received/injected packets
+    uint8_t verdict_reason;
+    uint8_t flags;              // DUMP_PCAPNG_INFO_*
+    uint32_t pkt_flags;         // DAQ_PKT_FLAG_*
+    int32_t ingress_index;
+    int32_t egress_index;
+    int16_t ingress_group;
+    int16_t egress_group;
+    uint32_t flow_id;
+    uint16_t address_space_id;
+    uint16_t reserved;
+} DumpPcapngInfo;
+
+/* Verdict reason and tracing text set on a message through the ioctl interface */
+typedef struct
+{
+    const DAQ_Msg_t *msg;
+    bool has_reason;
+    uint8_t reason;
+    uint32_t len;
+    char data[DUMP_MAX_TRACE_LEN];
+} DumpTraceData;
+
+typedef struct
+{
+    uint8_t *data;
+    size_t len;
+    bool new_file;              // Switch to the next output file before writing this buffer
+} DumpBuffer;
+
+/* Output files created by the writer thread that are subject to the retention limits */
+typedef struct _DumpFileEntry
+{
+    struct _DumpFileEntry *next;
+    uint64_t size;
+    char path[];
+} DumpFileEntry;
+
+/*
+ * Each output file has a ring of large buffers shared between the packet thread and the writer
+ * thread.  The packet thread is the only producer: it copies records into the buffer at the head
+ * of the ring and advances 'head' once that buffer is full (or has been sitting around for too
+ * long).  The writer thread is the only consumer: it writes out everything between 'tail' and
+ * 'head' and then advances 'tail'.  Neither index is ever written by the other side, so no locking
+ * is required to move records; the mutex and condition variables in the context are only used to
+ * sleep and wake up.
+ */
+typedef struct
+{
+    char *filename;             // Output filename template
+    bool active;
+
+    DumpBuffer *buffers;
+    unsigned num_buffers;       // Always a power of two
+    size_t buffer_size;
+    unsigned head;              // Buffers handed to the writer thread (owned by the packet thread)
+    unsigned tail;              // Buffers written out (owned by the writer thread)
+    DumpBuffer *fill;           // Buffer currently being filled by the packet thread, if any
+    struct timespec fill_start; // When the first record was copied into the fill buffer
+
+    /* Rotation state tracked by the packet thread for the file currently being filled */
+    uint64_t file_bytes;
+    uint64_t file_records;
+    struct timespec file_start;
+    bool rotate_pending;        // A rotation limit was hit; start a new file with the next record
+    bool next_new_file;         // The next buffer acquired starts a new file
+    int32_t ifaces[DUMP_PCAPNG_MAX_IFACES];  // Ingress indices with an IDB in the current pcapng file
+    unsigned num_ifaces;
+
+    /* File state owned by the writer thread */
+    int fd;
+    unsigned file_seq;
+    DumpFileEntry *files_head;  // Oldest file subject to retention
+    DumpFileEntry *files_tail;  // File currently being written
+    unsigned num_files;
+    uint64_t total_file_bytes;
+
+    /* Packet thread counters */
+    uint64_t records;
+    uint64_t records_filtered;
+    uint64_t records_dropped;
+    uint64_t max_queue_depth;
+    /* Writer thread counters */
+    uint64_t bytes_written;
+    uint64_t write_errors;
+    uint64_t files_opened;
+    uint64_t files_removed;
+    uint64_t open_errors;
+} DumpOutput;
+
+/*
+ * The flight recorder keeps the most recently received packets as ready-to-write savefile records
+ * in a preallocated byte ring, evicting the oldest records to make room for new ones (or once they
+ * fall out of the configured time window).  Nothing is written out until a trigger arrives, at
+ * which point the packet thread swaps the ring with an equally sized spare and hands the old one
+ * to the writer thread as a snapshot.  Records never wrap around the end of the ring, so a
+ * snapshot is at most two contiguous regions and is written with a single writev().
+ */
+typedef struct
+{
+    char *filename;
+    bool active;
+
+    /* Ring state owned by the packet thread */
+    uint8_t *data;
+    uint8_t *spare;
+    size_t size;
+    size_t head;                // Offset at which the next record will be stored
+    size_t tail;                // Offset of the oldest record
+    size_t wrap;                // End of the records at the top of the ring while wrapped
+    bool wrapped;               // Newer records have wrapped around to the bottom of the ring
+    uint64_t held;              // Number of records currently in the ring
+
+    /* Snapshot handed from the packet thread to the writer thread */
+    struct iovec snap_iov[2];
+    unsigned snap_iovcnt;
+    bool snap_pending;          // Set by the packet thread, cleared by the writer thread
+    unsigned file_seq;          // Owned by the writer thread
+
+    /* Packet thread counters */
+    uint64_t records;
+    uint64_t records_filtered;
+    uint64_t records_evicted;
+    uint64_t triggers;
+    uint64_t triggers_busy;
+    /* Writer thread counters */
+    uint64_t snapshots_written;
+    uint64_t bytes_written;
+    uint64_t write_errors;
+} DumpFlightRecorder;
+
+typedef struct
+{
+    DAQ_ModuleInstance_h modinst;
+    DAQ_InstanceAPI_t subapi;
+
+    DumpOutput tx;
+    DumpOutput rx;
+    DumpFlightRecorder flight;
+
+    /* Output format configuration */
+    bool pcapng;
+    int linktype;
+    int snaplen;
+    DumpTraceData *traces;
+
+    /* Flight recorder configuration */
+    unsigned flight_seconds;
+    uint8_t flight_reasons[256 / 8];    // Bitmap of verdict reasons that trigger a snapshot
+
+    /* Writer thread configuration */
+    unsigned flush_interval_ms;
+    bool drop_on_overflow;
+
+    /* Recording selection configuration */
+    char *record_filter;
+    struct bpf_program fcode;
+    uint32_t record_verdicts;
+    uint32_t record_snaplen;
+
+    /* Rotation and retention configuration */
+    unsigned instance_id;
+    uint64_t rotate_size;
+    uint64_t rotate_packets;
+    unsigned rotate_interval;
+    unsigned max_files;
+    uint64_t max_total_size;
+
+    /* Writer thread state */
+    pthread_t writer_tid;
+    pthread_mutex_t writer_lock;
+    pthread_cond_t work_cond;   // Signaled when buffers are handed off or the writer should exit
+    pthread_cond_t space_cond;  // Signaled when the writer thread has freed up buffers
+    bool writer_running;
+    bool writer_exit;
+
+    uint8_t file_hdr[DUMP_MAX_FILE_HDR_LEN];   // Header of the configured output format
+    size_t file_hdr_len;
+    uint8_t pcap_hdr[DUMP_MAX_FILE_HDR_LEN];   // Classic savefile header (flight recorder snapshots)
+    size_t pcap_hdr_len;
+
+    DAQ_Stats_t stats;
+} DumpContext;
+
+static DAQ_VariableDesc_t dump_variable_descriptions[] = {
+    { "file", "PCAP filename to output transmitted packets to (default: " DEFAULT_TX_DUMP_FILE ")", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "output", "Set to none to prevent output from being written to file (deprecated)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "dump-rx", "Also dump received packets to their own PCAP file (default: " DEFAULT_RX_DUMP_FILE ")", 0 },
+    { "format", "Output file format: pcap or pcapng (default: pcap)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "buffer-size", "Size in kilobytes of each output buffer (default: 1024, minimum: 128)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "buffers", "Number of output buffers queued per output file (default: 8)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "overflow", "Action when all output buffers are in use: block or drop (default: block)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "flush-interval", "Maximum milliseconds a partially filled output buffer is held back (default: 1000)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "record-filter", "Only record packets matching this BPF expression", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "record-verdicts", "Comma-separated verdicts to record transmitted packets for, plus inject (default: pass,replace,whitelist,ignore,inject)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "record-snaplen", "Truncate recorded packets to this many bytes", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "flight-recorder", "Keep recently received packets in memory and write them to this PCAP file when triggered (default: " DEFAULT_FLIGHT_RECORDER_FILE ")", 0 },
+    { "flight-recorder-size", "Size in megabytes of the flight recorder ring (default: 64)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "flight-recorder-seconds", "Only keep packets received within this many seconds in the flight recorder", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "flight-recorder-reasons", "Comma-separated verdict reasons that trigger a flight recorder snapshot", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "rotate-size", "Start a new output file once the current one reaches this many megabytes", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "rotate-packets", "Start a new output file once the current one holds this many packets", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "rotate-interval", "Start a new output file once the current one is this many seconds old", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "max-files", "Remove the oldest rotated output files beyond this many per output", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "max-total-size", "Remove the oldest rotated output files beyond this many megabytes per output", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+};
+
+static const char *dump_verdict_names[MAX_DAQ_VERDICT] = {
+    "pass",         // DAQ_VERDICT_PASS
+    "block",        // DAQ_VERDICT_BLOCK
+    "replace",      // DAQ_VERDICT_REPLACE
+    "whitelist",    // DAQ_VERDICT_WHITELIST
+    "blacklist",    // DAQ_VERDICT_BLACKLIST
+    "ignore",       // DAQ_VERDICT_IGNORE
+};
+
+static DAQ_BaseAPI_t daq_base_api;
+static unsigned timestamp_meta_type;
+static pthread_mutex_t bpf_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+//-------------------------------------------------------------------------
+
+static int write_fully(int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0)
+    {
+        ssize_t written = writev(fd, iov, iovcnt);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        /* Skip past the fully written vectors and trim the partially written one. */
+        while (iovcnt > 0 && (size_t) written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (uint8_t *) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+
+    return 0;
+}
+
+static inline unsigned dump_output_queue_depth(const DumpOutput *out)
+{
+    return out->head - __atomic_load_n(&out->tail, __ATOMIC_ACQUIRE);
+}
+
+static bool dump_work_pending(DumpContext *dc)
+{
+    return __atomic_load_n(&dc->tx.head, __ATOMIC_ACQUIRE) != dc->tx.tail ||
+           __atomic_load_n(&dc->rx.head, __ATOMIC_ACQUIRE) != dc->rx.tail ||
+           __atomic_load_n(&dc->flight.snap_pending, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Output files (only ever touched by the writer thread once it is running)
+ */
+
+/* Expand the output filename template.  Supported tokens are %i (instance ID), %n (file sequence
+    number), %t (UTC timestamp of when the file was opened) and %% (a literal percent sign). */
+static int dump_expand_filename(const DumpContext *dc, const char *tmpl, unsigned seq, bool unique,
+        char *buf, size_t len)
+{
+    bool has_unique_token = false;
+    size_t used = 0;
+    int n;
+
+    for (const char *p = tmpl; *p != '\0'; p++)
+    {
+        char token[32];
+
+        switch (*p == '%' ? p[1] : '\0')
+        {
+            case 'i':
+                snprintf(token, sizeof(token), "%u", dc->instance_id);
+                p++;
+                break;
+            case 'n':
+                snprintf(token, sizeof(token), "%u", seq);
+                has_unique_token = true;
+                p++;
+                break;
+            case 't':
+            {
+                time_t now = time(NULL);
+                struct tm tm;
+                gmtime_r(&now, &tm);
+                strftime(token, sizeof(token), "%Y%m%d%H%M%S", &tm);
+                has_unique_token = true;
+                p++;
+                break;
+            }
+            case '%':
+                p++;
+                /* Fall through */
+            default:
+                token[0] = *p;
+                token[1] = '\0';
+                break;
+        }
+
+        n = snprintf(buf + used, len - used, "%s", token);
+        if (n < 0 || (size_t) n >= len - used)
+            return -1;
+        used += n;
+    }
+
+    /* Fall back to a numeric suffix if unique names are needed and the template doesn't guarantee them. */
+    if (!has_unique_token && unique)
+    {
+        n = snprintf(buf + used, len - used, ".%u", seq);
+        if (n < 0 || (size_t) n >= len - used)
+            return -1;
+    }
+
+    return 0;
+}
+
+static void dump_output_enforce_retention(DumpContext *dc, DumpOutput *out)
+{
+    /* The file currently being written to is never removed. */
+    while (out->files_head && out->files_head != out->files_tail &&
+            ((dc->max_files && out->num_files > dc->max_files) ||
+             (dc->max_total_size && out->total_file_bytes > dc->max_total_size)))
+    {
+        DumpFileEntry *entry = out->files_head;
+        out->files_head = entry->next;
+        out->num_files--;
+        out->total_file_bytes -= entry->size;
+        if (unlink(entry->path) == 0)
+            __atomic_store_n(&out->files_removed, out->files_removed + 1, __ATOMIC_RELAXED);
+        free(entry);
+    }
+}
+
+static void dump_output_forget_files(DumpOutput *out)
+{
+    while (out->files_head)
+    {
+        DumpFileEntry *entry = out->files_head;
+        out->files_head = entry->next;
+        free(entry);
+    }
+    out->files_tail = NULL;
+    out->num_files = 0;
+    out->total_file_bytes = 0;
+}
+
+/* Open the next output file and write the savefile header to it.  Returns an errno value. */
+static int dump_output_open_file(DumpContext *dc, DumpOutput *out)
+{
+    char path[PATH_MAX];
+    bool unique = dc->rotate_size || dc->rotate_packets || dc->rotate_interval;
+    if (dump_expand_filename(dc, out->filename, out->file_seq, unique, path, sizeof(path)) != 0)
+        return ENAMETOOLONG;
+
+    out->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (out->fd < 0)
+        return errno;
+
+    struct iovec iov;
+    iov.iov_base = dc->file_hdr;
+    iov.iov_len = dc->file_hdr_len;
+    if (write_fully(out->fd, &iov, 1) != 0)
+    {
+        int err = errno;
+        close(out->fd);
+        out->fd = -1;
+        unlink(path);
+        return err;
+    }
+
+    size_t path_len = strlen(path) + 1;
+    DumpFileEntry *entry = malloc(sizeof(DumpFileEntry) + path_len);
+    if (entry)
+    {
+        entry->next = NULL;
+        entry->size = dc->file_hdr_len;
+        memcpy(entry->path, path, path_len);
+        if (out->files_tail)
+            out->files_tail->next = entry;
+        else
+            out->files_head = entry;
+        out->files_tail = entry;
+        out->num_files++;
+        out->total_file_bytes += entry->size;
+    }
+    __atomic_store_n(&out->files_opened, out->files_opened + 1, __ATOMIC_RELAXED);
+
+    dump_output_enforce_retention(dc, out);
+
+    return 0;
+}
+
+static void dump_output_close_file(DumpOutput *out)
+{
+    if (out->fd >= 0)
+    {
+        close(out->fd);
+        out->fd = -1;
+    }
+}
+
+static void dump_output_rotate(DumpContext *dc, DumpOutput *out)
+{
+    dump_output_close_file(out);
+    out->file_seq++;
+    if (dump_output_open_file(dc, out) != 0)
+        __atomic_store_n(&out->open_errors, out->open_errors + 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Writer thread
+ */
+
+static unsigned dump_output_drain(DumpContext *dc, DumpOutput *out)
+{
+    unsigned head = __atomic_load_n(&out->head, __ATOMIC_ACQUIRE);
+    unsigned tail = out->tail;
+
+    if (head == tail)
+        return 0;
+
+    if (out->buffers[tail & (out->num_buffers - 1)].new_file)
+        dump_output_rotate(dc, out);
+
+    /* Gather up as many consecutive buffers as possible that go to the same file. */
+    struct iovec iov[DUMP_MAX_IOV];
+    unsigned count = 0;
+    size_t bytes = 0;
+    while (tail + count != head && count < DUMP_MAX_IOV)
+    {
+        DumpBuffer *buf = &out->buffers[(tail + count) & (out->num_buffers - 1)];
+        if (count > 0 && buf->new_file)
+            break;
+        iov[count].iov_base = buf->data;
+        iov[count].iov_len = buf->len;
+        bytes += buf->len;
+        count++;
+    }
+
+    /* Buffers that couldn't be written are dropped rather than retried so that the packet thread
+        can never wait forever on a broken output. */
+    if (out->fd >= 0 && write_fully(out->fd, iov, count) == 0)
+    {
+        __atomic_store_n(&out->bytes_written, out->bytes_written + bytes, __ATOMIC_RELAXED);
+        if (out->files_tail)
+        {
+            out->files_tail->size += bytes;
+            out->total_file_bytes += bytes;
+            dump_output_enforce_retention(dc, out);
+        }
+    }
+    else
+        __atomic_store_n(&out->write_errors, out->write_errors + 1, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&out->tail, tail + count, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&dc->writer_lock);
+    pthread_cond_signal(&dc->space_cond);
+    pthread_mutex_unlock(&dc->writer_lock);
+
+    return count;
+}
+
+static unsigned dump_flight_drain(DumpContext *dc, DumpFlightRecorder *fr)
+{
+    if (!__atomic_load_n(&fr->snap_pending, __ATOMIC_ACQUIRE))
+        return 0;
+
+    char path[PATH_MAX];
+    int fd = -1;
+    if (dump_expand_filename(dc, fr->filename, fr->file_seq++, true, path, sizeof(path)) == 0)
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+    struct iovec iov[3];
+    iov[0].iov_base = dc->pcap_hdr;
+    iov[0].iov_len = dc->pcap_hdr_len;
+    size_t bytes = dc->pcap_hdr_len;
+    for (unsigned i = 0; i < fr->snap_iovcnt; i++)
+    {
+        iov[i + 1] = fr->snap_iov[i];
+        bytes += fr->snap_iov[i].iov_len;
+    }
+
+    if (fd >= 0 && write_fully(fd, iov, fr->snap_iovcnt + 1) == 0)
+    {
+        __atomic_store_n(&fr->bytes_written, fr->bytes_written + bytes, __ATOMIC_RELAXED);
+        __atomic_store_n(&fr->snapshots_written, fr->snapshots_written + 1, __ATOMIC_RELAXED);
+    }
+    else
+        __atomic_store_n(&fr->write_errors, fr->write_errors + 1, __ATOMIC_RELAXED);
+    if (fd >= 0)
+        close(fd);
+
+    /* The spare ring is free to be swapped in again. */
+    __atomic_store_n(&fr->snap_pending, false, __ATOMIC_RELEASE);
+
+    return 1;
+}
+
+static void *dump_writer_thread(void *arg)
+{
+    DumpContext *dc = (DumpContext *) arg;
+
+    while (true)
+    {
+        if (dump_output_drain(dc, &dc->tx) + dump_output_drain(dc, &dc->rx) +
+                dump_flight_drain(dc, &dc->flight) > 0)
+            continue;
+
+        pthread_mutex_lock(&dc->writer_lock);
+        while (!dump_work_pending(dc) && !dc->writer_exit)
+            pthread_cond_wait(&dc->work_cond, &dc->writer_lock);
+        /* Everything that was handed off before the exit request must hit the disk first. */
+        bool done = dc->writer_exit && !dump_work_pending(dc);
+        pthread_mutex_unlock(&dc->writer_lock);
+
+        if (done)
+            break;
+    }
+
+    return NULL;
+}
+
+/*
+ * Packet thread
+ */
+
+static void dump_output_submit(DumpContext *dc, DumpOutput *out)
+{
+    __atomic_store_n(&out->head, out->head + 1, __ATOMIC_RELEASE);
+    out->fill = NULL;
+
+    unsigned depth = dump_output_queue_depth(out);
+    if (depth > out->max_queue_depth)
+        out->max_queue_depth = depth;
+
+    pthread_mutex_lock(&dc->writer_lock);
+    pthread_cond_signal(&dc->work_cond);
+    pthread_mutex_unlock(&dc->writer_lock);
+}
+
+static bool dump_output_acquire(DumpContext *dc, DumpOutput *out)
+{
+    if (dump_output_queue_depth(out) == out->num_buffers)
+    {
+        if (dc->drop_on_overflow)
+            return false;
+
+        pthread_mutex_lock(&dc->writer_lock);
+        while (dump_output_queue_depth(out) == out->num_buffers)
+            pthread_cond_wait(&dc->space_cond, &dc->writer_lock);
+        pthread_mutex_unlock(&dc->writer_lock);
+    }
+
+    out->fill = &out->buffers[out->head & (out->num_buffers - 1)];
+    out->fill->len = 0;
+    out->fill->new_file = out->next_new_file;
+    out->next_new_file = false;
+    clock_gettime(CLOCK_MONOTONIC, &out->fill_start);
+
+    return true;
+}
+
+/* Selection happens before anything else so that unwanted packets never touch the buffers. */
+static inline bool dump_select(const DumpContext *dc, const uint8_t *data, uint32_t *caplen, uint32_t pktlen)
+{
+    if (dc->fcode.bf_insns && bpf_filter(dc->fcode.bf_insns, data, pktlen, *caplen) == 0)
+        return false;
+
+    if (dc->record_snaplen && *caplen > dc->record_snaplen)
+        *caplen = dc->record_snaplen;
+
+    return true;
+}
+
+/* Rotation happens on buffer boundaries: hand off what belongs to the current file and flag the
+    next buffer as the start of a new one.  The writer thread does the rest. */
+static void dump_output_check_rotate(DumpContext *dc, DumpOutput *out, size_t reclen)
+{
+    if (out->file_records == 0)
+        return;
+
+    if (!out->rotate_pending &&
+            (!dc->rotate_size || out->file_bytes + reclen <= dc->rotate_size) &&
+            (!dc->rotate_packets || out->file_records < dc->rotate_packets))
+        return;
+
+    if (out->fill)
+        dump_output_submit(dc, out);
+    out->next_new_file = true;
+    out->rotate_pending = false;
+    out->file_bytes = dc->file_hdr_len;
+    out->file_records = 0;
+    out->num_ifaces = 0;
+    clock_gettime(CLOCK_MONOTONIC, &out->file_start);
+}
+
+/* Make room for 'len' more bytes in the fill buffer, handing it off first if necessary.  Returns
+    NULL if no buffer is available and the overflow policy is to drop. */
+static uint8_t *dump_output_reserve(DumpContext *dc, DumpOutput *out, size_t len)
+{
+    if (out->fill && out->fill->len + len > out->buffer_size)
+        dump_output_submit(dc, out);
+
+    if (!out->fill && !dump_output_acquire(dc, out))
+        return NULL;
+
+    return out->fill->data + out->fill->len;
+}
+
+static inline void dump_output_commit(DumpOutput *out, size_t len)
+{
+    out->fill->len += len;
+    out->file_bytes += len;
+    out->file_records++;
+    out->records++;
+}
+
+/* Full resolution timestamp of a packet, falling back on its header when there's none attached. */
+static inline uint64_t dump_timestamp_ns(const DAQ_PktTimestamp_t *pts, const DAQ_PktHdr_t *hdr)
+{
+    if (pts)
+        return pts->nsec;
+    return (uint64_t) hdr->ts.tv_sec * 1000000000 + (uint64_t) hdr->ts.tv_usec * 1000;
+}
+
+static inline void dump_fill_record_hdr(DumpRecordHdr *rechdr, uint64_t ts_ns,
+        uint32_t caplen, uint32_t pktlen)
+{
+    rechdr->ts_sec = ts_ns / 1000000000;
+    rechdr->ts_nsec = ts_ns % 1000000000;
+    rechdr->caplen = caplen;
+    rechdr->len = pktlen;
+}
+
+static void dump_output_record_pcap(DumpContext *dc, DumpOutput *out, uint64_t ts_ns,
+        const uint8_t *data, uint32_t caplen, uint32_t pktlen)
+{
+    /* Records that could never fit into a buffer are truncated. */
+    if (sizeof(DumpRecordHdr) + caplen > out->buffer_size)
+        caplen = out->buffer_size - sizeof(DumpRecordHdr);
+
+    size_t reclen = sizeof(DumpRecordHdr) + caplen;
+
+    dump_output_check_rotate(dc, out, reclen);
+
+    uint8_t *dst = dump_output_reserve(dc, out, reclen);
+    if (!dst)
+    {
+        out->records_dropped++;
+        return;
+    }
+
+    DumpRecordHdr rechdr;
+    dump_fill_record_hdr(&rechdr, ts_ns, caplen, pktlen);
+
+    memcpy(dst, &rechdr, sizeof(rechdr));
+    memcpy(dst + sizeof(rechdr), data, caplen);
+    dump_output_commit(out, reclen);
+}
+
+static inline uint8_t *pcapng_put_option(uint8_t *p, uint16_t code, const void *value, uint16_t len)
+{
+    memcpy(p, &code, sizeof(code));
+    memcpy(p + 2, &len, sizeof(len));
+    memcpy(p + 4, value, len);
+    memset(p + 4 + len, 0, PCAPNG_PAD(len) - len);
+    return p + 4 + PCAPNG_PAD(len);
+}
+
+static inline uint8_t *pcapng_put_u32(uint8_t *p, uint32_t value)
+{
+    memcpy(p, &value, sizeof(value));
+    return p + sizeof(value);
+}
+
+static size_t dump_pcapng_build_idb(const DumpContext *dc, uint8_t *buf, int32_t ingress_index)
+{
+    char name[32];
+    if (ingress_index == DAQ_PKTHDR_UNKNOWN)
+        snprintf(name, sizeof(name), "daq:unknown");
+    else
+        snprintf(name, sizeof(name), "daq:%d", ingress_index);
+
+    uint8_t *p = buf + 8;
+    uint16_t linktype = dc->linktype;
+    uint16_t reserved = 0;
+    memcpy(p, &linktype, sizeof(linktype));
+    memcpy(p + 2, &reserved, sizeof(reserved));
+    p = pcapng_put_u32(p + 4, dc->snaplen);
+    p = pcapng_put_option(p, PCAPNG_OPT_IF_NAME, name, strlen(name));
+    /* Enhanced Packet Block timestamps are in nanoseconds (10^-9). */
+    uint8_t tsresol = 9;
+    p = pcapng_put_option(p, PCAPNG_OPT_IF_TSRESOL, &tsresol, sizeof(tsresol));
+    p = pcapng_put_option(p, PCAPNG_OPT_ENDOFOPT, NULL, 0);
+
+    uint32_t block_len = (p - buf) + 4;
+    pcapng_put_u32(buf, PCAPNG_BT_IDB);
+    pcapng_put_u32(buf + 4, block_len);
+    pcapng_put_u32(p, block_len);
+
+    return block_len;
+}
+
+static void dump_output_record_pcapng(DumpContext *dc, DumpOutput *out, const DAQ_PktHdr_t *hdr,
+        uint64_t ts_ns, const uint8_t *data, uint32_t caplen, uint32_t pktlen, int verdict, const DumpTraceData *trace)
+{
+    uint32_t trace_len = trace ? trace->len : 0;
+    size_t opts_len = (4 + 4) + (4 + sizeof(DumpPcapngInfo)) + (trace_len ? 4 + PCAPNG_PAD(trace_len) : 0) + 4;
+    size_t overhead = sizeof(PcapngEPBHdr) + opts_len + 4;
+
+    /* Records that could never fit into a buffer (along with an IDB) are truncated. */
+    if (DUMP_PCAPNG_MAX_IDB_LEN + overhead + PCAPNG_PAD(caplen) > out->buffer_size)
+        caplen = (out->buffer_size - DUMP_PCAPNG_MAX_IDB_LEN - overhead) & ~3U;
+
+    size_t reclen = overhead + PCAPNG_PAD(caplen);
+
+    dump_output_check_rotate(dc, out, reclen);
+
+    /* Interfaces are described lazily, the first time an ingress index shows up in a file. */
+    uint8_t idb[DUMP_PCAPNG_MAX_IDB_LEN];
+    size_t idb_len = 0;
+    uint32_t iface_id;
+    for (iface_id = 0; iface_id < out->num_ifaces; iface_id++)
+    {
+        if (out->ifaces[iface_id] == hdr->ingress_index)
+            break;
+    }
+    if (iface_id == out->num_ifaces)
+    {
+        if (out->num_ifaces < DUMP_PCAPNG_MAX_IFACES)
+            idb_len = dump_pcapng_build_idb(dc, idb, hdr->ingress_index);
+        else
+            iface_id = 0;
+    }
+
+    uint8_t *dst = dump_output_reserve(dc, out, idb_len + reclen);
+    if (!dst)
+    {
+        out->records_dropped++;
+        return;
+    }
+
+    if (idb_len)
+    {
+        memcpy(dst, idb, idb_len);
+        out->ifaces[out->num_ifaces++] = hdr->ingress_index;
+        out->fill->len += idb_len;
+        out->file_bytes += idb_len;
+        dst += idb_len;
+    }
+
+    PcapngEPBHdr epb;
+    epb.block_type = PCAPNG_BT_EPB;
+    epb.block_len = reclen;
+    epb.iface_id = iface_id;
+    epb.ts_high = ts_ns >> 32;
+    epb.ts_low = ts_ns & 0xffffffff;
+    epb.caplen = caplen;
+    epb.pktlen = pktlen;
+    memcpy(dst, &epb, sizeof(epb));
+
+    uint8_t *p = dst + sizeof(epb);
+    memcpy(p, data, caplen);
+    memset(p + caplen, 0, PCAPNG_PAD(caplen) - caplen);
+    p += PCAPNG_PAD(caplen);
+
+    uint32_t epb_flags = (out == &dc->rx) ? PCAPNG_EPB_FLAG_INBOUND : PCAPNG_EPB_FLAG_OUTBOUND;
+    p = pcapng_put_option(p, PCAPNG_OPT_EPB_FLAGS, &epb_flags, sizeof(epb_flags));
+
+    DumpPcapngInfo info;
+    info.pen = DUMP_PCAPNG_PEN;
+    info.version = DUMP_PCAPNG_INFO_VERSION;
+    info.verdict = verdict;
+    info.verdict_reason = (trace && trace->has_reason) ? trace->reason : 0;
+    info.flags = (trace && trace->has_reason) ? DUMP_PCAPNG_INFO_HAS_REASON : 0;
+    info.pkt_flags = hdr->flags;
+    info.ingress_index = hdr->ingress_index;
+    info.egress_index = hdr->egress_index;
+    info.ingress_group = hdr->ingress_group;
+    info.egress_group = hdr->egress_group;
+    info.flow_id = hdr->flow_id;
+    info.address_space_id = hdr->address_space_id;
+    info.reserved = 0;
+    p = pcapng_put_option(p, PCAPNG_OPT_CUSTOM_BINARY, &info, sizeof(info));
+
+    if (trace_len)
+        p = pcapng_put_option(p, PCAPNG_OPT_COMMENT, trace->data, trace_len);
+
+    p = pcapng_put_option(p, PCAPNG_OPT_ENDOFOPT, NULL, 0);
+    pcapng_put_u32(p, reclen);
+
+    dump_output_commit(out, reclen);
+}
+
+static void dump_output_record(DumpContext *dc, DumpOutput *out, const DAQ_PktHdr_t *hdr,
+        uint64_t ts_ns, const uint8_t *data, uint32_t caplen, uint32_t pktlen, int verdict,
+        const DumpTraceData *trace)
+{
+    if (!dump_select(dc, data, &caplen, pktlen))
+    {
+        out->records_filtered++;
+        return;
+    }
+
+    if (dc->pcapng)
+        dump_output_record_pcapng(dc, out, hdr, ts_ns, data, caplen, pktlen, verdict, trace);
+    else
+        dump_output_record_pcap(dc, out, ts_ns, data, caplen, pktlen);
+}
+
+/* Trace data is held in a small direct-mapped table keyed by message until the verdict comes in.
+    Colliding messages simply replace each other, which bounds both memory and per-packet cost. */
+static inline DumpTraceData *dump_trace_slot(DumpContext *dc, const DAQ_Msg_t *msg)
+{
+    return &dc->traces[((uintptr_t) msg / sizeof(void *)) % DUMP_TRACE_SLOTS];
+}
+
+static void dump_trace_set(DumpContext *dc, const DAQ_Msg_t *msg, uint8_t reason, const uint8_t *data,
+        uint32_t len)
+{
+    DumpTraceData *trace = dump_trace_slot(dc, msg);
+    if (trace->msg != msg)
+    {
+        trace->msg = msg;
+        trace->len = 0;
+    }
+    trace->has_reason = true;
+    trace->reason = reason;
+    if (data && len)
+    {
+        trace->len = (len < DUMP_MAX_TRACE_LEN) ? len : DUMP_MAX_TRACE_LEN;
+        memcpy(trace->data, data, trace->len);
+    }
+}
+
+static const DumpTraceData *dump_trace_take(DumpContext *dc, const DAQ_Msg_t *msg)
+{
+    DumpTraceData *trace = dump_trace_slot(dc, msg);
+    if (trace->msg != msg)
+        return NULL;
+    /* The message will be released after this, so the slot is free to be reused afterward. */
+    trace->msg = NULL;
+    return trace;
+}
+
+static void dump_flight_evict(DumpFlightRecorder *fr)
+{
+    DumpRecordHdr rechdr;
+    memcpy(&rechdr, fr->data + fr->tail, sizeof(rechdr));
+    fr->tail += sizeof(rechdr) + rechdr.caplen;
+    fr->held--;
+    fr->records_evicted++;
+
+    if (fr->held == 0)
+    {
+        fr->head = fr->tail = 0;
+        fr->wrapped = false;
+    }
+    else if (fr->wrapped && fr->tail == fr->wrap)
+    {
+        fr->tail = 0;
+        fr->wrapped = false;
+    }
+}
+
+static void dump_flight_record(DumpContext *dc, DumpFlightRecorder *fr, uint64_t ts_ns,
+        const uint8_t *data, uint32_t caplen, uint32_t pktlen)
+{
+    if (!dump_select(dc, data, &caplen, pktlen))
+    {
+        fr->records_filtered++;
+        return;
+    }
+
+    if (sizeof(DumpRecordHdr) + caplen > fr->size)
+        caplen = fr->size - sizeof(DumpRecordHdr);
+
+    size_t reclen = sizeof(DumpRecordHdr) + caplen;
+
+    /* Make room for the new record, wrapping to the bottom of the ring if it doesn't fit at the top. */
+    while (true)
+    {
+        if (!fr->wrapped)
+        {
+            if (fr->size - fr->head >= reclen)
+                break;
+            if (fr->held == 0)
+            {
+                fr->head = fr->tail = 0;
+                continue;
+            }
+            fr->wrap = fr->head;
+            fr->head = 0;
+            fr->wrapped = true;
+        }
+        if (fr->tail - fr->head >= reclen)
+            break;
+        dump_flight_evict(fr);
+    }
+
+    DumpRecordHdr rechdr;
+    dump_fill_record_hdr(&rechdr, ts_ns, caplen, pktlen);
+
+    uint8_t *dst = fr->data + fr->head;
+    memcpy(dst, &rechdr, sizeof(rechdr));
+    memcpy(dst + sizeof(rechdr), data, caplen);
+    fr->head += reclen;
+    fr->held++;
+    fr->records++;
+
+    /* Age out records that have fallen out of the time window. */
+    if (dc->flight_seconds)
+    {
+        while (fr->held > 1)
+        {
+            memcpy(&rechdr, fr->data + fr->tail, sizeof(rechdr));
+            uint64_t oldest_ns = (uint64_t) rechdr.ts_sec * 1000000000 + rechdr.ts_nsec;
+            if (oldest_ns >= ts_ns || ts_ns - oldest_ns <= dc->flight_seconds * 1000000000ULL)
+                break;
+            dump_flight_evict(fr);
+        }
+    }
+}
+
+/* Hand the current contents of the flight recorder to the writer thread and start over with the
+    spare ring.  Triggers that arrive while the previous snapshot is still being written are
+    counted but otherwise ignored; the packets they would have captured stay in the ring. */
+static void dump_flight_trigger(DumpContext *dc, DumpFlightRecorder *fr)
+{
+    fr->triggers++;
+
+    if (fr->held == 0)
+        return;
+
+    if (__atomic_load_n(&fr->snap_pending, __ATOMIC_ACQUIRE))
+    {
+        fr->triggers_busy++;
+        return;
+    }
+
+    fr->snap_iovcnt = 0;
+    if (fr->wrapped)
+    {
+        fr->snap_iov[fr->snap_iovcnt].iov_base = fr->data + fr->tail;
+        fr->snap_iov[fr->snap_iovcnt++].iov_len = fr->wrap - fr->tail;
+        fr->snap_iov[fr->snap_iovcnt].iov_base = fr->data;
+        fr->snap_iov[fr->snap_iovcnt++].iov_len = fr->head;
+    }
+    else
+    {
+        fr->snap_iov[fr->snap_iovcnt].iov_base = fr->data + fr->tail;
+        fr->snap_iov[fr->snap_iovcnt++].iov_len = fr->head - fr->tail;
+    }
+
+    uint8_t *tmp = fr->data;
+    fr->data = fr->spare;
+    fr->spare = tmp;
+    fr->head = fr->tail = 0;
+    fr->wrapped = false;
+    fr->held = 0;
+
+    pthread_mutex_lock(&dc->writer_lock);
+    __atomic_store_n(&fr->snap_pending, true, __ATOMIC_RELEASE);
+    pthread_cond_signal(&dc->work_cond);
+    pthread_mutex_unlock(&dc->writer_lock);
+}
+
+static inline uint64_t elapsed_ms(const struct timespec *start, const struct timespec *now)
+{
+    return (now->tv_sec - start->tv_sec) * 1000 + (now->tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static void dump_output_check_flush(DumpContext *dc, DumpOutput *out, const struct timespec *now)
+{
+    if (dc->rotate_interval && out->file_records > 0 &&
+            elapsed_ms(&out->file_start, now) >= dc->rotate_interval * 1000ULL)
+        out->rotate_pending = true;
+
+    if (out->fill && elapsed_ms(&out->fill_start, now) >= dc->flush_interval_ms)
+        dump_output_submit(dc, out);
+}
+
+static void dump_check_flush(DumpContext *dc)
+{
+    if (!dc->tx.fill && !dc->rx.fill && !dc->rotate_interval)
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    dump_output_check_flush(dc, &dc->tx, &now);
+    dump_output_check_flush(dc, &dc->rx, &now);
+}
+
+/*
+ * Output setup and teardown
+ */
+
+static int dump_output_init(DumpContext *dc, DumpOutput *out, const char *filename, const char *prefix,
+        unsigned num_buffers, size_t buffer_size)
+{
+    size_t len = strlen(filename) + strlen(prefix) + 1;
+    out->filename = malloc(len);
+    if (!out->filename)
+    {
+        SET_ERROR(dc->modinst, "%s: Couldn't allocate memory for the PCAP filename", __func__);
+        return DAQ_ERROR_NOMEM;
+    }
+    snprintf(out->filename, len, "%s%s", prefix, filename);
+
+    out->buffers = calloc(num_buffers, sizeof(DumpBuffer));
+    if (!out->buffers)
+    {
+        SET_ERROR(dc->modinst, "%s: Couldn't allocate memory for the output buffer ring", __func__);
+        return DAQ_ERROR_NOMEM;
+    }
+    out->num_buffers = num_buffers;
+    out->buffer_size = buffer_size;
+
+    for (unsigned i = 0; i < num_buffers; i++)
+    {
+        out->buffers[i].data = malloc(buffer_size);
+        if (!out->buffers[i].data)
+        {
+            SET_ERROR(dc->modinst, "%s: Couldn't allocate %zu bytes for an output buffer", __func__, buffer_size);
+            return DAQ_ERROR_NOMEM;
+        }
+    }
+
+    return DAQ_SUCCESS;
+}
+
+static void dump_output_free(DumpOutput *out)
+{
+    if (out->buffers)
+    {
+        for (unsigned i = 0; i < out->num_buffers; i++)
+            free(out->buffers[i].data);
+        free(out->buffers);
+    }
+    free(out->filename);
+}
+
+static int dump_flight_init(DumpContext *dc, DumpFlightRecorder *fr, const char *filename, const char *prefix,
+        size_t size)
+{
+    size_t len = strlen(filename) + strlen(prefix) + 1;
+    fr->filename = malloc(len);
+    if (!fr->filename)
+    {
+        SET_ERROR(dc->modinst, "%s: Couldn't allocate memory for the flight recorder filename", __func__);
+        return DAQ_ERROR_NOMEM;
+    }
+    snprintf(fr->filename, len, "%s%s", prefix, filename);
+
+    fr->data = malloc(size);
+    fr->spare = malloc(size);
+    if (!fr->data || !fr->spare)
+    {
+        SET_ERROR(dc->modinst, "%s: Couldn't allocate %zu bytes for the flight recorder rings", __func__, size * 2);
+        return DAQ_ERROR_NOMEM;
+    }
+    fr->size = size;
+
+    return DAQ_SUCCESS;
+}
+
+static void dump_flight_free(DumpFlightRecorder *fr)
+{
+    free(fr->data);
+    free(fr->spare);
+    free(fr->filename);
+}
 
-#define CALL_SUBAPI_NOARGS(ctxt, fname) \
-    ctxt->subapi.fname.func(ctxt->subapi.fname.context)
+/* The first file is opened synchronously so that configuration problems are reported by start(). */
+static int dump_output_open(DumpContext *dc, DumpOutput *out)
+{
+    out->file_seq = 0;
+    int err = dump_output_open_file(dc, out);
+    if (err != 0)
+    {
+        SET_ERROR(dc->modinst, "Could not open PCAP %s for writing: %s", out->filename, strerror(err));
+        return DAQ_ERROR;
+    }
 
-#define CALL_SUBAPI(ctxt, fname, ...) \
-    ctxt->subapi.fname.func(ctxt->subapi.fname.context, __VA_ARGS__)
+    out->head = out->tail = 0;
+    out->fill = NULL;
+    out->file_bytes = dc->file_hdr_len;
+    out->file_records = 0;
+    out->rotate_pending = false;
+    out->next_new_file = false;
+    out->num_ifaces = 0;
+    clock_gettime(CLOCK_MONOTONIC, &out->file_start);
+    out->active = true;
 
-typedef struct
+    return DAQ_SUCCESS;
+}
+
+static void dump_output_close(DumpOutput *out)
 {
-    DAQ_ModuleInstance_h modinst;
-    DAQ_InstanceAPI_t subapi;
+    out->active = false;
+    dump_output_close_file(out);
+    dump_output_forget_files(out);
+}
 
-    pcap_dumper_t *tx_dumper;
-    char *tx_filename;
+static void dump_build_pcapng_header(DumpContext *dc)
+{
+    static const char userappl[] = "DAQ dump module";
+    uint8_t *buf = dc->file_hdr;
+    uint8_t *p = buf + 8;
+    uint16_t major = 1, minor = 0;
+    int64_t section_len = -1;
+
+    p = pcapng_put_u32(p, PCAPNG_BYTE_ORDER_MAGIC);
+    memcpy(p, &major, sizeof(major));
+    memcpy(p + 2, &minor, sizeof(minor));
+    memcpy(p + 4, &section_len, sizeof(section_len));
+    p += 12;
+    p = pcapng_put_option(p, PCAPNG_OPT_SHB_USERAPPL, userappl, sizeof(userappl) - 1);
+    p = pcapng_put_option(p, PCAPNG_OPT_ENDOFOPT, NULL, 0);
+
+    uint32_t block_len = (p - buf) + 4;
+    pcapng_put_u32(buf, PCAPNG_BT_SHB);
+    pcapng_put_u32(buf + 4, block_len);
+    pcapng_put_u32(p, block_len);
+    dc->file_hdr_len = block_len;
+}
 
-    pcap_dumper_t *rx_dumper;
-    char *rx_filename;
+/* Let LibPCAP generate the savefile header so that it takes care of mapping the DLT to the
+    on-disk link type, which is then reused for pcapng output. */
+static int dump_build_file_header(DumpContext *dc, int dlt, int snaplen)
+{
+    pcap_t *pcap = pcap_open_dead_with_tstamp_precision(dlt, snaplen, PCAP_TSTAMP_PRECISION_NANO);
+    if (!pcap)
+    {
+        SET_ERROR(dc->modinst, "Could not create a dead PCAP handle!");
+        return DAQ_ERROR;
+    }
 
-    DAQ_Stats_t stats;
-} DumpContext;
+    char *buf = NULL;
+    size_t size = 0;
+    FILE *fp = open_memstream(&buf, &size);
+    if (!fp)
+    {
+        SET_ERROR(dc->modinst, "Could not open a memory stream for the PCAP header: %s", strerror(errno));
+        pcap_close(pcap);
+        return DAQ_ERROR;
+    }
 
-static DAQ_VariableDesc_t dump_variable_descriptions[] = {
-    { "file", "PCAP filename to output transmitted packets to (default: " DEFAULT_TX_DUMP_FILE ")", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
-    { "output", "Set to none to prevent output from being written to file (deprecated)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
-    { "dump-rx", "Also dump received packets to their own PCAP file (default: " DEFAULT_RX_DUMP_FILE ")", 0 }
-};
+    pcap_dumper_t *dumper = pcap_dump_fopen(pcap, fp);
+    if (!dumper)
+    {
+        SET_ERROR(dc->modinst, "Could not generate the PCAP header: %s", pcap_geterr(pcap));
+        fclose(fp);
+        free(buf);
+        pcap_close(pcap);
+        return DAQ_ERROR;
+    }
+    pcap_dump_close(dumper);
+    pcap_close(pcap);
 
-static DAQ_BaseAPI_t daq_base_api;
+    if (size > sizeof(dc->pcap_hdr) || size < sizeof(struct pcap_file_header))
+    {
+        SET_ERROR(dc->modinst, "Unexpected PCAP header size: %zu", size);
+        free(buf);
+        return DAQ_ERROR;
+    }
+    memcpy(dc->pcap_hdr, buf, size);
+    dc->pcap_hdr_len = size;
+    free(buf);
+
+    /* The upper bits of the link type field carry FCS information that pcapng doesn't have. */
+    struct pcap_file_header pfh;
+    memcpy(&pfh, dc->pcap_hdr, sizeof(pfh));
+    dc->linktype = pfh.linktype & 0xffff;
+    dc->snaplen = snaplen;
+
+    if (dc->pcapng)
+        dump_build_pcapng_header(dc);
+    else
+    {
+        memcpy(dc->file_hdr, dc->pcap_hdr, dc->pcap_hdr_len);
+        dc->file_hdr_len = dc->pcap_hdr_len;
+    }
+
+    return DAQ_SUCCESS;
+}
+
+static int dump_parse_flight_reasons(DumpContext *dc, const char *value)
+{
+    char *list = strdup(value);
+    if (!list)
+    {
+        SET_ERROR(dc->modinst, "%s: Couldn't allocate memory for the verdict reason list", __func__);
+        return DAQ_ERROR_NOMEM;
+    }
+
+    char *saveptr;
+    for (char *token = strtok_r(list, ",", &saveptr); token; token = strtok_r(NULL, ",", &saveptr))
+    {
+        unsigned long reason;
+        if (util_parse_uint(token, &reason) != 0 || reason > UINT8_MAX)
+        {
+            SET_ERROR(dc->modinst, "%s: Invalid verdict reason in flight-recorder-reasons: '%s'", __func__, token);
+            free(list);
+            return DAQ_ERROR_INVAL;
+        }
+        dc->flight_reasons[reason / 8] |= 1 << (reason % 8);
+    }
+    free(list);
+
+    return DAQ_SUCCESS;
+}
+
+static inline bool dump_flight_reason_triggers(const DumpContext *dc, uint8_t reason)
+{
+    return dc->flight_reasons[reason / 8] & (1 << (reason % 8));
+}
+
+static int dump_compile_filter(DumpContext *dc, int dlt, int snaplen)
+{
+    struct bpf_program fcode;
+
+    pthread_mutex_lock(&bpf_mutex);
+    if (pcap_compile_nopcap(snaplen, dlt, &fcode, dc->record_filter, 1, PCAP_NETMASK_UNKNOWN) == -1)
+    {
+        pthread_mutex_unlock(&bpf_mutex);
+        SET_ERROR(dc->modinst, "%s: BPF state machine compilation failed for '%s'", __func__, dc->record_filter);
+        return DAQ_ERROR;
+    }
+    pthread_mutex_unlock(&bpf_mutex);
+
+    pcap_freecode(&dc->fcode);
+    dc->fcode.bf_len = fcode.bf_len;
+    dc->fcode.bf_insns = fcode.bf_insns;
+
+    return DAQ_SUCCESS;
+}
+
+static int dump_parse_record_verdicts(DumpContext *dc, const char *value)
+{
+    char *list = strdup(value);
+    if (!list)
+    {
+        SET_ERROR(dc->modinst, "%s: Couldn't allocate memory for the verdict list", __func__);
+        return DAQ_ERROR_NOMEM;
+    }
+
+    uint32_t mask = 0;
+    char *saveptr;
+    for (char *name = strtok_r(list, ",", &saveptr); name; name = strtok_r(NULL, ",", &saveptr))
+    {
+        if (!strcmp(name, "inject"))
+        {
+            mask |= DUMP_RECORD_INJECTED;
+            continue;
+        }
+
+        DAQ_Verdict verdict;
+        for (verdict = DAQ_VERDICT_PASS; verdict < MAX_DAQ_VERDICT; verdict++)
+        {
+            if (!strcmp(name, dump_verdict_names[verdict]))
+                break;
+        }
+        if (verdict == MAX_DAQ_VERDICT)
+        {
+            SET_ERROR(dc->modinst, "%s: Invalid verdict in record-verdicts: '%s'", __func__, name);
+            free(list);
+            return DAQ_ERROR_INVAL;
+        }
+        mask |= DUMP_RECORD_VERDICT(verdict);
+    }
+    free(list);
+
+    dc->record_verdicts = mask;
+
+    return DAQ_SUCCESS;
+}
+
+static void dump_stop_writer(DumpContext *dc)
+{
+    if (!dc->writer_running)
+        return;
+
+    /* Hand off whatever is left in the partially filled buffers before asking the writer to exit. */
+    if (dc->tx.fill)
+        dump_output_submit(dc, &dc->tx);
+    if (dc->rx.fill)
+        dump_output_submit(dc, &dc->rx);
+
+    pthread_mutex_lock(&dc->writer_lock);
+    dc->writer_exit = true;
+    pthread_cond_signal(&dc->work_cond);
+    pthread_mutex_unlock(&dc->writer_lock);
+
+    pthread_join(dc->writer_tid, NULL);
+    dc->writer_running = false;
+
+    dump_output_close(&dc->tx);
+    dump_output_close(&dc->rx);
+    dc->flight.active = false;
+}
+
+static void dump_add_counter(DIOCTL_GetModuleCounters *gmc, const char *name, uint64_t value)
+{
+    if (gmc->num_counters >= gmc->max_counters)
+        return;
+
+    DAQ_ModuleCounter_t *counter = &gmc->counters[gmc->num_counters++];
+    counter->module = "dump";
+    counter->name = name;
+    counter->value = value;
+}
+
+static void dump_add_output_counters(DIOCTL_GetModuleCounters *gmc, const DumpOutput *out, bool rx)
+{
+    dump_add_counter(gmc, rx ? "rx_records" : "tx_records", out->records);
+    dump_add_counter(gmc, rx ? "rx_records_filtered" : "tx_records_filtered", out->records_filtered);
+    dump_add_counter(gmc, rx ? "rx_records_dropped" : "tx_records_dropped", out->records_dropped);
+    dump_add_counter(gmc, rx ? "rx_bytes_written" : "tx_bytes_written",
+            __atomic_load_n(&out->bytes_written, __ATOMIC_RELAXED));
+    dump_add_counter(gmc, rx ? "rx_write_errors" : "tx_write_errors",
+            __atomic_load_n(&out->write_errors, __ATOMIC_RELAXED));
+    dump_add_counter(gmc, rx ? "rx_queue_depth" : "tx_queue_depth", dump_output_queue_depth(out));
+    dump_add_counter(gmc, rx ? "rx_max_queue_depth" : "tx_max_queue_depth", out->max_queue_depth);
+    dump_add_counter(gmc, rx ? "rx_files_opened" : "tx_files_opened",
+            __atomic_load_n(&out->files_opened, __ATOMIC_RELAXED));
+    dump_add_counter(gmc, rx ? "rx_files_removed" : "tx_files_removed",
+            __atomic_load_n(&out->files_removed, __ATOMIC_RELAXED));
+    dump_add_counter(gmc, rx ? "rx_open_errors" : "tx_open_errors",
+            __atomic_load_n(&out->open_errors, __ATOMIC_RELAXED));
+}
+
+static void dump_add_flight_counters(DIOCTL_GetModuleCounters *gmc, const DumpFlightRecorder *fr)
+{
+    dump_add_counter(gmc, "flight_records", fr->records);
+    dump_add_counter(gmc, "flight_records_filtered", fr->records_filtered);
+    dump_add_counter(gmc, "flight_records_evicted", fr->records_evicted);
+    dump_add_counter(gmc, "flight_records_held", fr->held);
+    dump_add_counter(gmc, "flight_triggers", fr->triggers);
+    dump_add_counter(gmc, "flight_triggers_busy", fr->triggers_busy);
+    dump_add_counter(gmc, "flight_snapshots_written",
+            __atomic_load_n(&fr->snapshots_written, __ATOMIC_RELAXED));
+    dump_add_counter(gmc, "flight_bytes_written", __atomic_load_n(&fr->bytes_written, __ATOMIC_RELAXED));
+    dump_add_counter(gmc, "flight_write_errors", __atomic_load_n(&fr->write_errors, __ATOMIC_RELAXED));
+}
 
 //-------------------------------------------------------------------------
 
@@ -75,6 +1499,11 @@ static int dump_daq_module_load(const DAQ_BaseAPI_t *base_api)
     if (base_api->api_version != DAQ_BASE_API_VERSION || base_api->api_size != sizeof(DAQ_BaseAPI_t))
         return DAQ_ERROR;
 
+    int type = base_api->meta_type_register(DAQ_META_TYPE_TIMESTAMP, sizeof(DAQ_PktTimestamp_t));
+    if (type < 0)
+        return type;
+    timestamp_meta_type = type;
+
     daq_base_api = *base_api;
 
     return DAQ_SUCCESS;
@@ -93,6 +1522,23 @@ static int dump_daq_get_variable_descs(const DAQ_VariableDesc_t **var_desc_table
     return sizeof(dump_variable_descriptions) / sizeof(DAQ_VariableDesc_t);
 }
 
+static void dump_daq_destroy(void *handle)
+{
+    DumpContext *dc = (DumpContext *) handle;
+
+    dump_stop_writer(dc);
+    dump_output_free(&dc->tx);
+    dump_output_free(&dc->rx);
+    dump_flight_free(&dc->flight);
+    free(dc->traces);
+    free(dc->record_filter);
+    pcap_freecode(&dc->fcode);
+    pthread_cond_destroy(&dc->space_cond);
+    pthread_cond_destroy(&dc->work_cond);
+    pthread_mutex_destroy(&dc->writer_lock);
+    free(dc);
+}
+
 static int dump_daq_instantiate(const DAQ_ModuleConfig_h modcfg, DAQ_ModuleInstance_h modinst, void **ctxt_ptr)
 {
     // Simple multi-instance sanity check
@@ -111,55 +1557,230 @@ static int dump_daq_instantiate(const DAQ_ModuleConfig_h modcfg, DAQ_ModuleInsta
         return DAQ_ERROR_NOMEM;
     }
     dc->modinst = modinst;
+    dc->record_verdicts = DEFAULT_RECORD_VERDICTS;
+    dc->tx.fd = -1;
+    dc->rx.fd = -1;
+    pthread_mutex_init(&dc->writer_lock, NULL);
+    pthread_cond_init(&dc->work_cond, NULL);
+    pthread_cond_init(&dc->space_cond, NULL);
+
+    int rval = DAQ_ERROR_INVAL;
 
     if (daq_base_api.resolve_subapi(modinst, &dc->subapi) != DAQ_SUCCESS)
     {
         SET_ERROR(modinst, "%s: Couldn't resolve subapi. No submodule configured?", __func__);
-        free(dc);
-        return DAQ_ERROR_INVAL;
+        goto fail;
     }
 
     const char *tx_filename = DEFAULT_TX_DUMP_FILE;
+    bool tx_configured = false;
     const char *rx_filename = NULL;
+    const char *flight_filename = NULL;
+    unsigned long flight_size_mb = DEFAULT_FLIGHT_RECORDER_MB;
+    unsigned long buffer_size_kb = DEFAULT_BUFFER_SIZE_KB;
+    unsigned long num_buffers = DEFAULT_NUM_BUFFERS;
+    unsigned long flush_interval_ms = DEFAULT_FLUSH_INTERVAL_MS;
     const char *varKey, *varValue;
     daq_base_api.config_first_variable(modcfg, &varKey, &varValue);
     while (varKey)
     {
         if (!strcmp(varKey, "file"))
+        {
             tx_filename = varValue;
+            tx_configured = true;
+        }
         else if (!strcmp(varKey, "dump-rx"))
             rx_filename = varValue ? varValue : DEFAULT_RX_DUMP_FILE;
         else if (!strcmp(varKey, "output"))
         {
+            tx_configured = true;
             if (!strcmp(varValue, "none"))
                 tx_filename = NULL;
             else
             {
                 SET_ERROR(modinst, "%s: Invalid output type (%s)", __func__, varValue);
-                free(dc);
-                return DAQ_ERROR_INVAL;
+                goto fail;
+            }
+        }
+        else if (!strcmp(varKey, "format"))
+        {
+            if (!strcmp(varValue, "pcapng"))
+                dc->pcapng = true;
+            else if (!strcmp(varValue, "pcap"))
+                dc->pcapng = false;
+            else
+            {
+                SET_ERROR(modinst, "%s: Invalid output format (%s)", __func__, varValue);
+                goto fail;
+            }
+        }
+        else if (!strcmp(varKey, "buffer-size"))
+        {
+            if (util_parse_uint(varValue, &buffer_size_kb) != 0 || buffer_size_kb < MIN_BUFFER_SIZE_KB)
+            {
+                SET_ERROR(modinst, "%s: Invalid value for key '%s': '%s'", __func__, varKey, varValue);
+                goto fail;
+            }
+        }
+        else if (!strcmp(varKey, "buffers"))
+        {
+            if (util_parse_uint(varValue, &num_buffers) != 0 || num_buffers < 2 || num_buffers > 65536)
+            {
+                SET_ERROR(modinst, "%s: Invalid value for key '%s': '%s'", __func__, varKey, varValue);
+                goto fail;
+            }
+        }
+        else if (!strcmp(varKey, "overflow"))
+        {
+            if (!strcmp(varValue, "drop"))
+                dc->drop_on_overflow = true;
+            else if (!strcmp(varValue, "block"))
+                dc->drop_on_overflow = false;
+            else
+            {
+                SET_ERROR(modinst, "%s: Invalid overflow action (%s)", __func__, varValue);
+                goto fail;
+            }
+        }
+        else if (!strcmp(varKey, "flush-interval"))
+        {
+            if (util_parse_uint(varValue, &flush_interval_ms) != 0)
+            {
+                SET_ERROR(modinst, "%s: Invalid value for key '%s': '%s'", __func__, varKey, varValue);
+                goto fail;
+            }
+        }
+        else if (!strcmp(varKey, "flight-recorder"))
+            flight_filename = varValue ? varValue : DEFAULT_FLIGHT_RECORDER_FILE;
+        else if (!strcmp(varKey, "flight-recorder-size"))
+        {
+            if (util_parse_uint(varValue, &flight_size_mb) != 0 || flight_size_mb == 0 ||
+                    flight_size_mb > SIZE_MAX / (2 * 1024 * 1024))
+            {
+                SET_ERROR(modinst, "%s: Invalid value for key '%s': '%s'", __func__, varKey, varValue);
+                goto fail;
+            }
+        }
+        else if (!strcmp(varKey, "flight-recorder-seconds"))
+        {
+            unsigned long seconds;
+            if (util_parse_uint(varValue, &seconds) != 0 || seconds > UINT_MAX)
+            {
+                SET_ERROR(modinst, "%s: Invalid value for key '%s': '%s'", __func__, varKey, varValue);
+                goto fail;
+            }
+            dc->flight_seconds = seconds;
+        }
+        else if (!strcmp(varKey, "flight-recorder-reasons"))
+        {
+            rval = dump_parse_flight_reasons(dc, varValue);
+            if (rval != DAQ_SUCCESS)
+                goto fail;
+            rval = DAQ_ERROR_INVAL;
+        }
+        else if (!strcmp(varKey, "record-filter"))
+        {
+            free(dc->record_filter);
+            dc->record_filter = strdup(varValue);
+            if (!dc->record_filter)
+            {
+                SET_ERROR(modinst, "%s: Couldn't allocate memory for the record filter", __func__);
+                rval = DAQ_ERROR_NOMEM;
+                goto fail;
+            }
+        }
+        else if (!strcmp(varKey, "record-verdicts"))
+        {
+            rval = dump_parse_record_verdicts(dc, varValue);
+            if (rval != DAQ_SUCCESS)
+                goto fail;
+            rval = DAQ_ERROR_INVAL;
+        }
+        else if (!strcmp(varKey, "record-snaplen"))
+        {
+            unsigned long snaplen;
+            if (util_parse_uint(varValue, &snaplen) != 0 || snaplen == 0 || snaplen > UINT32_MAX)
+            {
+                SET_ERROR(modinst, "%s: Invalid value for key '%s': '%s'", __func__, varKey, varValue);
+                goto fail;
+            }
+            dc->record_snaplen = snaplen;
+        }
+        else if (!strcmp(varKey, "rotate-size") || !strcmp(varKey, "max-total-size"))
+        {
+            unsigned long size_mb;
+            if (util_parse_uint(varValue, &size_mb) != 0 || size_mb > UINT64_MAX / (1024 * 1024))
+            {
+                SET_ERROR(modinst, "%s: Invalid value for key '%s': '%s'", __func__, varKey, varValue);
+                goto fail;
+            }
+            if (!strcmp(varKey, "rotate-size"))
+                dc->rotate_size = (uint64_t) size_mb * 1024 * 1024;
+            else
+                dc->max_total_size = (uint64_t) size_mb * 1024 * 1024;
+        }
+        else if (!strcmp(varKey, "rotate-packets"))
+        {
+            unsigned long packets;
+            if (util_parse_uint(varValue, &packets) != 0)
+            {
+                SET_ERROR(modinst, "%s: Invalid value for key '%s': '%s'", __func__, varKey, varValue);
+                goto fail;
+            }
+            dc->rotate_packets = packets;
+        }
+        else if (!strcmp(varKey, "rotate-interval") || !strcmp(varKey, "max-files"))
+        {
+            unsigned long value;
+            if (util_parse_uint(varValue, &value) != 0 || value > UINT_MAX)
+            {
+                SET_ERROR(modinst, "%s: Invalid value for key '%s': '%s'", __func__, varKey, varValue);
+                goto fail;
             }
+            if (!strcmp(varKey, "rotate-interval"))
+                dc->rotate_interval = value;
+            else
+                dc->max_files = value;
         }
         daq_base_api.config_next_variable(modcfg, &varKey, &varValue);
     }
+    dc->flush_interval_ms = flush_interval_ms;
+    dc->instance_id = instance_id;
 
-    // Mangle the output filenames with a prefix in the multi-instance scenario
+    /* The flight recorder is meant to keep the disk quiet until it's triggered, so it replaces the
+        default TX file rather than having every packet copied into both. */
+    if (flight_filename && !tx_configured)
+        tx_filename = NULL;
+
+    /* The buffer ring indices are masked, so round the buffer count up to a power of two. */
+    unsigned ring_size = 1;
+    while (ring_size < num_buffers)
+        ring_size <<= 1;
+
+    // Mangle the output filenames with a prefix in the multi-instance scenario unless the
+    // filename templates already place the instance ID themselves
     char prefix[32];
-    if (instance_id > 0)
+    bool templated = (!tx_filename || strstr(tx_filename, "%i")) && (!rx_filename || strstr(rx_filename, "%i")) &&
+        (!flight_filename || strstr(flight_filename, "%i"));
+    if (instance_id > 0 && !templated)
     {
         // For now, only support mangling base filenames (no directory path allowed)
         if (tx_filename && strchr(tx_filename, '/'))
         {
             SET_ERROR(modinst, "%s: Invalid TX PCAP filename for multi-instance: %s", __func__, tx_filename);
-            free(dc);
-            return DAQ_ERROR_INVAL;
+            goto fail;
         }
 
         if (rx_filename && strchr(rx_filename, '/'))
         {
             SET_ERROR(modinst, "%s: Invalid RX PCAP filename for multi-instance: %s", __func__, rx_filename);
-            free(dc);
-            return DAQ_ERROR_INVAL;
+            goto fail;
+        }
+
+        if (flight_filename && strchr(flight_filename, '/'))
+        {
+            SET_ERROR(modinst, "%s: Invalid flight recorder filename for multi-instance: %s", __func__, flight_filename);
+            goto fail;
         }
 
         snprintf(prefix, sizeof(prefix), "%u_", instance_id);
@@ -169,47 +1790,43 @@ static int dump_daq_instantiate(const DAQ_ModuleConfig_h modcfg, DAQ_ModuleInsta
 
     if (tx_filename)
     {
-        size_t len = strlen(tx_filename) + strlen(prefix) + 1;
-        dc->tx_filename = malloc(len);
-        if (!dc->tx_filename)
-        {
-            SET_ERROR(modinst, "%s: Couldn't allocate memory for the TX PCAP filename", __func__);
-            free(dc);
-            return DAQ_ERROR_NOMEM;
-        }
-        snprintf(dc->tx_filename, len, "%s%s", prefix, tx_filename);
+        rval = dump_output_init(dc, &dc->tx, tx_filename, prefix, ring_size, buffer_size_kb * 1024);
+        if (rval != DAQ_SUCCESS)
+            goto fail;
     }
 
     if (rx_filename)
     {
-        size_t len = strlen(rx_filename) + strlen(prefix) + 1;
-        dc->rx_filename = malloc(len);
-        if (!dc->rx_filename)
+        rval = dump_output_init(dc, &dc->rx, rx_filename, prefix, ring_size, buffer_size_kb * 1024);
+        if (rval != DAQ_SUCCESS)
+            goto fail;
+    }
+
+    if (dc->pcapng && tx_filename)
+    {
+        dc->traces = calloc(DUMP_TRACE_SLOTS, sizeof(DumpTraceData));
+        if (!dc->traces)
         {
-            SET_ERROR(modinst, "%s: Couldn't allocate memory for the RX PCAP filename", __func__);
-            free(dc->tx_filename);
-            free(dc);
-            return DAQ_ERROR_NOMEM;
+            SET_ERROR(modinst, "%s: Couldn't allocate memory for the trace data table", __func__);
+            rval = DAQ_ERROR_NOMEM;
+            goto fail;
         }
-        snprintf(dc->rx_filename, len, "%s%s", prefix, rx_filename);
+    }
+
+    if (flight_filename)
+    {
+        rval = dump_flight_init(dc, &dc->flight, flight_filename, prefix, flight_size_mb * 1024 * 1024);
+        if (rval != DAQ_SUCCESS)
+            goto fail;
     }
 
     *ctxt_ptr = dc;
 
     return DAQ_SUCCESS;
-}
-
-static void dump_daq_destroy(void *handle)
-{
-    DumpContext *dc = (DumpContext *) handle;
 
-    if (dc->tx_dumper)
-        pcap_dump_close(dc->tx_dumper);
-    free(dc->tx_filename);
-    if (dc->rx_dumper)
-        pcap_dump_close(dc->rx_dumper);
-    free(dc->rx_filename);
-    free(dc);
+fail:
+    dump_daq_destroy(dc);
+    return rval;
 }
 
 static int dump_daq_start(void *handle)
@@ -220,67 +1837,65 @@ static int dump_daq_start(void *handle)
     if (rval != DAQ_SUCCESS)
         return rval;
 
+    if (!dc->tx.filename && !dc->rx.filename && !dc->flight.filename)
+        return DAQ_SUCCESS;
+
     int dlt = CALL_SUBAPI_NOARGS(dc, get_datalink_type);
     int snaplen = CALL_SUBAPI_NOARGS(dc, get_snaplen);
 
-    if (dc->tx_filename)
+    /* The filter is compiled against the snaplen of the packets it will see, but the savefile
+        header advertises the snaplen of what is actually recorded. */
+    if (dc->record_filter && dump_compile_filter(dc, dlt, snaplen) != DAQ_SUCCESS)
+        goto fail;
+
+    if (dc->record_snaplen && (snaplen <= 0 || dc->record_snaplen < (uint32_t) snaplen))
+        snaplen = dc->record_snaplen;
+
+    if (dump_build_file_header(dc, dlt, snaplen) != DAQ_SUCCESS)
+        goto fail;
+
+    if (dc->tx.filename && dump_output_open(dc, &dc->tx) != DAQ_SUCCESS)
+        goto fail;
+
+    if (dc->rx.filename && dump_output_open(dc, &dc->rx) != DAQ_SUCCESS)
+        goto fail;
+
+    if (dc->flight.filename)
     {
-        pcap_t *pcap = pcap_open_dead(dlt, snaplen);
-        if (!pcap)
-        {
-            CALL_SUBAPI_NOARGS(dc, stop);
-            SET_ERROR(dc->modinst, "Could not create a dead PCAP handle!");
-            return DAQ_ERROR;
-        }
-        dc->tx_dumper = pcap_dump_open(pcap, dc->tx_filename);
-        if (!dc->tx_dumper)
-        {
-            CALL_SUBAPI_NOARGS(dc, stop);
-            SET_ERROR(dc->modinst, "Could not open PCAP %s for writing: %s", dc->tx_filename, pcap_geterr(pcap));
-            pcap_close(pcap);
-            return DAQ_ERROR;
-        }
-        pcap_close(pcap);
+        dc->flight.head = dc->flight.tail = 0;
+        dc->flight.wrapped = false;
+        dc->flight.held = 0;
+        dc->flight.file_seq = 0;
+        dc->flight.active = true;
     }
 
-    if (dc->rx_filename)
+    dc->writer_exit = false;
+    if ((rval = pthread_create(&dc->writer_tid, NULL, dump_writer_thread, dc)) != 0)
     {
-        pcap_t *pcap = pcap_open_dead(dlt, snaplen);
-        if (!pcap)
-        {
-            CALL_SUBAPI_NOARGS(dc, stop);
-            SET_ERROR(dc->modinst, "Could not create a dead PCAP handle!");
-            return DAQ_ERROR;
-        }
-        dc->rx_dumper = pcap_dump_open(pcap, dc->rx_filename);
-        if (!dc->rx_dumper)
-        {
-            CALL_SUBAPI_NOARGS(dc, stop);
-            SET_ERROR(dc->modinst, "Could not open PCAP %s for writing: %s", dc->rx_filename, pcap_geterr(pcap));
-            pcap_close(pcap);
-            return DAQ_ERROR;
-        }
-        pcap_close(pcap);
+        SET_ERROR(dc->modinst, "Could not create the PCAP writer thread: %s", strerror(rval));
+        goto fail;
     }
+    dc->writer_running = true;
 
     return DAQ_SUCCESS;
+
+fail:
+    dump_output_close(&dc->tx);
+    dump_output_close(&dc->rx);
+    dc->flight.active = false;
+    CALL_SUBAPI_NOARGS(dc, stop);
+    return DAQ_ERROR;
 }
 
 static int dump_daq_inject(void *handle, DAQ_MsgType type, const void *hdr, const uint8_t *data, uint32_t data_len)
 {
     DumpContext *dc = (DumpContext*) handle;
 
-    if (dc->tx_dumper && type == DAQ_MSG_TYPE_PACKET)
+    if (dc->tx.active && type == DAQ_MSG_TYPE_PACKET && (dc->record_verdicts & DUMP_RECORD_INJECTED))
     {
         const DAQ_PktHdr_t *pkthdr = (const DAQ_PktHdr_t *) hdr;
-        struct pcap_pkthdr pcap_hdr;
-
-        pcap_hdr.ts.tv_sec = pkthdr->ts.tv_sec;
-        pcap_hdr.ts.tv_usec = pkthdr->ts.tv_usec;
-        pcap_hdr.caplen = data_len;
-        pcap_hdr.len = data_len;
-
-        pcap_dump((u_char *) dc->tx_dumper, &pcap_hdr, data);
+        dump_output_record(dc, &dc->tx, pkthdr, dump_timestamp_ns(NULL, pkthdr), data, data_len, data_len,
+                DUMP_PCAPNG_NO_VERDICT, NULL);
     }
 
     if (CHECK_SUBAPI(dc, inject))
@@ -298,18 +1913,14 @@ static int dump_daq_inject_relative(void *handle, const DAQ_Msg_t *msg, const ui
 {
     DumpContext *dc = (DumpContext*) handle;
 
-    if (dc->tx_dumper && msg->type == DAQ_MSG_TYPE_PACKET)
+    if (dc->tx.active && msg->type == DAQ_MSG_TYPE_PACKET && (dc->record_verdicts & DUMP_RECORD_INJECTED))
     {
         const DAQ_PktHdr_t *pkthdr = (const DAQ_PktHdr_t *) msg->hdr;
-        struct pcap_pkthdr pcap_hdr;
 
         // Reuse the timestamp from the original packet for the injected packet
-        pcap_hdr.ts.tv_sec = pkthdr->ts.tv_sec;
-        pcap_hdr.ts.tv_usec = pkthdr->ts.tv_usec;
-        pcap_hdr.caplen = data_len;
-        pcap_hdr.len = data_len;
-
-        pcap_dump((u_char *) dc->tx_dumper, &pcap_hdr, data);
+        const DAQ_PktTimestamp_t *pts = (const DAQ_PktTimestamp_t *) daq_msg_find_meta(msg, timestamp_meta_type);
+        dump_output_record(dc, &dc->tx, pkthdr, dump_timestamp_ns(pts, pkthdr), data, data_len, data_len,
+                DUMP_PCAPNG_NO_VERDICT, NULL);
     }
 
     if (CHECK_SUBAPI(dc, inject_relative))
@@ -331,19 +1942,89 @@ static int dump_daq_stop(void *handle)
     if (rval != DAQ_SUCCESS)
         return rval;
 
-    if (dc->tx_dumper)
+    dump_stop_writer(dc);
+
+    return DAQ_SUCCESS;
+}
+
+static int dump_daq_ioctl(void *handle, DAQ_IoctlCmd cmd, void *arg, size_t arglen)
+{
+    DumpContext *dc = (DumpContext*) handle;
+
+    if (cmd == DIOCTL_GET_MODULE_COUNTERS)
+    {
+        if (arglen != sizeof(DIOCTL_GetModuleCounters))
+            return DAQ_ERROR_INVAL;
+        DIOCTL_GetModuleCounters *gmc = (DIOCTL_GetModuleCounters *) arg;
+        if (!gmc->counters && gmc->max_counters > 0)
+            return DAQ_ERROR_INVAL;
+
+        if (dc->tx.filename)
+            dump_add_output_counters(gmc, &dc->tx, false);
+        if (dc->rx.filename)
+            dump_add_output_counters(gmc, &dc->rx, true);
+        if (dc->flight.filename)
+            dump_add_flight_counters(gmc, &dc->flight);
+
+        if (CHECK_SUBAPI(dc, ioctl))
+        {
+            int rval = CALL_SUBAPI(dc, ioctl, cmd, arg, arglen);
+            if (rval != DAQ_SUCCESS && rval != DAQ_ERROR_NOTSUP)
+                return rval;
+        }
+
+        return DAQ_SUCCESS;
+    }
+
+    /* Hold on to tracing data until the verdict so that it can be recorded alongside the packet. */
+    if (dc->traces && dc->tx.active)
     {
-        pcap_dump_close(dc->tx_dumper);
-        dc->tx_dumper = NULL;
+        if (cmd == DIOCTL_SET_PACKET_TRACE_DATA && arglen == sizeof(DIOCTL_SetPacketTraceData))
+        {
+            DIOCTL_SetPacketTraceData *sptd = (DIOCTL_SetPacketTraceData *) arg;
+            if (sptd->msg)
+                dump_trace_set(dc, sptd->msg, sptd->verdict_reason, sptd->trace_data, sptd->trace_data_len);
+        }
+        else if (cmd == DIOCTL_SET_PACKET_VERDICT_REASON && arglen == sizeof(DIOCTL_SetPacketVerdictReason))
+        {
+            DIOCTL_SetPacketVerdictReason *spvr = (DIOCTL_SetPacketVerdictReason *) arg;
+            if (spvr->msg)
+                dump_trace_set(dc, spvr->msg, spvr->verdict_reason, NULL, 0);
+        }
     }
 
-    if (dc->rx_dumper)
+    if (dc->flight.active)
     {
-        pcap_dump_close(dc->rx_dumper);
-        dc->rx_dumper = NULL;
+        /* Snapshots are triggered either explicitly or by verdict reasons of interest.  In all
+            cases, the request is still passed on to the wrapped module. */
+        bool trigger = false;
+        if (cmd == DIOCTL_FLUSH_PACKET_HISTORY)
+            trigger = true;
+        else if (cmd == DIOCTL_SET_PACKET_TRACE_DATA && arglen == sizeof(DIOCTL_SetPacketTraceData))
+            trigger = dump_flight_reason_triggers(dc, ((DIOCTL_SetPacketTraceData *) arg)->verdict_reason);
+        else if (cmd == DIOCTL_SET_PACKET_VERDICT_REASON && arglen == sizeof(DIOCTL_SetPacketVerdictReason))
+            trigger = dump_flight_reason_triggers(dc, ((DIOCTL_SetPacketVerdictReason *) arg)->verdict_reason);
+
+        if (trigger)
+        {
+            dump_flight_trigger(dc, &dc->flight);
+            if (cmd == DIOCTL_FLUSH_PACKET_HISTORY)
+            {
+                if (CHECK_SUBAPI(dc, ioctl))
+                {
+                    int rval = CALL_SUBAPI(dc, ioctl, cmd, arg, arglen);
+                    if (rval != DAQ_SUCCESS && rval != DAQ_ERROR_NOTSUP)
+                        return rval;
+                }
+                return DAQ_SUCCESS;
+            }
+        }
     }
 
-    return DAQ_SUCCESS;
+    if (CHECK_SUBAPI(dc, ioctl))
+        return CALL_SUBAPI(dc, ioctl, cmd, arg, arglen);
+
+    return DAQ_ERROR_NOTSUP;
 }
 
 static int dump_daq_get_stats(void *handle, DAQ_Stats_t *stats)
@@ -381,12 +2062,12 @@ static uint32_t dump_daq_get_capabilities(void *handle)
     return caps;
 }
 
-static unsigned dump_daq_msg_receive(void *handle, const unsigned max_recv, const DAQ_Msg_t *msgs[], DAQ_RecvStatus *rstat)
+DAQ_STACK_LINKAGE unsigned dump_daq_msg_receive(void *handle, const unsigned max_recv, const DAQ_Msg_t *msgs[], DAQ_RecvStatus *rstat)
 {
     DumpContext *dc = (DumpContext*) handle;
     unsigned num_receive = CALL_SUBAPI(dc, msg_receive, max_recv, msgs, rstat);
 
-    if (dc->rx_dumper)
+    if (dc->rx.active || dc->flight.active)
     {
         for (unsigned idx = 0; idx < num_receive; idx++)
         {
@@ -396,37 +2077,39 @@ static unsigned dump_daq_msg_receive(void *handle, const unsigned max_recv, cons
                 continue;
 
             const DAQ_PktHdr_t *hdr = (const DAQ_PktHdr_t *) msg->hdr;
-            const uint8_t *data = msg->data;
-            struct pcap_pkthdr pcap_hdr;
-
-            pcap_hdr.ts.tv_sec = hdr->ts.tv_sec;
-            pcap_hdr.ts.tv_usec = hdr->ts.tv_usec;
-            pcap_hdr.caplen = msg->data_len;
-            pcap_hdr.len = hdr->pktlen;
-            pcap_dump((u_char *) dc->rx_dumper, &pcap_hdr, data);
+            const DAQ_PktTimestamp_t *pts = (const DAQ_PktTimestamp_t *) daq_msg_find_meta(msg, timestamp_meta_type);
+            uint64_t ts_ns = dump_timestamp_ns(pts, hdr);
+            if (dc->rx.active)
+                dump_output_record(dc, &dc->rx, hdr, ts_ns, msg->data, msg->data_len, hdr->pktlen,
+                        DUMP_PCAPNG_NO_VERDICT, NULL);
+            if (dc->flight.active)
+                dump_flight_record(dc, &dc->flight, ts_ns, msg->data, msg->data_len, hdr->pktlen);
         }
     }
 
+    /* Receive calls are the only regular event on the packet thread, so use them to make sure
+        that records don't linger in partially filled buffers. */
+    dump_check_flush(dc);
+
     return num_receive;
 }
 
-static int dump_daq_msg_finalize(void *handle, const DAQ_Msg_t *msg, DAQ_Verdict verdict)
+DAQ_STACK_LINKAGE int dump_daq_msg_finalize(void *handle, const DAQ_Msg_t *msg, DAQ_Verdict verdict)
 {
-    static const int s_fwd[MAX_DAQ_VERDICT] = { 1, 0, 1, 1, 0, 1 };
     DumpContext *dc = (DumpContext *) handle;
 
     dc->stats.verdicts[verdict]++;
-    if (dc->tx_dumper && msg->type == DAQ_MSG_TYPE_PACKET && s_fwd[verdict])
+
+    /* Any tracing data must be claimed whether or not the packet is recorded so that it can't
+        end up attached to a later message reusing the same descriptor. */
+    const DumpTraceData *trace = dc->traces ? dump_trace_take(dc, msg) : NULL;
+
+    if (dc->tx.active && msg->type == DAQ_MSG_TYPE_PACKET && (dc->record_verdicts & DUMP_RECORD_VERDICT(verdict)))
     {
         const DAQ_PktHdr_t *hdr = (const DAQ_PktHdr_t *) msg->hdr;
-        const uint8_t *data = msg->data;
-        struct pcap_pkthdr pcap_hdr;
-
-        pcap_hdr.ts.tv_sec = hdr->ts.tv_sec;
-        pcap_hdr.ts.tv_usec = hdr->ts.tv_usec;
-        pcap_hdr.caplen = msg->data_len;
-        pcap_hdr.len = hdr->pktlen;
-        pcap_dump((u_char *) dc->tx_dumper, &pcap_hdr, data);
+        const DAQ_PktTimestamp_t *pts = (const DAQ_PktTimestamp_t *) daq_msg_find_meta(msg, timestamp_meta_type);
+        dump_output_record(dc, &dc->tx, hdr, dump_timestamp_ns(pts, hdr), msg->data, msg->data_len,
+                hdr->pktlen, verdict, trace);
     }
 
     return CALL_SUBAPI(dc, msg_finalize, msg, verdict);
@@ -456,7 +2139,7 @@ DAQ_ModuleAPI_t dump_daq_module_data =
     /* .inject_relative = */ dump_daq_inject_relative,
     /* .interrupt = */ NULL,
     /* .stop = */ dump_daq_stop,
-    /* .ioctl = */ NULL,
+    /* .ioctl = */ dump_daq_ioctl,
     /* .get_stats = */ dump_daq_get_stats,
     /* .reset_stats = */ dump_daq_reset_stats,
     /* .get_snaplen = */ NULL,
@@ -469,4 +2152,3 @@ DAQ_ModuleAPI_t dump_daq_module_data =
     /* .msg_finalize = */ dump_daq_msg_finalize,
     /* .get_msg_pool_info = */ NULL,
 };
-
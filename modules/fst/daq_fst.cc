@@ -52,7 +52,7 @@
     ctxt->subapi.fname.func(ctxt->subapi.fname.context)
 
 #define CALL_SUBAPI(ctxt, fname, ...) \
-    ctxt->subapi.fname.func(ctxt->subapi.fname.context, __VA_ARGS__)
+    DAQ_SUBAPI_CALL(ctxt->subapi, fname, __VA_ARGS__)
 
 struct FstMsgDesc
 {
@@ -104,6 +104,7 @@ static DAQ_VariableDesc_t fst_variable_descriptions[] = {
 };
 
 static DAQ_BaseAPI_t daq_base_api;
+static unsigned timestamp_meta_type;
 
 
 /* --------------------------------------------------------------------------------------------- */
@@ -151,6 +152,11 @@ static int fst_daq_module_load(const DAQ_BaseAPI_t *base_api)
     if (base_api->api_version != DAQ_BASE_API_VERSION || base_api->api_size != sizeof(DAQ_BaseAPI_t))
         return DAQ_ERROR;
 
+    int type = base_api->meta_type_register(DAQ_META_TYPE_TIMESTAMP, sizeof(DAQ_PktTimestamp_t));
+    if (type < 0)
+        return type;
+    timestamp_meta_type = type;
+
     daq_base_api = *base_api;
 
     return DAQ_SUCCESS;
@@ -282,6 +288,7 @@ static bool process_lost_souls(FstContext *fc, const DAQ_Msg_t *msgs[], unsigned
         msg->data_len = 0;
         msg->data = nullptr;
         memset(msg->meta, 0, sizeof(msg->meta));
+        msg->wrapped = nullptr;
         msgs[idx++] = &desc->msg;
 
         debugf("%" PRIu64 ": Produced EoF message for flow %u\n", fc->processed, entry->flow_id);
@@ -307,6 +314,7 @@ static bool process_new_soul(FstContext *fc, std::shared_ptr<FstEntry> entry, co
     msg->data_len = 0;
     msg->data = nullptr;
     memset(msg->meta, 0, sizeof(msg->meta));
+    msg->wrapped = nullptr;
     msgs[idx++] = &desc->msg;
 
     debugf("%" PRIu64 ": Produced SoF message for flow %u\n", fc->processed, entry->flow_id);
@@ -314,6 +322,14 @@ static bool process_new_soul(FstContext *fc, std::shared_ptr<FstEntry> entry, co
     return true;
 }
 
+static uint64_t get_timestamp_ns(const DAQ_Msg_t *msg, const DAQ_PktHdr_t *pkthdr)
+{
+    const DAQ_PktTimestamp_t *pts = static_cast<const DAQ_PktTimestamp_t*>(daq_msg_find_meta(msg, timestamp_meta_type));
+    if (pts)
+        return pts->nsec;
+    return static_cast<uint64_t>(pkthdr->ts.tv_sec) * 1000000000 + static_cast<uint64_t>(pkthdr->ts.tv_usec) * 1000;
+}
+
 static bool process_daq_msg(FstContext *fc, const DAQ_Msg_t *orig_msg, const DAQ_Msg_t *msgs[], unsigned max_recv, unsigned &idx)
 {
     fc->processed++;
@@ -325,7 +341,8 @@ static bool process_daq_msg(FstContext *fc, const DAQ_Msg_t *orig_msg, const DAQ
     }
 
     const DAQ_PktHdr_t *orig_pkthdr = static_cast<const DAQ_PktHdr_t*>(orig_msg->hdr);
-    fc->flow_table.process_timeouts(&orig_pkthdr->ts);
+    uint64_t ts_ns = get_timestamp_ns(orig_msg, orig_pkthdr);
+    fc->flow_table.process_timeouts(ts_ns);
 
     if (!process_lost_souls(fc, msgs, max_recv, idx))
         return false;
@@ -349,7 +366,7 @@ static bool process_daq_msg(FstContext *fc, const DAQ_Msg_t *orig_msg, const DAQ
     std::shared_ptr<FstEntry> entry;
     if (!node)
     {
-        entry = std::make_shared<FstEntry>(orig_pkthdr, key, ++fc->last_flow_id, swapped);
+        entry = std::make_shared<FstEntry>(orig_pkthdr, ts_ns, key, ++fc->last_flow_id, swapped);
         node = fc->flow_table.insert(key, entry);
         FstTimeoutList::ID tol_id;
         switch (key.protocol)
@@ -382,13 +399,13 @@ static bool process_daq_msg(FstContext *fc, const DAQ_Msg_t *orig_msg, const DAQ
 
         /* Don't update the entry stats until we're sure we'll be handling this packet message or
             it will be double counted. */
-        entry->update_stats(orig_pkthdr, swapped);
+        entry->update_stats(orig_pkthdr, ts_ns, swapped);
     }
     else
     {
         entry = node->entry;
         debugf("%" PRIu64 ": Found existing flow %u (0x%x)\n", fc->processed, entry->flow_id, entry->flags);
-        entry->update_stats(orig_pkthdr, swapped);
+        entry->update_stats(orig_pkthdr, ts_ns, swapped);
         if (entry->flags & (FST_ENTRY_FLAG_WHITELISTED | FST_ENTRY_FLAG_BLACKLISTED))
         {
             DAQ_Verdict verdict;
@@ -433,13 +450,8 @@ static bool process_daq_msg(FstContext *fc, const DAQ_Msg_t *orig_msg, const DAQ
     msg->data_len = orig_msg->data_len;
     msg->data = orig_msg->data;
 
-    /* Copy over any metadata from the wrapped message that we won't produce. */
-    for (int slot = 0; slot < DAQ_MSG_META_SLOTS; slot++)
-    {
-        if ((slot == DAQ_PKT_META_DECODE_DATA) || (slot == DAQ_PKT_META_TCP_ACK_DATA))
-            continue;
-        msg->meta[slot] = orig_msg->meta[slot];
-    }
+    /* Any metadata from the wrapped message that we don't produce shows through. */
+    msg->wrapped = orig_msg;
 
     /* Then, set up the DAQ packet header. */
     DAQ_PktHdr_t *pkthdr = &desc->pkthdr;
@@ -464,8 +476,10 @@ static bool process_daq_msg(FstContext *fc, const DAQ_Msg_t *orig_msg, const DAQ
     /* Finally, set up the decode data slot. */
     desc->decoded = dd.decoded_data;
     msg->meta[DAQ_PKT_META_DECODE_DATA] = &desc->decoded;
-    /* And (maybe) the TCP meta ACK slot. */
+    /* And (maybe) the TCP meta ACK slot.  Bare ACKs are elided by us, not by whatever is below us, so
+        the wrapped message's TCP meta ACK data must not show through when we don't provide any. */
     msg->meta[DAQ_PKT_META_TCP_ACK_DATA] = nullptr;
+    msg->meta_suppressed = 1U << DAQ_PKT_META_TCP_ACK_DATA;
     if (fc->meta_ack_enabled)
     {
         if (key.protocol == IPPROTO_TCP && dd.tcp_data_segment &&
@@ -583,7 +597,7 @@ static bool process_unjudged_souls(FstContext *fc, const DAQ_Msg_t *msgs[], unsi
     return idx < max_recv;
 }
 
-static unsigned fst_daq_msg_receive(void *handle, const unsigned max_recv, const DAQ_Msg_t *msgs[], DAQ_RecvStatus *rstat)
+DAQ_STACK_LINKAGE unsigned fst_daq_msg_receive(void *handle, const unsigned max_recv, const DAQ_Msg_t *msgs[], DAQ_RecvStatus *rstat)
 {
     FstContext *fc = static_cast<FstContext*>(handle);
     unsigned idx = 0;
@@ -653,7 +667,7 @@ static unsigned fst_daq_msg_receive(void *handle, const unsigned max_recv, const
     return idx;
 }
 
-static int fst_daq_msg_finalize(void *handle, const DAQ_Msg_t *msg, DAQ_Verdict verdict)
+DAQ_STACK_LINKAGE int fst_daq_msg_finalize(void *handle, const DAQ_Msg_t *msg, DAQ_Verdict verdict)
 {
     FstContext *fc = static_cast<FstContext*>(handle);
 
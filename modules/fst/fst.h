@@ -94,15 +94,16 @@ struct FstKeyHash
 
 struct FstEntry
 {
-    FstEntry(const DAQ_PktHdr_t *pkthdr, const FstKey &key, uint32_t id, bool swapped);
+    FstEntry(const DAQ_PktHdr_t *pkthdr, uint64_t ts_ns, const FstKey &key, uint32_t id, bool swapped);
     ~FstEntry() { delete[] ha_state; }
-    void update_stats(const DAQ_PktHdr_t *pkthdr, bool swapped);
+    void update_stats(const DAQ_PktHdr_t *pkthdr, uint64_t ts_ns, bool swapped);
 
     FstTcpTracker tcp_tracker;
     DAQ_FlowStats_t flow_stats = { };
     uint8_t *ha_state = nullptr;
     uint32_t ha_state_len = 0;
     uint32_t flow_id;
+    uint64_t last_seen_ns;      /* Full resolution timestamp of the latest packet, for timeouts */
 #define FST_ENTRY_FLAG_NEW          0x01
 #define FST_ENTRY_FLAG_SWAPPED      0x02
 #define FST_ENTRY_FLAG_WHITELISTED  0x04
@@ -152,7 +153,7 @@ public:
     size_t get_max_size() const { return max_size; }
 
     void move_node_to_timeout_list(FstNode *node, FstTimeoutList::ID tol_id);
-    unsigned process_timeouts(const struct timeval *curr_time);
+    unsigned process_timeouts(uint64_t curr_ns);
 
     bool purgatory_empty() { return purgatory.empty(); }
     std::shared_ptr<FstEntry> get_lost_soul();
@@ -243,7 +244,7 @@ bool FstTcpTracker::get_meta_ack_data(DAQ_PktTcpAckData_t &ptad, bool c2s)
     return false;
 }
 
-FstEntry::FstEntry(const DAQ_PktHdr_t *pkthdr, const FstKey &key, uint32_t id, bool swapped)
+FstEntry::FstEntry(const DAQ_PktHdr_t *pkthdr, uint64_t ts_ns, const FstKey &key, uint32_t id, bool swapped)
 {
     flow_stats.ingress_group = pkthdr->ingress_group;
     flow_stats.egress_group = pkthdr->egress_group;
@@ -293,6 +294,7 @@ FstEntry::FstEntry(const DAQ_PktHdr_t *pkthdr, const FstKey &key, uint32_t id, b
 
     flow_stats.sof_timestamp = pkthdr->ts;
     flow_stats.eof_timestamp = pkthdr->ts;
+    last_seen_ns = ts_ns;
 
     flow_stats.vlan_tag = key.vlan_tag;
     flow_stats.address_space_id = key.addr_space_id;
@@ -303,7 +305,7 @@ FstEntry::FstEntry(const DAQ_PktHdr_t *pkthdr, const FstKey &key, uint32_t id, b
         flags |= FST_ENTRY_FLAG_SWAPPED;
 }
 
-void FstEntry::update_stats(const DAQ_PktHdr_t *pkthdr, bool swapped)
+void FstEntry::update_stats(const DAQ_PktHdr_t *pkthdr, uint64_t ts_ns, bool swapped)
 {
     if (!swapped == !(flags & FST_ENTRY_FLAG_SWAPPED))
     {
@@ -316,6 +318,7 @@ void FstEntry::update_stats(const DAQ_PktHdr_t *pkthdr, bool swapped)
         flow_stats.responder_bytes += pkthdr->pktlen;
     }
     flow_stats.eof_timestamp = pkthdr->ts;
+    last_seen_ns = ts_ns;
 }
 
 void FlowStateTable::extract_node(FstNode *node)
@@ -400,7 +403,7 @@ void FlowStateTable::move_node_to_timeout_list(FstNode *node, FstTimeoutList::ID
     node->timeout_iter = node->timeout_list->list.begin();
 }
 
-unsigned FlowStateTable::process_timeouts(const struct timeval *curr_time)
+unsigned FlowStateTable::process_timeouts(uint64_t curr_ns)
 {
     unsigned timeout_count = 0;
     for (FstTimeoutList &to_list : timeout_lists)
@@ -408,10 +411,8 @@ unsigned FlowStateTable::process_timeouts(const struct timeval *curr_time)
         while (!to_list.list.empty())
         {
             FstNode *node = to_list.list.back();
-            struct timeval target_time = node->entry->flow_stats.eof_timestamp;
-            target_time.tv_sec += to_list.timeout;
-            if (curr_time->tv_sec < target_time.tv_sec ||
-                (curr_time->tv_sec == target_time.tv_sec && curr_time->tv_usec < target_time.tv_usec))
+            uint64_t target_ns = node->entry->last_seen_ns + (uint64_t) to_list.timeout * 1000000000;
+            if (curr_ns < target_ns)
                 break;
             extract_node(node);
             timeout_count++;
@@ -0,0 +1,1148 @@
+/*
+** Copyright (C) 2014-2021 Cisco and/or its affiliates. All rights reserved.
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation.  You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "daq_dlt.h"
+#include "daq_module_api.h"
+#include "daq_module_util.h"
+
+#define DAQ_LB_VERSION 1
+
+#define LB_DEFAULT_BURST        64
+#define LB_MAX_BURST            1024
+/* Ring size used when the wrapped module can't report the size of its message pool */
+#define LB_DEFAULT_RING_SIZE    4096
+/* Longest the dispatcher sleeps waiting for verdicts before checking on everything else */
+#define LB_IDLE_WAIT_US         1000
+
+#define LB_CACHELINE    64
+
+#define SET_ERROR(modinst, ...)    daq_base_api.set_errbuf(modinst, __VA_ARGS__)
+
+#define CHECK_SUBAPI(ctxt, fname) \
+    (ctxt->subapi.fname.func != NULL)
+
+#define CALL_SUBAPI_NOARGS(ctxt, fname) \
+    ctxt->subapi.fname.func(ctxt->subapi.fname.context)
+
+#define CALL_SUBAPI(ctxt, fname, ...) \
+    DAQ_SUBAPI_CALL(ctxt->subapi, fname, __VA_ARGS__)
+
+typedef struct
+{
+    const DAQ_Msg_t *msg;
+    DAQ_Verdict verdict;
+} LbVerdict;
+
+/*
+ * Each worker has a pair of single-producer/single-consumer rings shared with the dispatcher: one
+ * carrying messages from the dispatcher to the worker and one carrying verdicts back.  In both, the
+ * 'head' index is only advanced by the producer and the 'tail' index only by the consumer.  The
+ * indices live on separate cache lines so that the two threads don't bounce them back and forth.
+ * The rings are at least as large as the wrapped module's message pool, so they can never fill up
+ * when its size is known; the pool running dry is the backpressure.
+ */
+typedef struct
+{
+    const DAQ_Msg_t **msgs;
+    LbVerdict *verdicts;
+    unsigned mask;
+
+    unsigned msg_head __attribute__((aligned(LB_CACHELINE)));     // Dispatcher
+    unsigned verdict_tail;
+    uint64_t dispatched;
+
+    unsigned msg_tail __attribute__((aligned(LB_CACHELINE)));     // Worker
+    unsigned verdict_head;
+
+    /* Sleeping and waking up */
+    pthread_mutex_t lock __attribute__((aligned(LB_CACHELINE)));
+    pthread_cond_t cond;
+    bool sleeping;
+    bool attached;
+    bool stopped;
+} LbWorker;
+
+typedef enum
+{
+    LB_REQ_NONE,
+    LB_REQ_GET_STATS,
+    LB_REQ_RESET_STATS,
+    LB_REQ_IOCTL,
+} LbRequestType;
+
+typedef struct
+{
+    LbRequestType type;
+    DAQ_IoctlCmd cmd;
+    void *arg;
+    size_t arglen;
+    int rval;
+} LbRequest;
+
+/*
+ * The hub is shared by every instance configured with the same input.  The wrapped module of the
+ * first instance is the only one that is started, and it is driven exclusively by the dispatcher
+ * thread; anything else that needs to reach it while the dispatcher is running is handed to the
+ * dispatcher as a request.
+ */
+typedef struct _lb_hub
+{
+    struct _lb_hub *next;
+    char *input;
+    unsigned refcnt;
+
+    LbWorker *workers;
+    unsigned num_workers;
+    unsigned ring_size;
+    unsigned burst;
+    int dlt;
+    bool dlt_known;
+
+    DAQ_InstanceAPI_t subapi;
+    bool have_owner;
+    unsigned active_workers;
+
+    pthread_t dispatcher;
+    bool dispatching;
+
+    /* Protects the request and the fields above; the dispatcher sleeps on 'cond' */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_cond_t req_cond;
+    LbRequest req;
+    bool dispatcher_sleeping;
+    bool exit;
+    bool eof;
+    bool error;
+
+    /* Dispatcher counters */
+    uint64_t receive_calls;
+    uint64_t received;
+    uint64_t nobuf_waits;
+    uint64_t ring_full_waits;
+    uint64_t orphaned;
+} LbHub;
+
+typedef struct
+{
+    DAQ_ModuleInstance_h modinst;
+    DAQ_InstanceAPI_t subapi;
+
+    LbHub *hub;
+    LbWorker *worker;
+    unsigned worker_id;
+    bool owner;
+    bool started;
+    unsigned timeout;
+    volatile bool interrupted;
+
+    unsigned held;
+    DAQ_Stats_t stats;
+} LbContext;
+
+static DAQ_VariableDesc_t lb_variable_descriptions[] = {
+    { "burst", "Maximum number of messages to receive from the wrapped module at a time (default: 64)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+};
+
+static DAQ_BaseAPI_t daq_base_api;
+static pthread_mutex_t lb_hubs_lock = PTHREAD_MUTEX_INITIALIZER;
+static LbHub *lb_hubs;
+
+
+//-------------------------------------------------------------------------
+// Dispatcher thread
+//-------------------------------------------------------------------------
+
+static inline void lb_wake_worker(LbWorker *worker)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&worker->sleeping, __ATOMIC_SEQ_CST))
+    {
+        pthread_mutex_lock(&worker->lock);
+        pthread_cond_signal(&worker->cond);
+        pthread_mutex_unlock(&worker->lock);
+    }
+}
+
+static inline void lb_wake_dispatcher(LbHub *hub)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&hub->dispatcher_sleeping, __ATOMIC_SEQ_CST))
+    {
+        pthread_mutex_lock(&hub->lock);
+        pthread_cond_signal(&hub->cond);
+        pthread_mutex_unlock(&hub->lock);
+    }
+}
+
+/* Hand every verdict the workers have returned to the wrapped module. */
+static unsigned lb_return_verdicts(LbHub *hub)
+{
+    unsigned count = 0;
+
+    for (unsigned i = 0; i < hub->num_workers; i++)
+    {
+        LbWorker *worker = &hub->workers[i];
+        unsigned head = __atomic_load_n(&worker->verdict_head, __ATOMIC_ACQUIRE);
+        unsigned tail = worker->verdict_tail;
+        while (tail != head)
+        {
+            LbVerdict *v = &worker->verdicts[tail & worker->mask];
+            CALL_SUBAPI(hub, msg_finalize, v->msg, v->verdict);
+            tail++;
+            count++;
+        }
+        __atomic_store_n(&worker->verdict_tail, tail, __ATOMIC_RELEASE);
+    }
+
+    return count;
+}
+
+/* Pass the messages waiting on a worker that will never get to them.  Once a worker has been
+    stopped, the dispatcher takes over as the consumer of its message ring. */
+static void lb_pass_orphans(LbHub *hub, LbWorker *worker)
+{
+    unsigned head = worker->msg_head;
+    unsigned tail = __atomic_load_n(&worker->msg_tail, __ATOMIC_ACQUIRE);
+    while (tail != head)
+    {
+        CALL_SUBAPI(hub, msg_finalize, worker->msgs[tail & worker->mask], DAQ_VERDICT_PASS);
+        tail++;
+        hub->orphaned++;
+    }
+    __atomic_store_n(&worker->msg_tail, tail, __ATOMIC_RELEASE);
+}
+
+static void lb_wait_for_verdicts(LbHub *hub)
+{
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    struct timespec deadline;
+    deadline.tv_sec = now.tv_sec;
+    deadline.tv_nsec = (now.tv_usec + LB_IDLE_WAIT_US) * 1000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&hub->lock);
+    __atomic_store_n(&hub->dispatcher_sleeping, true, __ATOMIC_SEQ_CST);
+    bool pending = false;
+    for (unsigned i = 0; i < hub->num_workers && !pending; i++)
+    {
+        LbWorker *worker = &hub->workers[i];
+        pending = __atomic_load_n(&worker->verdict_head, __ATOMIC_SEQ_CST) != worker->verdict_tail;
+    }
+    if (!pending && !hub->exit && hub->req.type == LB_REQ_NONE)
+        pthread_cond_timedwait(&hub->cond, &hub->lock, &deadline);
+    __atomic_store_n(&hub->dispatcher_sleeping, false, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&hub->lock);
+}
+
+static void lb_perform_request(LbHub *hub, LbRequest *req)
+{
+    switch (req->type)
+    {
+        case LB_REQ_GET_STATS:
+            req->rval = CHECK_SUBAPI(hub, get_stats) ? CALL_SUBAPI(hub, get_stats, (DAQ_Stats_t *) req->arg) : DAQ_ERROR_NOTSUP;
+            break;
+        case LB_REQ_RESET_STATS:
+            if (CHECK_SUBAPI(hub, reset_stats))
+                CALL_SUBAPI_NOARGS(hub, reset_stats);
+            req->rval = DAQ_SUCCESS;
+            break;
+        case LB_REQ_IOCTL:
+            req->rval = CHECK_SUBAPI(hub, ioctl) ? CALL_SUBAPI(hub, ioctl, req->cmd, req->arg, req->arglen) : DAQ_ERROR_NOTSUP;
+            break;
+        default:
+            req->rval = DAQ_ERROR;
+            break;
+    }
+}
+
+static void lb_service_request(LbHub *hub)
+{
+    pthread_mutex_lock(&hub->lock);
+    if (hub->req.type != LB_REQ_NONE)
+    {
+        lb_perform_request(hub, &hub->req);
+        hub->req.type = LB_REQ_NONE;
+        pthread_cond_broadcast(&hub->req_cond);
+    }
+    pthread_mutex_unlock(&hub->lock);
+}
+
+static bool lb_dispatch(LbHub *hub, const DAQ_Msg_t *msg)
+{
+    uint32_t hash = util_flow_hash_msg(msg, hub->dlt);
+    LbWorker *worker = &hub->workers[((uint64_t) hash * hub->num_workers) >> 32];
+
+    while (true)
+    {
+        if (__atomic_load_n(&worker->stopped, __ATOMIC_ACQUIRE))
+        {
+            CALL_SUBAPI(hub, msg_finalize, msg, DAQ_VERDICT_PASS);
+            hub->orphaned++;
+            return true;
+        }
+
+        unsigned head = worker->msg_head;
+        if (head - __atomic_load_n(&worker->msg_tail, __ATOMIC_ACQUIRE) < hub->ring_size)
+        {
+            worker->msgs[head & worker->mask] = msg;
+            __atomic_store_n(&worker->msg_head, head + 1, __ATOMIC_RELEASE);
+            worker->dispatched++;
+            return true;
+        }
+
+        /* Only possible when the wrapped module's pool size is unknown; make progress on the
+            verdicts while waiting for the worker to catch up. */
+        hub->ring_full_waits++;
+        lb_wake_worker(worker);
+        if (lb_return_verdicts(hub) == 0)
+        {
+            if (__atomic_load_n(&hub->exit, __ATOMIC_ACQUIRE))
+                return false;
+            lb_wait_for_verdicts(hub);
+        }
+    }
+}
+
+static void *lb_dispatcher_thread(void *arg)
+{
+    LbHub *hub = (LbHub *) arg;
+    const DAQ_Msg_t **msgs = calloc(hub->burst, sizeof(*msgs));
+
+    while (msgs && !__atomic_load_n(&hub->exit, __ATOMIC_ACQUIRE))
+    {
+        unsigned returned = lb_return_verdicts(hub);
+
+        if (__atomic_load_n(&hub->req.type, __ATOMIC_ACQUIRE) != LB_REQ_NONE)
+            lb_service_request(hub);
+
+        for (unsigned i = 0; i < hub->num_workers; i++)
+        {
+            if (__atomic_load_n(&hub->workers[i].stopped, __ATOMIC_ACQUIRE))
+                lb_pass_orphans(hub, &hub->workers[i]);
+        }
+
+        if (hub->eof || hub->error)
+        {
+            if (returned == 0)
+                lb_wait_for_verdicts(hub);
+            continue;
+        }
+
+        DAQ_RecvStatus rstat;
+        unsigned num_recv = CALL_SUBAPI(hub, msg_receive, hub->burst, msgs, &rstat);
+        hub->receive_calls++;
+        hub->received += num_recv;
+
+        for (unsigned i = 0; i < num_recv; i++)
+        {
+            if (!lb_dispatch(hub, msgs[i]))
+            {
+                /* Shutting down with nowhere to put the rest */
+                for (; i < num_recv; i++)
+                    CALL_SUBAPI(hub, msg_finalize, msgs[i], DAQ_VERDICT_PASS);
+                break;
+            }
+        }
+        if (num_recv > 0)
+        {
+            for (unsigned i = 0; i < hub->num_workers; i++)
+                lb_wake_worker(&hub->workers[i]);
+        }
+
+        switch (rstat)
+        {
+            case DAQ_RSTAT_EOF:
+                __atomic_store_n(&hub->eof, true, __ATOMIC_RELEASE);
+                for (unsigned i = 0; i < hub->num_workers; i++)
+                    lb_wake_worker(&hub->workers[i]);
+                break;
+
+            case DAQ_RSTAT_ERROR:
+            case DAQ_RSTAT_INVALID:
+                __atomic_store_n(&hub->error, true, __ATOMIC_RELEASE);
+                for (unsigned i = 0; i < hub->num_workers; i++)
+                    lb_wake_worker(&hub->workers[i]);
+                break;
+
+            case DAQ_RSTAT_NOBUF:
+                /* Everything is held by the workers; wait for some of it to come back. */
+                if (num_recv == 0 && lb_return_verdicts(hub) == 0)
+                {
+                    hub->nobuf_waits++;
+                    lb_wait_for_verdicts(hub);
+                }
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    /* Every worker has stopped by now; give back whatever is left. */
+    lb_return_verdicts(hub);
+    for (unsigned i = 0; i < hub->num_workers; i++)
+        lb_pass_orphans(hub, &hub->workers[i]);
+    if (!msgs)
+        __atomic_store_n(&hub->error, true, __ATOMIC_RELEASE);
+    free(msgs);
+
+    return NULL;
+}
+
+/* Run a request against the wrapped module, on the dispatcher thread if it is running. */
+static int lb_hub_request(LbHub *hub, LbRequestType type, DAQ_IoctlCmd cmd, void *arg, size_t arglen)
+{
+    LbRequest req = { type, cmd, arg, arglen, DAQ_SUCCESS };
+
+    pthread_mutex_lock(&hub->lock);
+    if (!hub->have_owner)
+        req.rval = DAQ_ERROR_NOTSUP;
+    else if (!hub->dispatching)
+        lb_perform_request(hub, &req);
+    else
+    {
+        while (hub->req.type != LB_REQ_NONE)
+            pthread_cond_wait(&hub->req_cond, &hub->lock);
+        hub->req = req;
+        __atomic_store_n(&hub->req.type, type, __ATOMIC_RELEASE);
+        pthread_cond_signal(&hub->cond);
+        while (hub->req.type != LB_REQ_NONE)
+            pthread_cond_wait(&hub->req_cond, &hub->lock);
+        req.rval = hub->req.rval;
+    }
+    pthread_mutex_unlock(&hub->lock);
+
+    return req.rval;
+}
+
+/* Stop the dispatcher and the wrapped module it drives.  Called with the hub lock held. */
+static int lb_hub_shutdown(LbHub *hub)
+{
+    if (!hub->dispatching)
+        return DAQ_SUCCESS;
+
+    __atomic_store_n(&hub->exit, true, __ATOMIC_RELEASE);
+    pthread_cond_signal(&hub->cond);
+    /* Let the dispatcher finish up (including any request in progress) without the lock. */
+    pthread_mutex_unlock(&hub->lock);
+    pthread_join(hub->dispatcher, NULL);
+    pthread_mutex_lock(&hub->lock);
+    hub->dispatching = false;
+    pthread_cond_broadcast(&hub->req_cond);
+
+    return CALL_SUBAPI_NOARGS(hub, stop);
+}
+
+
+//-------------------------------------------------------------------------
+// Hub management
+//-------------------------------------------------------------------------
+
+static void lb_hub_free(LbHub *hub)
+{
+    if (hub->workers)
+    {
+        for (unsigned i = 0; i < hub->num_workers; i++)
+        {
+            LbWorker *worker = &hub->workers[i];
+            free(worker->msgs);
+            free(worker->verdicts);
+            pthread_mutex_destroy(&worker->lock);
+            pthread_cond_destroy(&worker->cond);
+        }
+        free(hub->workers);
+    }
+    pthread_mutex_destroy(&hub->lock);
+    pthread_cond_destroy(&hub->cond);
+    pthread_cond_destroy(&hub->req_cond);
+    free(hub->input);
+    free(hub);
+}
+
+static LbHub *lb_hub_create(LbContext *lc, const char *input, unsigned num_workers, unsigned burst)
+{
+    LbHub *hub = calloc(1, sizeof(*hub));
+    if (!hub)
+    {
+        SET_ERROR(lc->modinst, "%s: Couldn't allocate memory for the shared context", __func__);
+        return NULL;
+    }
+    pthread_mutex_init(&hub->lock, NULL);
+    pthread_cond_init(&hub->cond, NULL);
+    pthread_cond_init(&hub->req_cond, NULL);
+    hub->num_workers = num_workers;
+    hub->burst = burst;
+
+    hub->input = strdup(input);
+    hub->workers = calloc(num_workers, sizeof(LbWorker));
+    if (!hub->input || !hub->workers)
+    {
+        SET_ERROR(lc->modinst, "%s: Couldn't allocate memory for the shared context", __func__);
+        lb_hub_free(hub);
+        return NULL;
+    }
+
+    /* Every instance wraps an identically configured module, so this instance's can be asked about
+        the message pool size that the first instance's will have. */
+    DAQ_MsgPoolInfo_t mpool_info;
+    unsigned ring_size = LB_DEFAULT_RING_SIZE;
+    if (CHECK_SUBAPI(lc, get_msg_pool_info) && CALL_SUBAPI(lc, get_msg_pool_info, &mpool_info) == DAQ_SUCCESS &&
+            mpool_info.size > 0)
+    {
+        ring_size = 1;
+        while (ring_size < mpool_info.size)
+            ring_size <<= 1;
+    }
+    hub->ring_size = ring_size;
+
+    for (unsigned i = 0; i < num_workers; i++)
+    {
+        LbWorker *worker = &hub->workers[i];
+        pthread_mutex_init(&worker->lock, NULL);
+        pthread_cond_init(&worker->cond, NULL);
+        worker->mask = ring_size - 1;
+        worker->msgs = calloc(ring_size, sizeof(*worker->msgs));
+        worker->verdicts = calloc(ring_size, sizeof(*worker->verdicts));
+        if (!worker->msgs || !worker->verdicts)
+        {
+            SET_ERROR(lc->modinst, "%s: Couldn't allocate rings of %u entries for %u workers",
+                    __func__, ring_size, num_workers);
+            lb_hub_free(hub);
+            return NULL;
+        }
+    }
+
+    return hub;
+}
+
+static int lb_attach(LbContext *lc, const char *input, unsigned num_workers, unsigned burst)
+{
+    int rval = DAQ_SUCCESS;
+
+    pthread_mutex_lock(&lb_hubs_lock);
+    LbHub *hub;
+    for (hub = lb_hubs; hub; hub = hub->next)
+    {
+        if (!strcmp(hub->input, input))
+            break;
+    }
+    if (!hub)
+    {
+        hub = lb_hub_create(lc, input, num_workers, burst);
+        if (!hub)
+        {
+            rval = DAQ_ERROR_NOMEM;
+            goto out;
+        }
+        hub->next = lb_hubs;
+        lb_hubs = hub;
+    }
+    else if (hub->num_workers != num_workers)
+    {
+        SET_ERROR(lc->modinst, "%s: Instance count (%u) doesn't match the other instances on '%s' (%u)",
+                __func__, num_workers, input, hub->num_workers);
+        rval = DAQ_ERROR_INVAL;
+        goto out;
+    }
+
+    LbWorker *worker = &hub->workers[lc->worker_id];
+    if (worker->attached)
+    {
+        SET_ERROR(lc->modinst, "%s: Instance %u on '%s' already exists", __func__, lc->worker_id + 1, input);
+        rval = DAQ_ERROR_INVAL;
+        goto out;
+    }
+    worker->attached = true;
+    hub->refcnt++;
+
+    if (lc->owner)
+    {
+        pthread_mutex_lock(&hub->lock);
+        hub->subapi = lc->subapi;
+        hub->have_owner = true;
+        pthread_mutex_unlock(&hub->lock);
+    }
+
+    lc->hub = hub;
+    lc->worker = worker;
+
+out:
+    pthread_mutex_unlock(&lb_hubs_lock);
+    return rval;
+}
+
+static void lb_detach(LbContext *lc)
+{
+    LbHub *hub = lc->hub;
+
+    pthread_mutex_lock(&lb_hubs_lock);
+    pthread_mutex_lock(&hub->lock);
+    if (lc->owner)
+    {
+        /* The wrapped module is about to go away along with this instance. */
+        if (hub->dispatching)
+        {
+            lb_hub_shutdown(hub);
+            __atomic_store_n(&hub->error, true, __ATOMIC_RELEASE);
+            for (unsigned i = 0; i < hub->num_workers; i++)
+                lb_wake_worker(&hub->workers[i]);
+        }
+        hub->have_owner = false;
+        pthread_cond_broadcast(&hub->req_cond);
+    }
+    __atomic_store_n(&lc->worker->stopped, true, __ATOMIC_RELEASE);
+    lc->worker->attached = false;
+    pthread_mutex_unlock(&hub->lock);
+
+    if (--hub->refcnt == 0)
+    {
+        LbHub **prev;
+        for (prev = &lb_hubs; *prev != hub; prev = &(*prev)->next);
+        *prev = hub->next;
+        lb_hub_free(hub);
+    }
+    pthread_mutex_unlock(&lb_hubs_lock);
+
+    lc->hub = NULL;
+    lc->worker = NULL;
+}
+
+
+//-------------------------------------------------------------------------
+// Worker
+//-------------------------------------------------------------------------
+
+static inline unsigned lb_pop_msgs(LbWorker *worker, const DAQ_Msg_t *msgs[], unsigned max_recv)
+{
+    unsigned head = __atomic_load_n(&worker->msg_head, __ATOMIC_ACQUIRE);
+    unsigned tail = worker->msg_tail;
+    unsigned count = 0;
+    while (tail != head && count < max_recv)
+        msgs[count++] = worker->msgs[tail++ & worker->mask];
+    if (count)
+        __atomic_store_n(&worker->msg_tail, tail, __ATOMIC_RELEASE);
+    return count;
+}
+
+static bool lb_wait_for_msgs(LbContext *lc, const struct timespec *deadline)
+{
+    LbWorker *worker = lc->worker;
+    LbHub *hub = lc->hub;
+    bool timed_out = false;
+
+    pthread_mutex_lock(&worker->lock);
+    __atomic_store_n(&worker->sleeping, true, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&worker->msg_head, __ATOMIC_SEQ_CST) == worker->msg_tail && !lc->interrupted &&
+            !__atomic_load_n(&hub->eof, __ATOMIC_ACQUIRE) && !__atomic_load_n(&hub->error, __ATOMIC_ACQUIRE))
+    {
+        if (deadline)
+            timed_out = (pthread_cond_timedwait(&worker->cond, &worker->lock, deadline) == ETIMEDOUT);
+        else
+            pthread_cond_wait(&worker->cond, &worker->lock);
+    }
+    __atomic_store_n(&worker->sleeping, false, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&worker->lock);
+
+    return timed_out;
+}
+
+static void lb_add_counter(DIOCTL_GetModuleCounters *gmc, const char *name, uint64_t value)
+{
+    if (gmc->num_counters >= gmc->max_counters)
+        return;
+
+    DAQ_ModuleCounter_t *counter = &gmc->counters[gmc->num_counters++];
+    counter->module = "lb";
+    counter->name = name;
+    counter->value = value;
+}
+
+
+//-------------------------------------------------------------------------
+// DAQ Module API
+//-------------------------------------------------------------------------
+
+static int lb_daq_module_load(const DAQ_BaseAPI_t *base_api)
+{
+    if (base_api->api_version != DAQ_BASE_API_VERSION || base_api->api_size != sizeof(DAQ_BaseAPI_t))
+        return DAQ_ERROR;
+
+    daq_base_api = *base_api;
+
+    return DAQ_SUCCESS;
+}
+
+static int lb_daq_module_unload(void)
+{
+    memset(&daq_base_api, 0, sizeof(daq_base_api));
+    return DAQ_SUCCESS;
+}
+
+static int lb_daq_get_variable_descs(const DAQ_VariableDesc_t **var_desc_table)
+{
+    *var_desc_table = lb_variable_descriptions;
+
+    return sizeof(lb_variable_descriptions) / sizeof(DAQ_VariableDesc_t);
+}
+
+static int lb_daq_instantiate(const DAQ_ModuleConfig_h modcfg, DAQ_ModuleInstance_h modinst, void **ctxt_ptr)
+{
+    unsigned total_instances = daq_base_api.config_get_total_instances(modcfg);
+    unsigned instance_id = daq_base_api.config_get_instance_id(modcfg);
+    if (total_instances > 1 && instance_id == 0)
+    {
+        SET_ERROR(modinst, "%s: Instance ID required for multi-instance (%u instances expected)", __func__, total_instances);
+        return DAQ_ERROR_INVAL;
+    }
+
+    LbContext *lc = calloc(1, sizeof(LbContext));
+    if (!lc)
+    {
+        SET_ERROR(modinst, "%s: Couldn't allocate memory for the DAQ context", __func__);
+        return DAQ_ERROR_NOMEM;
+    }
+    lc->modinst = modinst;
+
+    int rval = DAQ_ERROR_INVAL;
+
+    if (daq_base_api.resolve_subapi(modinst, &lc->subapi) != DAQ_SUCCESS)
+    {
+        SET_ERROR(modinst, "%s: Couldn't resolve subapi. No submodule configured?", __func__);
+        goto fail;
+    }
+
+    unsigned long burst = LB_DEFAULT_BURST;
+    const char *varKey, *varValue;
+    daq_base_api.config_first_variable(modcfg, &varKey, &varValue);
+    while (varKey)
+    {
+        if (!strcmp(varKey, "burst"))
+        {
+            if (util_parse_uint(varValue, &burst) != 0 || burst == 0 || burst > LB_MAX_BURST)
+            {
+                SET_ERROR(modinst, "%s: Invalid value for key '%s': '%s'", __func__, varKey, varValue);
+                goto fail;
+            }
+        }
+        daq_base_api.config_next_variable(modcfg, &varKey, &varValue);
+    }
+
+    unsigned num_workers = total_instances ? total_instances : 1;
+    lc->worker_id = instance_id ? instance_id - 1 : 0;
+    lc->owner = (lc->worker_id == 0);
+    lc->timeout = daq_base_api.config_get_timeout(modcfg);
+
+    /* Verdicts only go back to the wrapped module between its receive calls, so inline, a module
+        that could block forever would hold on to packets that are waiting to be forwarded. */
+    if (daq_base_api.config_get_mode(modcfg) == DAQ_MODE_INLINE && lc->timeout == 0)
+    {
+        SET_ERROR(modinst, "%s: A receive timeout is required in inline mode", __func__);
+        goto fail;
+    }
+
+    const char *input = daq_base_api.config_get_input(modcfg);
+    if ((rval = lb_attach(lc, input ? input : "", num_workers, burst)) != DAQ_SUCCESS)
+        goto fail;
+
+    *ctxt_ptr = lc;
+
+    return DAQ_SUCCESS;
+
+fail:
+    free(lc);
+    return rval;
+}
+
+static void lb_daq_destroy(void *handle)
+{
+    LbContext *lc = (LbContext *) handle;
+
+    if (lc->hub)
+        lb_detach(lc);
+    free(lc);
+}
+
+static int lb_daq_set_filter(void *handle, const char *filter)
+{
+    LbContext *lc = (LbContext *) handle;
+
+    if (!CHECK_SUBAPI(lc, set_filter))
+        return DAQ_ERROR_NOTSUP;
+
+    /* Only the first instance's wrapped module sees any traffic, but the filter is checked against
+        each instance's so that errors are reported consistently. */
+    if (lc->owner && lc->hub->dispatching)
+    {
+        SET_ERROR(lc->modinst, "%s: The filter can't be changed while packets are being dispatched", __func__);
+        return DAQ_ERROR;
+    }
+
+    return CALL_SUBAPI(lc, set_filter, filter);
+}
+
+static int lb_daq_start(void *handle)
+{
+    LbContext *lc = (LbContext *) handle;
+    LbHub *hub = lc->hub;
+    int rval = DAQ_SUCCESS;
+
+    pthread_mutex_lock(&hub->lock);
+    if (lc->owner)
+    {
+        rval = CALL_SUBAPI_NOARGS(lc, start);
+        if (rval == DAQ_SUCCESS)
+        {
+            /* Some modules (like savefile) only know their datalink type once started. */
+            hub->dlt = CHECK_SUBAPI(lc, get_datalink_type) ? CALL_SUBAPI_NOARGS(lc, get_datalink_type) : DLT_EN10MB;
+            hub->dlt_known = true;
+            hub->exit = false;
+            if ((rval = pthread_create(&hub->dispatcher, NULL, lb_dispatcher_thread, hub)) != 0)
+            {
+                SET_ERROR(lc->modinst, "%s: Couldn't create the dispatcher thread: %s (%d)",
+                        __func__, strerror(rval), rval);
+                CALL_SUBAPI_NOARGS(lc, stop);
+                rval = DAQ_ERROR;
+            }
+            else
+                hub->dispatching = true;
+        }
+    }
+    if (rval == DAQ_SUCCESS)
+    {
+        hub->active_workers++;
+        lc->started = true;
+    }
+    pthread_mutex_unlock(&hub->lock);
+
+    return rval;
+}
+
+static int lb_daq_inject(void *handle, DAQ_MsgType type, const void *hdr, const uint8_t *data, uint32_t data_len)
+{
+    return DAQ_ERROR_NOTSUP;
+}
+
+static int lb_daq_inject_relative(void *handle, const DAQ_Msg_t *msg, const uint8_t *data, uint32_t data_len, int reverse)
+{
+    return DAQ_ERROR_NOTSUP;
+}
+
+static int lb_daq_interrupt(void *handle)
+{
+    LbContext *lc = (LbContext *) handle;
+
+    lc->interrupted = true;
+    pthread_mutex_lock(&lc->worker->lock);
+    pthread_cond_signal(&lc->worker->cond);
+    pthread_mutex_unlock(&lc->worker->lock);
+
+    return DAQ_SUCCESS;
+}
+
+static int lb_daq_stop(void *handle)
+{
+    LbContext *lc = (LbContext *) handle;
+    LbHub *hub = lc->hub;
+    int rval = DAQ_SUCCESS;
+
+    if (!lc->started)
+        return DAQ_SUCCESS;
+
+    /* From here on, the dispatcher passes anything it has for this worker. */
+    __atomic_store_n(&lc->worker->stopped, true, __ATOMIC_RELEASE);
+    lc->started = false;
+
+    /* The last worker to stop takes the wrapped module down with it. */
+    pthread_mutex_lock(&hub->lock);
+    if (--hub->active_workers == 0)
+        rval = lb_hub_shutdown(hub);
+    pthread_mutex_unlock(&hub->lock);
+
+    return rval;
+}
+
+static int lb_daq_ioctl(void *handle, DAQ_IoctlCmd cmd, void *arg, size_t arglen)
+{
+    LbContext *lc = (LbContext *) handle;
+    LbHub *hub = lc->hub;
+
+    /* Only the module counters are supported.  Anything else would have to take a round trip
+        through the dispatcher thread, which is no place for a per-packet operation. */
+    if (cmd != DIOCTL_GET_MODULE_COUNTERS)
+        return DAQ_ERROR_NOTSUP;
+
+    if (arglen != sizeof(DIOCTL_GetModuleCounters))
+        return DAQ_ERROR_INVAL;
+    DIOCTL_GetModuleCounters *gmc = (DIOCTL_GetModuleCounters *) arg;
+    if (!gmc->counters && gmc->max_counters > 0)
+        return DAQ_ERROR_INVAL;
+
+    lb_add_counter(gmc, "delivered", lc->stats.packets_received);
+    lb_add_counter(gmc, "dispatched", __atomic_load_n(&lc->worker->dispatched, __ATOMIC_RELAXED));
+    if (!lc->owner)
+        return DAQ_SUCCESS;
+
+    /* The dispatcher's counters and the wrapped module's are reported by the first instance only. */
+    lb_add_counter(gmc, "receive_calls", __atomic_load_n(&hub->receive_calls, __ATOMIC_RELAXED));
+    lb_add_counter(gmc, "received", __atomic_load_n(&hub->received, __ATOMIC_RELAXED));
+    lb_add_counter(gmc, "nobuf_waits", __atomic_load_n(&hub->nobuf_waits, __ATOMIC_RELAXED));
+    lb_add_counter(gmc, "ring_full_waits", __atomic_load_n(&hub->ring_full_waits, __ATOMIC_RELAXED));
+    lb_add_counter(gmc, "orphaned", __atomic_load_n(&hub->orphaned, __ATOMIC_RELAXED));
+    int rval = lb_hub_request(hub, LB_REQ_IOCTL, cmd, arg, arglen);
+    return (rval == DAQ_ERROR_NOTSUP) ? DAQ_SUCCESS : rval;
+}
+
+static int lb_daq_get_stats(void *handle, DAQ_Stats_t *stats)
+{
+    LbContext *lc = (LbContext *) handle;
+
+    /* The wrapped module's own counters (hardware received/dropped and filtered) are reported by the
+        first instance only so that they add up across instances. */
+    memset(stats, 0, sizeof(*stats));
+    if (lc->owner)
+    {
+        DAQ_Stats_t sub_stats;
+        if (lb_hub_request(lc->hub, LB_REQ_GET_STATS, 0, &sub_stats, sizeof(sub_stats)) == DAQ_SUCCESS)
+        {
+            stats->hw_packets_received = sub_stats.hw_packets_received;
+            stats->hw_packets_dropped = sub_stats.hw_packets_dropped;
+            stats->packets_filtered = sub_stats.packets_filtered;
+        }
+    }
+    stats->packets_received = lc->stats.packets_received;
+    for (int i = 0; i < MAX_DAQ_VERDICT; i++)
+        stats->verdicts[i] = lc->stats.verdicts[i];
+
+    return DAQ_SUCCESS;
+}
+
+static void lb_daq_reset_stats(void *handle)
+{
+    LbContext *lc = (LbContext *) handle;
+
+    if (lc->owner)
+        lb_hub_request(lc->hub, LB_REQ_RESET_STATS, 0, NULL, 0);
+    memset(&lc->stats, 0, sizeof(lc->stats));
+}
+
+static uint32_t lb_daq_get_capabilities(void *handle)
+{
+    LbContext *lc = (LbContext *) handle;
+    uint32_t caps = CHECK_SUBAPI(lc, get_capabilities) ? CALL_SUBAPI_NOARGS(lc, get_capabilities) : 0;
+    caps &= ~(DAQ_CAPA_INJECT | DAQ_CAPA_INJECT_RAW);
+    caps |= DAQ_CAPA_INTERRUPT;
+    return caps;
+}
+
+DAQ_STACK_LINKAGE unsigned lb_daq_msg_receive(void *handle, const unsigned max_recv, const DAQ_Msg_t *msgs[], DAQ_RecvStatus *rstat)
+{
+    LbContext *lc = (LbContext *) handle;
+    LbHub *hub = lc->hub;
+    struct timespec deadline, *deadline_ptr = NULL;
+
+    while (true)
+    {
+        unsigned count = lb_pop_msgs(lc->worker, msgs, max_recv);
+        if (count > 0)
+        {
+            for (unsigned i = 0; i < count; i++)
+            {
+                if (msgs[i]->type == DAQ_MSG_TYPE_PACKET)
+                    lc->stats.packets_received++;
+            }
+            lc->held += count;
+            *rstat = DAQ_RSTAT_OK;
+            return count;
+        }
+
+        if (lc->interrupted)
+        {
+            lc->interrupted = false;
+            *rstat = DAQ_RSTAT_INTERRUPTED;
+            return 0;
+        }
+
+        /* Check the ring once more after seeing the end so that nothing dispatched before it is missed. */
+        if (__atomic_load_n(&hub->error, __ATOMIC_ACQUIRE))
+        {
+            if (__atomic_load_n(&lc->worker->msg_head, __ATOMIC_ACQUIRE) != lc->worker->msg_tail)
+                continue;
+            SET_ERROR(lc->modinst, "%s: Receiving from the wrapped module failed", __func__);
+            *rstat = DAQ_RSTAT_ERROR;
+            return 0;
+        }
+        if (__atomic_load_n(&hub->eof, __ATOMIC_ACQUIRE))
+        {
+            if (__atomic_load_n(&lc->worker->msg_head, __ATOMIC_ACQUIRE) != lc->worker->msg_tail)
+                continue;
+            *rstat = DAQ_RSTAT_EOF;
+            return 0;
+        }
+
+        if (lc->timeout && !deadline_ptr)
+        {
+            struct timeval now;
+            gettimeofday(&now, NULL);
+            deadline.tv_sec = now.tv_sec + lc->timeout / 1000;
+            deadline.tv_nsec = (now.tv_usec + (lc->timeout % 1000) * 1000L) * 1000L;
+            if (deadline.tv_nsec >= 1000000000L)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            deadline_ptr = &deadline;
+        }
+        if (lb_wait_for_msgs(lc, deadline_ptr))
+        {
+            count = lb_pop_msgs(lc->worker, msgs, max_recv);
+            if (count > 0)
+            {
+                for (unsigned i = 0; i < count; i++)
+                {
+                    if (msgs[i]->type == DAQ_MSG_TYPE_PACKET)
+                        lc->stats.packets_received++;
+                }
+                lc->held += count;
+                *rstat = DAQ_RSTAT_OK;
+                return count;
+            }
+            *rstat = DAQ_RSTAT_TIMEOUT;
+            return 0;
+        }
+    }
+}
+
+DAQ_STACK_LINKAGE int lb_daq_msg_finalize(void *handle, const DAQ_Msg_t *msg, DAQ_Verdict verdict)
+{
+    LbContext *lc = (LbContext *) handle;
+    LbWorker *worker = lc->worker;
+    LbHub *hub = lc->hub;
+
+    if (verdict >= MAX_DAQ_VERDICT)
+        verdict = DAQ_VERDICT_PASS;
+    lc->stats.verdicts[verdict]++;
+
+    unsigned head = worker->verdict_head;
+    while (head - __atomic_load_n(&worker->verdict_tail, __ATOMIC_ACQUIRE) >= hub->ring_size)
+    {
+        /* Only possible when the wrapped module's pool size is unknown */
+        lb_wake_dispatcher(hub);
+        sched_yield();
+    }
+    LbVerdict *v = &worker->verdicts[head & worker->mask];
+    v->msg = msg;
+    v->verdict = verdict;
+    __atomic_store_n(&worker->verdict_head, head + 1, __ATOMIC_RELEASE);
+    if (lc->held > 0)
+        lc->held--;
+
+    lb_wake_dispatcher(hub);
+
+    return DAQ_SUCCESS;
+}
+
+static int lb_daq_get_datalink_type(void *handle)
+{
+    LbContext *lc = (LbContext *) handle;
+    LbHub *hub = lc->hub;
+
+    /* Every instance delivers what the first instance's wrapped module captures.  That is cached
+        once it has started; until then, its wrapped module is asked directly, since it isn't being
+        driven by the dispatcher yet. */
+    int dlt;
+    pthread_mutex_lock(&hub->lock);
+    if (hub->dlt_known)
+        dlt = hub->dlt;
+    else if (hub->have_owner)
+        dlt = CHECK_SUBAPI(hub, get_datalink_type) ? CALL_SUBAPI_NOARGS(hub, get_datalink_type) : DLT_EN10MB;
+    else
+        dlt = CHECK_SUBAPI(lc, get_datalink_type) ? CALL_SUBAPI_NOARGS(lc, get_datalink_type) : DLT_EN10MB;
+    pthread_mutex_unlock(&hub->lock);
+
+    return dlt;
+}
+
+static int lb_daq_get_msg_pool_info(void *handle, DAQ_MsgPoolInfo_t *info)
+{
+    LbContext *lc = (LbContext *) handle;
+
+    /* The pool is shared by all of the instances, so the best that can be said about what is still
+        available to this one is how much of it this one isn't holding. */
+    int rval = CHECK_SUBAPI(lc, get_msg_pool_info) ? CALL_SUBAPI(lc, get_msg_pool_info, info) : DAQ_ERROR_NOTSUP;
+    if (rval == DAQ_SUCCESS)
+        info->available = (info->size > lc->held) ? info->size - lc->held : 0;
+
+    return rval;
+}
+
+#ifdef BUILDING_SO
+DAQ_SO_PUBLIC DAQ_ModuleAPI_t DAQ_MODULE_DATA =
+#else
+DAQ_ModuleAPI_t lb_daq_module_data =
+#endif
+{
+    /* .api_version = */ DAQ_MODULE_API_VERSION,
+    /* .api_size = */ sizeof(DAQ_ModuleAPI_t),
+    /* .module_version = */ DAQ_LB_VERSION,
+    /* .name = */ "lb",
+    /* .type = */ DAQ_TYPE_WRAPPER | DAQ_TYPE_INLINE_CAPABLE | DAQ_TYPE_MULTI_INSTANCE,
+    /* .load = */ lb_daq_module_load,
+    /* .unload = */ lb_daq_module_unload,
+    /* .get_variable_descs = */ lb_daq_get_variable_descs,
+    /* .instantiate = */ lb_daq_instantiate,
+    /* .destroy = */ lb_daq_destroy,
+    /* .set_filter = */ lb_daq_set_filter,
+    /* .start = */ lb_daq_start,
+    /* .inject = */ lb_daq_inject,
+    /* .inject_relative = */ lb_daq_inject_relative,
+    /* .interrupt = */ lb_daq_interrupt,
+    /* .stop = */ lb_daq_stop,
+    /* .ioctl = */ lb_daq_ioctl,
+    /* .get_stats = */ lb_daq_get_stats,
+    /* .reset_stats = */ lb_daq_reset_stats,
+    /* .get_snaplen = */ NULL,
+    /* .get_capabilities = */ lb_daq_get_capabilities,
+    /* .get_datalink_type = */ lb_daq_get_datalink_type,
+    /* .config_load = */ NULL,
+    /* .config_swap = */ NULL,
+    /* .config_free = */ NULL,
+    /* .msg_receive = */ lb_daq_msg_receive,
+    /* .msg_finalize = */ lb_daq_msg_finalize,
+    /* .get_msg_pool_info = */ lb_daq_get_msg_pool_info,
+};
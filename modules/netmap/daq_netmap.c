@@ -843,7 +843,7 @@ static inline DAQ_RecvStatus wait_for_packet(Netmap_Context_t *nmc)
     return DAQ_RSTAT_TIMEOUT;
 }
 
-static unsigned netmap_daq_msg_receive(void *handle, const unsigned max_recv, const DAQ_Msg_t *msgs[], DAQ_RecvStatus *rstat)
+DAQ_STACK_LINKAGE unsigned netmap_daq_msg_receive(void *handle, const unsigned max_recv, const DAQ_Msg_t *msgs[], DAQ_RecvStatus *rstat)
 {
     Netmap_Context_t *nmc = (Netmap_Context_t *) handle;
     DAQ_RecvStatus status = DAQ_RSTAT_OK;
@@ -945,7 +945,7 @@ static const DAQ_Verdict verdict_translation_table[MAX_DAQ_VERDICT] = {
     DAQ_VERDICT_PASS        /* DAQ_VERDICT_IGNORE */
 };
 
-static int netmap_daq_msg_finalize(void *handle, const DAQ_Msg_t *msg, DAQ_Verdict verdict)
+DAQ_STACK_LINKAGE int netmap_daq_msg_finalize(void *handle, const DAQ_Msg_t *msg, DAQ_Verdict verdict)
 {
     Netmap_Context_t *nmc = (Netmap_Context_t *) handle;
     NetmapPktDesc *desc = (NetmapPktDesc *) msg->priv;
@@ -22,14 +22,21 @@
 #include "config.h"
 #endif
 
+#define _GNU_SOURCE // For recvmmsg()
+
 #include <arpa/inet.h>
 
+#include <endian.h>
 #include <errno.h>
+#include <limits.h>
 #include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
 #include <linux/netfilter/nfnetlink_queue.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/time.h>
+#include <time.h>
 
 #include <libmnl/libmnl.h>
 
@@ -38,13 +45,28 @@
 
 /* FIXIT-M Need to figure out how to reimplement inject for NFQ */
 
-#define DAQ_NFQ_VERSION 8
+#define DAQ_NFQ_VERSION 15
 
 #define NFQ_DEFAULT_POOL_SIZE   16
 #define DEFAULT_QUEUE_MAXLEN    1024   // Based on NFQNL_QMAX_DEFAULT from nfnetlnk_queue_core.c
+#define DEFAULT_VERDICT_BATCH   64
+#define DEFAULT_VERDICT_TIMEOUT 1000   // Microseconds
+#define NFQ_MAX_QUEUE_NUM       UINT16_MAX
+#define NFQ_PAYLOAD_IOVS        3      // Verdict buffer up to the payload, the payload, and its padding
+
+/* Worst case length of a verdict message carrying plen bytes of replacement payload.  The payload
+    itself is never copied into the verdict buffer, only its attribute header. */
+#define NFQ_VERDICT_MSG_LEN(plen) \
+    (MNL_NLMSG_HDRLEN + MNL_ALIGN(sizeof(struct nfgenmsg)) + \
+     MNL_ATTR_HDRLEN + MNL_ALIGN(sizeof(struct nfqnl_msg_verdict_hdr)) + \
+     MNL_ATTR_HDRLEN + MNL_ALIGN(plen))
+/* Length of the nested conntrack attribute carrying a mark and mask */
+#define NFQ_CT_MARK_ATTR_LEN    (MNL_ATTR_HDRLEN + 2 * (MNL_ATTR_HDRLEN + MNL_ALIGN(sizeof(uint32_t))))
 
 #define SET_ERROR(modinst, ...)    daq_base_api.set_errbuf(modinst, __VA_ARGS__)
 
+struct _nfq_queue;
+
 typedef struct _nfq_pkt_desc
 {
     DAQ_Msg_t msg;
@@ -52,9 +74,40 @@ typedef struct _nfq_pkt_desc
     uint8_t *nlmsg_buf;
     const struct nlmsghdr *nlmh;
     struct nfqnl_msg_packet_hdr *nlph;
+    struct _nfq_queue *queue;
+    DAQ_PktOffloadInfo_t offload;
+    DAQ_MsgMeta_t offload_meta;
+    DAQ_PktTimestamp_t ts;
+    DAQ_MsgMeta_t ts_meta;
+    /* Free list link, or outstanding list links while the application holds the packet */
+    struct _nfq_pkt_desc *prev;
     struct _nfq_pkt_desc *next;
 } NfqPktDesc;
 
+typedef struct _nfq_queue
+{
+    uint16_t num;
+    /* Packets received from this queue but not yet finalized, oldest (lowest packet ID) first */
+    NfqPktDesc *outstanding_head;
+    NfqPktDesc *outstanding_tail;
+    /* Open run of identical verdicts on the oldest outstanding packets */
+    unsigned run_count;
+    uint32_t run_last_id;
+    int run_verdict;
+    /* Statistics */
+    uint64_t packets_received;
+    uint64_t packets_accepted;
+    uint64_t packets_dropped;
+    char counter_names[3][32];
+} NfqQueue;
+
+typedef struct _nfq_ct_mark
+{
+    uint32_t value;
+    uint32_t mask;
+    bool enabled;
+} NfqCtMark;
+
 typedef struct _nfq_msg_pool
 {
     NfqPktDesc *pool;
@@ -65,28 +118,67 @@ typedef struct _nfq_msg_pool
 typedef struct _nfq_context
 {
     /* Configuration */
-    unsigned queue_num;
+    NfqQueue *queues;
+    unsigned num_queues;
     int snaplen;
     int timeout;
     unsigned queue_maxlen;
+    unsigned verdict_batch;
+    unsigned verdict_timeout;
+    NfqCtMark whitelist_mark;
+    NfqCtMark blacklist_mark;
     bool fail_open;
     bool debug;
     /* State */
     DAQ_ModuleInstance_h modinst;
     DAQ_Stats_t stats;
     NfqMsgPool pool;
+    /* Scratch space for receiving a datagram into each of up to a pool's worth of descriptors at once */
+    struct mmsghdr *recv_msgs;
+    struct iovec *recv_iovs;
+    struct sockaddr_nl *recv_addrs;
+    NfqPktDesc **recv_descs;
     char *nlmsg_buf;
     size_t nlmsg_bufsize;
     struct mnl_socket *nlsock;
     int nlsock_fd;
     unsigned portid;
     volatile bool interrupted;
+    /* Verdict messages waiting to be sent together.  Replacement payloads are sent from the packet
+        buffers they were received into, so the datagram is gathered from pieces of the verdict buffer
+        interleaved with those payloads. */
+    char *verdict_buf;
+    size_t verdict_buf_len;
+    size_t verdict_buf_gathered;
+    struct iovec *verdict_iovs;
+    unsigned verdict_iovcnt;
+    size_t verdict_payload_len;
+    size_t verdict_send_max;
+    unsigned verdicts_pending;
+    unsigned open_runs;
+    struct timespec pending_since;
+    /* Counters */
+    uint64_t verdict_sends;
+    uint64_t verdict_msgs;
+    uint64_t verdict_batches;
+    uint64_t verdicts_batched;
+    uint64_t recv_calls;
+    uint64_t whitelist_marked;
+    uint64_t blacklist_marked;
+    uint64_t gso_packets;
+    uint64_t csum_partial_packets;
+    uint64_t replace_truncated;
+    uint64_t replace_csum_fixed;
 } Nfq_Context_t;
 
 static DAQ_VariableDesc_t nfq_variable_descriptions[] = {
     { "debug", "Enable debugging output to stdout", DAQ_VAR_DESC_FORBIDS_ARGUMENT },
     { "fail_open", "Allow the kernel to bypass the netfilter queue when it is full", DAQ_VAR_DESC_FORBIDS_ARGUMENT },
     { "queue_maxlen", "Maximum queue length (default: 1024)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "verdict_batch", "Maximum number of verdicts to hold back and send together (default: 64, 1 disables batching)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "verdict_timeout", "Maximum number of microseconds to hold back verdicts (default: 1000)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "whitelist_mark", "Conntrack mark[/mask] to set on flows given a whitelist verdict", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "blacklist_mark", "Conntrack mark[/mask] to set on flows given a blacklist verdict", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
 };
 
 static const DAQ_Verdict verdict_translation_table[MAX_DAQ_VERDICT] = {
@@ -99,6 +191,8 @@ static const DAQ_Verdict verdict_translation_table[MAX_DAQ_VERDICT] = {
 };
 
 static DAQ_BaseAPI_t daq_base_api;
+static unsigned offload_meta_type;
+static unsigned timestamp_meta_type;
 
 
 /*
@@ -115,6 +209,14 @@ static void destroy_packet_pool(Nfq_Context_t *nfqc)
         free(pool->pool);
         pool->pool = NULL;
     }
+    free(nfqc->recv_msgs);
+    nfqc->recv_msgs = NULL;
+    free(nfqc->recv_iovs);
+    nfqc->recv_iovs = NULL;
+    free(nfqc->recv_addrs);
+    nfqc->recv_addrs = NULL;
+    free(nfqc->recv_descs);
+    nfqc->recv_descs = NULL;
     pool->freelist = NULL;
     pool->info.available = 0;
     pool->info.mem_size = 0;
@@ -131,6 +233,16 @@ static int create_packet_pool(Nfq_Context_t *nfqc, unsigned size)
         return DAQ_ERROR_NOMEM;
     }
     pool->info.mem_size = sizeof(NfqPktDesc) * size;
+    nfqc->recv_msgs = calloc(sizeof(struct mmsghdr), size);
+    nfqc->recv_iovs = calloc(sizeof(struct iovec), size);
+    nfqc->recv_addrs = calloc(sizeof(struct sockaddr_nl), size);
+    nfqc->recv_descs = calloc(sizeof(NfqPktDesc *), size);
+    if (!nfqc->recv_msgs || !nfqc->recv_iovs || !nfqc->recv_addrs || !nfqc->recv_descs)
+    {
+        SET_ERROR(nfqc->modinst, "%s: Could not allocate receive vectors for %u packet descriptors!",
+                __func__, size);
+        return DAQ_ERROR_NOMEM;
+    }
     while (pool->info.size < size)
     {
         /* Allocate netlink message receive buffer and set up descriptor */
@@ -156,6 +268,14 @@ static int create_packet_pool(Nfq_Context_t *nfqc, unsigned size)
         msg->hdr = &desc->pkthdr;
         msg->owner = nfqc->modinst;
         msg->priv = desc;
+        desc->ts_meta.data = &desc->ts;
+        desc->ts_meta.type = timestamp_meta_type;
+        msg->meta_ext = &desc->ts_meta;
+        desc->ts.source = DAQ_PKT_TS_SOURCE_SOFTWARE;
+        /* The offload info goes in front of the timestamp when there is any. */
+        desc->offload_meta.data = &desc->offload;
+        desc->offload_meta.type = offload_meta_type;
+        desc->offload_meta.next = &desc->ts_meta;
 
         /* Place it on the free list */
         desc->next = nfqc->pool.freelist;
@@ -208,7 +328,7 @@ static struct nlmsghdr *nfq_build_cfg_params(char *buf, uint8_t mode, int range,
     return nlh;
 }
 
-static struct nlmsghdr *nfq_build_verdict(char *buf, int id, int queue_num, int verd, uint32_t plen, uint8_t *pkt)
+static struct nlmsghdr *nfq_build_verdict(char *buf, int id, int queue_num, int verd)
 {
     struct nlmsghdr *nlh = nfq_hdr_put(buf, NFQNL_MSG_VERDICT, queue_num);
     struct nfqnl_msg_verdict_hdr vh = {
@@ -216,44 +336,479 @@ static struct nlmsghdr *nfq_build_verdict(char *buf, int id, int queue_num, int
         .id = htonl(id),
     };
     mnl_attr_put(nlh, NFQA_VERDICT_HDR, sizeof(vh), &vh);
-    if (plen)
-        mnl_attr_put(nlh, NFQA_PAYLOAD, plen, pkt);
 
     return nlh;
 }
 
-/* Oh, don't mind me; I'm just reimplementing all of mnl_socket_recvfrom so that I can pass in
-    a single flag to recvmsg (MSG_DONTWAIT). */
-static ssize_t nl_socket_recv(const Nfq_Context_t *nfqc, void *buf, size_t bufsiz, bool blocking)
+/* Have the kernel update the connection tracking mark of the packet's flow along with the verdict. */
+static void nfq_put_ct_mark(struct nlmsghdr *nlh, const NfqCtMark *ctmark)
 {
-    ssize_t ret;
-    struct sockaddr_nl addr;
-    struct iovec iov = {
-        .iov_base   = buf,
-        .iov_len    = bufsiz,
+    struct nlattr *nest = mnl_attr_nest_start(nlh, NFQA_CT);
+    mnl_attr_put_u32(nlh, CTA_MARK, htonl(ctmark->value));
+    mnl_attr_put_u32(nlh, CTA_MARK_MASK, htonl(ctmark->mask));
+    mnl_attr_nest_end(nlh, nest);
+}
+
+/* Batch verdicts apply to every packet still queued in the kernel with an ID up to and including
+    the given one. */
+static struct nlmsghdr *nfq_build_verdict_batch(char *buf, int id, int queue_num, int verd)
+{
+    struct nlmsghdr *nlh = nfq_hdr_put(buf, NFQNL_MSG_VERDICT_BATCH, queue_num);
+    struct nfqnl_msg_verdict_hdr vh = {
+        .verdict = htonl(verd),
+        .id = htonl(id),
     };
+    mnl_attr_put(nlh, NFQA_VERDICT_HDR, sizeof(vh), &vh);
+
+    return nlh;
+}
+
+static inline void nfq_outstanding_append(NfqQueue *queue, NfqPktDesc *desc)
+{
+    desc->next = NULL;
+    desc->prev = queue->outstanding_tail;
+    if (queue->outstanding_tail)
+        queue->outstanding_tail->next = desc;
+    else
+        queue->outstanding_head = desc;
+    queue->outstanding_tail = desc;
+}
+
+static inline void nfq_outstanding_remove(NfqQueue *queue, NfqPktDesc *desc)
+{
+    if (desc->prev)
+        desc->prev->next = desc->next;
+    else
+        queue->outstanding_head = desc->next;
+    if (desc->next)
+        desc->next->prev = desc->prev;
+    else
+        queue->outstanding_tail = desc->prev;
+    desc->prev = NULL;
+    desc->next = NULL;
+}
+
+/* Close a queue's open run of verdicts by appending a single verdict message covering all of it to
+    the send buffer.  Space for that message is always reserved while a run is open. */
+static void nfq_close_verdict_run(Nfq_Context_t *nfqc, NfqQueue *queue)
+{
+    if (queue->run_count == 0)
+        return;
+
+    char *buf = nfqc->verdict_buf + nfqc->verdict_buf_len;
+    struct nlmsghdr *nlh;
+    if (queue->run_count == 1)
+        nlh = nfq_build_verdict(buf, queue->run_last_id, queue->num, queue->run_verdict);
+    else
+    {
+        nlh = nfq_build_verdict_batch(buf, queue->run_last_id, queue->num, queue->run_verdict);
+        nfqc->verdict_batches++;
+        nfqc->verdicts_batched += queue->run_count;
+    }
+    nfqc->verdict_buf_len += MNL_ALIGN(nlh->nlmsg_len);
+    nfqc->verdict_msgs++;
+    nfqc->open_runs--;
+    queue->run_count = 0;
+}
+
+/* Add the part of the verdict buffer written since the last time to the send vector. */
+static inline void nfq_gather_verdict_buf(Nfq_Context_t *nfqc)
+{
+    if (nfqc->verdict_buf_len == nfqc->verdict_buf_gathered)
+        return;
+    struct iovec *iov = &nfqc->verdict_iovs[nfqc->verdict_iovcnt++];
+    iov->iov_base = nfqc->verdict_buf + nfqc->verdict_buf_gathered;
+    iov->iov_len = nfqc->verdict_buf_len - nfqc->verdict_buf_gathered;
+    nfqc->verdict_buf_gathered = nfqc->verdict_buf_len;
+}
+
+/* Send all pending verdict messages to the kernel in a single system call. */
+static int nfq_flush_verdicts(Nfq_Context_t *nfqc)
+{
+    for (unsigned i = 0; nfqc->open_runs > 0 && i < nfqc->num_queues; i++)
+        nfq_close_verdict_run(nfqc, &nfqc->queues[i]);
+    if (nfqc->verdict_buf_len == 0)
+        return DAQ_SUCCESS;
+
+    nfq_gather_verdict_buf(nfqc);
+    struct sockaddr_nl snl = { .nl_family = AF_NETLINK };
     struct msghdr msg = {
-        .msg_name   = &addr,
-        .msg_namelen    = sizeof(struct sockaddr_nl),
-        .msg_iov    = &iov,
-        .msg_iovlen = 1,
-        .msg_control    = NULL,
-        .msg_controllen = 0,
-        .msg_flags  = 0,
+        .msg_name = &snl,
+        .msg_namelen = sizeof(snl),
+        .msg_iov = nfqc->verdict_iovs,
+        .msg_iovlen = nfqc->verdict_iovcnt,
     };
-    ret = recvmsg(nfqc->nlsock_fd, &msg, blocking ? 0 : MSG_DONTWAIT);
+    ssize_t ret = sendmsg(nfqc->nlsock_fd, &msg, 0);
+    nfqc->verdict_buf_len = 0;
+    nfqc->verdict_buf_gathered = 0;
+    nfqc->verdict_iovcnt = 0;
+    nfqc->verdict_payload_len = 0;
+    nfqc->verdicts_pending = 0;
+    nfqc->verdict_sends++;
     if (ret == -1)
-        return ret;
+    {
+        SET_ERROR(nfqc->modinst, "%s: Couldn't send NFQ verdicts: %s (%d)",
+                __func__, strerror(errno), errno);
+        return DAQ_ERROR;
+    }
+
+    return DAQ_SUCCESS;
+}
+
+/* Make room in the send buffer for a message of the given length (not counting any replacement
+    payload, which takes up send vector entries and datagram space instead), keeping space in reserve
+    for closing the open runs. */
+static inline int nfq_reserve_verdict_space(Nfq_Context_t *nfqc, size_t len, uint32_t plen)
+{
+    len += nfqc->open_runs * NFQ_VERDICT_MSG_LEN(0);
+    if (nfqc->verdict_buf_len + len > nfqc->nlmsg_bufsize ||
+        nfqc->verdict_buf_len + nfqc->verdict_payload_len + len + MNL_ALIGN(plen) > nfqc->verdict_send_max ||
+        (plen && nfqc->verdict_iovcnt + NFQ_PAYLOAD_IOVS + 1 > IOV_MAX))
+        return nfq_flush_verdicts(nfqc);
+    return DAQ_SUCCESS;
+}
 
-    if (msg.msg_flags & MSG_TRUNC) {
-        errno = ENOSPC;
-        return -1;
+static inline void nfq_verdict_pending(Nfq_Context_t *nfqc)
+{
+    if (nfqc->verdicts_pending++ == 0 && nfqc->verdict_timeout)
+        clock_gettime(CLOCK_MONOTONIC, &nfqc->pending_since);
+}
+
+/*
+ * Queue a plain accept or drop verdict for the oldest outstanding packet from a queue.  Since every
+ * packet the kernel queued before it has already been given a verdict, it can extend the queue's open
+ * run of identical verdicts, which will be sent as a single batch verdict message.
+ */
+static int nfq_queue_run_verdict(Nfq_Context_t *nfqc, NfqQueue *queue, uint32_t id, int nfq_verdict)
+{
+    if (queue->run_count > 0 && queue->run_verdict != nfq_verdict)
+        nfq_close_verdict_run(nfqc, queue);
+    if (queue->run_count == 0)
+    {
+        if (nfq_reserve_verdict_space(nfqc, NFQ_VERDICT_MSG_LEN(0), 0) != DAQ_SUCCESS)
+            return DAQ_ERROR;
+        queue->run_verdict = nfq_verdict;
+        nfqc->open_runs++;
     }
-    if (msg.msg_namelen != sizeof(struct sockaddr_nl)) {
-        errno = EINVAL;
-        return -1;
+    queue->run_last_id = id;
+    queue->run_count++;
+    nfq_verdict_pending(nfqc);
+
+    return DAQ_SUCCESS;
+}
+
+/*
+ * Queue an individual verdict message (packets finalized out of order, carrying a new payload, or
+ * marking their flow).  A replacement payload is referenced in place rather than copied, so it must
+ * stay intact until the pending verdicts are sent, which always happens before the next receive.
+ */
+static int nfq_queue_verdict(Nfq_Context_t *nfqc, NfqQueue *queue, uint32_t id, int nfq_verdict,
+        uint32_t plen, uint8_t *pkt, const NfqCtMark *ctmark)
+{
+    size_t len = NFQ_VERDICT_MSG_LEN(0) + (ctmark ? NFQ_CT_MARK_ATTR_LEN : 0);
+    if (len + MNL_ALIGN(plen) > nfqc->verdict_send_max)
+    {
+        SET_ERROR(nfqc->modinst, "%s: Replacement packet is too large to send (%u bytes)",
+                __func__, plen);
+        return DAQ_ERROR;
     }
-    return ret;
+    if (nfq_reserve_verdict_space(nfqc, len, plen) != DAQ_SUCCESS)
+        return DAQ_ERROR;
+
+    struct nlmsghdr *nlh = nfq_build_verdict(nfqc->verdict_buf + nfqc->verdict_buf_len, id,
+            queue->num, nfq_verdict);
+    if (ctmark)
+        nfq_put_ct_mark(nlh, ctmark);
+    if (plen)
+    {
+        /* The payload attribute comes last so that everything after its header can be sent straight
+            from the packet buffer, followed by the padding out to the attribute alignment. */
+        static uint8_t padding[MNL_ALIGNTO];
+        struct nlattr *attr = mnl_nlmsg_get_payload_tail(nlh);
+        attr->nla_type = NFQA_PAYLOAD;
+        attr->nla_len = MNL_ATTR_HDRLEN + plen;
+        nlh->nlmsg_len += MNL_ATTR_HDRLEN;
+        nfqc->verdict_buf_len += nlh->nlmsg_len;
+        nlh->nlmsg_len += MNL_ALIGN(plen);
+        nfq_gather_verdict_buf(nfqc);
+        struct iovec *iov = &nfqc->verdict_iovs[nfqc->verdict_iovcnt++];
+        iov->iov_base = pkt;
+        iov->iov_len = plen;
+        if (MNL_ALIGN(plen) != plen)
+        {
+            iov = &nfqc->verdict_iovs[nfqc->verdict_iovcnt++];
+            iov->iov_base = padding;
+            iov->iov_len = MNL_ALIGN(plen) - plen;
+        }
+        nfqc->verdict_payload_len += MNL_ALIGN(plen);
+    }
+    else
+        nfqc->verdict_buf_len += MNL_ALIGN(nlh->nlmsg_len);
+    nfqc->verdict_msgs++;
+    nfq_verdict_pending(nfqc);
+
+    return DAQ_SUCCESS;
+}
+
+static uint32_t nfq_csum_add(uint32_t sum, const uint8_t *data, uint32_t len)
+{
+    while (len > 1)
+    {
+        sum += (data[0] << 8) | data[1];
+        data += 2;
+        len -= 2;
+    }
+    if (len)
+        sum += data[0] << 8;
+    return sum;
+}
+
+/*
+ * Fill in the complete TCP or UDP checksum of an unfragmented IPv4 or IPv6 packet.  Returns false if
+ * the packet isn't one that this knows how to handle.
+ */
+static bool nfq_fix_l4_checksum(uint8_t *data, uint32_t len)
+{
+    uint8_t *l4;
+    uint32_t l4len;
+    uint8_t proto;
+    uint32_t sum;
+
+    if (len < 1)
+        return false;
+    if ((data[0] >> 4) == 4)
+    {
+        uint32_t hlen = (data[0] & 0x0f) * 4;
+        if (len < 20 || hlen < 20)
+            return false;
+        uint32_t tot_len = (data[2] << 8) | data[3];
+        if (tot_len < hlen || tot_len > len)
+            return false;
+        /* Bail on fragments (MF set or a non-zero offset) */
+        if (((data[6] << 8) | data[7]) & 0x3fff)
+            return false;
+        proto = data[9];
+        l4 = data + hlen;
+        l4len = tot_len - hlen;
+        sum = nfq_csum_add(0, data + 12, 8);
+    }
+    else if ((data[0] >> 4) == 6)
+    {
+        if (len < 40)
+            return false;
+        uint32_t payload_len = (data[4] << 8) | data[5];
+        if (40 + payload_len > len)
+            return false;
+        /* Extension headers aren't walked */
+        proto = data[6];
+        l4 = data + 40;
+        l4len = payload_len;
+        sum = nfq_csum_add(0, data + 8, 32);
+    }
+    else
+        return false;
+
+    uint8_t *check;
+    if (proto == IPPROTO_TCP && l4len >= 20)
+        check = l4 + 16;
+    else if (proto == IPPROTO_UDP && l4len >= 8)
+        check = l4 + 6;
+    else
+        return false;
+
+    sum += proto + (l4len >> 16) + (l4len & 0xffff);
+    check[0] = check[1] = 0;
+    sum = nfq_csum_add(sum, l4, l4len);
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    uint16_t csum = ~sum & 0xffff;
+    /* A computed UDP checksum of zero is transmitted as all ones */
+    if (csum == 0 && proto == IPPROTO_UDP)
+        csum = 0xffff;
+    check[0] = csum >> 8;
+    check[1] = csum & 0xff;
+
+    return true;
+}
+
+static bool nfq_verdicts_timed_out(Nfq_Context_t *nfqc)
+{
+    if (!nfqc->verdict_timeout)
+        return false;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t elapsed = (now.tv_sec - nfqc->pending_since.tv_sec) * 1000000 +
+        (now.tv_nsec - nfqc->pending_since.tv_nsec) / 1000;
+
+    return elapsed >= nfqc->verdict_timeout;
+}
+
+static void nfq_add_counter(DIOCTL_GetModuleCounters *gmc, const char *name, uint64_t value)
+{
+    if (gmc->num_counters >= gmc->max_counters)
+        return;
+
+    DAQ_ModuleCounter_t *counter = &gmc->counters[gmc->num_counters++];
+    counter->module = "nfq";
+    counter->name = name;
+    counter->value = value;
+}
+
+static inline NfqQueue *nfq_find_queue(Nfq_Context_t *nfqc, const struct nlmsghdr *nlh)
+{
+    const struct nfgenmsg *nfg = mnl_nlmsg_get_payload(nlh);
+    uint16_t num = ntohs(nfg->res_id);
+    for (unsigned i = 0; i < nfqc->num_queues; i++)
+    {
+        if (nfqc->queues[i].num == num)
+            return &nfqc->queues[i];
+    }
+    return NULL;
+}
+
+/* Parse a conntrack mark given as <mark>[/<mask>] (decimal or hexadecimal). */
+static bool nfq_parse_ct_mark(const char *value, NfqCtMark *ctmark)
+{
+    char *endptr;
+    errno = 0;
+    unsigned long mark = strtoul(value, &endptr, 0);
+    unsigned long mask = UINT32_MAX;
+    if (endptr == value || errno != 0 || mark > UINT32_MAX)
+        return false;
+    if (*endptr == '/')
+    {
+        const char *p = endptr + 1;
+        mask = strtoul(p, &endptr, 0);
+        if (endptr == p || errno != 0 || mask == 0 || mask > UINT32_MAX)
+            return false;
+    }
+    if (*endptr != '\0' || (mark & ~mask) != 0)
+        return false;
+
+    ctmark->value = mark;
+    ctmark->mask = mask;
+    ctmark->enabled = true;
+    return true;
+}
+
+/*
+ * Parse the input specification: a comma-separated list of queue numbers and ranges of queue numbers
+ * (for example, "0-3" to match iptables' "--queue-balance 0:3").  When running multiple instances,
+ * the queues are dealt out among them in order so that each instance binds its own share.
+ */
+static int nfq_parse_queues(Nfq_Context_t *nfqc, const char *input, unsigned total_instances, unsigned instance_id)
+{
+    uint8_t *seen = calloc(NFQ_MAX_QUEUE_NUM + 1, sizeof(uint8_t));
+    uint16_t *nums = calloc(NFQ_MAX_QUEUE_NUM + 1, sizeof(uint16_t));
+    unsigned count = 0;
+    int rval = DAQ_ERROR_INVAL;
+
+    if (!seen || !nums)
+    {
+        SET_ERROR(nfqc->modinst, "%s: Couldn't allocate memory for parsing the queue list", __func__);
+        rval = DAQ_ERROR_NOMEM;
+        goto out;
+    }
+
+    const char *p = input;
+    do
+    {
+        char *endptr;
+        errno = 0;
+        unsigned long first = strtoul(p, &endptr, 10);
+        unsigned long last = first;
+        if (endptr != p && *endptr == '-')
+        {
+            p = endptr + 1;
+            last = strtoul(p, &endptr, 10);
+        }
+        if (endptr == p || (*endptr != '\0' && *endptr != ',') || errno != 0 ||
+            first > last || last > NFQ_MAX_QUEUE_NUM)
+        {
+            SET_ERROR(nfqc->modinst, "%s: Invalid queue number specified: '%s'", __func__, input);
+            goto out;
+        }
+        for (unsigned long num = first; num <= last; num++)
+        {
+            if (seen[num])
+            {
+                SET_ERROR(nfqc->modinst, "%s: Queue %lu specified more than once: '%s'", __func__, num, input);
+                goto out;
+            }
+            seen[num] = 1;
+            nums[count++] = num;
+        }
+        p = endptr;
+    } while (*p++ == ',');
+
+    /* A single queue is bound by every instance, as it always has been. */
+    unsigned stride = 1, offset = 0;
+    if (count > 1 && total_instances > 1)
+    {
+        if (instance_id == 0)
+        {
+            SET_ERROR(nfqc->modinst, "%s: Instance ID required for multi-instance (%u instances expected)",
+                    __func__, total_instances);
+            goto out;
+        }
+        if (count < total_instances)
+        {
+            SET_ERROR(nfqc->modinst, "%s: Not enough queues in '%s' to give one to each of %u instances",
+                    __func__, input, total_instances);
+            goto out;
+        }
+        stride = total_instances;
+        offset = (instance_id - 1) % total_instances;
+    }
+
+    nfqc->num_queues = (count - offset + stride - 1) / stride;
+    nfqc->queues = calloc(nfqc->num_queues, sizeof(NfqQueue));
+    if (!nfqc->queues)
+    {
+        SET_ERROR(nfqc->modinst, "%s: Couldn't allocate memory for %u queues", __func__, nfqc->num_queues);
+        nfqc->num_queues = 0;
+        rval = DAQ_ERROR_NOMEM;
+        goto out;
+    }
+    for (unsigned i = 0; i < nfqc->num_queues; i++)
+    {
+        NfqQueue *queue = &nfqc->queues[i];
+        queue->num = nums[offset + i * stride];
+        snprintf(queue->counter_names[0], sizeof(queue->counter_names[0]), "queue%hu_received", queue->num);
+        snprintf(queue->counter_names[1], sizeof(queue->counter_names[1]), "queue%hu_accepted", queue->num);
+        snprintf(queue->counter_names[2], sizeof(queue->counter_names[2]), "queue%hu_dropped", queue->num);
+    }
+    rval = DAQ_SUCCESS;
+
+out:
+    free(seen);
+    free(nums);
+    return rval;
+}
+
+/* Receive up to count netlink datagrams into the buffers of the descriptors staged in recv_descs
+    with a single system call.  If blocking, wait for the first one and then drain whatever else is
+    already queued on the socket without waiting any further (MSG_WAITFORONE). */
+static int nl_socket_recv_batch(Nfq_Context_t *nfqc, unsigned count, bool blocking)
+{
+    for (unsigned i = 0; i < count; i++)
+    {
+        struct iovec *iov = &nfqc->recv_iovs[i];
+        iov->iov_base = nfqc->recv_descs[i]->nlmsg_buf;
+        iov->iov_len = nfqc->nlmsg_bufsize;
+
+        struct msghdr *msg = &nfqc->recv_msgs[i].msg_hdr;
+        msg->msg_name = &nfqc->recv_addrs[i];
+        msg->msg_namelen = sizeof(struct sockaddr_nl);
+        msg->msg_iov = iov;
+        msg->msg_iovlen = 1;
+        msg->msg_control = NULL;
+        msg->msg_controllen = 0;
+        msg->msg_flags = 0;
+    }
+    nfqc->recv_calls++;
+    return recvmmsg(nfqc->nlsock_fd, nfqc->recv_msgs, count, blocking ? MSG_WAITFORONE : MSG_DONTWAIT, NULL);
 }
 
 static int parse_attr_cb(const struct nlattr *attr, void *data)
@@ -330,22 +885,48 @@ static int process_message_cb(const struct nlmsghdr *nlh, void *data)
     DAQ_Msg_t *msg = &desc->msg;
     msg->data = mnl_attr_get_payload(attr[NFQA_PAYLOAD]);
 
+    msg->data_len = mnl_attr_get_payload_len(attr[NFQA_PAYLOAD]);
+
+    /* The payload is truncated to the copy range when the original packet was longer, in which case
+        the original length is reported separately. */
     DAQ_PktHdr_t *pkthdr = &desc->pkthdr;
-    pkthdr->pktlen = mnl_attr_get_payload_len(attr[NFQA_PAYLOAD]);
     if (attr[NFQA_CAP_LEN])
-        msg->data_len = ntohl(mnl_attr_get_u32(attr[NFQA_CAP_LEN]));
+        pkthdr->pktlen = ntohl(mnl_attr_get_u32(attr[NFQA_CAP_LEN]));
     else
-        msg->data_len = pkthdr->pktlen;
-    /*
-     * FIXIT-M Implement getting timestamps from the message if it happens to have that attribute
+        pkthdr->pktlen = msg->data_len;
+
+    /* Packets can be queued before the stack has segmented them or computed their checksums; let the
+        application know so that it doesn't mistake them for oversized or corrupt packets. */
+    desc->offload.flags = 0;
+    if (attr[NFQA_SKB_INFO])
+    {
+        uint32_t skbinfo = ntohl(mnl_attr_get_u32(attr[NFQA_SKB_INFO]));
+        if (skbinfo & NFQA_SKB_GSO)
+            desc->offload.flags |= DAQ_OFFLOAD_FLAG_GSO;
+        if (skbinfo & NFQA_SKB_CSUMNOTREADY)
+            desc->offload.flags |= DAQ_OFFLOAD_FLAG_CSUM_PARTIAL;
+        if (skbinfo & NFQA_SKB_CSUM_NOTVERIFIED)
+            desc->offload.flags |= DAQ_OFFLOAD_FLAG_CSUM_NOT_VERIFIED;
+    }
+    msg->meta_ext = desc->offload.flags ? &desc->offload_meta : &desc->ts_meta;
+    /* The kernel only includes the receive timestamp of the skb when it has one, and then only to
+        the microsecond.  Otherwise, stamp the packet now. */
     if (attr[NFQA_TIMESTAMP])
     {
-        struct nfqnl_msg_packet_timestamp *qpt = (struct nfqnl_msg_packet_timestamp *) mnl_attr_get_payload(attr[NFQA_TIMESTAMP]);
-        ...
+        const struct nfqnl_msg_packet_timestamp *qpt =
+            (const struct nfqnl_msg_packet_timestamp *) mnl_attr_get_payload(attr[NFQA_TIMESTAMP]);
+        pkthdr->ts.tv_sec = be64toh(qpt->sec);
+        pkthdr->ts.tv_usec = be64toh(qpt->usec);
+        desc->ts.nsec = (uint64_t) pkthdr->ts.tv_sec * 1000000000 + (uint64_t) pkthdr->ts.tv_usec * 1000;
     }
     else
-    */
-        gettimeofday(&pkthdr->ts, NULL);
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        pkthdr->ts.tv_sec = now.tv_sec;
+        pkthdr->ts.tv_usec = now.tv_nsec / 1000;
+        desc->ts.nsec = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+    }
     if (attr[NFQA_IFINDEX_INDEV])
         pkthdr->ingress_index = ntohl(mnl_attr_get_u32(attr[NFQA_IFINDEX_INDEV]));
     else
@@ -369,6 +950,15 @@ static int nfq_daq_module_load(const DAQ_BaseAPI_t *base_api)
     if (base_api->api_version != DAQ_BASE_API_VERSION || base_api->api_size != sizeof(DAQ_BaseAPI_t))
         return DAQ_ERROR;
 
+    int type = base_api->meta_type_register(DAQ_META_TYPE_OFFLOAD_INFO, sizeof(DAQ_PktOffloadInfo_t));
+    if (type < 0)
+        return type;
+    offload_meta_type = type;
+    type = base_api->meta_type_register(DAQ_META_TYPE_TIMESTAMP, sizeof(DAQ_PktTimestamp_t));
+    if (type < 0)
+        return type;
+    timestamp_meta_type = type;
+
     daq_base_api = *base_api;
 
     return DAQ_SUCCESS;
@@ -404,18 +994,16 @@ static int nfq_daq_instantiate(const DAQ_ModuleConfig_h modcfg, DAQ_ModuleInstan
     nfqc->modinst = modinst;
 
     nfqc->queue_maxlen = DEFAULT_QUEUE_MAXLEN;
+    nfqc->verdict_batch = DEFAULT_VERDICT_BATCH;
+    nfqc->verdict_timeout = DEFAULT_VERDICT_TIMEOUT;
 
-    char *endptr;
-    errno = 0;
-    nfqc->queue_num = strtoul(daq_base_api.config_get_input(modcfg), &endptr, 10);
-    if (*endptr != '\0' || errno != 0)
-    {
-        SET_ERROR(modinst, "%s: Invalid queue number specified: '%s'",
-                __func__, daq_base_api.config_get_input(modcfg));
-        rval = DAQ_ERROR_INVAL;
+    rval = nfq_parse_queues(nfqc, daq_base_api.config_get_input(modcfg),
+            daq_base_api.config_get_total_instances(modcfg), daq_base_api.config_get_instance_id(modcfg));
+    if (rval != DAQ_SUCCESS)
         goto fail;
-    }
+    rval = DAQ_ERROR;
 
+    char *endptr;
     const char *varKey, *varValue;
     daq_base_api.config_first_variable(modcfg, &varKey, &varValue);
     while (varKey)
@@ -427,7 +1015,7 @@ static int nfq_daq_instantiate(const DAQ_ModuleConfig_h modcfg, DAQ_ModuleInstan
         else if (!strcmp(varKey, "queue_maxlen"))
         {
             errno = 0;
-            nfqc->queue_maxlen = strtol(varValue, NULL, 10);
+            nfqc->queue_maxlen = strtol(varValue, &endptr, 10);
             if (*endptr != '\0' || errno != 0)
             {
                 SET_ERROR(modinst, "%s: Invalid value for key '%s': '%s'",
@@ -436,6 +1024,34 @@ static int nfq_daq_instantiate(const DAQ_ModuleConfig_h modcfg, DAQ_ModuleInstan
                 goto fail;
             }
         }
+        else if (!strcmp(varKey, "verdict_batch") || !strcmp(varKey, "verdict_timeout"))
+        {
+            errno = 0;
+            unsigned long value = strtoul(varValue, &endptr, 10);
+            if (*varValue == '\0' || *endptr != '\0' || errno != 0 || value > UINT_MAX ||
+                (value == 0 && !strcmp(varKey, "verdict_batch")))
+            {
+                SET_ERROR(modinst, "%s: Invalid value for key '%s': '%s'",
+                        __func__, varKey, varValue);
+                rval = DAQ_ERROR_INVAL;
+                goto fail;
+            }
+            if (!strcmp(varKey, "verdict_batch"))
+                nfqc->verdict_batch = value;
+            else
+                nfqc->verdict_timeout = value;
+        }
+        else if (!strcmp(varKey, "whitelist_mark") || !strcmp(varKey, "blacklist_mark"))
+        {
+            NfqCtMark *ctmark = !strcmp(varKey, "whitelist_mark") ? &nfqc->whitelist_mark : &nfqc->blacklist_mark;
+            if (!nfq_parse_ct_mark(varValue, ctmark))
+            {
+                SET_ERROR(modinst, "%s: Invalid value for key '%s': '%s'",
+                        __func__, varKey, varValue);
+                rval = DAQ_ERROR_INVAL;
+                goto fail;
+            }
+        }
 
         daq_base_api.config_next_variable(modcfg, &varKey, &varValue);
     }
@@ -460,6 +1076,25 @@ static int nfq_daq_instantiate(const DAQ_ModuleConfig_h modcfg, DAQ_ModuleInstan
         goto fail;
     }
 
+    /* Verdict messages are accumulated in a buffer of the same size and sent along with any
+        replacement payloads using a vector of up to the system's limit of entries. */
+    nfqc->verdict_buf = malloc(nfqc->nlmsg_bufsize);
+    if (!nfqc->verdict_buf)
+    {
+        SET_ERROR(modinst, "%s: Couldn't allocate %zu bytes for a verdict buffer",
+                __func__, nfqc->nlmsg_bufsize);
+        rval = DAQ_ERROR_NOMEM;
+        goto fail;
+    }
+    nfqc->verdict_iovs = calloc(IOV_MAX, sizeof(struct iovec));
+    if (!nfqc->verdict_iovs)
+    {
+        SET_ERROR(modinst, "%s: Couldn't allocate a verdict send vector of %d entries",
+                __func__, IOV_MAX);
+        rval = DAQ_ERROR_NOMEM;
+        goto fail;
+    }
+
     /* Netlink message buffer length must be determined prior to creating packet pool */
     uint32_t pool_size = daq_base_api.config_get_msg_pool_size(modcfg);
     if ((rval = create_packet_pool(nfqc, pool_size ? pool_size : NFQ_DEFAULT_POOL_SIZE)) != DAQ_SUCCESS)
@@ -495,8 +1130,10 @@ static int nfq_daq_instantiate(const DAQ_ModuleConfig_h modcfg, DAQ_ModuleInstan
         Try with FORCE first to allow overriding the system's global rmem_max, then fall back on being limited
         by it if that doesn't work.
         The value will be doubled to allow room for bookkeeping overhead, so the default of 1024 * 1500 will
-        end up allocating about 3MB of receive buffer space.  The unmodified default tends to be around 208KB. */
-    unsigned int socket_rcvbuf_size = nfqc->queue_maxlen * nfqc->snaplen;
+        end up allocating about 3MB of receive buffer space.  The unmodified default tends to be around 208KB.
+        Every bound queue can fill up independently, so make room for all of them (within reason). */
+    unsigned long long rcvbuf_size = (unsigned long long) nfqc->queue_maxlen * nfqc->snaplen * nfqc->num_queues;
+    unsigned int socket_rcvbuf_size = (rcvbuf_size > INT_MAX / 2) ? INT_MAX / 2 : rcvbuf_size;
     if (setsockopt(nfqc->nlsock_fd, SOL_SOCKET, SO_RCVBUFFORCE, &socket_rcvbuf_size, sizeof(socket_rcvbuf_size)) == -1)
     {
         if (setsockopt(nfqc->nlsock_fd, SOL_SOCKET, SO_RCVBUF, &socket_rcvbuf_size, sizeof(socket_rcvbuf_size)) == -1)
@@ -509,6 +1146,18 @@ static int nfq_daq_instantiate(const DAQ_ModuleConfig_h modcfg, DAQ_ModuleInstan
     if (nfqc->debug)
         printf("Set socket receive buffer size to %u\n", socket_rcvbuf_size);
 
+    /* The kernel rejects netlink datagrams that wouldn't fit in the socket's send buffer (less some
+        slack), which bounds how many verdicts and replacement payloads can be sent together. */
+    int socket_sndbuf_size;
+    socklen_t optlen = sizeof(socket_sndbuf_size);
+    if (getsockopt(nfqc->nlsock_fd, SOL_SOCKET, SO_SNDBUF, &socket_sndbuf_size, &optlen) == -1)
+    {
+        SET_ERROR(modinst, "%s: Couldn't get send buffer size of netlink socket: %s (%d)",
+                __func__, strerror(errno), errno);
+        goto fail;
+    }
+    nfqc->verdict_send_max = (socket_sndbuf_size > 32) ? socket_sndbuf_size - 32 : 0;
+
     if (mnl_socket_bind(nfqc->nlsock, 0, MNL_SOCKET_AUTOPID) == -1)
     {
         SET_ERROR(modinst, "%s: Couldn't bind the netlink socket: %s (%d)",
@@ -550,38 +1199,6 @@ static int nfq_daq_instantiate(const DAQ_ModuleConfig_h modcfg, DAQ_ModuleInstan
         goto fail;
     }
 
-    /* Now, actually bind to the netfilter queue.  The address family specified is irrelevant. */
-    nlh = nfq_build_cfg_command(nfqc->nlmsg_buf, AF_UNSPEC, NFQNL_CFG_CMD_BIND, nfqc->queue_num);
-    if (mnl_socket_sendto(nfqc->nlsock, nlh, nlh->nlmsg_len) == -1)
-    {
-        SET_ERROR(modinst, "%s: Couldn't bind to NFQ queue %u: %s (%d)",
-                __func__, nfqc->queue_num, strerror(errno), errno);
-        goto fail;
-    }
-
-    /*
-     * Set the queue into packet copying mode with a max copying length of our snaplen.
-     * While we're building a configuration message, we might as well tack on our requested
-     * maximum queue length and enable delivery of packets that will be subject to GSO. That
-     * last bit means we'll potentially see packets larger than the device MTU prior to their
-     * trip through the segmentation offload path.  They'll probably show up as truncated.
-     */
-    nlh = nfq_build_cfg_params(nfqc->nlmsg_buf, NFQNL_COPY_PACKET, nfqc->snaplen, nfqc->queue_num);
-    mnl_attr_put_u32(nlh, NFQA_CFG_QUEUE_MAXLEN, htonl(nfqc->queue_maxlen));
-    mnl_attr_put_u32(nlh, NFQA_CFG_FLAGS, htonl(NFQA_CFG_F_GSO));
-    mnl_attr_put_u32(nlh, NFQA_CFG_MASK, htonl(NFQA_CFG_F_GSO));
-    if (nfqc->fail_open)
-    {
-        mnl_attr_put_u32(nlh, NFQA_CFG_FLAGS, htonl(NFQA_CFG_F_FAIL_OPEN));
-        mnl_attr_put_u32(nlh, NFQA_CFG_MASK, htonl(NFQA_CFG_F_FAIL_OPEN));
-    }
-    if (mnl_socket_sendto(nfqc->nlsock, nlh, nlh->nlmsg_len) == -1)
-    {
-        SET_ERROR(modinst, "%s: Couldn't configure NFQ parameters: %s (%d)",
-                __func__, strerror(errno), errno);
-        goto fail;
-    }
-
     *ctxt_ptr = nfqc;
 
     return DAQ_SUCCESS;
@@ -593,7 +1210,11 @@ fail:
             mnl_socket_close(nfqc->nlsock);
         if (nfqc->nlmsg_buf)
             free(nfqc->nlmsg_buf);
+        if (nfqc->verdict_buf)
+            free(nfqc->verdict_buf);
+        free(nfqc->verdict_iovs);
         destroy_packet_pool(nfqc);
+        free(nfqc->queues);
         free(nfqc);
     }
 
@@ -609,13 +1230,60 @@ static void nfq_daq_destroy(void *handle)
         mnl_socket_close(nfqc->nlsock);
     if (nfqc->nlmsg_buf)
         free(nfqc->nlmsg_buf);
+    if (nfqc->verdict_buf)
+        free(nfqc->verdict_buf);
+    free(nfqc->verdict_iovs);
     destroy_packet_pool(nfqc);
+    free(nfqc->queues);
     free(nfqc);
 }
 
 /* Module->start() */
 static int nfq_daq_start(void *handle)
 {
+    Nfq_Context_t *nfqc = (Nfq_Context_t *) handle;
+
+    /* Queues are bound here rather than at instantiation so that an instance that is never started
+        (such as those beneath the LB module other than the first) doesn't claim them. */
+    for (unsigned i = 0; i < nfqc->num_queues; i++)
+    {
+        uint16_t queue_num = nfqc->queues[i].num;
+
+        /* Now, actually bind to the netfilter queue.  The address family specified is irrelevant. */
+        struct nlmsghdr *nlh = nfq_build_cfg_command(nfqc->nlmsg_buf, AF_UNSPEC, NFQNL_CFG_CMD_BIND, queue_num);
+        if (mnl_socket_sendto(nfqc->nlsock, nlh, nlh->nlmsg_len) == -1)
+        {
+            SET_ERROR(nfqc->modinst, "%s: Couldn't bind to NFQ queue %hu: %s (%d)",
+                    __func__, queue_num, strerror(errno), errno);
+            return DAQ_ERROR;
+        }
+
+        /*
+         * Set the queue into packet copying mode with a max copying length of our snaplen.
+         * While we're building a configuration message, we might as well tack on our requested
+         * maximum queue length and enable delivery of packets that will be subject to GSO. That
+         * last bit means we'll potentially see packets larger than the device MTU prior to their
+         * trip through the segmentation offload path.  They'll probably show up as truncated.
+         */
+        nlh = nfq_build_cfg_params(nfqc->nlmsg_buf, NFQNL_COPY_PACKET, nfqc->snaplen, queue_num);
+        mnl_attr_put_u32(nlh, NFQA_CFG_QUEUE_MAXLEN, htonl(nfqc->queue_maxlen));
+        mnl_attr_put_u32(nlh, NFQA_CFG_FLAGS, htonl(NFQA_CFG_F_GSO));
+        mnl_attr_put_u32(nlh, NFQA_CFG_MASK, htonl(NFQA_CFG_F_GSO));
+        if (nfqc->fail_open)
+        {
+            mnl_attr_put_u32(nlh, NFQA_CFG_FLAGS, htonl(NFQA_CFG_F_FAIL_OPEN));
+            mnl_attr_put_u32(nlh, NFQA_CFG_MASK, htonl(NFQA_CFG_F_FAIL_OPEN));
+        }
+        if (mnl_socket_sendto(nfqc->nlsock, nlh, nlh->nlmsg_len) == -1)
+        {
+            SET_ERROR(nfqc->modinst, "%s: Couldn't configure NFQ parameters for queue %hu: %s (%d)",
+                    __func__, queue_num, strerror(errno), errno);
+            return DAQ_ERROR;
+        }
+        if (nfqc->debug)
+            printf("Bound to NFQ queue %hu\n", queue_num);
+    }
+
     return DAQ_SUCCESS;
 }
 
@@ -634,12 +1302,20 @@ static int nfq_daq_stop(void *handle)
 {
     Nfq_Context_t *nfqc = (Nfq_Context_t *) handle;
 
-    struct nlmsghdr *nlh = nfq_build_cfg_command(nfqc->nlmsg_buf, AF_INET, NFQNL_CFG_CMD_UNBIND, nfqc->queue_num);
-    if (mnl_socket_sendto(nfqc->nlsock, nlh, nlh->nlmsg_len) == -1)
-    {
-        SET_ERROR(nfqc->modinst, "%s: Couldn't bind to NFQ queue %u: %s (%d)",
-                __func__, nfqc->queue_num, strerror(errno), errno);
+    /* Don't leave any verdicts behind for packets that have already been finalized. */
+    if (nfq_flush_verdicts(nfqc) != DAQ_SUCCESS)
         return DAQ_ERROR;
+
+    for (unsigned i = 0; i < nfqc->num_queues; i++)
+    {
+        uint16_t queue_num = nfqc->queues[i].num;
+        struct nlmsghdr *nlh = nfq_build_cfg_command(nfqc->nlmsg_buf, AF_INET, NFQNL_CFG_CMD_UNBIND, queue_num);
+        if (mnl_socket_sendto(nfqc->nlsock, nlh, nlh->nlmsg_len) == -1)
+        {
+            SET_ERROR(nfqc->modinst, "%s: Couldn't unbind from NFQ queue %hu: %s (%d)",
+                    __func__, queue_num, strerror(errno), errno);
+            return DAQ_ERROR;
+        }
     }
     mnl_socket_close(nfqc->nlsock);
     nfqc->nlsock = NULL;
@@ -647,6 +1323,45 @@ static int nfq_daq_stop(void *handle)
     return DAQ_SUCCESS;
 }
 
+/* Module->ioctl() */
+static int nfq_daq_ioctl(void *handle, DAQ_IoctlCmd cmd, void *arg, size_t arglen)
+{
+    Nfq_Context_t *nfqc = (Nfq_Context_t *) handle;
+
+    if (cmd == DIOCTL_GET_MODULE_COUNTERS)
+    {
+        if (arglen != sizeof(DIOCTL_GetModuleCounters))
+            return DAQ_ERROR_INVAL;
+        DIOCTL_GetModuleCounters *gmc = (DIOCTL_GetModuleCounters *) arg;
+        if (!gmc->counters && gmc->max_counters > 0)
+            return DAQ_ERROR_INVAL;
+
+        nfq_add_counter(gmc, "verdict_sends", nfqc->verdict_sends);
+        nfq_add_counter(gmc, "verdict_msgs", nfqc->verdict_msgs);
+        nfq_add_counter(gmc, "verdict_batches", nfqc->verdict_batches);
+        nfq_add_counter(gmc, "verdicts_batched", nfqc->verdicts_batched);
+        nfq_add_counter(gmc, "recv_calls", nfqc->recv_calls);
+        nfq_add_counter(gmc, "gso_packets", nfqc->gso_packets);
+        nfq_add_counter(gmc, "csum_partial_packets", nfqc->csum_partial_packets);
+        nfq_add_counter(gmc, "replace_truncated", nfqc->replace_truncated);
+        nfq_add_counter(gmc, "replace_csum_fixed", nfqc->replace_csum_fixed);
+        if (nfqc->whitelist_mark.enabled)
+            nfq_add_counter(gmc, "whitelist_marked", nfqc->whitelist_marked);
+        if (nfqc->blacklist_mark.enabled)
+            nfq_add_counter(gmc, "blacklist_marked", nfqc->blacklist_marked);
+        for (unsigned i = 0; i < nfqc->num_queues; i++)
+        {
+            NfqQueue *queue = &nfqc->queues[i];
+            nfq_add_counter(gmc, queue->counter_names[0], queue->packets_received);
+            nfq_add_counter(gmc, queue->counter_names[1], queue->packets_accepted);
+            nfq_add_counter(gmc, queue->counter_names[2], queue->packets_dropped);
+        }
+        return DAQ_SUCCESS;
+    }
+
+    return DAQ_ERROR_NOTSUP;
+}
+
 /* Module->get_stats() */
 static int nfq_daq_get_stats(void *handle, DAQ_Stats_t *stats)
 {
@@ -689,11 +1404,19 @@ static int nfq_daq_get_datalink_type(void *handle)
 }
 
 /* Module->msg_receive() */
-static unsigned nfq_daq_msg_receive(void *handle, const unsigned max_recv, const DAQ_Msg_t *msgs[], DAQ_RecvStatus *rstat)
+DAQ_STACK_LINKAGE unsigned nfq_daq_msg_receive(void *handle, const unsigned max_recv, const DAQ_Msg_t *msgs[], DAQ_RecvStatus *rstat)
 {
     Nfq_Context_t *nfqc = (Nfq_Context_t *) handle;
     unsigned idx = 0;
 
+    /* The application is done finalizing the previous burst, so send its verdicts before
+        potentially blocking for more packets. */
+    if (nfqc->verdicts_pending > 0 && nfq_flush_verdicts(nfqc) != DAQ_SUCCESS)
+    {
+        *rstat = DAQ_RSTAT_ERROR;
+        return 0;
+    }
+
     *rstat = DAQ_RSTAT_OK;
     while (idx < max_recv)
     {
@@ -705,15 +1428,17 @@ static unsigned nfq_daq_msg_receive(void *handle, const unsigned max_recv, const
             break;
         }
 
-        /* Make sure that we have a packet descriptor available to populate. */
-        NfqPktDesc *desc = nfqc->pool.freelist;
-        if (!desc)
+        /* Stage as many free packet descriptors as we could possibly return. */
+        unsigned count = 0;
+        for (NfqPktDesc *desc = nfqc->pool.freelist; desc && count < max_recv - idx; desc = desc->next)
+            nfqc->recv_descs[count++] = desc;
+        if (count == 0)
         {
             *rstat = DAQ_RSTAT_NOBUF;
             break;
         }
 
-        ssize_t ret = nl_socket_recv(nfqc, desc->nlmsg_buf, nfqc->nlmsg_bufsize, idx == 0);
+        int ret = nl_socket_recv_batch(nfqc, count, idx == 0);
         if (ret < 0)
         {
             if (errno == ENOBUFS)
@@ -732,40 +1457,89 @@ static unsigned nfq_daq_msg_receive(void *handle, const unsigned max_recv, const
             }
             else
             {
-                SET_ERROR(nfqc->modinst, "%s: Socket receive failed: %zd - %s (%d)",
+                SET_ERROR(nfqc->modinst, "%s: Socket receive failed: %d - %s (%d)",
                         __func__, ret, strerror(errno), errno);
                 *rstat = DAQ_RSTAT_ERROR;
             }
             break;
         }
-        errno = 0;
-        ret = mnl_cb_run(desc->nlmsg_buf, ret, 0, nfqc->portid, process_message_cb, desc);
-        if (ret < 0)
-        {
-            SET_ERROR(nfqc->modinst, "%s: Netlink message processing failed: %zd - %s (%d)",
-                    __func__, ret, strerror(errno), errno);
-            *rstat = DAQ_RSTAT_ERROR;
-            break;
-        }
 
-        /* Increment the module instance's packet counter. */
-        nfqc->stats.packets_received++;
+        /* The received descriptors are the first ones on the free list.  Take them all off and
+            process every datagram, putting back any that couldn't be turned into a packet. */
+        nfqc->pool.freelist = nfqc->recv_descs[ret - 1]->next;
+        for (int i = 0; i < ret; i++)
+        {
+            NfqPktDesc *desc = nfqc->recv_descs[i];
+            const struct msghdr *msg = &nfqc->recv_msgs[i].msg_hdr;
+            ssize_t rval;
 
-        /* Last, but not least, extract this descriptor from the free list and
-            place the message in the return vector. */
-        nfqc->pool.freelist = desc->next;
-        desc->next = NULL;
-        nfqc->pool.info.available--;
-        msgs[idx] = &desc->msg;
+            if (msg->msg_flags & MSG_TRUNC)
+            {
+                SET_ERROR(nfqc->modinst, "%s: Netlink message was truncated (%u bytes)",
+                        __func__, nfqc->recv_msgs[i].msg_len);
+                *rstat = DAQ_RSTAT_ERROR;
+            }
+            else if (msg->msg_namelen != sizeof(struct sockaddr_nl))
+            {
+                SET_ERROR(nfqc->modinst, "%s: Received a message with an invalid source address",
+                        __func__);
+                *rstat = DAQ_RSTAT_ERROR;
+            }
+            else
+            {
+                errno = 0;
+                rval = mnl_cb_run(desc->nlmsg_buf, nfqc->recv_msgs[i].msg_len, 0, nfqc->portid,
+                        process_message_cb, desc);
+                if (rval < 0)
+                {
+                    SET_ERROR(nfqc->modinst, "%s: Netlink message processing failed: %zd - %s (%d)",
+                            __func__, rval, strerror(errno), errno);
+                    *rstat = DAQ_RSTAT_ERROR;
+                }
+                else if (desc->nlmh && !(desc->queue = nfq_find_queue(nfqc, desc->nlmh)))
+                {
+                    SET_ERROR(nfqc->modinst, "%s: Received a packet from a queue that isn't bound",
+                            __func__);
+                    *rstat = DAQ_RSTAT_ERROR;
+                }
+                else if (desc->nlmh)
+                {
+                    /* Increment the module instance's and queue's packet counters. */
+                    nfqc->stats.packets_received++;
+                    desc->queue->packets_received++;
+                    if (desc->offload.flags & DAQ_OFFLOAD_FLAG_GSO)
+                        nfqc->gso_packets++;
+                    if (desc->offload.flags & DAQ_OFFLOAD_FLAG_CSUM_PARTIAL)
+                        nfqc->csum_partial_packets++;
+
+                    /* Last, but not least, move this descriptor to the tail of its queue's
+                        outstanding list and place the message in the return vector. */
+                    nfq_outstanding_append(desc->queue, desc);
+                    nfqc->pool.info.available--;
+                    msgs[idx++] = &desc->msg;
+                    continue;
+                }
+            }
+            desc->nlmh = NULL;
+            desc->next = nfqc->pool.freelist;
+            nfqc->pool.freelist = desc;
+        }
+        if (*rstat != DAQ_RSTAT_OK)
+            break;
 
-        idx++;
+        /* Coming up short means that the socket has been drained. */
+        if ((unsigned) ret < count)
+        {
+            *rstat = DAQ_RSTAT_WOULD_BLOCK;
+            break;
+        }
     }
 
     return idx;
 }
 
 /* Module->msg_finalize() */
-static int nfq_daq_msg_finalize(void *handle, const DAQ_Msg_t *msg, DAQ_Verdict verdict)
+DAQ_STACK_LINKAGE int nfq_daq_msg_finalize(void *handle, const DAQ_Msg_t *msg, DAQ_Verdict verdict)
 {
     Nfq_Context_t *nfqc = (Nfq_Context_t *) handle;
     NfqPktDesc *desc = (NfqPktDesc *) msg->priv;
@@ -774,30 +1548,75 @@ static int nfq_daq_msg_finalize(void *handle, const DAQ_Msg_t *msg, DAQ_Verdict
     if (verdict >= MAX_DAQ_VERDICT)
         verdict = DAQ_VERDICT_PASS;
     nfqc->stats.verdicts[verdict]++;
+
+    /* Whitelisted and blacklisted flows can be handed off to the kernel by marking them so that
+        netfilter rules can keep the rest of their packets from being queued. */
+    const NfqCtMark *ctmark = NULL;
+    if (verdict == DAQ_VERDICT_WHITELIST && nfqc->whitelist_mark.enabled)
+    {
+        ctmark = &nfqc->whitelist_mark;
+        nfqc->whitelist_marked++;
+    }
+    else if (verdict == DAQ_VERDICT_BLACKLIST && nfqc->blacklist_mark.enabled)
+    {
+        ctmark = &nfqc->blacklist_mark;
+        nfqc->blacklist_marked++;
+    }
     verdict = verdict_translation_table[verdict];
 
-    /* Send the verdict back to the kernel through netlink */
-    /* FIXIT-L Consider using an iovec for scatter/gather transmission with the new payload as a
-        separate entry. This would avoid a copy and potentially avoid buffer size restrictions.
-        Only as relevant as REPLACE is common. */
-    uint32_t plen = (verdict == DAQ_VERDICT_REPLACE) ? msg->data_len : 0;
-    int nfq_verdict = (verdict == DAQ_VERDICT_PASS || verdict == DAQ_VERDICT_REPLACE) ? NF_ACCEPT : NF_DROP;;
-    struct nlmsghdr *nlh = nfq_build_verdict(nfqc->nlmsg_buf, ntohl(desc->nlph->packet_id), nfqc->queue_num,
-            nfq_verdict, plen, msg->data);
-    if (mnl_socket_sendto(nfqc->nlsock, nlh, nlh->nlmsg_len) == -1)
+    /* Queue the verdict to be sent back to the kernel through netlink.  Plain verdicts on the oldest
+        outstanding packet join the open run of identical verdicts; anything else (including those that
+        mark the flow, which batch verdicts can't carry) gets its own message. */
+    uint32_t plen = 0;
+    if (verdict == DAQ_VERDICT_REPLACE)
     {
-        SET_ERROR(nfqc->modinst, "%s: Couldn't send NFQ verdict: %s (%d)",
-                        __func__, strerror(errno), errno);
-        return DAQ_ERROR;
+        if (msg->data_len < desc->pkthdr.pktlen)
+        {
+            /* Handing back a truncated payload would cut the packet short, so let the original
+                through instead. */
+            nfqc->replace_truncated++;
+        }
+        else
+        {
+            /* The kernel stops trusting the checksum state of a replaced packet, so one that was
+                queued with its checksum left to be finished in transmit needs it finished now. */
+            if ((desc->offload.flags & DAQ_OFFLOAD_FLAG_CSUM_PARTIAL) &&
+                    nfq_fix_l4_checksum(msg->data, msg->data_len))
+                nfqc->replace_csum_fixed++;
+            plen = msg->data_len;
+        }
     }
+    int nfq_verdict = (verdict == DAQ_VERDICT_PASS || verdict == DAQ_VERDICT_REPLACE) ? NF_ACCEPT : NF_DROP;
+    uint32_t packet_id = ntohl(desc->nlph->packet_id);
+    NfqQueue *queue = desc->queue;
+    bool oldest = (desc == queue->outstanding_head);
+    int rval;
+    if (plen == 0 && oldest && !ctmark)
+        rval = nfq_queue_run_verdict(nfqc, queue, packet_id, nfq_verdict);
+    else
+        rval = nfq_queue_verdict(nfqc, queue, packet_id, nfq_verdict, plen, msg->data, ctmark);
+    if (nfq_verdict == NF_ACCEPT)
+        queue->packets_accepted++;
+    else
+        queue->packets_dropped++;
 
     /* Toss the descriptor back on the free list for reuse.
         Make sure to clear out the netlink message header to show that it is unused. */
+    nfq_outstanding_remove(queue, desc);
     desc->nlmh = NULL;
     desc->next = nfqc->pool.freelist;
     nfqc->pool.freelist = desc;
     nfqc->pool.info.available++;
 
+    if (rval != DAQ_SUCCESS)
+        return rval;
+
+    /* Send the pending verdicts once enough have accumulated, the application has returned every
+        packet it was holding (the end of a burst), or the oldest one has been held for too long. */
+    if (nfqc->verdicts_pending >= nfqc->verdict_batch || nfqc->pool.info.available == nfqc->pool.info.size ||
+        nfq_verdicts_timed_out(nfqc))
+        return nfq_flush_verdicts(nfqc);
+
     return DAQ_SUCCESS;
 }
 
@@ -832,7 +1651,7 @@ const DAQ_ModuleAPI_t nfq_daq_module_data =
     /* .inject_relative = */ NULL,
     /* .interrupt = */ nfq_daq_interrupt,
     /* .stop = */ nfq_daq_stop,
-    /* .ioctl = */ NULL,
+    /* .ioctl = */ nfq_daq_ioctl,
     /* .get_stats = */ nfq_daq_get_stats,
     /* .reset_stats = */ nfq_daq_reset_stats,
     /* .get_snaplen = */ nfq_daq_get_snaplen,
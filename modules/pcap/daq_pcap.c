@@ -43,6 +43,8 @@ typedef struct _pcap_pkt_desc
 {
     DAQ_Msg_t msg;
     DAQ_PktHdr_t pkthdr;
+    DAQ_PktTimestamp_t ts;
+    DAQ_MsgMeta_t ts_meta;
     uint8_t *data;
     struct _pcap_pkt_desc *next;
 } PcapPktDesc;
@@ -76,6 +78,7 @@ typedef struct _pcap_context
     FILE *fp;
     uint32_t netmask;
     bool nonblocking;
+    bool nsec_timestamps;
     volatile bool interrupted;
     /* Readback timeout state */
     struct timeval last_recv;
@@ -101,6 +104,7 @@ static DAQ_VariableDesc_t pcap_variable_descriptions[] = {
 };
 
 static DAQ_BaseAPI_t daq_base_api;
+static unsigned timestamp_meta_type;
 static pthread_mutex_t bpf_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 static void destroy_packet_pool(Pcap_Context_t *pc)
@@ -157,6 +161,9 @@ static int create_packet_pool(Pcap_Context_t *pc, unsigned size)
         msg->data = desc->data;
         msg->owner = pc->modinst;
         msg->priv = desc;
+        desc->ts_meta.data = &desc->ts;
+        desc->ts_meta.type = timestamp_meta_type;
+        msg->meta_ext = &desc->ts_meta;
 
         /* Place it on the free list */
         desc->next = pool->freelist;
@@ -220,6 +227,11 @@ static int pcap_daq_module_load(const DAQ_BaseAPI_t *base_api)
     if (base_api->api_version != DAQ_BASE_API_VERSION || base_api->api_size != sizeof(DAQ_BaseAPI_t))
         return DAQ_ERROR;
 
+    int type = base_api->meta_type_register(DAQ_META_TYPE_TIMESTAMP, sizeof(DAQ_PktTimestamp_t));
+    if (type < 0)
+        return type;
+    timestamp_meta_type = type;
+
     daq_base_api = *base_api;
 
     return DAQ_SUCCESS;
@@ -431,6 +443,8 @@ static int pcap_daq_start(void *handle)
             goto fail;
         if ((status = pcap_set_buffer_size(pc->handle, pc->buffer_size)) < 0)
             goto fail;
+        /* Ask for nanosecond timestamps, but settle for whatever the device supports. */
+        pcap_set_tstamp_precision(pc->handle, PCAP_TSTAMP_PRECISION_NANO);
         if ((status = pcap_activate(pc->handle)) < 0)
             goto fail;
         if ((status = set_nonblocking(pc, true)) < 0)
@@ -440,7 +454,7 @@ static int pcap_daq_start(void *handle)
     }
     else
     {
-        pc->handle = pcap_fopen_offline(pc->fp, pc->pcap_errbuf);
+        pc->handle = pcap_fopen_offline_with_tstamp_precision(pc->fp, PCAP_TSTAMP_PRECISION_NANO, pc->pcap_errbuf);
         if (!pc->handle)
             goto fail;
         pc->fp = NULL;
@@ -448,6 +462,7 @@ static int pcap_daq_start(void *handle)
         netmask = htonl(defaultnet);
     }
     pc->netmask = netmask;
+    pc->nsec_timestamps = (pcap_get_tstamp_precision(pc->handle) == PCAP_TSTAMP_PRECISION_NANO);
 
     if (pc->filter_string)
     {
@@ -581,7 +596,7 @@ static int pcap_daq_get_datalink_type(void *handle)
     return DLT_NULL;
 }
 
-static unsigned pcap_daq_msg_receive(void *handle, const unsigned max_recv, const DAQ_Msg_t *msgs[], DAQ_RecvStatus *rstat)
+DAQ_STACK_LINKAGE unsigned pcap_daq_msg_receive(void *handle, const unsigned max_recv, const DAQ_Msg_t *msgs[], DAQ_RecvStatus *rstat)
 {
     struct pcap_pkthdr *pcaphdr;
     Pcap_Context_t *pc = (Pcap_Context_t *) handle;
@@ -701,7 +716,17 @@ static unsigned pcap_daq_msg_receive(void *handle, const unsigned max_recv, cons
         DAQ_PktHdr_t *pkthdr = &desc->pkthdr;
         pkthdr->pktlen = pcaphdr->len;
         pkthdr->ts.tv_sec = pcaphdr->ts.tv_sec;
-        pkthdr->ts.tv_usec = pcaphdr->ts.tv_usec;
+        if (pc->nsec_timestamps)
+        {
+            /* The handle was opened with nanosecond precision, so tv_usec really holds nanoseconds. */
+            pkthdr->ts.tv_usec = pcaphdr->ts.tv_usec / 1000;
+            desc->ts.nsec = (uint64_t) pcaphdr->ts.tv_sec * 1000000000 + pcaphdr->ts.tv_usec;
+        }
+        else
+        {
+            pkthdr->ts.tv_usec = pcaphdr->ts.tv_usec;
+            desc->ts.nsec = (uint64_t) pcaphdr->ts.tv_sec * 1000000000 + (uint64_t) pcaphdr->ts.tv_usec * 1000;
+        }
 
         /* Last, but not least, extract this descriptor from the free list and 
             place the message in the return vector. */
@@ -736,7 +761,7 @@ static unsigned pcap_daq_msg_receive(void *handle, const unsigned max_recv, cons
     return idx;
 }
 
-static int pcap_daq_msg_finalize(void *handle, const DAQ_Msg_t *msg, DAQ_Verdict verdict)
+DAQ_STACK_LINKAGE int pcap_daq_msg_finalize(void *handle, const DAQ_Msg_t *msg, DAQ_Verdict verdict)
 {
     Pcap_Context_t *pc = (Pcap_Context_t *) handle;
     PcapPktDesc *desc = (PcapPktDesc *) msg->priv;
@@ -0,0 +1,417 @@
+/*
+** Copyright (C) 2014-2021 Cisco and/or its affiliates. All rights reserved.
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation.  You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "daq_dlt.h"
+#include "daq_module_api.h"
+#include "daq_module_util.h"
+
+#define DAQ_SAMPLE_VERSION 1
+
+#define SAMPLE_DEFAULT_MIN_RATE     1.0
+#define SAMPLE_DEFAULT_INTERVAL_MS  100
+/* Largest factor by which the sampling rate may grow in a single adjustment */
+#define SAMPLE_MAX_GROWTH           1.25
+
+#define SET_ERROR(modinst, ...)    daq_base_api.set_errbuf(modinst, __VA_ARGS__)
+
+#define CHECK_SUBAPI(ctxt, fname) \
+    (ctxt->subapi.fname.func != NULL)
+
+#define CALL_SUBAPI_NOARGS(ctxt, fname) \
+    ctxt->subapi.fname.func(ctxt->subapi.fname.context)
+
+#define CALL_SUBAPI(ctxt, fname, ...) \
+    DAQ_SUBAPI_CALL(ctxt->subapi, fname, __VA_ARGS__)
+
+typedef struct
+{
+    /* Configuration */
+    double max_rate;
+    double min_rate;
+    double budget;
+    uint64_t interval;      // Nanoseconds
+    DAQ_Verdict verdict;
+
+    DAQ_ModuleInstance_h modinst;
+    DAQ_InstanceAPI_t subapi;
+    int dlt;
+
+    /* Flows whose hash falls below the threshold are sampled.  Lowering the threshold only ever
+        drops the flows at the top of the range, so a flow that stays sampled isn't cut short. */
+    double rate;
+    uint64_t threshold;
+
+    /* Processing time accounting */
+    uint64_t interval_start;
+    uint64_t returned;
+    uint64_t busy;
+    unsigned utilization;
+
+    /* Counters */
+    uint64_t sampled_packets;
+    uint64_t unsampled_packets;
+    uint64_t unsampled_bytes;
+    uint64_t adjustments;
+} SampleContext;
+
+static DAQ_VariableDesc_t sample_variable_descriptions[] = {
+    { "rate", "Percentage of flows to sample (default: 100)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "budget", "Percentage of the time the application may spend processing packets; adjusts the rate to match (default: 0, fixed rate)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "min-rate", "Lowest percentage of flows to sample when adjusting the rate (default: 1)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "interval", "Milliseconds between adjustments of the rate (default: 100)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "action", "Verdict to render on packets from unsampled flows: pass or whitelist (default: pass)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+};
+
+static DAQ_BaseAPI_t daq_base_api;
+
+//-------------------------------------------------------------------------
+
+static int parse_percentage(const char *str, double *value)
+{
+    char *endptr;
+
+    if (!str || *str == '\0')
+        return -1;
+
+    errno = 0;
+    *value = strtod(str, &endptr);
+    if (*endptr != '\0' || errno != 0 || !(*value >= 0.0 && *value <= 100.0))
+        return -1;
+
+    return 0;
+}
+
+static inline uint64_t sample_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sample_set_rate(SampleContext *sc, double rate)
+{
+    if (rate > sc->max_rate)
+        rate = sc->max_rate;
+    if (rate < sc->min_rate)
+        rate = sc->min_rate;
+    sc->rate = rate;
+    sc->threshold = (uint64_t) (rate / 100.0 * 4294967296.0);
+}
+
+
+//-------------------------------------------------------------------------
+// Rate adjustment
+//-------------------------------------------------------------------------
+
+/* Scale the sampling rate by how far the application's share of the time spent busy was from the
+    budget over the last interval.  Cutting back happens in a single step so that an overload is
+    shed right away; growing back is limited to a fraction per interval to avoid oscillating. */
+static void sample_adjust_rate(SampleContext *sc, uint64_t now)
+{
+    uint64_t elapsed = now - sc->interval_start;
+    double utilization = (double) sc->busy * 100.0 / elapsed;
+    if (utilization > 100.0)
+        utilization = 100.0;
+
+    double factor = (utilization > 0.0) ? sc->budget / utilization : SAMPLE_MAX_GROWTH;
+    if (factor > SAMPLE_MAX_GROWTH)
+        factor = SAMPLE_MAX_GROWTH;
+
+    double old_rate = sc->rate;
+    sample_set_rate(sc, sc->rate * factor);
+    if (sc->rate != old_rate)
+        sc->adjustments++;
+
+    sc->utilization = (unsigned) utilization;
+    sc->interval_start = now;
+    sc->busy = 0;
+}
+
+static void sample_add_counter(DIOCTL_GetModuleCounters *gmc, const char *name, uint64_t value)
+{
+    if (gmc->num_counters >= gmc->max_counters)
+        return;
+
+    DAQ_ModuleCounter_t *counter = &gmc->counters[gmc->num_counters++];
+    counter->module = "sample";
+    counter->name = name;
+    counter->value = value;
+}
+
+
+//-------------------------------------------------------------------------
+// DAQ Module API
+//-------------------------------------------------------------------------
+
+static int sample_daq_module_load(const DAQ_BaseAPI_t *base_api)
+{
+    if (base_api->api_version != DAQ_BASE_API_VERSION || base_api->api_size != sizeof(DAQ_BaseAPI_t))
+        return DAQ_ERROR;
+
+    daq_base_api = *base_api;
+
+    return DAQ_SUCCESS;
+}
+
+static int sample_daq_module_unload(void)
+{
+    memset(&daq_base_api, 0, sizeof(daq_base_api));
+    return DAQ_SUCCESS;
+}
+
+static int sample_daq_get_variable_descs(const DAQ_VariableDesc_t **var_desc_table)
+{
+    *var_desc_table = sample_variable_descriptions;
+
+    return sizeof(sample_variable_descriptions) / sizeof(DAQ_VariableDesc_t);
+}
+
+static int sample_daq_instantiate(const DAQ_ModuleConfig_h modcfg, DAQ_ModuleInstance_h modinst, void **ctxt_ptr)
+{
+    SampleContext *sc = calloc(1, sizeof(SampleContext));
+    if (!sc)
+    {
+        SET_ERROR(modinst, "%s: Couldn't allocate memory for the DAQ context", __func__);
+        return DAQ_ERROR_NOMEM;
+    }
+    sc->modinst = modinst;
+
+    if (daq_base_api.resolve_subapi(modinst, &sc->subapi) != DAQ_SUCCESS)
+    {
+        SET_ERROR(modinst, "%s: Couldn't resolve subapi. No submodule configured?", __func__);
+        free(sc);
+        return DAQ_ERROR_INVAL;
+    }
+
+    sc->max_rate = 100.0;
+    sc->min_rate = SAMPLE_DEFAULT_MIN_RATE;
+    sc->interval = SAMPLE_DEFAULT_INTERVAL_MS * 1000000ULL;
+    sc->verdict = DAQ_VERDICT_PASS;
+
+    const char *varKey, *varValue;
+    daq_base_api.config_first_variable(modcfg, &varKey, &varValue);
+    while (varKey)
+    {
+        int rval = 0;
+
+        if (!strcmp(varKey, "rate"))
+            rval = parse_percentage(varValue, &sc->max_rate);
+        else if (!strcmp(varKey, "budget"))
+            rval = parse_percentage(varValue, &sc->budget);
+        else if (!strcmp(varKey, "min-rate"))
+            rval = parse_percentage(varValue, &sc->min_rate);
+        else if (!strcmp(varKey, "interval"))
+        {
+            unsigned long interval = 0;
+            if (util_parse_uint(varValue, &interval) != 0 || interval == 0)
+                rval = -1;
+            sc->interval = interval * 1000000ULL;
+        }
+        else if (!strcmp(varKey, "action"))
+        {
+            if (varValue && !strcmp(varValue, "pass"))
+                sc->verdict = DAQ_VERDICT_PASS;
+            else if (varValue && !strcmp(varValue, "whitelist"))
+                sc->verdict = DAQ_VERDICT_WHITELIST;
+            else
+                rval = -1;
+        }
+
+        if (rval != 0)
+        {
+            SET_ERROR(modinst, "%s: Invalid value for key '%s': '%s'", __func__, varKey, varValue);
+            free(sc);
+            return DAQ_ERROR_INVAL;
+        }
+
+        daq_base_api.config_next_variable(modcfg, &varKey, &varValue);
+    }
+
+    /* With a fixed rate, the minimum doesn't apply. */
+    if (sc->budget == 0.0 || sc->min_rate > sc->max_rate)
+        sc->min_rate = sc->max_rate;
+    sample_set_rate(sc, sc->max_rate);
+
+    *ctxt_ptr = sc;
+
+    return DAQ_SUCCESS;
+}
+
+static void sample_daq_destroy(void *handle)
+{
+    SampleContext *sc = (SampleContext *) handle;
+
+    free(sc);
+}
+
+static int sample_daq_start(void *handle)
+{
+    SampleContext *sc = (SampleContext *) handle;
+
+    int rval = CALL_SUBAPI_NOARGS(sc, start);
+    if (rval != DAQ_SUCCESS)
+        return rval;
+
+    sc->dlt = CHECK_SUBAPI(sc, get_datalink_type) ? CALL_SUBAPI_NOARGS(sc, get_datalink_type) : DLT_EN10MB;
+    sc->interval_start = sample_now();
+    sc->returned = 0;
+    sc->busy = 0;
+
+    return DAQ_SUCCESS;
+}
+
+static int sample_daq_ioctl(void *handle, DAQ_IoctlCmd cmd, void *arg, size_t arglen)
+{
+    SampleContext *sc = (SampleContext *) handle;
+
+    if (cmd == DIOCTL_GET_MODULE_COUNTERS)
+    {
+        if (arglen != sizeof(DIOCTL_GetModuleCounters))
+            return DAQ_ERROR_INVAL;
+        DIOCTL_GetModuleCounters *gmc = (DIOCTL_GetModuleCounters *) arg;
+        if (!gmc->counters && gmc->max_counters > 0)
+            return DAQ_ERROR_INVAL;
+
+        sample_add_counter(gmc, "sampled_packets", sc->sampled_packets);
+        sample_add_counter(gmc, "unsampled_packets", sc->unsampled_packets);
+        sample_add_counter(gmc, "unsampled_bytes", sc->unsampled_bytes);
+        sample_add_counter(gmc, "rate_ppm", (uint64_t) (sc->rate * 10000.0));
+        if (sc->budget > 0.0)
+        {
+            sample_add_counter(gmc, "utilization", sc->utilization);
+            sample_add_counter(gmc, "adjustments", sc->adjustments);
+        }
+
+        if (CHECK_SUBAPI(sc, ioctl))
+        {
+            int rval = CALL_SUBAPI(sc, ioctl, cmd, arg, arglen);
+            if (rval != DAQ_SUCCESS && rval != DAQ_ERROR_NOTSUP)
+                return rval;
+        }
+        return DAQ_SUCCESS;
+    }
+
+    if (!CHECK_SUBAPI(sc, ioctl))
+        return DAQ_ERROR_NOTSUP;
+
+    return CALL_SUBAPI(sc, ioctl, cmd, arg, arglen);
+}
+
+static void sample_daq_reset_stats(void *handle)
+{
+    SampleContext *sc = (SampleContext *) handle;
+
+    if (CHECK_SUBAPI(sc, reset_stats))
+        CALL_SUBAPI_NOARGS(sc, reset_stats);
+
+    sc->sampled_packets = 0;
+    sc->unsampled_packets = 0;
+    sc->unsampled_bytes = 0;
+    sc->adjustments = 0;
+}
+
+DAQ_STACK_LINKAGE unsigned sample_daq_msg_receive(void *handle, const unsigned max_recv, const DAQ_Msg_t *msgs[], DAQ_RecvStatus *rstat)
+{
+    SampleContext *sc = (SampleContext *) handle;
+
+    /* The application was busy from the time the last receive returned until now. */
+    if (sc->budget > 0.0)
+    {
+        uint64_t now = sample_now();
+        if (sc->returned)
+            sc->busy += now - sc->returned;
+        if (now - sc->interval_start >= sc->interval)
+            sample_adjust_rate(sc, now);
+    }
+
+    unsigned num_recv = CALL_SUBAPI(sc, msg_receive, max_recv, msgs, rstat);
+
+    unsigned num_delivered = 0;
+    for (unsigned i = 0; i < num_recv; i++)
+    {
+        const DAQ_Msg_t *msg = msgs[i];
+
+        if (sc->threshold > UINT32_MAX || util_flow_hash_msg(msg, sc->dlt) < sc->threshold)
+        {
+            if (msg->type == DAQ_MSG_TYPE_PACKET)
+                sc->sampled_packets++;
+            msgs[num_delivered++] = msg;
+            continue;
+        }
+
+        if (msg->type == DAQ_MSG_TYPE_PACKET)
+        {
+            sc->unsampled_packets++;
+            sc->unsampled_bytes += msg->data_len;
+        }
+        CALL_SUBAPI(sc, msg_finalize, msg, sc->verdict);
+    }
+
+    if (sc->budget > 0.0)
+        sc->returned = sample_now();
+
+    return num_delivered;
+}
+
+#ifdef BUILDING_SO
+DAQ_SO_PUBLIC DAQ_ModuleAPI_t DAQ_MODULE_DATA =
+#else
+DAQ_ModuleAPI_t sample_daq_module_data =
+#endif
+{
+    /* .api_version = */ DAQ_MODULE_API_VERSION,
+    /* .api_size = */ sizeof(DAQ_ModuleAPI_t),
+    /* .module_version = */ DAQ_SAMPLE_VERSION,
+    /* .name = */ "sample",
+    /* .type = */ DAQ_TYPE_WRAPPER | DAQ_TYPE_INLINE_CAPABLE,
+    /* .load = */ sample_daq_module_load,
+    /* .unload = */ sample_daq_module_unload,
+    /* .get_variable_descs = */ sample_daq_get_variable_descs,
+    /* .instantiate = */ sample_daq_instantiate,
+    /* .destroy = */ sample_daq_destroy,
+    /* .set_filter = */ NULL,
+    /* .start = */ sample_daq_start,
+    /* .inject = */ NULL,
+    /* .inject_relative = */ NULL,
+    /* .interrupt = */ NULL,
+    /* .stop = */ NULL,
+    /* .ioctl = */ sample_daq_ioctl,
+    /* .get_stats = */ NULL,
+    /* .reset_stats = */ sample_daq_reset_stats,
+    /* .get_snaplen = */ NULL,
+    /* .get_capabilities = */ NULL,
+    /* .get_datalink_type = */ NULL,
+    /* .config_load = */ NULL,
+    /* .config_swap = */ NULL,
+    /* .config_free = */ NULL,
+    /* .msg_receive = */ sample_daq_msg_receive,
+    /* .msg_finalize = */ NULL,
+    /* .get_msg_pool_info = */ NULL,
+};
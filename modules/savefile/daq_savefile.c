@@ -63,7 +63,7 @@ struct pcap_file_header
 
 struct pcap_timeval {
     int32_t tv_sec;       /* seconds */
-    int32_t tv_usec;      /* microseconds */
+    int32_t tv_usec;      /* microseconds (nanoseconds with NSEC_TCPDUMP_MAGIC) */
 };
 
 struct pcap_sf_pkthdr
@@ -77,6 +77,8 @@ typedef struct _savefile_msg_desc
 {
     DAQ_Msg_t msg;
     DAQ_PktHdr_t pkthdr;
+    DAQ_PktTimestamp_t ts;
+    DAQ_MsgMeta_t ts_meta;
     struct _savefile_msg_desc *next;
 } SavefileMsgDesc;
 
@@ -101,10 +103,12 @@ typedef struct
     off_t file_size;
     off_t file_offset;
     int fd;
+    bool nsec_timestamps;
     volatile bool interrupted;
 } SavefileContext;
 
 static DAQ_BaseAPI_t daq_base_api;
+static unsigned timestamp_meta_type;
 
 static void destroy_message_pool(SavefileContext *sfc)
 {
@@ -149,6 +153,9 @@ static int create_message_pool(SavefileContext *sfc, unsigned size)
         msg->hdr = &desc->pkthdr;
         msg->owner = sfc->modinst;
         msg->priv = desc;
+        desc->ts_meta.data = &desc->ts;
+        desc->ts_meta.type = timestamp_meta_type;
+        msg->meta_ext = &desc->ts_meta;
 
         /* Place it on the free list */
         desc->next = pool->freelist;
@@ -201,7 +208,16 @@ static DAQ_RecvStatus savefile_read_message(SavefileContext *sfc, SavefileMsgDes
     DAQ_PktHdr_t *pkthdr = &desc->pkthdr;
     pkthdr->pktlen = sfhdr->len;
     pkthdr->ts.tv_sec = sfhdr->ts.tv_sec;
-    pkthdr->ts.tv_usec = sfhdr->ts.tv_usec;
+    if (sfc->nsec_timestamps)
+    {
+        pkthdr->ts.tv_usec = sfhdr->ts.tv_usec / 1000;
+        desc->ts.nsec = (uint64_t) (uint32_t) sfhdr->ts.tv_sec * 1000000000 + (uint32_t) sfhdr->ts.tv_usec;
+    }
+    else
+    {
+        pkthdr->ts.tv_usec = sfhdr->ts.tv_usec;
+        desc->ts.nsec = (uint64_t) (uint32_t) sfhdr->ts.tv_sec * 1000000000 + (uint64_t) (uint32_t) sfhdr->ts.tv_usec * 1000;
+    }
 
     return DAQ_RSTAT_OK;
 }
@@ -211,6 +227,11 @@ static int savefile_daq_module_load(const DAQ_BaseAPI_t *base_api)
     if (base_api->api_version != DAQ_BASE_API_VERSION || base_api->api_size != sizeof(DAQ_BaseAPI_t))
         return DAQ_ERROR;
 
+    int type = base_api->meta_type_register(DAQ_META_TYPE_TIMESTAMP, sizeof(DAQ_PktTimestamp_t));
+    if (type < 0)
+        return type;
+    timestamp_meta_type = type;
+
     daq_base_api = *base_api;
 
     return DAQ_SUCCESS;
@@ -325,6 +346,7 @@ static int savefile_daq_start(void *handle)
         SET_ERROR(sfc->modinst, "%s: Invalid PCAP savefile magic: %x", __func__, pfhdr->magic);
         goto err;
     }
+    sfc->nsec_timestamps = (pfhdr->magic == NSEC_TCPDUMP_MAGIC);
 
     /* Validate the file format version (only 2.4 is supported). */
     if (pfhdr->version_major != PCAP_VERSION_MAJOR || pfhdr->version_minor != PCAP_VERSION_MINOR)
@@ -415,7 +437,7 @@ static int savefile_daq_get_datalink_type(void *handle)
     return (sfc->pfhdr->linktype & 0x03FFFFFF);
 }
 
-static unsigned savefile_daq_msg_receive(void *handle, const unsigned max_recv, const DAQ_Msg_t *msgs[], DAQ_RecvStatus *rstat)
+DAQ_STACK_LINKAGE unsigned savefile_daq_msg_receive(void *handle, const unsigned max_recv, const DAQ_Msg_t *msgs[], DAQ_RecvStatus *rstat)
 {
     SavefileContext *sfc = (SavefileContext *) handle;
     DAQ_RecvStatus status = DAQ_RSTAT_OK;
@@ -466,7 +488,7 @@ static unsigned savefile_daq_msg_receive(void *handle, const unsigned max_recv,
     return idx;
 }
 
-static int savefile_daq_msg_finalize(void *handle, const DAQ_Msg_t *msg, DAQ_Verdict verdict)
+DAQ_STACK_LINKAGE int savefile_daq_msg_finalize(void *handle, const DAQ_Msg_t *msg, DAQ_Verdict verdict)
 {
     SavefileContext *sfc = (SavefileContext *) handle;
     SavefileMsgDesc *desc = (SavefileMsgDesc *) msg->priv;
@@ -0,0 +1,681 @@
+/*
+** Copyright (C) 2014-2021 Cisco and/or its affiliates. All rights reserved.
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation.  You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "daq_dlt.h"
+#include "daq_module_api.h"
+#include "daq_module_util.h"
+
+#include "shm_ring.h"
+
+#define DAQ_SHMPUB_VERSION 1
+
+#define SHMPUB_DEFAULT_NAME     "daq"
+#define SHMPUB_DEFAULT_BUFFERS  1024
+#define SHMPUB_MAX_BUFFERS      (1 << 20)
+
+#define SET_ERROR(modinst, ...)    daq_base_api.set_errbuf(modinst, __VA_ARGS__)
+
+#define CHECK_SUBAPI(ctxt, fname) \
+    (ctxt->subapi.fname.func != NULL)
+
+#define CALL_SUBAPI_NOARGS(ctxt, fname) \
+    ctxt->subapi.fname.func(ctxt->subapi.fname.context)
+
+#define CALL_SUBAPI(ctxt, fname, ...) \
+    DAQ_SUBAPI_CALL(ctxt->subapi, fname, __VA_ARGS__)
+
+typedef struct
+{
+    /* Configuration */
+    char name[NAME_MAX];
+    unsigned buffers;
+    unsigned snaplen;
+    unsigned timeout;
+
+    DAQ_ModuleInstance_h modinst;
+    DAQ_InstanceAPI_t subapi;
+
+    /* Shared memory */
+    ShmRegionHdr *region;
+    size_t region_size;
+    ShmRing *packet_ring;
+    ShmRing *verdict_ring;
+    uint8_t *buffer_base;
+    uint32_t num_buffers;
+    uint32_t buffer_size;
+    uint32_t attach_gen;
+
+    /* Buffers held by the consumer, with the wrapped module's message for each */
+    const DAQ_Msg_t **held;
+    uint32_t *held_pos;         // Packet ring position each held buffer was published at
+    uint32_t *free_buffers;
+    uint32_t num_free;
+    volatile bool interrupted;
+
+    /* Counters */
+    uint64_t published;
+    uint64_t published_bytes;
+    uint64_t truncated;
+    uint64_t verdicts;
+    uint64_t buffer_waits;
+    uint64_t reclaimed;
+    uint64_t stale_verdicts;
+} ShmpubContext;
+
+static DAQ_VariableDesc_t shmpub_variable_descriptions[] = {
+    { "name", "Name of the shared memory packet ring (default: daq)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "buffers", "Number of packet buffers, rounded up to a power of two (default: the wrapped module's message pool size)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+};
+
+static DAQ_BaseAPI_t daq_base_api;
+static unsigned timestamp_meta_type;
+
+//-------------------------------------------------------------------------
+
+static void shmpub_add_counter(DIOCTL_GetModuleCounters *gmc, const char *name, uint64_t value)
+{
+    if (gmc->num_counters >= gmc->max_counters)
+        return;
+
+    DAQ_ModuleCounter_t *counter = &gmc->counters[gmc->num_counters++];
+    counter->module = "shmpub";
+    counter->name = name;
+    counter->value = value;
+}
+
+static inline ShmPktHdr *shmpub_buffer(ShmpubContext *spc, uint32_t buffer)
+{
+    return (ShmPktHdr *) (spc->buffer_base + (size_t) buffer * spc->buffer_size);
+}
+
+/* Hand a buffer's message back to the wrapped module with the consumer's verdict. */
+static void shmpub_release(ShmpubContext *spc, uint32_t buffer, DAQ_Verdict verdict)
+{
+    const DAQ_Msg_t *msg = spc->held[buffer];
+
+    /* The consumer modified the packet in place in the shared buffer. */
+    if (verdict == DAQ_VERDICT_REPLACE)
+    {
+        uint32_t len = (msg->data_len < spc->snaplen) ? msg->data_len : spc->snaplen;
+        memcpy(msg->data, shmpub_buffer(spc, buffer) + 1, len);
+    }
+
+    CALL_SUBAPI(spc, msg_finalize, msg, verdict);
+    spc->held[buffer] = NULL;
+    spc->free_buffers[spc->num_free++] = buffer;
+}
+
+/*
+ * Collect the verdicts posted by the consumer.  When a new consumer has attached since the last
+ * call, also pass whatever the previous one took from the packet ring but never rendered a verdict
+ * on; no verdict will ever come for those.
+ */
+static void shmpub_reap(ShmpubContext *spc)
+{
+    ShmRegionHdr *hdr = spc->region;
+    ShmRing *ring = spc->verdict_ring;
+    uint32_t mask = spc->num_buffers - 1;
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = ring->tail;
+
+    while (tail != head)
+    {
+        const ShmDesc *sd = &ring->desc[tail & mask];
+        uint32_t offset = sd->offset - hdr->buffers;
+        uint32_t buffer = offset / spc->buffer_size;
+
+        if (sd->offset < hdr->buffers || offset % spc->buffer_size || buffer >= spc->num_buffers ||
+            !spc->held[buffer])
+            spc->stale_verdicts++;
+        else
+        {
+            DAQ_Verdict verdict = (sd->metadata < MAX_DAQ_VERDICT) ? (DAQ_Verdict) sd->metadata : DAQ_VERDICT_PASS;
+            shmpub_release(spc, buffer, verdict);
+            spc->verdicts++;
+        }
+        tail++;
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+    uint32_t attach_gen = __atomic_load_n(&hdr->attach_gen, __ATOMIC_ACQUIRE);
+    if (attach_gen != spc->attach_gen)
+    {
+        uint32_t reclaim_pos = __atomic_load_n(&hdr->reclaim_pos, __ATOMIC_RELAXED);
+
+        spc->attach_gen = attach_gen;
+        for (uint32_t buffer = 0; buffer < spc->num_buffers; buffer++)
+        {
+            if (spc->held[buffer] && (int32_t) (spc->held_pos[buffer] - reclaim_pos) < 0)
+            {
+                shmpub_release(spc, buffer, DAQ_VERDICT_PASS);
+                spc->reclaimed++;
+            }
+        }
+    }
+}
+
+/* Wait for the consumer to return buffers.  Returns false on interruption or timeout. */
+static bool shmpub_wait(ShmpubContext *spc, DAQ_RecvStatus *rstat)
+{
+    uint32_t num_free = spc->num_free;
+
+    shm_ring_wait(spc->verdict_ring, spc->verdict_ring->tail, spc->timeout);
+    if (spc->interrupted)
+    {
+        spc->interrupted = false;
+        *rstat = DAQ_RSTAT_INTERRUPTED;
+        return false;
+    }
+    shmpub_reap(spc);
+    if (spc->num_free == num_free && spc->timeout)
+    {
+        *rstat = DAQ_RSTAT_TIMEOUT;
+        return false;
+    }
+    return true;
+}
+
+static void shmpub_publish(ShmpubContext *spc, const DAQ_Msg_t *msg, uint32_t head)
+{
+    const DAQ_PktHdr_t *pkthdr = (const DAQ_PktHdr_t *) msg->hdr;
+    uint32_t buffer = spc->free_buffers[--spc->num_free];
+    ShmPktHdr *sph = shmpub_buffer(spc, buffer);
+
+    const DAQ_PktTimestamp_t *pts = (const DAQ_PktTimestamp_t *) daq_msg_find_meta(msg, timestamp_meta_type);
+    if (pts)
+    {
+        sph->ts_nsec = pts->nsec;
+        sph->ts_source = pts->source;
+    }
+    else
+    {
+        sph->ts_nsec = (uint64_t) pkthdr->ts.tv_sec * 1000000000 + (uint64_t) pkthdr->ts.tv_usec * 1000;
+        sph->ts_source = DAQ_PKT_TS_SOURCE_UNKNOWN;
+    }
+    sph->pktlen = pkthdr->pktlen;
+    sph->ingress_index = pkthdr->ingress_index;
+    sph->egress_index = pkthdr->egress_index;
+    sph->ingress_group = pkthdr->ingress_group;
+    sph->egress_group = pkthdr->egress_group;
+    sph->opaque = pkthdr->opaque;
+    sph->flow_id = pkthdr->flow_id;
+    sph->flags = pkthdr->flags;
+    sph->address_space_id = pkthdr->address_space_id;
+
+    uint32_t len = msg->data_len;
+    if (len > spc->snaplen)
+    {
+        len = spc->snaplen;
+        spc->truncated++;
+    }
+    memcpy(sph + 1, msg->data, len);
+
+    ShmDesc *sd = &spc->packet_ring->desc[head & (spc->num_buffers - 1)];
+    sd->flags = 0;
+    sd->region = 0;
+    sd->length = len;
+    sd->offset = spc->region->buffers + buffer * spc->buffer_size;
+    sd->metadata = 0;
+
+    spc->held[buffer] = msg;
+    spc->held_pos[buffer] = head;
+    spc->published++;
+    spc->published_bytes += len;
+}
+
+static void shmpub_destroy_region(ShmpubContext *spc)
+{
+    if (spc->region)
+    {
+        munmap(spc->region, spc->region_size);
+        spc->region = NULL;
+        shm_unlink(spc->name);
+    }
+    free(spc->held);
+    spc->held = NULL;
+    free(spc->held_pos);
+    spc->held_pos = NULL;
+    free(spc->free_buffers);
+    spc->free_buffers = NULL;
+    spc->num_free = 0;
+}
+
+static int shmpub_create_region(ShmpubContext *spc, uint32_t num_buffers, int dlt)
+{
+    uint32_t buffer_size = (sizeof(ShmPktHdr) + spc->snaplen + SHM_CACHE_LINE - 1) & ~(SHM_CACHE_LINE - 1);
+    uint32_t ring_size = shm_ring_size(num_buffers);
+    uint32_t packet_ring = (sizeof(ShmRegionHdr) + SHM_CACHE_LINE - 1) & ~(SHM_CACHE_LINE - 1);
+    uint32_t verdict_ring = packet_ring + ring_size;
+    uint32_t buffers = verdict_ring + ring_size;
+    uint64_t region_size = buffers + (uint64_t) num_buffers * buffer_size;
+
+    if (region_size > UINT32_MAX)
+    {
+        SET_ERROR(spc->modinst, "%s: %u buffers of %u bytes don't fit in a packet ring", __func__,
+                num_buffers, buffer_size);
+        return DAQ_ERROR_INVAL;
+    }
+
+    spc->held = calloc(num_buffers, sizeof(*spc->held));
+    spc->held_pos = calloc(num_buffers, sizeof(*spc->held_pos));
+    spc->free_buffers = calloc(num_buffers, sizeof(*spc->free_buffers));
+    if (!spc->held || !spc->held_pos || !spc->free_buffers)
+    {
+        SET_ERROR(spc->modinst, "%s: Couldn't allocate the buffer tracking for %u buffers", __func__, num_buffers);
+        shmpub_destroy_region(spc);
+        return DAQ_ERROR_NOMEM;
+    }
+
+    /* Replace anything left behind by a producer that didn't shut down cleanly.  Consumers still
+        attached to it keep their mapping until they notice it is gone. */
+    shm_unlink(spc->name);
+    int fd = shm_open(spc->name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd == -1)
+    {
+        SET_ERROR(spc->modinst, "%s: Couldn't create shared memory '%s': %s (%d)", __func__,
+                spc->name, strerror(errno), errno);
+        shmpub_destroy_region(spc);
+        return DAQ_ERROR;
+    }
+    if (ftruncate(fd, region_size) == -1)
+    {
+        SET_ERROR(spc->modinst, "%s: Couldn't size shared memory '%s' to %" PRIu64 " bytes: %s (%d)", __func__,
+                spc->name, region_size, strerror(errno), errno);
+        close(fd);
+        shm_unlink(spc->name);
+        shmpub_destroy_region(spc);
+        return DAQ_ERROR;
+    }
+    void *region = mmap(NULL, region_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (region == MAP_FAILED)
+    {
+        SET_ERROR(spc->modinst, "%s: Couldn't map shared memory '%s': %s (%d)", __func__,
+                spc->name, strerror(errno), errno);
+        shm_unlink(spc->name);
+        shmpub_destroy_region(spc);
+        return DAQ_ERROR;
+    }
+
+    spc->region = (ShmRegionHdr *) region;
+    spc->region_size = region_size;
+    spc->packet_ring = (ShmRing *) ((uint8_t *) region + packet_ring);
+    spc->verdict_ring = (ShmRing *) ((uint8_t *) region + verdict_ring);
+    spc->buffer_base = (uint8_t *) region + buffers;
+    spc->num_buffers = num_buffers;
+    spc->buffer_size = buffer_size;
+    spc->attach_gen = 0;
+    for (uint32_t i = 0; i < num_buffers; i++)
+        spc->free_buffers[i] = num_buffers - 1 - i;
+    spc->num_free = num_buffers;
+
+    /* A fresh mapping is zeroed, so only the header needs filling in.  The magic goes last so that a
+        consumer never sees a half-initialized region. */
+    ShmRegionHdr *hdr = spc->region;
+    hdr->version = SHM_RING_VERSION;
+    hdr->num_buffers = num_buffers;
+    hdr->buffer_size = buffer_size;
+    hdr->snaplen = spc->snaplen;
+    hdr->dlt = dlt;
+    hdr->packet_ring = packet_ring;
+    hdr->verdict_ring = verdict_ring;
+    hdr->buffers = buffers;
+    hdr->region_size = region_size;
+    __atomic_store_n(&hdr->magic, SHM_RING_MAGIC, __ATOMIC_RELEASE);
+
+    return DAQ_SUCCESS;
+}
+
+//-------------------------------------------------------------------------
+
+static int shmpub_daq_module_load(const DAQ_BaseAPI_t *base_api)
+{
+    if (base_api->api_version != DAQ_BASE_API_VERSION || base_api->api_size != sizeof(DAQ_BaseAPI_t))
+        return DAQ_ERROR;
+
+    int type = base_api->meta_type_register(DAQ_META_TYPE_TIMESTAMP, sizeof(DAQ_PktTimestamp_t));
+    if (type < 0)
+        return type;
+    timestamp_meta_type = type;
+
+    daq_base_api = *base_api;
+
+    return DAQ_SUCCESS;
+}
+
+static int shmpub_daq_module_unload(void)
+{
+    memset(&daq_base_api, 0, sizeof(daq_base_api));
+    return DAQ_SUCCESS;
+}
+
+static int shmpub_daq_get_variable_descs(const DAQ_VariableDesc_t **var_desc_table)
+{
+    *var_desc_table = shmpub_variable_descriptions;
+
+    return sizeof(shmpub_variable_descriptions) / sizeof(DAQ_VariableDesc_t);
+}
+
+static int shmpub_daq_instantiate(const DAQ_ModuleConfig_h modcfg, DAQ_ModuleInstance_h modinst, void **ctxt_ptr)
+{
+    ShmpubContext *spc = calloc(1, sizeof(ShmpubContext));
+    if (!spc)
+    {
+        SET_ERROR(modinst, "%s: Couldn't allocate memory for the DAQ context", __func__);
+        return DAQ_ERROR_NOMEM;
+    }
+    spc->modinst = modinst;
+
+    if (daq_base_api.resolve_subapi(modinst, &spc->subapi) != DAQ_SUCCESS)
+    {
+        SET_ERROR(modinst, "%s: Couldn't resolve subapi. No submodule configured?", __func__);
+        free(spc);
+        return DAQ_ERROR_INVAL;
+    }
+
+    spc->snaplen = daq_base_api.config_get_snaplen(modcfg);
+    spc->timeout = daq_base_api.config_get_timeout(modcfg);
+
+    const char *name = SHMPUB_DEFAULT_NAME;
+    const char *varKey, *varValue;
+    daq_base_api.config_first_variable(modcfg, &varKey, &varValue);
+    while (varKey)
+    {
+        if (!strcmp(varKey, "name"))
+        {
+            if (!varValue || *varValue == '\0')
+            {
+                SET_ERROR(modinst, "%s: Invalid value for key '%s': '%s'", __func__, varKey, varValue);
+                free(spc);
+                return DAQ_ERROR_INVAL;
+            }
+            name = varValue;
+        }
+        else if (!strcmp(varKey, "buffers"))
+        {
+            unsigned long buffers;
+            if (util_parse_uint(varValue, &buffers) != 0 || buffers == 0 || buffers > SHMPUB_MAX_BUFFERS)
+            {
+                SET_ERROR(modinst, "%s: Invalid value for key '%s': '%s'", __func__, varKey, varValue);
+                free(spc);
+                return DAQ_ERROR_INVAL;
+            }
+            spc->buffers = buffers;
+        }
+        daq_base_api.config_next_variable(modcfg, &varKey, &varValue);
+    }
+
+    /* Each instance of a multi-instance configuration has its own ring. */
+    unsigned total_instances = daq_base_api.config_get_total_instances(modcfg);
+    unsigned instance_id = daq_base_api.config_get_instance_id(modcfg);
+    int len;
+    if (total_instances > 1)
+        len = snprintf(spc->name, sizeof(spc->name), "/%s.%u", name, instance_id);
+    else
+        len = snprintf(spc->name, sizeof(spc->name), "/%s", name);
+    if (len < 0 || (size_t) len >= sizeof(spc->name) || strchr(spc->name + 1, '/'))
+    {
+        SET_ERROR(modinst, "%s: Invalid shared memory name: '%s'", __func__, name);
+        free(spc);
+        return DAQ_ERROR_INVAL;
+    }
+
+    *ctxt_ptr = spc;
+
+    return DAQ_SUCCESS;
+}
+
+static void shmpub_daq_destroy(void *handle)
+{
+    ShmpubContext *spc = (ShmpubContext *) handle;
+
+    shmpub_destroy_region(spc);
+    free(spc);
+}
+
+static int shmpub_daq_start(void *handle)
+{
+    ShmpubContext *spc = (ShmpubContext *) handle;
+
+    int rval = CALL_SUBAPI_NOARGS(spc, start);
+    if (rval != DAQ_SUCCESS)
+        return rval;
+
+    /* Every buffer the consumer holds pins one of the wrapped module's messages, so there's no
+        point in having more buffers than those. */
+    uint32_t buffers = spc->buffers;
+    if (CHECK_SUBAPI(spc, get_msg_pool_info))
+    {
+        DAQ_MsgPoolInfo_t mpool_info = { };
+        CALL_SUBAPI(spc, get_msg_pool_info, &mpool_info);
+        if (mpool_info.size && (!buffers || buffers > mpool_info.size))
+            buffers = mpool_info.size;
+    }
+    if (!buffers)
+        buffers = SHMPUB_DEFAULT_BUFFERS;
+    uint32_t num_buffers = 1;
+    while (num_buffers < buffers)
+        num_buffers <<= 1;
+
+    int dlt = CHECK_SUBAPI(spc, get_datalink_type) ? CALL_SUBAPI_NOARGS(spc, get_datalink_type) : DLT_EN10MB;
+
+    rval = shmpub_create_region(spc, num_buffers, dlt);
+    if (rval != DAQ_SUCCESS)
+    {
+        if (CHECK_SUBAPI(spc, stop))
+            CALL_SUBAPI_NOARGS(spc, stop);
+        return rval;
+    }
+
+    return DAQ_SUCCESS;
+}
+
+static int shmpub_daq_interrupt(void *handle)
+{
+    ShmpubContext *spc = (ShmpubContext *) handle;
+
+    spc->interrupted = true;
+    if (spc->region)
+        shm_ring_doorbell(spc->verdict_ring);
+
+    if (CHECK_SUBAPI(spc, interrupt))
+        return CALL_SUBAPI_NOARGS(spc, interrupt);
+
+    return DAQ_SUCCESS;
+}
+
+static int shmpub_daq_stop(void *handle)
+{
+    ShmpubContext *spc = (ShmpubContext *) handle;
+
+    if (spc->region)
+    {
+        __atomic_store_n(&spc->region->closed, 1, __ATOMIC_RELEASE);
+        shm_ring_doorbell(spc->packet_ring);
+
+        /* The wrapped module needs its messages back before it stops. */
+        shmpub_reap(spc);
+        for (uint32_t buffer = 0; buffer < spc->num_buffers; buffer++)
+        {
+            if (spc->held[buffer])
+                shmpub_release(spc, buffer, DAQ_VERDICT_PASS);
+        }
+        shmpub_destroy_region(spc);
+    }
+
+    if (CHECK_SUBAPI(spc, stop))
+        return CALL_SUBAPI_NOARGS(spc, stop);
+
+    return DAQ_SUCCESS;
+}
+
+static int shmpub_daq_ioctl(void *handle, DAQ_IoctlCmd cmd, void *arg, size_t arglen)
+{
+    ShmpubContext *spc = (ShmpubContext *) handle;
+
+    if (cmd == DIOCTL_GET_MODULE_COUNTERS)
+    {
+        if (arglen != sizeof(DIOCTL_GetModuleCounters))
+            return DAQ_ERROR_INVAL;
+        DIOCTL_GetModuleCounters *gmc = (DIOCTL_GetModuleCounters *) arg;
+        if (!gmc->counters && gmc->max_counters > 0)
+            return DAQ_ERROR_INVAL;
+
+        shmpub_add_counter(gmc, "published", spc->published);
+        shmpub_add_counter(gmc, "published_bytes", spc->published_bytes);
+        shmpub_add_counter(gmc, "truncated", spc->truncated);
+        shmpub_add_counter(gmc, "verdicts", spc->verdicts);
+        shmpub_add_counter(gmc, "held", spc->num_buffers - spc->num_free);
+        shmpub_add_counter(gmc, "buffer_waits", spc->buffer_waits);
+        shmpub_add_counter(gmc, "reclaimed", spc->reclaimed);
+        shmpub_add_counter(gmc, "stale_verdicts", spc->stale_verdicts);
+
+        if (CHECK_SUBAPI(spc, ioctl))
+        {
+            int rval = CALL_SUBAPI(spc, ioctl, cmd, arg, arglen);
+            if (rval != DAQ_SUCCESS && rval != DAQ_ERROR_NOTSUP)
+                return rval;
+        }
+        return DAQ_SUCCESS;
+    }
+
+    if (!CHECK_SUBAPI(spc, ioctl))
+        return DAQ_ERROR_NOTSUP;
+
+    return CALL_SUBAPI(spc, ioctl, cmd, arg, arglen);
+}
+
+static void shmpub_daq_reset_stats(void *handle)
+{
+    ShmpubContext *spc = (ShmpubContext *) handle;
+
+    if (CHECK_SUBAPI(spc, reset_stats))
+        CALL_SUBAPI_NOARGS(spc, reset_stats);
+
+    spc->published = 0;
+    spc->published_bytes = 0;
+    spc->truncated = 0;
+    spc->verdicts = 0;
+    spc->buffer_waits = 0;
+    spc->reclaimed = 0;
+    spc->stale_verdicts = 0;
+}
+
+/*
+ * Packets are published to the consumer instead of being returned to the application.  Everything
+ * else the wrapped module produces, like start and end of flow messages, is returned as usual.
+ */
+DAQ_STACK_LINKAGE unsigned shmpub_daq_msg_receive(void *handle, const unsigned max_recv, const DAQ_Msg_t *msgs[], DAQ_RecvStatus *rstat)
+{
+    ShmpubContext *spc = (ShmpubContext *) handle;
+
+    shmpub_reap(spc);
+    if (spc->num_free == 0)
+        spc->buffer_waits++;
+    while (spc->num_free == 0)
+    {
+        if (!shmpub_wait(spc, rstat))
+            return 0;
+    }
+
+    unsigned want = (max_recv < spc->num_free) ? max_recv : spc->num_free;
+    unsigned num_recv = CALL_SUBAPI(spc, msg_receive, want, msgs, rstat);
+
+    uint32_t head = spc->packet_ring->head;
+    unsigned num_returned = 0;
+    for (unsigned i = 0; i < num_recv; i++)
+    {
+        const DAQ_Msg_t *msg = msgs[i];
+
+        if (msg->type == DAQ_MSG_TYPE_PACKET)
+            shmpub_publish(spc, msg, head++);
+        else
+            msgs[num_returned++] = msg;
+    }
+    if (head != spc->packet_ring->head)
+        shm_ring_set_head(spc->packet_ring, head);
+
+    /* Don't report the end of the input until the consumer is done with it. */
+    if (*rstat == DAQ_RSTAT_EOF && num_returned == 0)
+    {
+        while (spc->num_free < spc->num_buffers)
+        {
+            if (!shmpub_wait(spc, rstat))
+                return 0;
+        }
+        __atomic_store_n(&spc->region->closed, 1, __ATOMIC_RELEASE);
+        shm_ring_doorbell(spc->packet_ring);
+        *rstat = DAQ_RSTAT_EOF;
+    }
+    else if (*rstat == DAQ_RSTAT_EOF)
+        *rstat = DAQ_RSTAT_OK;
+
+    return num_returned;
+}
+
+#ifdef BUILDING_SO
+DAQ_SO_PUBLIC DAQ_ModuleAPI_t DAQ_MODULE_DATA =
+#else
+DAQ_ModuleAPI_t shmpub_daq_module_data =
+#endif
+{
+    /* .api_version = */ DAQ_MODULE_API_VERSION,
+    /* .api_size = */ sizeof(DAQ_ModuleAPI_t),
+    /* .module_version = */ DAQ_SHMPUB_VERSION,
+    /* .name = */ "shmpub",
+    /* .type = */ DAQ_TYPE_WRAPPER | DAQ_TYPE_INLINE_CAPABLE | DAQ_TYPE_MULTI_INSTANCE,
+    /* .load = */ shmpub_daq_module_load,
+    /* .unload = */ shmpub_daq_module_unload,
+    /* .get_variable_descs = */ shmpub_daq_get_variable_descs,
+    /* .instantiate = */ shmpub_daq_instantiate,
+    /* .destroy = */ shmpub_daq_destroy,
+    /* .set_filter = */ NULL,
+    /* .start = */ shmpub_daq_start,
+    /* .inject = */ NULL,
+    /* .inject_relative = */ NULL,
+    /* .interrupt = */ shmpub_daq_interrupt,
+    /* .stop = */ shmpub_daq_stop,
+    /* .ioctl = */ shmpub_daq_ioctl,
+    /* .get_stats = */ NULL,
+    /* .reset_stats = */ shmpub_daq_reset_stats,
+    /* .get_snaplen = */ NULL,
+    /* .get_capabilities = */ NULL,
+    /* .get_datalink_type = */ NULL,
+    /* .config_load = */ NULL,
+    /* .config_swap = */ NULL,
+    /* .config_free = */ NULL,
+    /* .msg_receive = */ shmpub_daq_msg_receive,
+    /* .msg_finalize = */ NULL,
+    /* .get_msg_pool_info = */ NULL,
+};
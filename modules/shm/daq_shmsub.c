@@ -0,0 +1,466 @@
+/*
+** Copyright (C) 2014-2021 Cisco and/or its affiliates. All rights reserved.
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation.  You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "daq_dlt.h"
+#include "daq_module_api.h"
+
+#include "shm_ring.h"
+
+#define DAQ_SHMSUB_VERSION 1
+
+#define SET_ERROR(modinst, ...)    daq_base_api.set_errbuf(modinst, __VA_ARGS__)
+
+typedef struct _shmsub_msg_desc
+{
+    DAQ_Msg_t msg;
+    DAQ_PktHdr_t pkthdr;
+    DAQ_PktTimestamp_t ts;
+    DAQ_MsgMeta_t ts_meta;
+} ShmsubMsgDesc;
+
+typedef struct
+{
+    /* Configuration */
+    char name[NAME_MAX];
+    unsigned timeout;
+    /* State */
+    DAQ_ModuleInstance_h modinst;
+    DAQ_Stats_t stats;
+    ShmRegionHdr *region;
+    size_t region_size;
+    ShmRing *packet_ring;
+    ShmRing *verdict_ring;
+    ShmsubMsgDesc *pool;
+    DAQ_MsgPoolInfo_t pool_info;
+    volatile bool interrupted;
+} ShmsubContext;
+
+static DAQ_BaseAPI_t daq_base_api;
+static unsigned timestamp_meta_type;
+
+static void shmsub_detach(ShmsubContext *ssc)
+{
+    if (ssc->region)
+    {
+        munmap(ssc->region, ssc->region_size);
+        ssc->region = NULL;
+    }
+    free(ssc->pool);
+    ssc->pool = NULL;
+    ssc->pool_info.size = 0;
+    ssc->pool_info.available = 0;
+    ssc->pool_info.mem_size = 0;
+}
+
+static int shmsub_attach(ShmsubContext *ssc)
+{
+    int fd = shm_open(ssc->name, O_RDWR, 0);
+    if (fd == -1)
+    {
+        SET_ERROR(ssc->modinst, "%s: Couldn't open shared memory '%s': %s (%d)", __func__,
+                ssc->name, strerror(errno), errno);
+        return DAQ_ERROR_NODEV;
+    }
+
+    struct stat sb;
+    if (fstat(fd, &sb) == -1 || (size_t) sb.st_size < sizeof(ShmRegionHdr))
+    {
+        SET_ERROR(ssc->modinst, "%s: Shared memory '%s' is not a packet ring", __func__, ssc->name);
+        close(fd);
+        return DAQ_ERROR;
+    }
+
+    ssc->region_size = sb.st_size;
+    void *region = mmap(NULL, ssc->region_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (region == MAP_FAILED)
+    {
+        SET_ERROR(ssc->modinst, "%s: Couldn't map shared memory '%s': %s (%d)", __func__,
+                ssc->name, strerror(errno), errno);
+        return DAQ_ERROR;
+    }
+    ssc->region = (ShmRegionHdr *) region;
+
+    ShmRegionHdr *hdr = ssc->region;
+    uint32_t num_buffers = hdr->num_buffers;
+    if (hdr->magic != SHM_RING_MAGIC || hdr->version != SHM_RING_VERSION ||
+        hdr->region_size != ssc->region_size || num_buffers == 0 || (num_buffers & (num_buffers - 1)) ||
+        hdr->buffers + (uint64_t) num_buffers * hdr->buffer_size > ssc->region_size ||
+        hdr->packet_ring + shm_ring_size(num_buffers) > hdr->buffers ||
+        hdr->verdict_ring + shm_ring_size(num_buffers) > hdr->buffers)
+    {
+        SET_ERROR(ssc->modinst, "%s: Shared memory '%s' is not a compatible packet ring", __func__, ssc->name);
+        shmsub_detach(ssc);
+        return DAQ_ERROR;
+    }
+    ssc->packet_ring = (ShmRing *) ((uint8_t *) region + hdr->packet_ring);
+    ssc->verdict_ring = (ShmRing *) ((uint8_t *) region + hdr->verdict_ring);
+
+    /* One message per buffer, so that a buffer's index is also its message's. */
+    ssc->pool = calloc(num_buffers, sizeof(ShmsubMsgDesc));
+    if (!ssc->pool)
+    {
+        SET_ERROR(ssc->modinst, "%s: Could not allocate %zu bytes for a packet descriptor pool!",
+                __func__, sizeof(ShmsubMsgDesc) * num_buffers);
+        shmsub_detach(ssc);
+        return DAQ_ERROR_NOMEM;
+    }
+    for (uint32_t i = 0; i < num_buffers; i++)
+    {
+        ShmsubMsgDesc *desc = &ssc->pool[i];
+        DAQ_Msg_t *msg = &desc->msg;
+        msg->type = DAQ_MSG_TYPE_PACKET;
+        msg->hdr_len = sizeof(desc->pkthdr);
+        msg->hdr = &desc->pkthdr;
+        msg->owner = ssc->modinst;
+        msg->priv = desc;
+        desc->ts_meta.data = &desc->ts;
+        desc->ts_meta.type = timestamp_meta_type;
+        msg->meta_ext = &desc->ts_meta;
+    }
+    ssc->pool_info.size = num_buffers;
+    ssc->pool_info.available = num_buffers;
+    ssc->pool_info.mem_size = sizeof(ShmsubMsgDesc) * num_buffers;
+
+    /* Whatever a previous consumer took from the packet ring without returning a verdict is lost
+        with it.  Tell the producer where this consumer starts so that it can reclaim those. */
+    __atomic_store_n(&hdr->reclaim_pos, __atomic_load_n(&ssc->packet_ring->tail, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+    __atomic_add_fetch(&hdr->attach_gen, 1, __ATOMIC_RELEASE);
+    shm_ring_doorbell(ssc->verdict_ring);
+
+    return DAQ_SUCCESS;
+}
+
+static int shmsub_daq_module_load(const DAQ_BaseAPI_t *base_api)
+{
+    if (base_api->api_version != DAQ_BASE_API_VERSION || base_api->api_size != sizeof(DAQ_BaseAPI_t))
+        return DAQ_ERROR;
+
+    int type = base_api->meta_type_register(DAQ_META_TYPE_TIMESTAMP, sizeof(DAQ_PktTimestamp_t));
+    if (type < 0)
+        return type;
+    timestamp_meta_type = type;
+
+    daq_base_api = *base_api;
+
+    return DAQ_SUCCESS;
+}
+
+static int shmsub_daq_module_unload(void)
+{
+    memset(&daq_base_api, 0, sizeof(daq_base_api));
+    return DAQ_SUCCESS;
+}
+
+static int shmsub_daq_instantiate(const DAQ_ModuleConfig_h modcfg, DAQ_ModuleInstance_h modinst, void **ctxt_ptr)
+{
+    ShmsubContext *ssc = calloc(1, sizeof(ShmsubContext));
+    if (!ssc)
+    {
+        SET_ERROR(modinst, "%s: Couldn't allocate memory for the new ShmSub context!", __func__);
+        return DAQ_ERROR_NOMEM;
+    }
+    ssc->modinst = modinst;
+    ssc->timeout = daq_base_api.config_get_timeout(modcfg);
+
+    const char *input = daq_base_api.config_get_input(modcfg);
+    if (!input || *input == '\0')
+    {
+        SET_ERROR(modinst, "%s: No shared memory name given!", __func__);
+        free(ssc);
+        return DAQ_ERROR_INVAL;
+    }
+
+    /* Each instance of a multi-instance configuration has its own ring. */
+    unsigned total_instances = daq_base_api.config_get_total_instances(modcfg);
+    unsigned instance_id = daq_base_api.config_get_instance_id(modcfg);
+    int len;
+    if (total_instances > 1)
+        len = snprintf(ssc->name, sizeof(ssc->name), "/%s.%u", input, instance_id);
+    else
+        len = snprintf(ssc->name, sizeof(ssc->name), "/%s", input);
+    if (len < 0 || (size_t) len >= sizeof(ssc->name) || strchr(ssc->name + 1, '/'))
+    {
+        SET_ERROR(modinst, "%s: Invalid shared memory name: '%s'", __func__, input);
+        free(ssc);
+        return DAQ_ERROR_INVAL;
+    }
+
+    *ctxt_ptr = ssc;
+
+    return DAQ_SUCCESS;
+}
+
+static void shmsub_daq_destroy(void *handle)
+{
+    ShmsubContext *ssc = (ShmsubContext *) handle;
+
+    shmsub_detach(ssc);
+    free(ssc);
+}
+
+static int shmsub_daq_start(void *handle)
+{
+    ShmsubContext *ssc = (ShmsubContext *) handle;
+
+    return shmsub_attach(ssc);
+}
+
+static int shmsub_daq_interrupt(void *handle)
+{
+    ShmsubContext *ssc = (ShmsubContext *) handle;
+
+    ssc->interrupted = true;
+    if (ssc->region)
+        shm_ring_doorbell(ssc->packet_ring);
+
+    return DAQ_SUCCESS;
+}
+
+static int shmsub_daq_stop(void *handle)
+{
+    ShmsubContext *ssc = (ShmsubContext *) handle;
+
+    shmsub_detach(ssc);
+
+    return DAQ_SUCCESS;
+}
+
+static int shmsub_daq_get_stats(void *handle, DAQ_Stats_t *stats)
+{
+    ShmsubContext *ssc = (ShmsubContext *) handle;
+
+    memcpy(stats, &ssc->stats, sizeof(DAQ_Stats_t));
+
+    return DAQ_SUCCESS;
+}
+
+static void shmsub_daq_reset_stats(void *handle)
+{
+    ShmsubContext *ssc = (ShmsubContext *) handle;
+
+    memset(&ssc->stats, 0, sizeof(ssc->stats));
+}
+
+static int shmsub_daq_get_snaplen(void *handle)
+{
+    ShmsubContext *ssc = (ShmsubContext *) handle;
+
+    return ssc->region ? (int) ssc->region->snaplen : 0;
+}
+
+static uint32_t shmsub_daq_get_capabilities(void *handle)
+{
+    return DAQ_CAPA_BLOCK | DAQ_CAPA_REPLACE | DAQ_CAPA_WHITELIST | DAQ_CAPA_BLACKLIST | DAQ_CAPA_INTERRUPT | DAQ_CAPA_UNPRIV_START;
+}
+
+static int shmsub_daq_get_datalink_type(void *handle)
+{
+    ShmsubContext *ssc = (ShmsubContext *) handle;
+
+    return ssc->region ? ssc->region->dlt : DLT_NULL;
+}
+
+DAQ_STACK_LINKAGE unsigned shmsub_daq_msg_receive(void *handle, const unsigned max_recv, const DAQ_Msg_t *msgs[], DAQ_RecvStatus *rstat)
+{
+    ShmsubContext *ssc = (ShmsubContext *) handle;
+    ShmRegionHdr *hdr = ssc->region;
+    ShmRing *ring = ssc->packet_ring;
+    uint32_t mask = hdr->num_buffers - 1;
+    uint32_t tail = ring->tail;
+    uint32_t head;
+    struct timespec deadline;
+    bool have_deadline = false;
+
+    for (;;)
+    {
+        if (ssc->interrupted)
+        {
+            ssc->interrupted = false;
+            *rstat = DAQ_RSTAT_INTERRUPTED;
+            return 0;
+        }
+
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        if (head != tail)
+            break;
+
+        if (__atomic_load_n(&hdr->closed, __ATOMIC_ACQUIRE))
+        {
+            /* Check once more for anything published just before the producer closed. */
+            head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+            if (head != tail)
+                break;
+            *rstat = DAQ_RSTAT_EOF;
+            return 0;
+        }
+
+        unsigned wait_ms = 0;
+        if (ssc->timeout)
+        {
+            struct timespec now;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            if (!have_deadline)
+            {
+                deadline.tv_sec = now.tv_sec + ssc->timeout / 1000;
+                deadline.tv_nsec = now.tv_nsec + (ssc->timeout % 1000) * 1000000L;
+                if (deadline.tv_nsec >= 1000000000L)
+                {
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1000000000L;
+                }
+                have_deadline = true;
+            }
+            int64_t remaining = (deadline.tv_sec - now.tv_sec) * 1000 + (deadline.tv_nsec - now.tv_nsec) / 1000000L;
+            if (remaining <= 0)
+            {
+                *rstat = DAQ_RSTAT_TIMEOUT;
+                return 0;
+            }
+            wait_ms = remaining;
+        }
+        shm_ring_wait(ring, tail, wait_ms);
+    }
+
+    unsigned idx = 0;
+    while (idx < max_recv && tail != head)
+    {
+        const ShmDesc *sd = &ring->desc[tail & mask];
+        uint32_t buffer = (sd->offset - hdr->buffers) / hdr->buffer_size;
+        ShmsubMsgDesc *desc = &ssc->pool[buffer & mask];
+        ShmPktHdr *sph = (ShmPktHdr *) ((uint8_t *) hdr + hdr->buffers + (buffer & mask) * hdr->buffer_size);
+
+        DAQ_PktHdr_t *pkthdr = &desc->pkthdr;
+        pkthdr->ts.tv_sec = sph->ts_nsec / 1000000000;
+        pkthdr->ts.tv_usec = (sph->ts_nsec % 1000000000) / 1000;
+        desc->ts.nsec = sph->ts_nsec;
+        desc->ts.source = sph->ts_source;
+        pkthdr->pktlen = sph->pktlen;
+        pkthdr->ingress_index = sph->ingress_index;
+        pkthdr->egress_index = sph->egress_index;
+        pkthdr->ingress_group = sph->ingress_group;
+        pkthdr->egress_group = sph->egress_group;
+        pkthdr->opaque = sph->opaque;
+        pkthdr->flow_id = sph->flow_id;
+        pkthdr->flags = sph->flags;
+        pkthdr->address_space_id = sph->address_space_id;
+
+        /* The packet data stays where the producer put it. */
+        DAQ_Msg_t *msg = &desc->msg;
+        msg->data = (uint8_t *) (sph + 1);
+        msg->data_len = (sd->length <= hdr->buffer_size - sizeof(ShmPktHdr)) ? sd->length : 0;
+
+        msgs[idx++] = msg;
+        tail++;
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+    ssc->stats.packets_received += idx;
+    ssc->pool_info.available -= idx;
+    *rstat = DAQ_RSTAT_OK;
+
+    return idx;
+}
+
+DAQ_STACK_LINKAGE int shmsub_daq_msg_finalize(void *handle, const DAQ_Msg_t *msg, DAQ_Verdict verdict)
+{
+    ShmsubContext *ssc = (ShmsubContext *) handle;
+    ShmsubMsgDesc *desc = (ShmsubMsgDesc *) msg->priv;
+    ShmRegionHdr *hdr = ssc->region;
+    ShmRing *ring = ssc->verdict_ring;
+    uint32_t buffer = desc - ssc->pool;
+
+    if (verdict >= MAX_DAQ_VERDICT)
+        verdict = DAQ_VERDICT_PASS;
+    ssc->stats.verdicts[verdict]++;
+
+    /* Only the consumer writes the verdict ring, and it never holds more than one verdict per
+        buffer, so there is always room. */
+    uint32_t head = ring->head;
+    ShmDesc *sd = &ring->desc[head & (hdr->num_buffers - 1)];
+    sd->flags = 0;
+    sd->region = 0;
+    sd->length = msg->data_len;
+    sd->offset = hdr->buffers + buffer * hdr->buffer_size;
+    sd->metadata = verdict;
+    shm_ring_set_head(ring, head + 1);
+
+    ssc->pool_info.available++;
+
+    return DAQ_SUCCESS;
+}
+
+static int shmsub_daq_get_msg_pool_info(void *handle, DAQ_MsgPoolInfo_t *info)
+{
+    ShmsubContext *ssc = (ShmsubContext *) handle;
+
+    *info = ssc->pool_info;
+
+    return DAQ_SUCCESS;
+}
+
+#ifdef BUILDING_SO
+DAQ_SO_PUBLIC const DAQ_ModuleAPI_t DAQ_MODULE_DATA =
+#else
+const DAQ_ModuleAPI_t shmsub_daq_module_data =
+#endif
+{
+    /* .api_version = */ DAQ_MODULE_API_VERSION,
+    /* .api_size = */ sizeof(DAQ_ModuleAPI_t),
+    /* .module_version = */ DAQ_SHMSUB_VERSION,
+    /* .name = */ "shmsub",
+    /* .type = */ DAQ_TYPE_INTF_CAPABLE | DAQ_TYPE_INLINE_CAPABLE | DAQ_TYPE_MULTI_INSTANCE,
+    /* .load = */ shmsub_daq_module_load,
+    /* .unload = */ shmsub_daq_module_unload,
+    /* .get_variable_descs = */ NULL,
+    /* .instantiate = */ shmsub_daq_instantiate,
+    /* .destroy = */ shmsub_daq_destroy,
+    /* .set_filter = */ NULL,
+    /* .start = */ shmsub_daq_start,
+    /* .inject = */ NULL,
+    /* .inject_relative = */ NULL,
+    /* .interrupt = */ shmsub_daq_interrupt,
+    /* .stop = */ shmsub_daq_stop,
+    /* .ioctl = */ NULL,
+    /* .get_stats = */ shmsub_daq_get_stats,
+    /* .reset_stats = */ shmsub_daq_reset_stats,
+    /* .get_snaplen = */ shmsub_daq_get_snaplen,
+    /* .get_capabilities = */ shmsub_daq_get_capabilities,
+    /* .get_datalink_type = */ shmsub_daq_get_datalink_type,
+    /* .config_load = */ NULL,
+    /* .config_swap = */ NULL,
+    /* .config_free = */ NULL,
+    /* .msg_receive = */ shmsub_daq_msg_receive,
+    /* .msg_finalize = */ shmsub_daq_msg_finalize,
+    /* .get_msg_pool_info = */ shmsub_daq_get_msg_pool_info,
+};
@@ -0,0 +1,151 @@
+/*
+** Copyright (C) 2014-2021 Cisco and/or its affiliates. All rights reserved.
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation.  You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef _SHM_RING_H
+#define _SHM_RING_H
+
+/*
+ * Layout of the shared memory region between the ShmPub wrapper (the producer) and the ShmSub
+ * module (the consumer).  The region holds a header, two descriptor rings and a fixed number of
+ * packet buffers:
+ *
+ *   | ShmRegionHdr | packet ring | verdict ring | buffer 0 | buffer 1 | ... | buffer N-1 |
+ *
+ * The producer copies each packet into a free buffer and posts a descriptor for it on the packet
+ * ring.  The consumer hands the buffer to its application in place and, once the message has been
+ * finalized, posts a descriptor for the same buffer carrying the verdict on the verdict ring.  Both
+ * rings have one descriptor per buffer, so neither can overflow.
+ *
+ * Descriptors follow the layout of memif (the shared memory packet interface used by VPP and DPDK).
+ * Each ring has exactly one writer, which advances the head, and one reader, which advances the
+ * tail.  A reader with nothing to read may sleep on the ring's doorbell, a futex that the writer
+ * only rings when the reader has said it is waiting.
+ */
+
+#include <linux/futex.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHM_RING_MAGIC          0x44415153  /* 'DAQS' */
+#define SHM_RING_VERSION        2
+
+#define SHM_CACHE_LINE          64
+
+typedef struct
+{
+    uint16_t flags;
+    uint16_t region;
+    uint32_t length;        /* Bytes of packet data in the buffer */
+    uint32_t offset;        /* Offset of the buffer from the start of the region */
+    uint32_t metadata;      /* Verdict on the verdict ring */
+} ShmDesc;
+
+typedef struct
+{
+    uint32_t head;
+    uint8_t pad1[SHM_CACHE_LINE - sizeof(uint32_t)];
+    uint32_t tail;
+    uint8_t pad2[SHM_CACHE_LINE - sizeof(uint32_t)];
+    uint32_t doorbell;
+    uint32_t waiting;
+    uint8_t pad3[SHM_CACHE_LINE - 2 * sizeof(uint32_t)];
+    ShmDesc desc[];
+} ShmRing;
+
+/* Packet header stored at the start of each buffer, ahead of the packet data */
+typedef struct
+{
+    uint64_t ts_nsec;           /* Full resolution timestamp */
+    uint32_t pktlen;
+    int32_t ingress_index;
+    int32_t egress_index;
+    int32_t ingress_group;
+    int32_t egress_group;
+    uint32_t opaque;
+    uint32_t flow_id;
+    uint32_t flags;
+    uint16_t address_space_id;
+    uint8_t ts_source;
+    uint8_t pad[SHM_CACHE_LINE - 43];
+} ShmPktHdr;
+
+/* Packet data starts on its own cache line, and the padding accounts for all of the rest of it. */
+_Static_assert(sizeof(ShmPktHdr) == SHM_CACHE_LINE, "ShmPktHdr must fill exactly one cache line");
+_Static_assert(offsetof(ShmPktHdr, pad) + sizeof(((ShmPktHdr *) 0)->pad) == SHM_CACHE_LINE,
+        "ShmPktHdr padding doesn't match its fields");
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_buffers;       /* Power of two */
+    uint32_t buffer_size;       /* Including the ShmPktHdr */
+    uint32_t snaplen;
+    int32_t dlt;
+    uint32_t packet_ring;       /* Offsets from the start of the region */
+    uint32_t verdict_ring;
+    uint32_t buffers;
+    uint32_t closed;            /* Set by the producer when it stops publishing */
+    uint32_t attach_gen;        /* Bumped by each consumer that attaches */
+    uint32_t reclaim_pos;       /* Packet ring position the latest consumer started from */
+    uint64_t region_size;
+} ShmRegionHdr;
+
+static inline uint32_t shm_ring_size(uint32_t num_buffers)
+{
+    uint32_t size = sizeof(ShmRing) + num_buffers * sizeof(ShmDesc);
+    return (size + SHM_CACHE_LINE - 1) & ~(SHM_CACHE_LINE - 1);
+}
+
+static inline void shm_ring_doorbell(ShmRing *ring)
+{
+    __atomic_add_fetch(&ring->doorbell, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &ring->doorbell, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+/* Publish descriptors up to 'head', waking the reader if it is waiting for them. */
+static inline void shm_ring_set_head(ShmRing *ring, uint32_t head)
+{
+    __atomic_store_n(&ring->head, head, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->waiting, __ATOMIC_SEQ_CST))
+        shm_ring_doorbell(ring);
+}
+
+/*
+ * Sleep until the writer publishes past 'tail', someone rings the doorbell or 'timeout_ms' (0 for
+ * no limit) passes.  The reader announces itself before checking the head one last time, so a
+ * writer publishing concurrently either is seen here or sees the reader waiting.
+ */
+static inline void shm_ring_wait(ShmRing *ring, uint32_t tail, unsigned timeout_ms)
+{
+    uint32_t bell = __atomic_load_n(&ring->doorbell, __ATOMIC_SEQ_CST);
+
+    __atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == tail)
+    {
+        struct timespec ts = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000L };
+        syscall(SYS_futex, &ring->doorbell, FUTEX_WAIT, bell, timeout_ms ? &ts : NULL, NULL, 0);
+    }
+    __atomic_store_n(&ring->waiting, 0, __ATOMIC_SEQ_CST);
+}
+
+#endif /* _SHM_RING_H */
@@ -0,0 +1,590 @@
+/*
+** Copyright (C) 2014-2021 Cisco and/or its affiliates. All rights reserved.
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation.  You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "daq_dlt.h"
+#include "daq_module_api.h"
+#include "daq_module_util.h"
+
+#define DAQ_SLICE_VERSION 1
+
+/* Shadow messages allocated when the wrapped module doesn't report the size of its message pool */
+#define SLICE_DEFAULT_POOL_SIZE 1024
+
+#define SET_ERROR(modinst, ...)    daq_base_api.set_errbuf(modinst, __VA_ARGS__)
+
+#define CHECK_SUBAPI(ctxt, fname) \
+    (ctxt->subapi.fname.func != NULL)
+
+#define CALL_SUBAPI_NOARGS(ctxt, fname) \
+    ctxt->subapi.fname.func(ctxt->subapi.fname.context)
+
+#define CALL_SUBAPI(ctxt, fname, ...) \
+    DAQ_SUBAPI_CALL(ctxt->subapi, fname, __VA_ARGS__)
+
+typedef enum
+{
+    SLICE_MODE_FIXED,
+    SLICE_MODE_L4,
+} SliceMode;
+
+/*
+ * A sliced packet is handed to the application as a copy of the wrapped module's message with a
+ * shorter data length.  The original message is left untouched so that the wrapped module still
+ * forwards or injects on the whole packet.
+ */
+typedef struct _slice_msg
+{
+    DAQ_Msg_t msg;
+    DAQ_PktSliceInfo_t info;
+    DAQ_MsgMeta_t info_meta;
+    const DAQ_Msg_t *orig;
+    struct _slice_msg *next;
+} SliceMsg;
+
+typedef struct
+{
+    /* Configuration */
+    SliceMode mode;
+    uint32_t length;        // Upper bound on the data delivered, 0 for none
+    uint32_t payload;       // Bytes kept past the L4 header in L4 mode
+
+    DAQ_ModuleInstance_h modinst;
+    DAQ_InstanceAPI_t subapi;
+    int dlt;
+
+    SliceMsg *pool;
+    uint32_t pool_size;
+    SliceMsg *free_list;
+
+    /* Counters */
+    uint64_t sliced_packets;
+    uint64_t sliced_bytes;
+    uint64_t pool_exhausted;
+} SliceContext;
+
+static DAQ_VariableDesc_t slice_variable_descriptions[] = {
+    { "mode", "Where to cut packets: 'fixed' (at 'length') or 'l4' (just past the transport header) (default: fixed)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "length", "Maximum number of bytes of each packet to deliver", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "payload", "Number of payload bytes to keep past the transport header in l4 mode (default: 0)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+};
+
+static DAQ_BaseAPI_t daq_base_api;
+static unsigned slice_info_meta_type;
+
+//-------------------------------------------------------------------------
+
+/* Offset just past the transport header of an IPv4 packet starting at 'off'. */
+static uint32_t slice_ipv4_end(const uint8_t *data, uint32_t len, uint32_t off)
+{
+    const uint8_t *ip = data + off;
+    uint32_t l4off = off + (ip[0] & 0x0f) * 4;
+
+    /* Only the first fragment carries the transport header */
+    if ((((ip[6] << 8) | ip[7]) & 0x1fff) != 0)
+        return l4off;
+
+    switch (ip[9])
+    {
+        case 6:     // TCP
+            if (len >= l4off + 13)
+                return l4off + (data[l4off + 12] >> 4) * 4;
+            return l4off + 20;
+        case 17:    // UDP
+        case 1:     // ICMP
+            return l4off + 8;
+    }
+    return l4off;
+}
+
+/* Offset just past the transport header of an IPv6 packet starting at 'off'. */
+static uint32_t slice_ipv6_end(const uint8_t *data, uint32_t len, uint32_t off)
+{
+    uint8_t next = data[off + 6];
+    uint32_t l4off = off + 40;
+
+    for (;;)
+    {
+        switch (next)
+        {
+            case 0:     // Hop-by-Hop Options
+            case 43:    // Routing
+            case 60:    // Destination Options
+                if (len < l4off + 2)
+                    return l4off;
+                next = data[l4off];
+                l4off += (data[l4off + 1] + 1) * 8;
+                continue;
+            case 44:    // Fragment
+                if (len < l4off + 8)
+                    return l4off;
+                next = data[l4off];
+                if ((((data[l4off + 2] << 8) | data[l4off + 3]) & 0xfff8) != 0)
+                    return l4off + 8;
+                l4off += 8;
+                continue;
+            case 51:    // Authentication Header
+                if (len < l4off + 2)
+                    return l4off;
+                next = data[l4off];
+                l4off += (data[l4off + 1] + 2) * 4;
+                continue;
+            case 6:     // TCP
+                if (len >= l4off + 13)
+                    return l4off + (data[l4off + 12] >> 4) * 4;
+                return l4off + 20;
+            case 17:    // UDP
+            case 58:    // ICMPv6
+                return l4off + 8;
+        }
+        return l4off;
+    }
+}
+
+/*
+ * The number of bytes of a packet to deliver in L4 mode: everything up to the end of the transport
+ * header plus the configured payload.  Packets that aren't IP or whose headers can't be found are
+ * delivered whole.
+ */
+static uint32_t slice_l4_length(const SliceContext *sc, const uint8_t *data, uint32_t len)
+{
+    uint32_t off;
+    uint16_t ethertype = util_find_l3(data, len, sc->dlt, &off);
+
+    uint32_t end;
+    if (ethertype == UTIL_ETHERTYPE_IPV4 && len >= off + 20 && (data[off] >> 4) == 4 && (data[off] & 0x0f) >= 5)
+        end = slice_ipv4_end(data, len, off);
+    else if (ethertype == UTIL_ETHERTYPE_IPV6 && len >= off + 40 && (data[off] >> 4) == 6)
+        end = slice_ipv6_end(data, len, off);
+    else
+        return len;
+
+    end += sc->payload;
+    return (end < len) ? end : len;
+}
+
+static inline SliceMsg *slice_get_shadow(const SliceContext *sc, const DAQ_Msg_t *msg)
+{
+    const SliceMsg *smsg = (const SliceMsg *) msg;
+
+    if (smsg >= sc->pool && smsg < sc->pool + sc->pool_size)
+        return &sc->pool[smsg - sc->pool];
+    return NULL;
+}
+
+static void slice_add_counter(DIOCTL_GetModuleCounters *gmc, const char *name, uint64_t value)
+{
+    if (gmc->num_counters >= gmc->max_counters)
+        return;
+
+    DAQ_ModuleCounter_t *counter = &gmc->counters[gmc->num_counters++];
+    counter->module = "slice";
+    counter->name = name;
+    counter->value = value;
+}
+
+/*
+ * Find the message argument of an ioctl, if it has one, so that a sliced message can be swapped for
+ * the wrapped module's original before passing the ioctl on.
+ */
+static DAQ_Msg_h *slice_ioctl_msg(DAQ_IoctlCmd cmd, void *arg, size_t arglen)
+{
+    switch (cmd)
+    {
+        case DIOCTL_SET_FLOW_OPAQUE:
+            if (arglen != sizeof(DIOCTL_SetFlowOpaque))
+                return NULL;
+            return &((DIOCTL_SetFlowOpaque *) arg)->msg;
+        case DIOCTL_SET_FLOW_HA_STATE:
+        case DIOCTL_GET_FLOW_HA_STATE:
+            if (arglen != sizeof(DIOCTL_FlowHAState))
+                return NULL;
+            return &((DIOCTL_FlowHAState *) arg)->msg;
+        case DIOCTL_SET_FLOW_QOS_ID:
+            if (arglen != sizeof(DIOCTL_SetFlowQosID))
+                return NULL;
+            return &((DIOCTL_SetFlowQosID *) arg)->msg;
+        case DIOCTL_SET_PACKET_TRACE_DATA:
+            if (arglen != sizeof(DIOCTL_SetPacketTraceData))
+                return NULL;
+            return &((DIOCTL_SetPacketTraceData *) arg)->msg;
+        case DIOCTL_SET_PACKET_VERDICT_REASON:
+            if (arglen != sizeof(DIOCTL_SetPacketVerdictReason))
+                return NULL;
+            return &((DIOCTL_SetPacketVerdictReason *) arg)->msg;
+        case DIOCTL_GET_FLOW_TCP_SCRUBBED_SYN:
+        case DIOCTL_GET_FLOW_TCP_SCRUBBED_SYN_ACK:
+            if (arglen != sizeof(DIOCTL_GetFlowScrubbedTcp))
+                return NULL;
+            return &((DIOCTL_GetFlowScrubbedTcp *) arg)->msg;
+        case DIOCTL_CREATE_EXPECTED_FLOW:
+            if (arglen != sizeof(DIOCTL_CreateExpectedFlow))
+                return NULL;
+            return &((DIOCTL_CreateExpectedFlow *) arg)->ctrl_msg;
+        case DIOCTL_DIRECT_INJECT_PAYLOAD:
+            if (arglen != sizeof(DIOCTL_DirectInjectPayload))
+                return NULL;
+            return &((DIOCTL_DirectInjectPayload *) arg)->msg;
+        case DIOCTL_DIRECT_INJECT_RESET:
+            if (arglen != sizeof(DIOCTL_DirectInjectReset))
+                return NULL;
+            return &((DIOCTL_DirectInjectReset *) arg)->msg;
+        default:
+            break;
+    }
+    return NULL;
+}
+
+//-------------------------------------------------------------------------
+
+static int slice_daq_module_load(const DAQ_BaseAPI_t *base_api)
+{
+    if (base_api->api_version != DAQ_BASE_API_VERSION || base_api->api_size != sizeof(DAQ_BaseAPI_t))
+        return DAQ_ERROR;
+
+    int type = base_api->meta_type_register(DAQ_META_TYPE_SLICE_INFO, sizeof(DAQ_PktSliceInfo_t));
+    if (type < 0)
+        return type;
+    slice_info_meta_type = type;
+
+    daq_base_api = *base_api;
+
+    return DAQ_SUCCESS;
+}
+
+static int slice_daq_module_unload(void)
+{
+    memset(&daq_base_api, 0, sizeof(daq_base_api));
+    return DAQ_SUCCESS;
+}
+
+static int slice_daq_get_variable_descs(const DAQ_VariableDesc_t **var_desc_table)
+{
+    *var_desc_table = slice_variable_descriptions;
+
+    return sizeof(slice_variable_descriptions) / sizeof(DAQ_VariableDesc_t);
+}
+
+static int slice_daq_instantiate(const DAQ_ModuleConfig_h modcfg, DAQ_ModuleInstance_h modinst, void **ctxt_ptr)
+{
+    SliceContext *sc = calloc(1, sizeof(SliceContext));
+    if (!sc)
+    {
+        SET_ERROR(modinst, "%s: Couldn't allocate memory for the DAQ context", __func__);
+        return DAQ_ERROR_NOMEM;
+    }
+    sc->modinst = modinst;
+
+    if (daq_base_api.resolve_subapi(modinst, &sc->subapi) != DAQ_SUCCESS)
+    {
+        SET_ERROR(modinst, "%s: Couldn't resolve subapi. No submodule configured?", __func__);
+        free(sc);
+        return DAQ_ERROR_INVAL;
+    }
+
+    sc->mode = SLICE_MODE_FIXED;
+    const char *varKey, *varValue;
+    daq_base_api.config_first_variable(modcfg, &varKey, &varValue);
+    while (varKey)
+    {
+        unsigned long value;
+
+        if (!strcmp(varKey, "mode"))
+        {
+            if (varValue && !strcmp(varValue, "fixed"))
+                sc->mode = SLICE_MODE_FIXED;
+            else if (varValue && !strcmp(varValue, "l4"))
+                sc->mode = SLICE_MODE_L4;
+            else
+            {
+                SET_ERROR(modinst, "%s: Invalid value for key '%s': '%s'", __func__, varKey, varValue);
+                free(sc);
+                return DAQ_ERROR_INVAL;
+            }
+        }
+        else if (!strcmp(varKey, "length"))
+        {
+            if (util_parse_uint(varValue, &value) != 0 || value == 0 || value > UINT16_MAX)
+            {
+                SET_ERROR(modinst, "%s: Invalid value for key '%s': '%s'", __func__, varKey, varValue);
+                free(sc);
+                return DAQ_ERROR_INVAL;
+            }
+            sc->length = value;
+        }
+        else if (!strcmp(varKey, "payload"))
+        {
+            if (util_parse_uint(varValue, &value) != 0 || value > UINT16_MAX)
+            {
+                SET_ERROR(modinst, "%s: Invalid value for key '%s': '%s'", __func__, varKey, varValue);
+                free(sc);
+                return DAQ_ERROR_INVAL;
+            }
+            sc->payload = value;
+        }
+        daq_base_api.config_next_variable(modcfg, &varKey, &varValue);
+    }
+
+    if (sc->mode == SLICE_MODE_FIXED && sc->length == 0)
+    {
+        SET_ERROR(modinst, "%s: A length is required in fixed mode", __func__);
+        free(sc);
+        return DAQ_ERROR_INVAL;
+    }
+
+    *ctxt_ptr = sc;
+
+    return DAQ_SUCCESS;
+}
+
+static void slice_daq_destroy(void *handle)
+{
+    SliceContext *sc = (SliceContext *) handle;
+
+    free(sc->pool);
+    free(sc);
+}
+
+static int slice_daq_start(void *handle)
+{
+    SliceContext *sc = (SliceContext *) handle;
+
+    int rval = CALL_SUBAPI_NOARGS(sc, start);
+    if (rval != DAQ_SUCCESS)
+        return rval;
+
+    sc->dlt = CHECK_SUBAPI(sc, get_datalink_type) ? CALL_SUBAPI_NOARGS(sc, get_datalink_type) : DLT_EN10MB;
+
+    /* The application can't hold more sliced messages than the wrapped module has messages. */
+    if (!sc->pool)
+    {
+        DAQ_MsgPoolInfo_t mpool_info = { };
+        if (CHECK_SUBAPI(sc, get_msg_pool_info))
+            CALL_SUBAPI(sc, get_msg_pool_info, &mpool_info);
+        sc->pool_size = mpool_info.size ? mpool_info.size : SLICE_DEFAULT_POOL_SIZE;
+        sc->pool = calloc(sc->pool_size, sizeof(SliceMsg));
+        if (!sc->pool)
+        {
+            SET_ERROR(sc->modinst, "%s: Couldn't allocate %u shadow messages", __func__, sc->pool_size);
+            return DAQ_ERROR_NOMEM;
+        }
+        for (uint32_t i = 0; i < sc->pool_size; i++)
+        {
+            sc->pool[i].info_meta.data = &sc->pool[i].info;
+            sc->pool[i].info_meta.type = slice_info_meta_type;
+            sc->pool[i].msg.meta_ext = &sc->pool[i].info_meta;
+            sc->pool[i].next = sc->free_list;
+            sc->free_list = &sc->pool[i];
+        }
+    }
+
+    return DAQ_SUCCESS;
+}
+
+static int slice_daq_inject_relative(void *handle, const DAQ_Msg_t *msg, const uint8_t *data, uint32_t data_len, int reverse)
+{
+    SliceContext *sc = (SliceContext *) handle;
+    SliceMsg *smsg = slice_get_shadow(sc, msg);
+
+    if (!CHECK_SUBAPI(sc, inject_relative))
+        return DAQ_ERROR_NOTSUP;
+
+    return CALL_SUBAPI(sc, inject_relative, smsg ? smsg->orig : msg, data, data_len, reverse);
+}
+
+static int slice_daq_ioctl(void *handle, DAQ_IoctlCmd cmd, void *arg, size_t arglen)
+{
+    SliceContext *sc = (SliceContext *) handle;
+
+    if (cmd == DIOCTL_GET_MODULE_COUNTERS)
+    {
+        if (arglen != sizeof(DIOCTL_GetModuleCounters))
+            return DAQ_ERROR_INVAL;
+        DIOCTL_GetModuleCounters *gmc = (DIOCTL_GetModuleCounters *) arg;
+        if (!gmc->counters && gmc->max_counters > 0)
+            return DAQ_ERROR_INVAL;
+
+        slice_add_counter(gmc, "sliced_packets", sc->sliced_packets);
+        slice_add_counter(gmc, "sliced_bytes", sc->sliced_bytes);
+        slice_add_counter(gmc, "pool_exhausted", sc->pool_exhausted);
+
+        if (CHECK_SUBAPI(sc, ioctl))
+        {
+            int rval = CALL_SUBAPI(sc, ioctl, cmd, arg, arglen);
+            if (rval != DAQ_SUCCESS && rval != DAQ_ERROR_NOTSUP)
+                return rval;
+        }
+        return DAQ_SUCCESS;
+    }
+
+    if (!CHECK_SUBAPI(sc, ioctl))
+        return DAQ_ERROR_NOTSUP;
+
+    if (cmd == DIOCTL_SET_FLOW_PRESERVE && arglen == sizeof(DAQ_Msg_h))
+    {
+        SliceMsg *smsg = slice_get_shadow(sc, (const DAQ_Msg_t *) arg);
+        if (smsg)
+            arg = (void *) (uintptr_t) smsg->orig;
+        return CALL_SUBAPI(sc, ioctl, cmd, arg, arglen);
+    }
+
+    DAQ_Msg_h *msgp = slice_ioctl_msg(cmd, arg, arglen);
+    SliceMsg *smsg = msgp ? slice_get_shadow(sc, *msgp) : NULL;
+    if (!smsg)
+        return CALL_SUBAPI(sc, ioctl, cmd, arg, arglen);
+
+    /* Hand the wrapped module its own message, then put the application's back. */
+    *msgp = smsg->orig;
+    int rval = CALL_SUBAPI(sc, ioctl, cmd, arg, arglen);
+    *msgp = &smsg->msg;
+
+    return rval;
+}
+
+static void slice_daq_reset_stats(void *handle)
+{
+    SliceContext *sc = (SliceContext *) handle;
+
+    if (CHECK_SUBAPI(sc, reset_stats))
+        CALL_SUBAPI_NOARGS(sc, reset_stats);
+
+    sc->sliced_packets = 0;
+    sc->sliced_bytes = 0;
+    sc->pool_exhausted = 0;
+}
+
+static int slice_daq_get_snaplen(void *handle)
+{
+    SliceContext *sc = (SliceContext *) handle;
+
+    int snaplen = CALL_SUBAPI_NOARGS(sc, get_snaplen);
+    if (sc->length && (snaplen <= 0 || (uint32_t) snaplen > sc->length))
+        snaplen = sc->length;
+
+    return snaplen;
+}
+
+DAQ_STACK_LINKAGE unsigned slice_daq_msg_receive(void *handle, const unsigned max_recv, const DAQ_Msg_t *msgs[], DAQ_RecvStatus *rstat)
+{
+    SliceContext *sc = (SliceContext *) handle;
+
+    unsigned num_recv = CALL_SUBAPI(sc, msg_receive, max_recv, msgs, rstat);
+
+    for (unsigned i = 0; i < num_recv; i++)
+    {
+        const DAQ_Msg_t *msg = msgs[i];
+
+        if (msg->type != DAQ_MSG_TYPE_PACKET)
+            continue;
+
+        uint32_t len = msg->data_len;
+        if (sc->mode == SLICE_MODE_L4)
+            len = slice_l4_length(sc, msg->data, len);
+        if (sc->length && len > sc->length)
+            len = sc->length;
+        if (len == msg->data_len)
+            continue;
+
+        SliceMsg *smsg = sc->free_list;
+        if (!smsg)
+        {
+            sc->pool_exhausted++;
+            continue;
+        }
+        sc->free_list = smsg->next;
+
+        /* The rest of the original's metadata shows through without being copied. */
+        smsg->msg.hdr = msg->hdr;
+        smsg->msg.data = msg->data;
+        smsg->msg.wrapped = msg;
+        smsg->msg.owner = msg->owner;
+        smsg->msg.priv = msg->priv;
+        smsg->msg.hdr_len = msg->hdr_len;
+        smsg->msg.type = msg->type;
+        smsg->msg.data_len = len;
+        smsg->info.caplen = msg->data_len;
+        smsg->orig = msg;
+        msgs[i] = &smsg->msg;
+
+        sc->sliced_packets++;
+        sc->sliced_bytes += msg->data_len - len;
+    }
+
+    return num_recv;
+}
+
+DAQ_STACK_LINKAGE int slice_daq_msg_finalize(void *handle, const DAQ_Msg_t *msg, DAQ_Verdict verdict)
+{
+    SliceContext *sc = (SliceContext *) handle;
+    SliceMsg *smsg = slice_get_shadow(sc, msg);
+
+    if (smsg)
+    {
+        msg = smsg->orig;
+        smsg->next = sc->free_list;
+        sc->free_list = smsg;
+    }
+
+    return CALL_SUBAPI(sc, msg_finalize, msg, verdict);
+}
+
+#ifdef BUILDING_SO
+DAQ_SO_PUBLIC DAQ_ModuleAPI_t DAQ_MODULE_DATA =
+#else
+DAQ_ModuleAPI_t slice_daq_module_data =
+#endif
+{
+    /* .api_version = */ DAQ_MODULE_API_VERSION,
+    /* .api_size = */ sizeof(DAQ_ModuleAPI_t),
+    /* .module_version = */ DAQ_SLICE_VERSION,
+    /* .name = */ "slice",
+    /* .type = */ DAQ_TYPE_WRAPPER | DAQ_TYPE_INLINE_CAPABLE,
+    /* .load = */ slice_daq_module_load,
+    /* .unload = */ slice_daq_module_unload,
+    /* .get_variable_descs = */ slice_daq_get_variable_descs,
+    /* .instantiate = */ slice_daq_instantiate,
+    /* .destroy = */ slice_daq_destroy,
+    /* .set_filter = */ NULL,
+    /* .start = */ slice_daq_start,
+    /* .inject = */ NULL,
+    /* .inject_relative = */ slice_daq_inject_relative,
+    /* .interrupt = */ NULL,
+    /* .stop = */ NULL,
+    /* .ioctl = */ slice_daq_ioctl,
+    /* .get_stats = */ NULL,
+    /* .reset_stats = */ slice_daq_reset_stats,
+    /* .get_snaplen = */ slice_daq_get_snaplen,
+    /* .get_capabilities = */ NULL,
+    /* .get_datalink_type = */ NULL,
+    /* .config_load = */ NULL,
+    /* .config_swap = */ NULL,
+    /* .config_free = */ NULL,
+    /* .msg_receive = */ slice_daq_msg_receive,
+    /* .msg_finalize = */ slice_daq_msg_finalize,
+    /* .get_msg_pool_info = */ NULL,
+};
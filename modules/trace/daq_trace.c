@@ -23,20 +23,50 @@
 #include "config.h"
 #endif
 
-#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
 
-#if defined(__FreeBSD__) || defined(__OpenBSD__)
-#include <sys/socket.h>
+#ifdef LIBPCAP_AVAILABLE
+#include <pcap.h>
 #endif
 
 #include "daq_module_api.h"
+#include "daq_module_util.h"
+#include "trace_format.h"
 
-#define DAQ_TRACE_VERSION 1
+#define DAQ_TRACE_VERSION 3
 
 #define DAQ_TRACE_FILENAME "inline-out.txt"
+#define DAQ_TRACE_BINARY_FILENAME "inline-out.trace"
+
+#define DEFAULT_BUFFER_SIZE_KB      1024
+#define MIN_BUFFER_SIZE_KB          128
+#define DEFAULT_NUM_BUFFERS         8
+#define DEFAULT_FLUSH_INTERVAL_MS   1000
+
+/* Maximum number of buffers gathered into a single writev() by the writer thread */
+#define TRACE_MAX_IOV   64
+
+/* Maximum number of flow IDs that can be selected for tracing */
+#define TRACE_MAX_FLOW_IDS  64
+
+/* Size of the selected message table when the wrapped module can't report its pool size */
+#define DEFAULT_SELECTED_SLOTS  4096
+
+#define TRACE_VERDICT(v)    (1U << (v))
+#define TRACE_ALL_VERDICTS  ((1U << MAX_DAQ_VERDICT) - 1)
+
+#ifndef PCAP_NETMASK_UNKNOWN // For OpenBSD
+#define PCAP_NETMASK_UNKNOWN    0xffffffff
+#endif
 
 #define SET_ERROR(modinst, ...)    daq_base_api.set_errbuf(modinst, __VA_ARGS__)
 
@@ -47,41 +77,824 @@
     ctxt->subapi.fname.func(ctxt->subapi.fname.context)
 
 #define CALL_SUBAPI(ctxt, fname, ...) \
-    ctxt->subapi.fname.func(ctxt->subapi.fname.context, __VA_ARGS__)
+    DAQ_SUBAPI_CALL(ctxt->subapi, fname, __VA_ARGS__)
 
 typedef struct
+{
+    uint8_t *data;
+    size_t len;
+} TraceBuffer;
+
+/*
+ * Packet messages selected for tracing while they are outstanding.  This is an open-addressed hash
+ * set of message pointers with linear probing, sized to at least twice the message pool of the
+ * wrapped module so that probe sequences stay short.  Messages are added when they are received
+ * and removed when they are finalized.
+ */
+typedef struct
+{
+    const DAQ_Msg_t **slots;
+    unsigned mask;
+    unsigned count;
+} TraceMsgSet;
+
+/*
+ * Every traced event is encoded as a binary record (see trace_format.h) on the packet thread.  In
+ * text mode, the record is encoded into a scratch buffer and immediately rendered to the output
+ * file.  In binary mode, records are copied into a ring of large buffers that is drained by a
+ * writer thread, following the same single-producer/single-consumer scheme as the Dump module:
+ * 'head' is only advanced by the packet thread and 'tail' only by the writer thread, and the mutex
+ * and condition variables are only used to sleep and wake up.
+ */
+typedef struct
 {
     DAQ_ModuleInstance_h modinst;
     DAQ_InstanceAPI_t subapi;
 
+    bool binary;
+    bool active;
     FILE *outfile;
+    int fd;
     char *filename;
 
+    /* Text mode record encoding */
+    uint8_t *scratch;
+    size_t scratch_size;
+
+    /* Message selection configuration */
+    bool selective;             // Only trace packet messages found in 'selected'
+    char *filter;
+#ifdef LIBPCAP_AVAILABLE
+    struct bpf_program fcode;
+#endif
+    uint32_t flow_ids[TRACE_MAX_FLOW_IDS];
+    unsigned num_flow_ids;
+    uint32_t flagged;           // Packet flags that select a message
+    uint32_t verdicts;          // Verdicts to record (TRACE_VERDICT())
+
+    /* Sampling and rate limiting configuration and state */
+    unsigned sample_rate;
+    unsigned sample_count;
+    unsigned max_rate;
+    time_t rate_second;
+    unsigned rate_count;
+    TraceMsgSet selected;
+
+    /* Binary mode buffer ring */
+    TraceBuffer *buffers;
+    unsigned num_buffers;       // Always a power of two
+    size_t buffer_size;
+    unsigned head;              // Buffers handed to the writer thread (owned by the packet thread)
+    unsigned tail;              // Buffers written out (owned by the writer thread)
+    TraceBuffer *fill;          // Buffer currently being filled by the packet thread, if any
+    struct timespec fill_start; // When the first record was copied into the fill buffer
+    unsigned flush_interval_ms;
+    bool drop_on_overflow;
+
+    /* Writer thread state */
+    pthread_t writer_tid;
+    pthread_mutex_t writer_lock;
+    pthread_cond_t work_cond;   // Signaled when buffers are handed off or the writer should exit
+    pthread_cond_t space_cond;  // Signaled when the writer thread has freed up buffers
+    bool writer_running;
+    bool writer_exit;
+
+    /* Packet thread counters */
+    uint64_t messages_selected;
+    uint64_t messages_filtered;
+    uint64_t messages_unsampled;
+    uint64_t messages_rate_limited;
+    uint64_t records;
+    uint64_t records_dropped;
+    uint64_t max_queue_depth;
+    /* Writer thread counters */
+    uint64_t bytes_written;
+    uint64_t write_errors;
+
     DAQ_Stats_t stats;
 } TraceContext;
 
 static DAQ_VariableDesc_t trace_variable_descriptions[] = {
-    { "file", "Filename to write text traces to (default: " DAQ_TRACE_FILENAME ")", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "file", "Filename to write traces to (default: " DAQ_TRACE_FILENAME " or " DAQ_TRACE_BINARY_FILENAME ")", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "format", "Trace format: text or binary (default: text)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "buffer-size", "Size in kilobytes of each binary output buffer (default: 1024, minimum: 128)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "buffers", "Number of binary output buffers queued to the writer thread (default: 8)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "overflow", "Action when all binary output buffers are in use: block or drop (default: block)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "flush-interval", "Maximum milliseconds a partially filled binary output buffer is held back (default: 1000)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "filter", "Only trace packets matching this BPF expression", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "flow-id", "Only trace packets belonging to these comma-separated flow IDs", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "flagged", "Only trace packets flagged for tracing or debugging by the lower layers", DAQ_VAR_DESC_FORBIDS_ARGUMENT },
+    { "verdicts", "Comma-separated verdicts to record (default: all)", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "sample", "Only trace one out of every N selected packets", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+    { "max-rate", "Maximum number of packets to trace per second", DAQ_VAR_DESC_REQUIRES_ARGUMENT },
+};
+
+static const char *trace_verdict_names[MAX_DAQ_VERDICT] = {
+    "pass",         // DAQ_VERDICT_PASS
+    "block",        // DAQ_VERDICT_BLOCK
+    "replace",      // DAQ_VERDICT_REPLACE
+    "whitelist",    // DAQ_VERDICT_WHITELIST
+    "blacklist",    // DAQ_VERDICT_BLACKLIST
+    "ignore",       // DAQ_VERDICT_IGNORE
 };
 
 static DAQ_BaseAPI_t daq_base_api;
+#ifdef LIBPCAP_AVAILABLE
+static pthread_mutex_t bpf_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
 
 //-------------------------------------------------------------------------
 
-static void hexdump(FILE *fp, const uint8_t *data, unsigned int len, const char *prefix)
+static int write_fully(int fd, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0)
+    {
+        ssize_t written = writev(fd, iov, iovcnt);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        /* Skip past the fully written vectors and trim the partially written one. */
+        while (iovcnt > 0 && (size_t) written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (uint8_t *) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+
+    return 0;
+}
+
+static inline unsigned trace_queue_depth(const TraceContext *tc)
+{
+    return tc->head - __atomic_load_n(&tc->tail, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Writer thread
+ */
+
+static unsigned trace_drain(TraceContext *tc)
+{
+    unsigned head = __atomic_load_n(&tc->head, __ATOMIC_ACQUIRE);
+    unsigned tail = tc->tail;
+
+    if (head == tail)
+        return 0;
+
+    struct iovec iov[TRACE_MAX_IOV];
+    unsigned count = 0;
+    size_t bytes = 0;
+    while (tail + count != head && count < TRACE_MAX_IOV)
+    {
+        TraceBuffer *buf = &tc->buffers[(tail + count) & (tc->num_buffers - 1)];
+        iov[count].iov_base = buf->data;
+        iov[count].iov_len = buf->len;
+        bytes += buf->len;
+        count++;
+    }
+
+    /* Buffers that couldn't be written are dropped rather than retried so that the packet thread
+        can never wait forever on a broken output. */
+    if (write_fully(tc->fd, iov, count) == 0)
+        __atomic_store_n(&tc->bytes_written, tc->bytes_written + bytes, __ATOMIC_RELAXED);
+    else
+        __atomic_store_n(&tc->write_errors, tc->write_errors + 1, __ATOMIC_RELAXED);
+
+    __atomic_store_n(&tc->tail, tail + count, __ATOMIC_RELEASE);
+
+    pthread_mutex_lock(&tc->writer_lock);
+    pthread_cond_signal(&tc->space_cond);
+    pthread_mutex_unlock(&tc->writer_lock);
+
+    return count;
+}
+
+static void *trace_writer_thread(void *arg)
+{
+    TraceContext *tc = (TraceContext *) arg;
+
+    while (true)
+    {
+        if (trace_drain(tc) > 0)
+            continue;
+
+        pthread_mutex_lock(&tc->writer_lock);
+        while (__atomic_load_n(&tc->head, __ATOMIC_ACQUIRE) == tc->tail && !tc->writer_exit)
+            pthread_cond_wait(&tc->work_cond, &tc->writer_lock);
+        /* Everything that was handed off before the exit request must hit the disk first. */
+        bool done = tc->writer_exit && __atomic_load_n(&tc->head, __ATOMIC_ACQUIRE) == tc->tail;
+        pthread_mutex_unlock(&tc->writer_lock);
+
+        if (done)
+            break;
+    }
+
+    return NULL;
+}
+
+/*
+ * Packet thread
+ */
+
+static void trace_submit(TraceContext *tc)
+{
+    __atomic_store_n(&tc->head, tc->head + 1, __ATOMIC_RELEASE);
+    tc->fill = NULL;
+
+    unsigned depth = trace_queue_depth(tc);
+    if (depth > tc->max_queue_depth)
+        tc->max_queue_depth = depth;
+
+    pthread_mutex_lock(&tc->writer_lock);
+    pthread_cond_signal(&tc->work_cond);
+    pthread_mutex_unlock(&tc->writer_lock);
+}
+
+static bool trace_acquire(TraceContext *tc)
+{
+    if (trace_queue_depth(tc) == tc->num_buffers)
+    {
+        if (tc->drop_on_overflow)
+            return false;
+
+        pthread_mutex_lock(&tc->writer_lock);
+        while (trace_queue_depth(tc) == tc->num_buffers)
+            pthread_cond_wait(&tc->space_cond, &tc->writer_lock);
+        pthread_mutex_unlock(&tc->writer_lock);
+    }
+
+    tc->fill = &tc->buffers[tc->head & (tc->num_buffers - 1)];
+    tc->fill->len = 0;
+    clock_gettime(CLOCK_MONOTONIC, &tc->fill_start);
+
+    return true;
+}
+
+/* Make room for 'len' more bytes in the fill buffer, handing it off first if necessary.  Returns
+    NULL if no buffer is available and the overflow policy is to drop. */
+static uint8_t *trace_reserve(TraceContext *tc, size_t len)
+{
+    if (tc->fill && tc->fill->len + len > tc->buffer_size)
+        trace_submit(tc);
+
+    if (!tc->fill && !trace_acquire(tc))
+        return NULL;
+
+    return tc->fill->data + tc->fill->len;
+}
+
+static inline uint64_t elapsed_ms(const struct timespec *start, const struct timespec *now)
+{
+    return (now->tv_sec - start->tv_sec) * 1000 + (now->tv_nsec - start->tv_nsec) / 1000000;
+}
+
+static void trace_check_flush(TraceContext *tc)
+{
+    if (!tc->fill)
+        return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (elapsed_ms(&tc->fill_start, &now) >= tc->flush_interval_ms)
+        trace_submit(tc);
+}
+
+/*
+ * Message selection
+ */
+
+static inline unsigned trace_msg_hash(const DAQ_Msg_t *msg)
+{
+    return (unsigned) (((uint64_t) (uintptr_t) msg * 0x9E3779B97F4A7C15ULL) >> 32);
+}
+
+static bool trace_msg_set_add(TraceMsgSet *set, const DAQ_Msg_t *msg)
+{
+    /* Always leave at least one empty slot to terminate probe sequences. */
+    if (set->count >= set->mask)
+        return false;
+
+    unsigned i = trace_msg_hash(msg) & set->mask;
+    while (set->slots[i])
+        i = (i + 1) & set->mask;
+    set->slots[i] = msg;
+    set->count++;
+
+    return true;
+}
+
+static inline bool trace_msg_set_contains(const TraceMsgSet *set, const DAQ_Msg_t *msg)
+{
+    if (set->count == 0)
+        return false;
+
+    for (unsigned i = trace_msg_hash(msg) & set->mask; set->slots[i]; i = (i + 1) & set->mask)
+    {
+        if (set->slots[i] == msg)
+            return true;
+    }
+
+    return false;
+}
+
+static bool trace_msg_set_remove(TraceMsgSet *set, const DAQ_Msg_t *msg)
+{
+    if (set->count == 0)
+        return false;
+
+    unsigned i = trace_msg_hash(msg) & set->mask;
+    while (set->slots[i] != msg)
+    {
+        if (!set->slots[i])
+            return false;
+        i = (i + 1) & set->mask;
+    }
+
+    /* Pull later entries of the probe sequence back into the hole so that lookups never stop
+        short.  An entry can move into the hole unless its home slot lies after the hole. */
+    for (unsigned j = (i + 1) & set->mask; set->slots[j]; j = (j + 1) & set->mask)
+    {
+        unsigned home = trace_msg_hash(set->slots[j]) & set->mask;
+        if (((j - home) & set->mask) >= ((j - i) & set->mask))
+        {
+            set->slots[i] = set->slots[j];
+            i = j;
+        }
+    }
+    set->slots[i] = NULL;
+    set->count--;
+
+    return true;
+}
+
+/* Decide whether a newly received packet message will be traced.  Any of the configured selectors
+    matching is enough; sampling and the rate limit are then applied to the matching packets. */
+static bool trace_select_packet(TraceContext *tc, const DAQ_Msg_t *msg)
+{
+    const DAQ_PktHdr_t *hdr = (const DAQ_PktHdr_t *) msg->hdr;
+    bool match = !tc->filter && tc->num_flow_ids == 0 && !tc->flagged;
+
+    if (!match && (hdr->flags & tc->flagged))
+        match = true;
+
+    for (unsigned i = 0; !match && i < tc->num_flow_ids; i++)
+    {
+        if (hdr->flow_id == tc->flow_ids[i])
+            match = true;
+    }
+
+#ifdef LIBPCAP_AVAILABLE
+    if (!match && tc->fcode.bf_insns &&
+            bpf_filter(tc->fcode.bf_insns, msg->data, hdr->pktlen, msg->data_len) != 0)
+        match = true;
+#endif
+
+    if (!match)
+    {
+        tc->messages_filtered++;
+        return false;
+    }
+
+    if (tc->sample_rate > 1 && tc->sample_count++ % tc->sample_rate != 0)
+    {
+        tc->messages_unsampled++;
+        return false;
+    }
+
+    if (tc->max_rate)
+    {
+        if (tc->rate_count >= tc->max_rate)
+        {
+            tc->messages_rate_limited++;
+            return false;
+        }
+        tc->rate_count++;
+    }
+
+    tc->messages_selected++;
+
+    return true;
+}
+
+/* Records that refer to a packet message are only kept if the message was selected when it was
+    received.  Records that don't refer to a message are always kept. */
+static inline bool trace_msg_selected(const TraceContext *tc, const DAQ_Msg_t *msg)
+{
+    if (!tc->selective || !msg)
+        return true;
+
+    return trace_msg_set_contains(&tc->selected, msg);
+}
+
+static inline const DAQ_PktHdr_t *trace_msg_pkthdr(const DAQ_Msg_t *msg)
+{
+    return (msg && msg->type == DAQ_MSG_TYPE_PACKET) ? (const DAQ_PktHdr_t *) msg->hdr : NULL;
+}
+
+/* Start a record with room for 'payload_len' bytes of payload following the header.  Returns NULL
+    if the record should not (or can not) be recorded. */
+static TraceRecordHeader *trace_record_start(TraceContext *tc, TraceRecordType type, uint16_t arg,
+        const DAQ_PktHdr_t *pkthdr, uint32_t msg_len, size_t payload_len)
+{
+    if (!tc->active)
+        return NULL;
+
+    size_t len = sizeof(TraceRecordHeader) + payload_len;
+    TraceRecordHeader *rec;
+    if (tc->binary)
+    {
+        if (TRACE_RECORD_ALIGN(len) > tc->buffer_size ||
+                !(rec = (TraceRecordHeader *) trace_reserve(tc, TRACE_RECORD_ALIGN(len))))
+        {
+            tc->records_dropped++;
+            return NULL;
+        }
+    }
+    else
+    {
+        if (len > tc->scratch_size)
+        {
+            uint8_t *scratch = realloc(tc->scratch, len);
+            if (!scratch)
+            {
+                tc->records_dropped++;
+                return NULL;
+            }
+            tc->scratch = scratch;
+            tc->scratch_size = len;
+        }
+        rec = (TraceRecordHeader *) tc->scratch;
+    }
+
+    rec->len = len;
+    rec->type = type;
+    rec->arg = arg;
+    rec->flags = 0;
+    rec->msg_len = 0;
+    rec->ts_sec = 0;
+    rec->ts_usec = 0;
+    rec->reserved = 0;
+    if (pkthdr)
+    {
+        rec->flags |= TRACE_RECORD_FLAG_PACKET;
+        rec->msg_len = msg_len;
+        rec->ts_sec = pkthdr->ts.tv_sec;
+        rec->ts_usec = pkthdr->ts.tv_usec;
+    }
+
+    return rec;
+}
+
+static void trace_record_finish(TraceContext *tc, TraceRecordHeader *rec)
 {
-    unsigned int i;
-    for (i = 0; i < len; i++)
+    if (tc->binary)
     {
-        if (i % 16 == 0)
-            fprintf(fp, "\n%s", prefix ? prefix : "");
-        else if (i % 2 == 0)
-            fprintf(fp, " ");
-        fprintf(fp, "%02x", data[i]);
+        size_t aligned = TRACE_RECORD_ALIGN(rec->len);
+        memset((uint8_t *) rec + rec->len, 0, aligned - rec->len);
+        tc->fill->len += aligned;
     }
-    fprintf(fp, "\n");
+    else
+        trace_render_record(tc->outfile, rec);
+    tc->records++;
 }
 
+static inline uint8_t *trace_record_payload(TraceRecordHeader *rec)
+{
+    return (uint8_t *) (rec + 1);
+}
+
+static void trace_record_msg(TraceContext *tc, DAQ_IoctlCmd cmd, const DAQ_Msg_t *msg,
+        const void *payload, size_t payload_len)
+{
+    if (!trace_msg_selected(tc, msg))
+        return;
+
+    TraceRecordHeader *rec = trace_record_start(tc, TRACE_RECORD_IOCTL, cmd, trace_msg_pkthdr(msg),
+            msg ? msg->data_len : 0, payload_len);
+    if (!rec)
+        return;
+    if (payload_len)
+        memcpy(trace_record_payload(rec), payload, payload_len);
+    trace_record_finish(tc, rec);
+}
+
+static void trace_record_direct_inject_payload(TraceContext *tc, const DIOCTL_DirectInjectPayload *dip)
+{
+    if (!trace_msg_selected(tc, dip->msg))
+        return;
+
+    size_t payload_len = 2;
+    for (int i = 0; i < dip->num_segments; i++)
+        payload_len += sizeof(uint32_t) + dip->segments[i]->length;
+
+    TraceRecordHeader *rec = trace_record_start(tc, TRACE_RECORD_IOCTL, DIOCTL_DIRECT_INJECT_PAYLOAD,
+            trace_msg_pkthdr(dip->msg), dip->msg ? dip->msg->data_len : 0, payload_len);
+    if (!rec)
+        return;
+
+    uint8_t *p = trace_record_payload(rec);
+    *p++ = dip->reverse ? 1 : 0;
+    *p++ = dip->num_segments;
+    for (int i = 0; i < dip->num_segments; i++)
+    {
+        const DAQ_DIPayloadSegment *segment = dip->segments[i];
+        memcpy(p, &segment->length, sizeof(segment->length));
+        p += sizeof(segment->length);
+        memcpy(p, segment->data, segment->length);
+        p += segment->length;
+    }
+    trace_record_finish(tc, rec);
+}
+
+/*
+ * Selection setup and teardown
+ */
+
+static int trace_parse_flow_ids(TraceContext *tc, const char *value)
+{
+    char *list = strdup(value);
+    if (!list)
+    {
+        SET_ERROR(tc->modinst, "%s: Couldn't allocate memory for the flow ID list", __func__);
+        return DAQ_ERROR_NOMEM;
+    }
+
+    int rval = DAQ_SUCCESS;
+    unsigned parsed = 0;
+    char *saveptr;
+    for (char *id = strtok_r(list, ",", &saveptr); id; id = strtok_r(NULL, ",", &saveptr))
+    {
+        unsigned long flow_id;
+        if (util_parse_uint(id, &flow_id) != 0 || flow_id > UINT32_MAX)
+        {
+            SET_ERROR(tc->modinst, "%s: Invalid flow ID: '%s'", __func__, id);
+            rval = DAQ_ERROR_INVAL;
+            break;
+        }
+        if (tc->num_flow_ids == TRACE_MAX_FLOW_IDS)
+        {
+            SET_ERROR(tc->modinst, "%s: Too many flow IDs (maximum %d)", __func__, TRACE_MAX_FLOW_IDS);
+            rval = DAQ_ERROR_INVAL;
+            break;
+        }
+        tc->flow_ids[tc->num_flow_ids++] = flow_id;
+        parsed++;
+    }
+    free(list);
+
+    /* An empty list would otherwise quietly select every packet */
+    if (rval == DAQ_SUCCESS && parsed == 0)
+    {
+        SET_ERROR(tc->modinst, "%s: No flow IDs given: '%s'", __func__, value);
+        rval = DAQ_ERROR_INVAL;
+    }
+
+    return rval;
+}
+
+static int trace_parse_verdicts(TraceContext *tc, const char *value)
+{
+    char *list = strdup(value);
+    if (!list)
+    {
+        SET_ERROR(tc->modinst, "%s: Couldn't allocate memory for the verdict list", __func__);
+        return DAQ_ERROR_NOMEM;
+    }
+
+    uint32_t mask = 0;
+    char *saveptr;
+    for (char *name = strtok_r(list, ",", &saveptr); name; name = strtok_r(NULL, ",", &saveptr))
+    {
+        DAQ_Verdict verdict;
+        for (verdict = DAQ_VERDICT_PASS; verdict < MAX_DAQ_VERDICT; verdict++)
+        {
+            if (!strcmp(name, trace_verdict_names[verdict]))
+                break;
+        }
+        if (verdict == MAX_DAQ_VERDICT)
+        {
+            SET_ERROR(tc->modinst, "%s: Invalid verdict in verdicts: '%s'", __func__, name);
+            free(list);
+            return DAQ_ERROR_INVAL;
+        }
+        mask |= TRACE_VERDICT(verdict);
+    }
+    free(list);
+
+    if (mask == 0)
+    {
+        SET_ERROR(tc->modinst, "%s: No verdicts given: '%s'", __func__, value);
+        return DAQ_ERROR_INVAL;
+    }
+
+    tc->verdicts = mask;
+
+    return DAQ_SUCCESS;
+}
+
+#ifdef LIBPCAP_AVAILABLE
+static int trace_compile_filter(TraceContext *tc)
+{
+    struct bpf_program fcode;
+    int dlt = CALL_SUBAPI_NOARGS(tc, get_datalink_type);
+    int snaplen = CALL_SUBAPI_NOARGS(tc, get_snaplen);
+
+    pthread_mutex_lock(&bpf_mutex);
+    if (pcap_compile_nopcap(snaplen, dlt, &fcode, tc->filter, 1, PCAP_NETMASK_UNKNOWN) == -1)
+    {
+        pthread_mutex_unlock(&bpf_mutex);
+        SET_ERROR(tc->modinst, "%s: BPF state machine compilation failed for '%s'", __func__, tc->filter);
+        return DAQ_ERROR;
+    }
+    pthread_mutex_unlock(&bpf_mutex);
+
+    pcap_freecode(&tc->fcode);
+    tc->fcode.bf_len = fcode.bf_len;
+    tc->fcode.bf_insns = fcode.bf_insns;
+
+    return DAQ_SUCCESS;
+}
+#endif
+
+/* Size the selected message table so that it can never fill up with outstanding messages. */
+static int trace_open_selection(TraceContext *tc)
+{
+#ifdef LIBPCAP_AVAILABLE
+    if (tc->filter && trace_compile_filter(tc) != DAQ_SUCCESS)
+        return DAQ_ERROR;
+#endif
+
+    unsigned pool_size = DEFAULT_SELECTED_SLOTS / 2;
+    DAQ_MsgPoolInfo_t mpool_info;
+    if (CHECK_SUBAPI(tc, get_msg_pool_info) && CALL_SUBAPI(tc, get_msg_pool_info, &mpool_info) == DAQ_SUCCESS &&
+            mpool_info.size > 0)
+        pool_size = mpool_info.size;
+
+    unsigned num_slots = 64;
+    while (num_slots <= pool_size * 2)
+        num_slots <<= 1;
+
+    tc->selected.slots = calloc(num_slots, sizeof(*tc->selected.slots));
+    if (!tc->selected.slots)
+    {
+        SET_ERROR(tc->modinst, "%s: Couldn't allocate memory for the selected message table", __func__);
+        return DAQ_ERROR_NOMEM;
+    }
+    tc->selected.mask = num_slots - 1;
+    tc->selected.count = 0;
+    tc->sample_count = 0;
+    tc->rate_second = 0;
+    tc->rate_count = 0;
+
+    return DAQ_SUCCESS;
+}
+
+static void trace_close_selection(TraceContext *tc)
+{
+    free(tc->selected.slots);
+    memset(&tc->selected, 0, sizeof(tc->selected));
+}
+
+/*
+ * Output setup and teardown
+ */
+
+static int trace_open_binary(TraceContext *tc)
+{
+    tc->fd = open(tc->filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (tc->fd < 0)
+    {
+        SET_ERROR(tc->modinst, "can't open binary trace output file %s: %s", tc->filename, strerror(errno));
+        return DAQ_ERROR;
+    }
+
+    TraceFileHeader fhdr;
+    memset(&fhdr, 0, sizeof(fhdr));
+    memcpy(fhdr.magic, TRACE_FILE_MAGIC, sizeof(fhdr.magic));
+    fhdr.byte_order = TRACE_BYTE_ORDER_MAGIC;
+    fhdr.version = TRACE_FILE_VERSION;
+    struct iovec iov = { &fhdr, sizeof(fhdr) };
+    if (write_fully(tc->fd, &iov, 1) != 0)
+    {
+        SET_ERROR(tc->modinst, "can't write binary trace output file header: %s", strerror(errno));
+        goto fail;
+    }
+
+    tc->head = tc->tail = 0;
+    tc->fill = NULL;
+    tc->writer_exit = false;
+    int rval = pthread_create(&tc->writer_tid, NULL, trace_writer_thread, tc);
+    if (rval != 0)
+    {
+        SET_ERROR(tc->modinst, "Could not create the trace writer thread: %s", strerror(rval));
+        goto fail;
+    }
+    tc->writer_running = true;
+
+    return DAQ_SUCCESS;
+
+fail:
+    close(tc->fd);
+    tc->fd = -1;
+    return DAQ_ERROR;
+}
+
+static void trace_close(TraceContext *tc)
+{
+    tc->active = false;
+
+    if (tc->writer_running)
+    {
+        /* Hand off whatever is left in the partially filled buffer before asking the writer to exit. */
+        if (tc->fill)
+            trace_submit(tc);
+
+        pthread_mutex_lock(&tc->writer_lock);
+        tc->writer_exit = true;
+        pthread_cond_signal(&tc->work_cond);
+        pthread_mutex_unlock(&tc->writer_lock);
+
+        pthread_join(tc->writer_tid, NULL);
+        tc->writer_running = false;
+    }
+
+    if (tc->fd >= 0)
+    {
+        close(tc->fd);
+        tc->fd = -1;
+    }
+
+    if (tc->outfile)
+    {
+        fclose(tc->outfile);
+        tc->outfile = NULL;
+    }
+
+    trace_close_selection(tc);
+}
+
+static void trace_free(TraceContext *tc)
+{
+    if (tc->buffers)
+    {
+        for (unsigned i = 0; i < tc->num_buffers; i++)
+            free(tc->buffers[i].data);
+        free(tc->buffers);
+    }
+    pthread_cond_destroy(&tc->space_cond);
+    pthread_cond_destroy(&tc->work_cond);
+    pthread_mutex_destroy(&tc->writer_lock);
+#ifdef LIBPCAP_AVAILABLE
+    pcap_freecode(&tc->fcode);
+#endif
+    free(tc->filter);
+    free(tc->scratch);
+    free(tc->filename);
+    free(tc);
+}
+
+static void trace_add_counter(DIOCTL_GetModuleCounters *gmc, const char *name, uint64_t value)
+{
+    if (gmc->num_counters >= gmc->max_counters)
+        return;
+
+    DAQ_ModuleCounter_t *counter = &gmc->counters[gmc->num_counters++];
+    counter->module = "trace";
+    counter->name = name;
+    counter->value = value;
+}
+
+static void trace_add_counters(TraceContext *tc, DIOCTL_GetModuleCounters *gmc)
+{
+    if (tc->selective)
+    {
+        trace_add_counter(gmc, "messages_selected", tc->messages_selected);
+        trace_add_counter(gmc, "messages_filtered", tc->messages_filtered);
+        trace_add_counter(gmc, "messages_unsampled", tc->messages_unsampled);
+        trace_add_counter(gmc, "messages_rate_limited", tc->messages_rate_limited);
+    }
+    trace_add_counter(gmc, "records", tc->records);
+    trace_add_counter(gmc, "records_dropped", tc->records_dropped);
+    if (tc->binary)
+    {
+        trace_add_counter(gmc, "bytes_written", __atomic_load_n(&tc->bytes_written, __ATOMIC_RELAXED));
+        trace_add_counter(gmc, "write_errors", __atomic_load_n(&tc->write_errors, __ATOMIC_RELAXED));
+        trace_add_counter(gmc, "queue_depth", trace_queue_depth(tc));
+        trace_add_counter(gmc, "max_queue_depth", tc->max_queue_depth);
+    }
+}
+
+//-------------------------------------------------------------------------
+
 static int trace_daq_module_load(const DAQ_BaseAPI_t *base_api)
 {
     if (base_api->api_version != DAQ_BASE_API_VERSION || base_api->api_size != sizeof(DAQ_BaseAPI_t))
@@ -123,23 +936,134 @@ static int trace_daq_instantiate(const DAQ_ModuleConfig_h modcfg, DAQ_ModuleInst
         return DAQ_ERROR_NOMEM;
     }
     tc->modinst = modinst;
+    tc->fd = -1;
+    tc->verdicts = TRACE_ALL_VERDICTS;
+    pthread_mutex_init(&tc->writer_lock, NULL);
+    pthread_cond_init(&tc->work_cond, NULL);
+    pthread_cond_init(&tc->space_cond, NULL);
+
+    int rval = DAQ_ERROR_INVAL;
 
     if (daq_base_api.resolve_subapi(modinst, &tc->subapi) != DAQ_SUCCESS)
     {
         SET_ERROR(modinst, "%s: Couldn't resolve subapi. No submodule configured?", __func__);
-        free(tc);
-        return DAQ_ERROR_INVAL;
+        goto fail;
     }
 
-    const char *filename = DAQ_TRACE_FILENAME;
+    const char *filename = NULL;
+    unsigned long buffer_size_kb = DEFAULT_BUFFER_SIZE_KB;
+    unsigned long num_buffers = DEFAULT_NUM_BUFFERS;
+    unsigned long flush_interval_ms = DEFAULT_FLUSH_INTERVAL_MS;
+    unsigned long sample_rate = 1;
+    unsigned long max_rate = 0;
     const char *varKey, *varValue;
     daq_base_api.config_first_variable(modcfg, &varKey, &varValue);
     while (varKey)
     {
         if (!strcmp(varKey, "file"))
             filename = varValue;
+        else if (!strcmp(varKey, "format"))
+        {
+            if (!strcmp(varValue, "binary"))
+                tc->binary = true;
+            else if (!strcmp(varValue, "text"))
+                tc->binary = false;
+            else
+            {
+                SET_ERROR(modinst, "%s: Invalid trace format (%s)", __func__, varValue);
+                goto fail;
+            }
+        }
+        else if (!strcmp(varKey, "buffer-size"))
+        {
+            if (util_parse_uint(varValue, &buffer_size_kb) != 0 || buffer_size_kb < MIN_BUFFER_SIZE_KB)
+            {
+                SET_ERROR(modinst, "%s: Invalid value for key '%s': '%s'", __func__, varKey, varValue);
+                goto fail;
+            }
+        }
+        else if (!strcmp(varKey, "buffers"))
+        {
+            if (util_parse_uint(varValue, &num_buffers) != 0 || num_buffers < 2 || num_buffers > 65536)
+            {
+                SET_ERROR(modinst, "%s: Invalid value for key '%s': '%s'", __func__, varKey, varValue);
+                goto fail;
+            }
+        }
+        else if (!strcmp(varKey, "overflow"))
+        {
+            if (!strcmp(varValue, "drop"))
+                tc->drop_on_overflow = true;
+            else if (!strcmp(varValue, "block"))
+                tc->drop_on_overflow = false;
+            else
+            {
+                SET_ERROR(modinst, "%s: Invalid overflow action (%s)", __func__, varValue);
+                goto fail;
+            }
+        }
+        else if (!strcmp(varKey, "flush-interval"))
+        {
+            if (util_parse_uint(varValue, &flush_interval_ms) != 0)
+            {
+                SET_ERROR(modinst, "%s: Invalid value for key '%s': '%s'", __func__, varKey, varValue);
+                goto fail;
+            }
+        }
+        else if (!strcmp(varKey, "filter"))
+        {
+#ifdef LIBPCAP_AVAILABLE
+            free(tc->filter);
+            tc->filter = strdup(varValue);
+            if (!tc->filter)
+            {
+                SET_ERROR(modinst, "%s: Couldn't allocate memory for the trace filter", __func__);
+                rval = DAQ_ERROR_NOMEM;
+                goto fail;
+            }
+#else
+            SET_ERROR(modinst, "%s: BPF trace filters are not supported (built without LibPCAP)", __func__);
+            goto fail;
+#endif
+        }
+        else if (!strcmp(varKey, "flow-id"))
+        {
+            if ((rval = trace_parse_flow_ids(tc, varValue)) != DAQ_SUCCESS)
+                goto fail;
+            rval = DAQ_ERROR_INVAL;
+        }
+        else if (!strcmp(varKey, "flagged"))
+            tc->flagged = DAQ_PKT_FLAG_TRACE_ENABLED | DAQ_PKT_FLAG_DEBUG_ENABLED;
+        else if (!strcmp(varKey, "verdicts"))
+        {
+            if ((rval = trace_parse_verdicts(tc, varValue)) != DAQ_SUCCESS)
+                goto fail;
+            rval = DAQ_ERROR_INVAL;
+        }
+        else if (!strcmp(varKey, "sample"))
+        {
+            if (util_parse_uint(varValue, &sample_rate) != 0 || sample_rate == 0 || sample_rate > UINT32_MAX)
+            {
+                SET_ERROR(modinst, "%s: Invalid value for key '%s': '%s'", __func__, varKey, varValue);
+                goto fail;
+            }
+        }
+        else if (!strcmp(varKey, "max-rate"))
+        {
+            if (util_parse_uint(varValue, &max_rate) != 0 || max_rate > UINT32_MAX)
+            {
+                SET_ERROR(modinst, "%s: Invalid value for key '%s': '%s'", __func__, varKey, varValue);
+                goto fail;
+            }
+        }
         daq_base_api.config_next_variable(modcfg, &varKey, &varValue);
     }
+    if (!filename)
+        filename = tc->binary ? DAQ_TRACE_BINARY_FILENAME : DAQ_TRACE_FILENAME;
+    tc->sample_rate = sample_rate;
+    tc->max_rate = max_rate;
+    tc->selective = tc->filter || tc->num_flow_ids > 0 || tc->flagged || sample_rate > 1 || max_rate > 0;
+    tc->flush_interval_ms = flush_interval_ms;
 
     // Mangle the output filename with a prefix in the multi-instance scenario
     char prefix[32];
@@ -149,8 +1073,7 @@ static int trace_daq_instantiate(const DAQ_ModuleConfig_h modcfg, DAQ_ModuleInst
         if (strchr(filename, '/'))
         {
             SET_ERROR(modinst, "%s: Invalid filename for multi-instance: %s", __func__, filename);
-            free(tc);
-            return DAQ_ERROR_INVAL;
+            goto fail;
         }
 
         snprintf(prefix, sizeof(prefix), "%u_", instance_id);
@@ -158,29 +1081,59 @@ static int trace_daq_instantiate(const DAQ_ModuleConfig_h modcfg, DAQ_ModuleInst
     else
         prefix[0] = '\0';
 
+    rval = DAQ_ERROR_NOMEM;
+
     size_t len = strlen(filename) + strlen(prefix) + 1;
     tc->filename = malloc(len);
     if (!tc->filename)
     {
-        SET_ERROR(modinst, "%s: Couldn't allocate memory for the text output filename", __func__);
-        free(tc);
-        return DAQ_ERROR_NOMEM;
+        SET_ERROR(modinst, "%s: Couldn't allocate memory for the output filename", __func__);
+        goto fail;
     }
     snprintf(tc->filename, len, "%s%s", prefix, filename);
 
+    if (tc->binary)
+    {
+        /* Round the number of buffers up to a power of two for cheap ring indexing. */
+        unsigned ring_size = 2;
+        while (ring_size < num_buffers)
+            ring_size <<= 1;
+
+        tc->buffers = calloc(ring_size, sizeof(TraceBuffer));
+        if (!tc->buffers)
+        {
+            SET_ERROR(modinst, "%s: Couldn't allocate memory for the output buffer ring", __func__);
+            goto fail;
+        }
+        tc->num_buffers = ring_size;
+        tc->buffer_size = buffer_size_kb * 1024;
+
+        for (unsigned i = 0; i < ring_size; i++)
+        {
+            tc->buffers[i].data = malloc(tc->buffer_size);
+            if (!tc->buffers[i].data)
+            {
+                SET_ERROR(modinst, "%s: Couldn't allocate %zu bytes for an output buffer", __func__, tc->buffer_size);
+                goto fail;
+            }
+        }
+    }
+
     *ctxt_ptr = tc;
 
     return DAQ_SUCCESS;
+
+fail:
+    trace_free(tc);
+    return rval;
 }
 
 static void trace_daq_destroy(void *handle)
 {
     TraceContext *tc = (TraceContext *) handle;
 
-    if (tc->outfile)
-        fclose(tc->outfile);
-    free(tc->filename);
-    free(tc);
+    trace_close(tc);
+    trace_free(tc);
 }
 
 static int trace_daq_inject(void *handle, DAQ_MsgType type, const void *hdr, const uint8_t *data, uint32_t data_len)
@@ -190,10 +1143,12 @@ static int trace_daq_inject(void *handle, DAQ_MsgType type, const void *hdr, con
     if (type == DAQ_MSG_TYPE_PACKET)
     {
         const DAQ_PktHdr_t *pkthdr = (const DAQ_PktHdr_t *) hdr;
-        fprintf(tc->outfile, "I: %lu.%lu(%u)\n", (unsigned long) pkthdr->ts.tv_sec,
-               (unsigned long) pkthdr->ts.tv_usec, data_len);
-        hexdump(tc->outfile, data, data_len, "    ");
-        fprintf(tc->outfile, "\n");
+        TraceRecordHeader *rec = trace_record_start(tc, TRACE_RECORD_INJECT, 0, pkthdr, data_len, data_len);
+        if (rec)
+        {
+            memcpy(trace_record_payload(rec), data, data_len);
+            trace_record_finish(tc, rec);
+        }
     }
 
     if (CHECK_SUBAPI(tc, inject))
@@ -210,12 +1165,17 @@ static int trace_daq_inject(void *handle, DAQ_MsgType type, const void *hdr, con
 static int trace_daq_inject_relative(void *handle, const DAQ_Msg_t *msg, const uint8_t *data, uint32_t data_len, int reverse)
 {
     TraceContext *tc = (TraceContext*) handle;
-    const DAQ_PktHdr_t *hdr = (const DAQ_PktHdr_t *) msg->hdr;
 
-    fprintf(tc->outfile, "%cI: %lu.%lu(%u): %u\n", reverse ? 'R' : 'F',
-            (unsigned long) hdr->ts.tv_sec, (unsigned long) hdr->ts.tv_usec, msg->data_len, data_len);
-    hexdump(tc->outfile, data, data_len, "    ");
-    fprintf(tc->outfile, "\n");
+    if (trace_msg_selected(tc, msg))
+    {
+        TraceRecordHeader *rec = trace_record_start(tc, TRACE_RECORD_INJECT_RELATIVE, reverse ? 1 : 0,
+                trace_msg_pkthdr(msg), msg->data_len, data_len);
+        if (rec)
+        {
+            memcpy(trace_record_payload(rec), data, data_len);
+            trace_record_finish(tc, rec);
+        }
+    }
 
     if (CHECK_SUBAPI(tc, inject_relative))
     {
@@ -236,16 +1196,31 @@ static int trace_daq_start(void* handle)
     if (rval != DAQ_SUCCESS)
         return rval;
 
-    const char* filename = tc->filename ? tc->filename : DAQ_TRACE_FILENAME;
-    tc->outfile = fopen(filename, "w");
-    if (!tc->outfile)
+    if (tc->selective && trace_open_selection(tc) != DAQ_SUCCESS)
+        goto fail;
+
+    if (tc->binary)
     {
-        CALL_SUBAPI_NOARGS(tc, stop);
-        SET_ERROR(tc->modinst, "can't open text output file");
-        return DAQ_ERROR;
+        if (trace_open_binary(tc) != DAQ_SUCCESS)
+            goto fail;
     }
+    else
+    {
+        tc->outfile = fopen(tc->filename, "w");
+        if (!tc->outfile)
+        {
+            SET_ERROR(tc->modinst, "can't open text output file");
+            goto fail;
+        }
+    }
+    tc->active = true;
 
     return DAQ_SUCCESS;
+
+fail:
+    trace_close_selection(tc);
+    CALL_SUBAPI_NOARGS(tc, stop);
+    return DAQ_ERROR;
 }
 
 static int trace_daq_stop (void* handle)
@@ -256,31 +1231,35 @@ static int trace_daq_stop (void* handle)
     if (rval != DAQ_SUCCESS)
         return rval;
 
-    if (tc->outfile)
-    {
-        fclose(tc->outfile);
-        tc->outfile = NULL;
-    }
+    trace_close(tc);
 
     return DAQ_SUCCESS;
 }
 
-static void print_msg(TraceContext* tc, const DAQ_Msg_t *msg)
-{
-    if (msg->type == DAQ_MSG_TYPE_PACKET)
-    {
-        const DAQ_PktHdr_t *hdr = (const DAQ_PktHdr_t *) msg->hdr;
-        fprintf(tc->outfile, "%lu.%lu(%u)", (unsigned long) hdr->ts.tv_sec,
-                    (unsigned long) hdr->ts.tv_usec, msg->data_len);
-    }
-}
-
 static int trace_daq_ioctl(void *handle, DAQ_IoctlCmd cmd, void *arg, size_t arglen)
 {
     TraceContext* tc = (TraceContext*) handle;
 
     switch (cmd)
     {
+        case DIOCTL_GET_MODULE_COUNTERS:
+        {
+            if (arglen != sizeof(DIOCTL_GetModuleCounters))
+                return DAQ_ERROR_INVAL;
+            DIOCTL_GetModuleCounters *gmc = (DIOCTL_GetModuleCounters *) arg;
+            if (!gmc->counters && gmc->max_counters > 0)
+                return DAQ_ERROR_INVAL;
+
+            trace_add_counters(tc, gmc);
+
+            if (CHECK_SUBAPI(tc, ioctl))
+            {
+                int rval = CALL_SUBAPI(tc, ioctl, cmd, arg, arglen);
+                if (rval != DAQ_SUCCESS && rval != DAQ_ERROR_NOTSUP)
+                    return rval;
+            }
+            return DAQ_SUCCESS;
+        }
         case DIOCTL_GET_DEVICE_INDEX:
         {
             if (arglen != sizeof(DIOCTL_QueryDeviceIndex))
@@ -288,7 +1267,7 @@ static int trace_daq_ioctl(void *handle, DAQ_IoctlCmd cmd, void *arg, size_t arg
             DIOCTL_QueryDeviceIndex *qdi = (DIOCTL_QueryDeviceIndex *) arg;
             if (!qdi->device)
                 return DAQ_ERROR_INVAL;
-            fprintf(tc->outfile, "IOCTL: QueryDeviceIndex: '%s'\n", qdi->device);
+            trace_record_msg(tc, cmd, NULL, qdi->device, strlen(qdi->device));
             break;
         }
         case DIOCTL_SET_FLOW_OPAQUE:
@@ -298,9 +1277,7 @@ static int trace_daq_ioctl(void *handle, DAQ_IoctlCmd cmd, void *arg, size_t arg
             DIOCTL_SetFlowOpaque *sfo = (DIOCTL_SetFlowOpaque *) arg;
             if (!sfo->msg)
                 return DAQ_ERROR_INVAL;
-            fprintf(tc->outfile, "IOCTL: SetFlowOpaque: ");
-            print_msg(tc, sfo->msg);
-            fprintf(tc->outfile, " Value: %u\n", sfo->value);
+            trace_record_msg(tc, cmd, sfo->msg, &sfo->value, sizeof(sfo->value));
             break;
         }
         case DIOCTL_SET_FLOW_HA_STATE:
@@ -310,10 +1287,7 @@ static int trace_daq_ioctl(void *handle, DAQ_IoctlCmd cmd, void *arg, size_t arg
             DIOCTL_FlowHAState *fhs = (DIOCTL_FlowHAState *) arg;
             if (!fhs->msg || (!fhs->data && fhs->length != 0))
                 return DAQ_ERROR_INVAL;
-            fprintf(tc->outfile, "IOCTL: SetFlowHAState: ");
-            print_msg(tc, fhs->msg);
-            fprintf(tc->outfile, " (%u)\n", fhs->length);
-            hexdump(tc->outfile, fhs->data, fhs->length, "    ");
+            trace_record_msg(tc, cmd, fhs->msg, fhs->data, fhs->length);
             break;
         }
         case DIOCTL_GET_FLOW_HA_STATE:
@@ -323,9 +1297,7 @@ static int trace_daq_ioctl(void *handle, DAQ_IoctlCmd cmd, void *arg, size_t arg
             DIOCTL_FlowHAState *fhs = (DIOCTL_FlowHAState *) arg;
             if (!fhs->msg)
                 return DAQ_ERROR_INVAL;
-            fprintf(tc->outfile, "IOCTL: GetFlowHAState: ");
-            print_msg(tc, fhs->msg);
-            fprintf(tc->outfile, "\n");
+            trace_record_msg(tc, cmd, fhs->msg, NULL, 0);
             break;
         }
         case DIOCTL_SET_FLOW_QOS_ID:
@@ -335,10 +1307,7 @@ static int trace_daq_ioctl(void *handle, DAQ_IoctlCmd cmd, void *arg, size_t arg
             DIOCTL_SetFlowQosID *sfq = (DIOCTL_SetFlowQosID *) arg;
             if (!sfq->msg)
                 return DAQ_ERROR_INVAL;
-            fprintf(tc->outfile, "IOCTL: SetFlowQosID: ");
-            print_msg(tc, sfq->msg);
-            fprintf(tc->outfile, "%u/0x%x\n", (unsigned) (sfq->qos_id & 0xFFFFFFFF),
-                    (unsigned) (sfq->qos_id >> 32));
+            trace_record_msg(tc, cmd, sfq->msg, &sfq->qos_id, sizeof(sfq->qos_id));
             break;
         }
         case DIOCTL_SET_PACKET_TRACE_DATA:
@@ -348,10 +1317,18 @@ static int trace_daq_ioctl(void *handle, DAQ_IoctlCmd cmd, void *arg, size_t arg
             DIOCTL_SetPacketTraceData *sptd = (DIOCTL_SetPacketTraceData *) arg;
             if (!sptd->msg || (!sptd->trace_data && sptd->trace_data_len != 0))
                 return DAQ_ERROR_INVAL;
-            fprintf(tc->outfile, "IOCTL: SetPacketTraceData: ");
-            print_msg(tc, sptd->msg);
-            fprintf(tc->outfile, " VR: %hhu (%u):\n", sptd->verdict_reason, sptd->trace_data_len);
-            fprintf(tc->outfile, "    %.*s\n", sptd->trace_data_len, sptd->trace_data);
+            if (!trace_msg_selected(tc, sptd->msg))
+                break;
+            TraceRecordHeader *rec = trace_record_start(tc, TRACE_RECORD_IOCTL, cmd, trace_msg_pkthdr(sptd->msg),
+                    sptd->msg->data_len, 1 + (size_t) sptd->trace_data_len);
+            if (rec)
+            {
+                uint8_t *p = trace_record_payload(rec);
+                p[0] = sptd->verdict_reason;
+                if (sptd->trace_data_len)
+                    memcpy(p + 1, sptd->trace_data, sptd->trace_data_len);
+                trace_record_finish(tc, rec);
+            }
             break;
         }
         case DIOCTL_SET_PACKET_VERDICT_REASON:
@@ -361,9 +1338,7 @@ static int trace_daq_ioctl(void *handle, DAQ_IoctlCmd cmd, void *arg, size_t arg
             DIOCTL_SetPacketVerdictReason *spvr = (DIOCTL_SetPacketVerdictReason *) arg;
             if (!spvr->msg)
                 return DAQ_ERROR_INVAL;
-            fprintf(tc->outfile, "IOCTL: SetPacketVerdictReason: ");
-            print_msg(tc, spvr->msg);
-            fprintf(tc->outfile, " VR: %hhu\n", spvr->verdict_reason);
+            trace_record_msg(tc, cmd, spvr->msg, &spvr->verdict_reason, sizeof(spvr->verdict_reason));
             break;
         }
         case DIOCTL_SET_FLOW_PRESERVE:
@@ -373,9 +1348,7 @@ static int trace_daq_ioctl(void *handle, DAQ_IoctlCmd cmd, void *arg, size_t arg
             DAQ_Msg_h msg = (DAQ_Msg_h) arg;
             if (!msg)
                 return DAQ_ERROR_INVAL;
-            fprintf(tc->outfile, "IOCTL: SetFlowPreserve: ");
-            print_msg(tc, msg);
-            fprintf(tc->outfile, "\n");
+            trace_record_msg(tc, cmd, msg, NULL, 0);
             break;
         }
         case DIOCTL_GET_FLOW_TCP_SCRUBBED_SYN:
@@ -386,10 +1359,7 @@ static int trace_daq_ioctl(void *handle, DAQ_IoctlCmd cmd, void *arg, size_t arg
             DIOCTL_GetFlowScrubbedTcp *gpst = (DIOCTL_GetFlowScrubbedTcp *) arg;
             if (!gpst->msg)
                 return DAQ_ERROR_INVAL;
-            fprintf(tc->outfile, "IOCTL: %s: ", (cmd == DIOCTL_GET_FLOW_TCP_SCRUBBED_SYN) ?
-                    "GetFlowTcpScrubbedSyn" : "GetFlowTcpScrubbedSynAck");
-            print_msg(tc, gpst->msg);
-            fprintf(tc->outfile, "\n");
+            trace_record_msg(tc, cmd, gpst->msg, NULL, 0);
             break;
         }
         case DIOCTL_CREATE_EXPECTED_FLOW:
@@ -399,24 +1369,12 @@ static int trace_daq_ioctl(void *handle, DAQ_IoctlCmd cmd, void *arg, size_t arg
             DIOCTL_CreateExpectedFlow *cef = (DIOCTL_CreateExpectedFlow *) arg;
             if (!cef->ctrl_msg || cef->ctrl_msg->type != DAQ_MSG_TYPE_PACKET)
                 return DAQ_ERROR_INVAL;
-            fprintf(tc->outfile, "IOCTL: CreateExpectedFlow: ");
-            print_msg(tc, cef->ctrl_msg);
-            fprintf(tc->outfile, ":\n");
-
-            DAQ_EFlow_Key_t *key = (DAQ_EFlow_Key_t *) &cef->key;
-            char src_addr_str[INET6_ADDRSTRLEN], dst_addr_str[INET6_ADDRSTRLEN];
-            if (key->src_af == AF_INET)
-                inet_ntop(AF_INET, &key->sa.src_ip4, src_addr_str, sizeof(src_addr_str));
-            else
-                inet_ntop(AF_INET6, &key->sa.src_ip6, src_addr_str, sizeof(src_addr_str));
-            if (key->dst_af == AF_INET)
-                inet_ntop(AF_INET, &key->da.dst_ip4, dst_addr_str, sizeof(dst_addr_str));
-            else
-                inet_ntop(AF_INET6, &key->da.dst_ip6, dst_addr_str, sizeof(dst_addr_str));
-            fprintf(tc->outfile, "    %s:%hu -> %s:%hu (%hhu)\n", src_addr_str, key->src_port,
-                    dst_addr_str, key->dst_port, key->protocol);
-            fprintf(tc->outfile, "    %hu %hu %hu %hu 0x%X %u\n", key->address_space_id, key->tunnel_type,
-                    key->vlan_id, key->vlan_cnots, cef->flags, cef->timeout_ms);
+            TraceExpectedFlow ef;
+            memset(&ef, 0, sizeof(ef));
+            ef.key = cef->key;
+            ef.flags = cef->flags;
+            ef.timeout_ms = cef->timeout_ms;
+            trace_record_msg(tc, cmd, cef->ctrl_msg, &ef, sizeof(ef));
             break;
         }
         case DIOCTL_DIRECT_INJECT_PAYLOAD:
@@ -424,15 +1382,7 @@ static int trace_daq_ioctl(void *handle, DAQ_IoctlCmd cmd, void *arg, size_t arg
             if (arglen != sizeof(DIOCTL_DirectInjectPayload))
                 return DAQ_ERROR_INVAL;
             DIOCTL_DirectInjectPayload *dip = (DIOCTL_DirectInjectPayload *) arg;
-            fprintf(tc->outfile, "IOCTL: DirectInjectPayload: ");
-            print_msg(tc, dip->msg);
-            fprintf(tc->outfile, " (%hhu segments)%s\n", dip->num_segments, dip->reverse ? " (reverse)" : "");
-            for (int i = 0; i < dip->num_segments; i++)
-            {
-                const DAQ_DIPayloadSegment *segment = dip->segments[i];
-                fprintf(tc->outfile, "  Segment %d (%u)\n", i, segment->length);
-                hexdump(tc->outfile, segment->data, segment->length, "    ");
-            }
+            trace_record_direct_inject_payload(tc, dip);
             break;
         }
         case DIOCTL_DIRECT_INJECT_RESET:
@@ -440,19 +1390,12 @@ static int trace_daq_ioctl(void *handle, DAQ_IoctlCmd cmd, void *arg, size_t arg
             if (arglen != sizeof(DIOCTL_DirectInjectReset))
                 return DAQ_ERROR_INVAL;
             DIOCTL_DirectInjectReset *dir = (DIOCTL_DirectInjectReset *) arg;
-            fprintf(tc->outfile, "IOCTL: DirectInjectReset: ");
-            print_msg(tc, dir->msg);
-            if (dir->direction == DAQ_DIR_BOTH)
-                fprintf(tc->outfile, " (both)");
-            else if (dir->direction == DAQ_DIR_REVERSE)
-                fprintf(tc->outfile, " (reverse)");
-            fprintf(tc->outfile, "\n");
+            trace_record_msg(tc, cmd, dir->msg, &dir->direction, sizeof(dir->direction));
             break;
         }
 
         default:
-            fprintf(tc->outfile, "IOCTL: %d (%zu)\n", cmd, arglen);
-            hexdump(tc->outfile, arg, arglen, "    ");
+            trace_record_msg(tc, cmd, NULL, arg, arglen);
             break;
     }
 
@@ -497,33 +1440,60 @@ static uint32_t trace_daq_get_capabilities(void* handle)
     return caps;
 }
 
-// We don't have access to daq_verdict_string() because we're not linking
-// against LibDAQ, so pack our own copy.
-static const char *daq_verdict_strings[MAX_DAQ_VERDICT] = {
-    "Pass",         // DAQ_VERDICT_PASS
-    "Block",        // DAQ_VERDICT_BLOCK
-    "Replace",      // DAQ_VERDICT_REPLACE
-    "Whitelist",    // DAQ_VERDICT_WHITELIST
-    "Blacklist",    // DAQ_VERDICT_BLACKLIST
-    "Ignore"        // DAQ_VERDICT_IGNORE
-};
+DAQ_STACK_LINKAGE unsigned trace_daq_msg_receive(void *handle, const unsigned max_recv, const DAQ_Msg_t *msgs[], DAQ_RecvStatus *rstat)
+{
+    TraceContext *tc = (TraceContext *) handle;
+    unsigned num_receive = CALL_SUBAPI(tc, msg_receive, max_recv, msgs, rstat);
+
+    /* Without any selection configured, every message is traced and there is nothing to do. */
+    if (!tc->selective || !tc->active || num_receive == 0)
+        return num_receive;
+
+    if (tc->max_rate)
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec != tc->rate_second)
+        {
+            tc->rate_second = now.tv_sec;
+            tc->rate_count = 0;
+        }
+    }
+
+    for (unsigned idx = 0; idx < num_receive; idx++)
+    {
+        const DAQ_Msg_t *msg = msgs[idx];
+        if (msg->type == DAQ_MSG_TYPE_PACKET && trace_select_packet(tc, msg))
+            trace_msg_set_add(&tc->selected, msg);
+    }
 
-static int trace_daq_msg_finalize(void *handle, const DAQ_Msg_t *msg, DAQ_Verdict verdict)
+    return num_receive;
+}
+
+DAQ_STACK_LINKAGE int trace_daq_msg_finalize(void *handle, const DAQ_Msg_t *msg, DAQ_Verdict verdict)
 {
     TraceContext *tc = (TraceContext *) handle;
 
     tc->stats.verdicts[verdict]++;
-    if (msg->type == DAQ_MSG_TYPE_PACKET)
+    if (msg->type == DAQ_MSG_TYPE_PACKET &&
+            (!tc->selective || trace_msg_set_remove(&tc->selected, msg)) &&
+            (tc->verdicts & TRACE_VERDICT(verdict)))
     {
-        DAQ_PktHdr_t *hdr = (DAQ_PktHdr_t *) msg->hdr;
-        const uint8_t *data = msg->data;
-
-        fprintf(tc->outfile, "PV: %lu.%lu(%u): %s\n", (unsigned long) hdr->ts.tv_sec,
-                (unsigned long) hdr->ts.tv_usec, msg->data_len, daq_verdict_strings[verdict]);
-        if (verdict == DAQ_VERDICT_REPLACE)
-            hexdump(tc->outfile, data, msg->data_len, "    ");
+        /* Only replaced packets have their contents recorded along with the verdict. */
+        uint32_t payload_len = (verdict == DAQ_VERDICT_REPLACE) ? msg->data_len : 0;
+        TraceRecordHeader *rec = trace_record_start(tc, TRACE_RECORD_VERDICT, verdict,
+                (const DAQ_PktHdr_t *) msg->hdr, msg->data_len, payload_len);
+        if (rec)
+        {
+            if (payload_len)
+                memcpy(trace_record_payload(rec), msg->data, payload_len);
+            trace_record_finish(tc, rec);
+        }
     }
 
+    if (tc->binary)
+        trace_check_flush(tc);
+
     return CALL_SUBAPI(tc, msg_finalize, msg, verdict);
 }
 
@@ -560,7 +1530,7 @@ DAQ_ModuleAPI_t trace_daq_module_data =
     /* .config_load = */ NULL,
     /* .config_swap = */ NULL,
     /* .config_free = */ NULL,
-    /* .msg_receive = */ NULL,
+    /* .msg_receive = */ trace_daq_msg_receive,
     /* .msg_finalize = */ trace_daq_msg_finalize,
     /* .get_msg_pool_info = */ NULL,
 };
@@ -0,0 +1,178 @@
+/*
+** Copyright (C) 2018-2021 Cisco and/or its affiliates. All rights reserved.
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation.  You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/*
+ * Standalone decoder that renders binary trace files written by the Trace module in the same text
+ * format that the module writes in text mode.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "trace_format.h"
+
+/* Sanity limit on the size of a single record */
+#define MAX_RECORD_LEN  (64 * 1024 * 1024)
+
+static void usage(void)
+{
+    printf("Usage: daq-trace-decode [OPTION]... <file>\n");
+    printf("  -h                Display this usage text and exit\n");
+    printf("  -o <file>         Write the decoded text trace to a file instead of stdout\n");
+}
+
+static int decode(FILE *in, const char *filename, FILE *out)
+{
+    TraceFileHeader fhdr;
+    if (fread(&fhdr, sizeof(fhdr), 1, in) != 1 || memcmp(fhdr.magic, TRACE_FILE_MAGIC, sizeof(fhdr.magic)))
+    {
+        fprintf(stderr, "%s: Not a binary trace file\n", filename);
+        return -1;
+    }
+    if (fhdr.byte_order != TRACE_BYTE_ORDER_MAGIC)
+    {
+        fprintf(stderr, "%s: Trace file was written with a different byte order\n", filename);
+        return -1;
+    }
+    if (fhdr.version != TRACE_FILE_VERSION)
+    {
+        fprintf(stderr, "%s: Unsupported trace file version %hu\n", filename, fhdr.version);
+        return -1;
+    }
+
+    uint8_t *buf = NULL;
+    size_t bufsize = 0;
+    unsigned long count = 0;
+    int rval = 0;
+    TraceRecordHeader rec;
+    size_t nread;
+    while ((nread = fread(&rec, 1, sizeof(rec), in)) == sizeof(rec))
+    {
+        if (rec.len < sizeof(rec) || rec.len > MAX_RECORD_LEN)
+        {
+            fprintf(stderr, "%s: Invalid length %u for record %lu\n", filename, rec.len, count);
+            rval = -1;
+            break;
+        }
+
+        size_t len = TRACE_RECORD_ALIGN(rec.len);
+        if (len > bufsize)
+        {
+            uint8_t *newbuf = realloc(buf, len);
+            if (!newbuf)
+            {
+                fprintf(stderr, "%s: Couldn't allocate %zu bytes for record %lu\n", filename, len, count);
+                rval = -1;
+                break;
+            }
+            buf = newbuf;
+            bufsize = len;
+        }
+        memcpy(buf, &rec, sizeof(rec));
+        if (fread(buf + sizeof(rec), 1, len - sizeof(rec), in) != len - sizeof(rec))
+        {
+            fprintf(stderr, "%s: Truncated record %lu\n", filename, count);
+            rval = -1;
+            break;
+        }
+
+        if (trace_render_record(out, (const TraceRecordHeader *) buf) != 0)
+        {
+            fprintf(stderr, "%s: Malformed record %lu (type %hu)\n", filename, count, rec.type);
+            rval = -1;
+            break;
+        }
+        count++;
+    }
+    if (rval == 0 && nread != 0)
+    {
+        fprintf(stderr, "%s: Truncated record %lu\n", filename, count);
+        rval = -1;
+    }
+    if (rval == 0 && ferror(in))
+    {
+        fprintf(stderr, "%s: Read error: %s\n", filename, strerror(errno));
+        rval = -1;
+    }
+
+    free(buf);
+
+    return rval;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *outname = NULL;
+    int ch;
+
+    while ((ch = getopt(argc, argv, "ho:")) != -1)
+    {
+        switch (ch)
+        {
+            case 'h':
+                usage();
+                return 0;
+            case 'o':
+                outname = optarg;
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+
+    if (optind != argc - 1)
+    {
+        usage();
+        return 1;
+    }
+
+    const char *filename = argv[optind];
+    FILE *in = fopen(filename, "rb");
+    if (!in)
+    {
+        fprintf(stderr, "Couldn't open %s: %s\n", filename, strerror(errno));
+        return 1;
+    }
+
+    FILE *out = stdout;
+    if (outname && !(out = fopen(outname, "w")))
+    {
+        fprintf(stderr, "Couldn't open %s: %s\n", outname, strerror(errno));
+        fclose(in);
+        return 1;
+    }
+
+    int rval = decode(in, filename, out);
+
+    fclose(in);
+    if (out != stdout)
+        fclose(out);
+    else
+        fflush(out);
+
+    return rval == 0 ? 0 : 1;
+}
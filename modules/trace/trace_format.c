@@ -0,0 +1,255 @@
+/*
+** Copyright (C) 2018-2021 Cisco and/or its affiliates. All rights reserved.
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation.  You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <arpa/inet.h>
+#include <string.h>
+
+#if defined(__FreeBSD__) || defined(__OpenBSD__)
+#include <sys/socket.h>
+#endif
+
+#include "trace_format.h"
+
+// We don't have access to daq_verdict_string() because we're not linking
+// against LibDAQ, so pack our own copy.
+static const char *daq_verdict_strings[MAX_DAQ_VERDICT] = {
+    "Pass",         // DAQ_VERDICT_PASS
+    "Block",        // DAQ_VERDICT_BLOCK
+    "Replace",      // DAQ_VERDICT_REPLACE
+    "Whitelist",    // DAQ_VERDICT_WHITELIST
+    "Blacklist",    // DAQ_VERDICT_BLACKLIST
+    "Ignore"        // DAQ_VERDICT_IGNORE
+};
+
+static void hexdump(FILE *fp, const uint8_t *data, unsigned int len, const char *prefix)
+{
+    unsigned int i;
+    for (i = 0; i < len; i++)
+    {
+        if (i % 16 == 0)
+            fprintf(fp, "\n%s", prefix ? prefix : "");
+        else if (i % 2 == 0)
+            fprintf(fp, " ");
+        fprintf(fp, "%02x", data[i]);
+    }
+    fprintf(fp, "\n");
+}
+
+static void print_msg(FILE *fp, const TraceRecordHeader *rec)
+{
+    if (rec->flags & TRACE_RECORD_FLAG_PACKET)
+        fprintf(fp, "%lu.%lu(%u)", (unsigned long) rec->ts_sec, (unsigned long) rec->ts_usec, rec->msg_len);
+}
+
+static int render_ioctl(FILE *fp, const TraceRecordHeader *rec, const uint8_t *payload, uint32_t payload_len)
+{
+    switch (rec->arg)
+    {
+        case DIOCTL_GET_DEVICE_INDEX:
+            fprintf(fp, "IOCTL: QueryDeviceIndex: '%.*s'\n", (int) payload_len, (const char *) payload);
+            break;
+
+        case DIOCTL_SET_FLOW_OPAQUE:
+        {
+            uint32_t value;
+            if (payload_len != sizeof(value))
+                return -1;
+            memcpy(&value, payload, sizeof(value));
+            fprintf(fp, "IOCTL: SetFlowOpaque: ");
+            print_msg(fp, rec);
+            fprintf(fp, " Value: %u\n", value);
+            break;
+        }
+
+        case DIOCTL_SET_FLOW_HA_STATE:
+            fprintf(fp, "IOCTL: SetFlowHAState: ");
+            print_msg(fp, rec);
+            fprintf(fp, " (%u)\n", payload_len);
+            hexdump(fp, payload, payload_len, "    ");
+            break;
+
+        case DIOCTL_GET_FLOW_HA_STATE:
+            fprintf(fp, "IOCTL: GetFlowHAState: ");
+            print_msg(fp, rec);
+            fprintf(fp, "\n");
+            break;
+
+        case DIOCTL_SET_FLOW_QOS_ID:
+        {
+            uint64_t qos_id;
+            if (payload_len != sizeof(qos_id))
+                return -1;
+            memcpy(&qos_id, payload, sizeof(qos_id));
+            fprintf(fp, "IOCTL: SetFlowQosID: ");
+            print_msg(fp, rec);
+            fprintf(fp, "%u/0x%x\n", (unsigned) (qos_id & 0xFFFFFFFF), (unsigned) (qos_id >> 32));
+            break;
+        }
+
+        case DIOCTL_SET_PACKET_TRACE_DATA:
+            if (payload_len < 1)
+                return -1;
+            fprintf(fp, "IOCTL: SetPacketTraceData: ");
+            print_msg(fp, rec);
+            fprintf(fp, " VR: %hhu (%u):\n", payload[0], payload_len - 1);
+            fprintf(fp, "    %.*s\n", (int) (payload_len - 1), (const char *) payload + 1);
+            break;
+
+        case DIOCTL_SET_PACKET_VERDICT_REASON:
+            if (payload_len != 1)
+                return -1;
+            fprintf(fp, "IOCTL: SetPacketVerdictReason: ");
+            print_msg(fp, rec);
+            fprintf(fp, " VR: %hhu\n", payload[0]);
+            break;
+
+        case DIOCTL_SET_FLOW_PRESERVE:
+            fprintf(fp, "IOCTL: SetFlowPreserve: ");
+            print_msg(fp, rec);
+            fprintf(fp, "\n");
+            break;
+
+        case DIOCTL_GET_FLOW_TCP_SCRUBBED_SYN:
+        case DIOCTL_GET_FLOW_TCP_SCRUBBED_SYN_ACK:
+            fprintf(fp, "IOCTL: %s: ", (rec->arg == DIOCTL_GET_FLOW_TCP_SCRUBBED_SYN) ?
+                    "GetFlowTcpScrubbedSyn" : "GetFlowTcpScrubbedSynAck");
+            print_msg(fp, rec);
+            fprintf(fp, "\n");
+            break;
+
+        case DIOCTL_CREATE_EXPECTED_FLOW:
+        {
+            TraceExpectedFlow ef;
+            if (payload_len != sizeof(ef))
+                return -1;
+            memcpy(&ef, payload, sizeof(ef));
+            fprintf(fp, "IOCTL: CreateExpectedFlow: ");
+            print_msg(fp, rec);
+            fprintf(fp, ":\n");
+
+            const DAQ_EFlow_Key_t *key = &ef.key;
+            char src_addr_str[INET6_ADDRSTRLEN], dst_addr_str[INET6_ADDRSTRLEN];
+            if (key->src_af == AF_INET)
+                inet_ntop(AF_INET, &key->sa.src_ip4, src_addr_str, sizeof(src_addr_str));
+            else
+                inet_ntop(AF_INET6, &key->sa.src_ip6, src_addr_str, sizeof(src_addr_str));
+            if (key->dst_af == AF_INET)
+                inet_ntop(AF_INET, &key->da.dst_ip4, dst_addr_str, sizeof(dst_addr_str));
+            else
+                inet_ntop(AF_INET6, &key->da.dst_ip6, dst_addr_str, sizeof(dst_addr_str));
+            fprintf(fp, "    %s:%hu -> %s:%hu (%hhu)\n", src_addr_str, key->src_port,
+                    dst_addr_str, key->dst_port, key->protocol);
+            fprintf(fp, "    %hu %hu %hu %hu 0x%X %u\n", key->address_space_id, key->tunnel_type,
+                    key->vlan_id, key->vlan_cnots, ef.flags, ef.timeout_ms);
+            break;
+        }
+
+        case DIOCTL_DIRECT_INJECT_PAYLOAD:
+        {
+            if (payload_len < 2)
+                return -1;
+            uint8_t reverse = payload[0];
+            uint8_t num_segments = payload[1];
+            uint32_t offset = 2;
+            fprintf(fp, "IOCTL: DirectInjectPayload: ");
+            print_msg(fp, rec);
+            fprintf(fp, " (%hhu segments)%s\n", num_segments, reverse ? " (reverse)" : "");
+            for (int i = 0; i < num_segments; i++)
+            {
+                uint32_t length;
+                if (payload_len - offset < sizeof(length))
+                    return -1;
+                memcpy(&length, payload + offset, sizeof(length));
+                offset += sizeof(length);
+                if (payload_len - offset < length)
+                    return -1;
+                fprintf(fp, "  Segment %d (%u)\n", i, length);
+                hexdump(fp, payload + offset, length, "    ");
+                offset += length;
+            }
+            break;
+        }
+
+        case DIOCTL_DIRECT_INJECT_RESET:
+            if (payload_len != 1)
+                return -1;
+            fprintf(fp, "IOCTL: DirectInjectReset: ");
+            print_msg(fp, rec);
+            if (payload[0] == DAQ_DIR_BOTH)
+                fprintf(fp, " (both)");
+            else if (payload[0] == DAQ_DIR_REVERSE)
+                fprintf(fp, " (reverse)");
+            fprintf(fp, "\n");
+            break;
+
+        default:
+            fprintf(fp, "IOCTL: %d (%zu)\n", (int) rec->arg, (size_t) payload_len);
+            hexdump(fp, payload, payload_len, "    ");
+            break;
+    }
+
+    return 0;
+}
+
+int trace_render_record(FILE *fp, const TraceRecordHeader *rec)
+{
+    if (rec->len < sizeof(*rec))
+        return -1;
+
+    const uint8_t *payload = (const uint8_t *) (rec + 1);
+    uint32_t payload_len = rec->len - sizeof(*rec);
+
+    switch (rec->type)
+    {
+        case TRACE_RECORD_VERDICT:
+            if (rec->arg >= MAX_DAQ_VERDICT)
+                return -1;
+            fprintf(fp, "PV: %lu.%lu(%u): %s\n", (unsigned long) rec->ts_sec,
+                    (unsigned long) rec->ts_usec, rec->msg_len, daq_verdict_strings[rec->arg]);
+            if (rec->arg == DAQ_VERDICT_REPLACE)
+                hexdump(fp, payload, payload_len, "    ");
+            break;
+
+        case TRACE_RECORD_INJECT:
+            fprintf(fp, "I: %lu.%lu(%u)\n", (unsigned long) rec->ts_sec,
+                   (unsigned long) rec->ts_usec, payload_len);
+            hexdump(fp, payload, payload_len, "    ");
+            fprintf(fp, "\n");
+            break;
+
+        case TRACE_RECORD_INJECT_RELATIVE:
+            fprintf(fp, "%cI: %lu.%lu(%u): %u\n", rec->arg ? 'R' : 'F',
+                    (unsigned long) rec->ts_sec, (unsigned long) rec->ts_usec, rec->msg_len, payload_len);
+            hexdump(fp, payload, payload_len, "    ");
+            fprintf(fp, "\n");
+            break;
+
+        case TRACE_RECORD_IOCTL:
+            return render_ioctl(fp, rec, payload, payload_len);
+
+        default:
+            return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,105 @@
+/*
+** Copyright (C) 2018-2021 Cisco and/or its affiliates. All rights reserved.
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation.  You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+#ifndef _TRACE_FORMAT_H
+#define _TRACE_FORMAT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "daq_common.h"
+
+/*
+ * Binary trace file layout
+ *
+ * A binary trace file starts with a TraceFileHeader and is followed by a sequence of records.
+ * Each record starts with a TraceRecordHeader whose 'len' covers the header and the payload that
+ * follows it.  Records are padded out to a multiple of TRACE_RECORD_ALIGNMENT bytes.  All fields
+ * are in the byte order of the host that wrote the file, which is identified by 'byte_order'.
+ *
+ * Record payloads:
+ *  TRACE_RECORD_VERDICT - 'arg' is the DAQ_Verdict.  The payload is the packet data for
+ *      DAQ_VERDICT_REPLACE and empty otherwise.
+ *  TRACE_RECORD_INJECT - The payload is the injected packet data.
+ *  TRACE_RECORD_INJECT_RELATIVE - 'arg' is nonzero for reverse injection.  The header describes
+ *      the reference message and the payload is the injected packet data.
+ *  TRACE_RECORD_IOCTL - 'arg' is the DAQ_IoctlCmd.  The header describes the message the ioctl
+ *      refers to (if any) and the payload is command-specific:
+ *      DIOCTL_GET_DEVICE_INDEX: device name (not NUL-terminated)
+ *      DIOCTL_SET_FLOW_OPAQUE: uint32_t value
+ *      DIOCTL_SET_FLOW_HA_STATE: HA state blob
+ *      DIOCTL_SET_FLOW_QOS_ID: uint64_t QoS ID
+ *      DIOCTL_SET_PACKET_TRACE_DATA: uint8_t verdict reason followed by the tracing text
+ *      DIOCTL_SET_PACKET_VERDICT_REASON: uint8_t verdict reason
+ *      DIOCTL_CREATE_EXPECTED_FLOW: TraceExpectedFlow
+ *      DIOCTL_DIRECT_INJECT_PAYLOAD: uint8_t reverse, uint8_t segment count, then a uint32_t
+ *          length followed by the data for each segment
+ *      DIOCTL_DIRECT_INJECT_RESET: uint8_t direction
+ *      Other commands without payload have none; unknown commands carry the raw argument.
+ */
+
+#define TRACE_FILE_MAGIC            "DAQTRACE"
+#define TRACE_FILE_VERSION          1
+#define TRACE_BYTE_ORDER_MAGIC      0x1A2B3C4D
+#define TRACE_RECORD_ALIGNMENT      8
+#define TRACE_RECORD_ALIGN(len)     (((len) + TRACE_RECORD_ALIGNMENT - 1) & ~(size_t) (TRACE_RECORD_ALIGNMENT - 1))
+
+typedef struct
+{
+    char magic[8];
+    uint32_t byte_order;
+    uint16_t version;
+    uint16_t reserved;
+} TraceFileHeader;
+
+typedef enum
+{
+    TRACE_RECORD_VERDICT = 1,
+    TRACE_RECORD_INJECT,
+    TRACE_RECORD_INJECT_RELATIVE,
+    TRACE_RECORD_IOCTL,
+} TraceRecordType;
+
+#define TRACE_RECORD_FLAG_PACKET    0x1     /* Refers to a packet message ('ts' and 'msg_len' are valid) */
+
+typedef struct
+{
+    uint32_t len;           /* Length of the header and payload (excluding padding) */
+    uint16_t type;          /* TraceRecordType */
+    uint16_t arg;           /* Type-specific argument */
+    uint32_t flags;         /* TRACE_RECORD_FLAG_* */
+    uint32_t msg_len;       /* Data length of the message this record refers to */
+    uint64_t ts_sec;        /* Timestamp of the message this record refers to */
+    uint32_t ts_usec;
+    uint32_t reserved;
+} TraceRecordHeader;
+
+typedef struct
+{
+    DAQ_EFlow_Key_t key;
+    uint32_t flags;
+    uint32_t timeout_ms;
+} TraceExpectedFlow;
+
+/* Render a record in the text format used by the Trace module.  Returns 0 on success or -1 if the
+    record is malformed. */
+int trace_render_record(FILE *fp, const TraceRecordHeader *rec);
+
+#endif /* _TRACE_FORMAT_H */
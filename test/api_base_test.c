@@ -26,6 +26,7 @@
 #include <dlfcn.h>
 #include <setjmp.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <string.h>
 #include <sys/stat.h>
@@ -33,6 +34,7 @@
 #include <cmocka.h>
 
 #include "daq.h"
+#include "daq_fastpath.h"
 #include "mock_stdio.h"
 
 #include "daq_test_module.h"
@@ -114,6 +116,441 @@ static void test_string_translation(void **state)
     assert_null(daq_verdict_string(MAX_DAQ_VERDICT));
 }
 
+static void test_meta_types(void **state)
+{
+    int type, type2;
+
+    /* The built-in types are pre-registered under their well-known IDs. */
+    assert_int_equal(daq_meta_type_lookup("napt_info"), DAQ_PKT_META_NAPT_INFO);
+    assert_string_equal(daq_meta_type_name(DAQ_PKT_META_DECODE_DATA), "decode_data");
+    assert_int_equal(daq_meta_type_size(DAQ_PKT_META_DECODE_DATA), sizeof(DAQ_PktDecodeData_t));
+    assert_int_equal(daq_meta_type_register("tcp_ack_data", sizeof(DAQ_PktTcpAckData_t)), DAQ_PKT_META_TCP_ACK_DATA);
+    assert_null(daq_meta_type_name(DAQ_PKT_META_TCP_ACK_DATA + 1));
+
+    /* The other types defined by the library only exist once a module registers them. */
+    assert_int_equal(daq_meta_type_lookup(DAQ_META_TYPE_TIMESTAMP), DAQ_ERROR_NOTSUP);
+
+    assert_int_equal(daq_meta_type_lookup("test_meta"), DAQ_ERROR_NOTSUP);
+    assert_int_equal(daq_meta_type_register(NULL, 4), DAQ_ERROR_INVAL);
+    assert_int_equal(daq_meta_type_register("test_meta", 0), DAQ_ERROR_INVAL);
+
+    type = daq_meta_type_register("test_meta", 4);
+    assert_true(type >= DAQ_MSG_META_SLOTS);
+    assert_int_equal(daq_meta_type_register("test_meta", 4), type);
+    assert_int_equal(daq_meta_type_register("test_meta", 8), DAQ_ERROR_EXISTS);
+    assert_int_equal(daq_meta_type_lookup("test_meta"), type);
+    assert_string_equal(daq_meta_type_name(type), "test_meta");
+    assert_int_equal(daq_meta_type_size(type), 4);
+    type2 = daq_meta_type_register("test_meta2", 8);
+    assert_int_equal(type2, type + 1);
+    assert_null(daq_meta_type_name(type2 + 1));
+    assert_int_equal(daq_meta_type_size(type2 + 1), 0);
+
+    /* Metadata missing from a message shows through from the message it was derived from. */
+    uint32_t base_value = 1, wrapper_value = 2;
+    DAQ_PktTcpAckData_t tad = { 0 };
+    DAQ_MsgMeta_t base_meta = { NULL, &base_value, (unsigned) type };
+    DAQ_MsgMeta_t wrapper_meta = { NULL, &wrapper_value, (unsigned) type2 };
+    DAQ_Msg_t base_msg = { 0 };
+    DAQ_Msg_t wrapper_msg = { 0 };
+    DAQ_NAPTInfo_t napti = { 0 };
+    base_msg.meta[DAQ_PKT_META_NAPT_INFO] = &napti;
+    base_msg.meta[DAQ_PKT_META_TCP_ACK_DATA] = &tad;
+    base_msg.meta_ext = &base_meta;
+    wrapper_msg.meta_ext = &wrapper_meta;
+    wrapper_msg.wrapped = &base_msg;
+    assert_ptr_equal(daq_msg_get_meta(&wrapper_msg, DAQ_PKT_META_NAPT_INFO), &napti);
+    assert_ptr_equal(daq_msg_get_meta(&wrapper_msg, DAQ_PKT_META_TCP_ACK_DATA), &tad);
+    assert_ptr_equal(daq_msg_get_meta(&wrapper_msg, type), &base_value);
+    assert_ptr_equal(daq_msg_get_meta(&wrapper_msg, type2), &wrapper_value);
+    assert_null(daq_msg_get_meta(&base_msg, type2));
+    assert_null(daq_msg_get_meta(&wrapper_msg, DAQ_PKT_META_DECODE_DATA));
+
+    /* ...unless the message suppresses a built-in type it doesn't carry. */
+    wrapper_msg.meta_suppressed = 1U << DAQ_PKT_META_TCP_ACK_DATA;
+    assert_null(daq_msg_get_meta(&wrapper_msg, DAQ_PKT_META_TCP_ACK_DATA));
+    assert_ptr_equal(daq_msg_get_meta(&wrapper_msg, DAQ_PKT_META_NAPT_INFO), &napti);
+
+    /* The nanosecond timestamp comes from the registered type, or the packet header without it. */
+    DAQ_PktHdr_t pkthdr = { .ts = { 1, 2 } };
+    DAQ_PktTimestamp_t ts = { 1000002003, DAQ_PKT_TS_SOURCE_SOFTWARE };
+    int ts_type = daq_meta_type_register(DAQ_META_TYPE_TIMESTAMP, sizeof(DAQ_PktTimestamp_t));
+    assert_true(ts_type >= DAQ_MSG_META_SLOTS);
+    DAQ_MsgMeta_t ts_meta = { NULL, &ts, (unsigned) ts_type };
+    base_msg.hdr = wrapper_msg.hdr = &pkthdr;
+    assert_int_equal(daq_msg_get_timestamp_ns(&wrapper_msg, ts_type), 1000002000);
+    base_meta.next = &ts_meta;
+    assert_int_equal(daq_msg_get_timestamp_ns(&wrapper_msg, ts_type), 1000002003);
+    assert_int_equal(daq_msg_get_timestamp_ns(&wrapper_msg, -1), 1000002000);
+
+    /* Unloading the modules that registered them clears the registered types. */
+    daq_unload_modules();
+    assert_int_equal(daq_meta_type_lookup("test_meta"), DAQ_ERROR_NOTSUP);
+    assert_null(daq_meta_type_name(type));
+    assert_int_equal(daq_meta_type_lookup("napt_info"), DAQ_PKT_META_NAPT_INFO);
+    assert_int_equal(daq_meta_type_register("test_meta2", 8), DAQ_MSG_META_SLOTS);
+    daq_unload_modules();
+}
+
+/*
+ * A module that hands out packets from a small fixed pool and records what is injected, for
+ * exercising the instance API.
+ */
+#define FIXTURE_MODULE_NAME     "Fixture"
+#define FIXTURE_POOL_SIZE       4
+#define FIXTURE_MAX_INJECTS     8
+
+static struct
+{
+    DAQ_Msg_t msgs[FIXTURE_POOL_SIZE];
+    DAQ_PktHdr_t hdrs[FIXTURE_POOL_SIZE];
+    uint8_t data[FIXTURE_POOL_SIZE];
+    bool held[FIXTURE_POOL_SIZE];
+    unsigned received;
+    unsigned finalized;
+    unsigned verdicts[MAX_DAQ_VERDICT];
+    unsigned num_injects;
+    DAQ_PktHdr_t inject_hdrs[FIXTURE_MAX_INJECTS];
+    uint8_t inject_data[FIXTURE_MAX_INJECTS];
+    const DAQ_Msg_t *inject_msgs[FIXTURE_MAX_INJECTS];     // Original of each relative injection
+    int inject_reverse[FIXTURE_MAX_INJECTS];
+    bool no_inject;     // Bring the module up without any injection support
+} fixture;
+
+static DAQ_ModuleAPI_t fixture_module;
+
+static int fixture_inject(void *handle, DAQ_MsgType type, const void *hdr, const uint8_t *data, uint32_t data_len)
+{
+    if (fixture.num_injects == FIXTURE_MAX_INJECTS || data_len != 1)
+        return DAQ_ERROR;
+    fixture.inject_hdrs[fixture.num_injects] = *(const DAQ_PktHdr_t *) hdr;
+    fixture.inject_data[fixture.num_injects] = data[0];
+    fixture.inject_msgs[fixture.num_injects] = NULL;
+    fixture.num_injects++;
+    return DAQ_SUCCESS;
+}
+
+static int fixture_inject_relative(void *handle, const DAQ_Msg_t *msg, const uint8_t *data, uint32_t data_len, int reverse)
+{
+    if (fixture.num_injects == FIXTURE_MAX_INJECTS || data_len != 1 || !*(bool *) msg->priv)
+        return DAQ_ERROR;
+    fixture.inject_hdrs[fixture.num_injects] = *(const DAQ_PktHdr_t *) msg->hdr;
+    fixture.inject_data[fixture.num_injects] = data[0];
+    fixture.inject_msgs[fixture.num_injects] = msg;
+    fixture.inject_reverse[fixture.num_injects] = reverse;
+    fixture.num_injects++;
+    return DAQ_SUCCESS;
+}
+
+static unsigned fixture_msg_receive(void *handle, const unsigned max_recv, const DAQ_Msg_t *msgs[], DAQ_RecvStatus *rstat)
+{
+    unsigned count = 0;
+
+    for (unsigned i = 0; i < FIXTURE_POOL_SIZE && count < max_recv; i++)
+    {
+        if (fixture.held[i])
+            continue;
+        DAQ_PktHdr_t *hdr = &fixture.hdrs[i];
+        memset(hdr, 0, sizeof(*hdr));
+        hdr->ingress_index = 1;
+        hdr->egress_index = 2;
+        hdr->ingress_group = DAQ_PKTHDR_UNKNOWN;
+        hdr->egress_group = DAQ_PKTHDR_UNKNOWN;
+        hdr->pktlen = 1;
+        fixture.data[i] = (uint8_t) fixture.received;
+        DAQ_Msg_t *msg = &fixture.msgs[i];
+        memset(msg, 0, sizeof(*msg));
+        msg->type = DAQ_MSG_TYPE_PACKET;
+        msg->hdr_len = sizeof(*hdr);
+        msg->hdr = hdr;
+        msg->data_len = 1;
+        msg->data = &fixture.data[i];
+        msg->priv = &fixture.held[i];
+        fixture.held[i] = true;
+        fixture.received++;
+        msgs[count++] = msg;
+    }
+    *rstat = count ? DAQ_RSTAT_OK : DAQ_RSTAT_NOBUF;
+
+    return count;
+}
+
+static int fixture_msg_finalize(void *handle, const DAQ_Msg_t *msg, DAQ_Verdict verdict)
+{
+    bool *held = (bool *) msg->priv;
+
+    if (!*held)
+        return DAQ_ERROR;
+    *held = false;
+    fixture.finalized++;
+    fixture.verdicts[verdict]++;
+    return DAQ_SUCCESS;
+}
+
+static int fixture_bringup(void **state)
+{
+    static const DAQ_ModuleAPI_t *fixture_modules[] = { &fixture_module, NULL };
+    DAQ_ModuleConfig_h modcfg;
+    DAQ_Config_h cfg;
+    DAQ_Instance_h instance;
+    char errbuf[256];
+
+    bool no_inject = fixture.no_inject;
+    memset(&fixture, 0, sizeof(fixture));
+    memcpy(&fixture_module, &test_module, sizeof(DAQ_ModuleAPI_t));
+    fixture_module.name = FIXTURE_MODULE_NAME;
+    fixture_module.inject = no_inject ? NULL : fixture_inject;
+    fixture_module.inject_relative = no_inject ? NULL : fixture_inject_relative;
+    fixture_module.msg_receive = fixture_msg_receive;
+    fixture_module.msg_finalize = fixture_msg_finalize;
+
+    if (daq_load_static_modules(fixture_modules) != 1)
+        return -1;
+
+    if (daq_config_new(&cfg) != DAQ_SUCCESS)
+        return -1;
+
+    if (daq_module_config_new(&modcfg, daq_find_module(FIXTURE_MODULE_NAME)) != DAQ_SUCCESS ||
+            daq_config_push_module_config(cfg, modcfg) != DAQ_SUCCESS)
+    {
+        daq_config_destroy(cfg);
+        return -1;
+    }
+
+    int rval = daq_instance_instantiate(cfg, &instance, errbuf, sizeof(errbuf));
+    daq_config_destroy(cfg);
+    if (rval != DAQ_SUCCESS)
+        return -1;
+
+    if (daq_instance_start(instance) != DAQ_SUCCESS)
+    {
+        daq_instance_destroy(instance);
+        return -1;
+    }
+
+    *state = instance;
+    return 0;
+}
+
+static int fixture_teardown(void **state)
+{
+    DAQ_Instance_h instance = (DAQ_Instance_h) *state;
+
+    if (instance)
+        daq_instance_destroy(instance);
+    daq_unload_modules();
+    return 0;
+}
+
+static void test_queued_injects(void **state)
+{
+    DAQ_Instance_h instance = (DAQ_Instance_h) *state;
+    DAQ_InjectQueueStats_t stats;
+    DAQ_RecvStatus rstat;
+    DAQ_Msg_h msgs[FIXTURE_POOL_SIZE];
+    uint8_t payload = 0;
+    int rval;
+
+    assert_int_equal(daq_instance_queue_inject(instance, DAQ_MSG_TYPE_PACKET, NULL, &payload, 1), DAQ_ERROR_INVAL);
+    assert_int_equal(daq_instance_queue_inject_relative(instance, NULL, &payload, 1, 0), DAQ_ERROR_INVAL);
+
+    unsigned num_recv = daq_instance_msg_receive(instance, 2, msgs, &rstat);
+    assert_int_equal(num_recv, 2);
+    assert_int_equal(rstat, DAQ_RSTAT_OK);
+
+    /* Queue a mix of injections; nothing happens until the owning thread comes back. */
+    DAQ_PktHdr_t hdr = { .ingress_index = 7, .egress_index = 8 };
+    payload = 1;
+    rval = daq_instance_queue_inject(instance, DAQ_MSG_TYPE_PACKET, &hdr, &payload, 1);
+    assert_int_equal(rval, DAQ_SUCCESS);
+    payload = 2;
+    rval = daq_instance_queue_inject_relative(instance, msgs[0], &payload, 1, 0);
+    assert_int_equal(rval, DAQ_SUCCESS);
+    payload = 3;
+    rval = daq_instance_queue_inject_relative(instance, msgs[1], &payload, 1, 1);
+    assert_int_equal(rval, DAQ_SUCCESS);
+    assert_int_equal(fixture.num_injects, 0);
+
+    /* Everything queued is performed before the next finalize, so the originals of the relative
+        injections are still held by the time they are handed to the module. */
+    assert_int_equal(daq_instance_msg_finalize(instance, msgs[0], DAQ_VERDICT_PASS), DAQ_SUCCESS);
+    assert_int_equal(fixture.num_injects, 3);
+    assert_int_equal(fixture.finalized, 1);
+    assert_int_equal(daq_instance_msg_finalize(instance, msgs[1], DAQ_VERDICT_BLOCK), DAQ_SUCCESS);
+
+    /* Performed in the order they were queued, the relative ones through the module's own
+        relative injection. */
+    assert_int_equal(fixture.inject_data[0], 1);
+    assert_null(fixture.inject_msgs[0]);
+    assert_int_equal(fixture.inject_hdrs[0].ingress_index, 7);
+    assert_int_equal(fixture.inject_data[1], 2);
+    assert_ptr_equal(fixture.inject_msgs[1], msgs[0]);
+    assert_int_equal(fixture.inject_reverse[1], 0);
+    assert_int_equal(fixture.inject_data[2], 3);
+    assert_ptr_equal(fixture.inject_msgs[2], msgs[1]);
+    assert_int_equal(fixture.inject_reverse[2], 1);
+
+    /* Injections are also performed before receiving and before stopping. */
+    rval = daq_instance_queue_inject(instance, DAQ_MSG_TYPE_PACKET, &hdr, &payload, 1);
+    assert_int_equal(rval, DAQ_SUCCESS);
+    num_recv = daq_instance_msg_receive(instance, 1, msgs, &rstat);
+    assert_int_equal(num_recv, 1);
+    assert_int_equal(fixture.num_injects, 4);
+    rval = daq_instance_queue_inject(instance, DAQ_MSG_TYPE_PACKET, &hdr, &payload, 1);
+    assert_int_equal(rval, DAQ_SUCCESS);
+    assert_int_equal(daq_instance_stop(instance), DAQ_SUCCESS);
+    assert_int_equal(fixture.num_injects, 5);
+
+    /* Rejected injections are counted separately. */
+    fixture.num_injects = FIXTURE_MAX_INJECTS;
+    rval = daq_instance_queue_inject(instance, DAQ_MSG_TYPE_PACKET, &hdr, &payload, 1);
+    assert_int_equal(rval, DAQ_SUCCESS);
+    daq_instance_perform_queued_injects(instance);
+
+    assert_int_equal(daq_instance_get_inject_queue_stats(instance, &stats), DAQ_SUCCESS);
+    assert_int_equal(stats.queued, 6);
+    assert_int_equal(stats.injected, 5);
+    assert_int_equal(stats.failed, 1);
+}
+
+static void test_queued_injects_destroy(void **state)
+{
+    DAQ_Instance_h instance = (DAQ_Instance_h) *state;
+    DAQ_PktHdr_t hdr = { 0 };
+    uint8_t payload = 0;
+
+    /* Anything still queued when the instance goes away is thrown away without being injected. */
+    assert_int_equal(daq_instance_stop(instance), DAQ_SUCCESS);
+    for (unsigned i = 0; i < 3; i++)
+        assert_int_equal(daq_instance_queue_inject(instance, DAQ_MSG_TYPE_PACKET, &hdr, &payload, 1), DAQ_SUCCESS);
+    assert_int_equal(daq_instance_destroy(instance), DAQ_SUCCESS);
+    *state = NULL;
+    assert_int_equal(fixture.num_injects, 0);
+}
+
+/* What one run of the same sequence of calls did, through either the checked API or the fast path */
+typedef struct
+{
+    unsigned num_recv[4];
+    DAQ_RecvStatus rstat[4];
+    uint8_t data[FIXTURE_POOL_SIZE];
+    int rvals[FIXTURE_POOL_SIZE + 5];
+    unsigned received;
+    unsigned finalized;
+    unsigned verdicts[MAX_DAQ_VERDICT];
+    unsigned num_injects;
+} FixtureRun;
+
+static unsigned fixture_run_receive(DAQ_Instance_h instance, const DAQ_FastPath_t *fp, unsigned max_recv,
+        DAQ_Msg_h msgs[], DAQ_RecvStatus *rstat)
+{
+    if (fp)
+        return daq_fastpath_msg_receive(fp, max_recv, msgs, rstat);
+    return daq_instance_msg_receive(instance, max_recv, msgs, rstat);
+}
+
+static int fixture_run_finalize(DAQ_Instance_h instance, const DAQ_FastPath_t *fp, DAQ_Msg_h msg, DAQ_Verdict verdict)
+{
+    if (fp)
+        return daq_fastpath_msg_finalize(fp, msg, verdict);
+    return daq_instance_msg_finalize(instance, msg, verdict);
+}
+
+static void fixture_run(DAQ_Instance_h instance, const DAQ_FastPath_t *fp, FixtureRun *run)
+{
+    DAQ_Msg_h msgs[FIXTURE_POOL_SIZE * 2];
+    DAQ_PktHdr_t hdr = { 0 };
+    uint8_t payload = 0;
+    unsigned r = 0;
+
+    memset(run, 0, sizeof(*run));
+    fixture.received = fixture.finalized = fixture.num_injects = 0;
+    memset(fixture.verdicts, 0, sizeof(fixture.verdicts));
+
+    /* A partial batch, finalized with a spread of verdicts and one message finalized twice */
+    run->num_recv[0] = fixture_run_receive(instance, fp, 3, msgs, &run->rstat[0]);
+    assert_int_equal(run->num_recv[0], 3);
+    for (unsigned i = 0; i < run->num_recv[0]; i++)
+        run->data[i] = msgs[i]->data[0];
+    run->rvals[r++] = fixture_run_finalize(instance, fp, msgs[0], DAQ_VERDICT_PASS);
+    run->rvals[r++] = fixture_run_finalize(instance, fp, msgs[1], DAQ_VERDICT_BLOCK);
+    run->rvals[r++] = fixture_run_finalize(instance, fp, msgs[2], DAQ_VERDICT_WHITELIST);
+    run->rvals[r++] = fixture_run_finalize(instance, fp, msgs[0], DAQ_VERDICT_PASS);
+
+    /* Asking for more than the pool holds, then running it dry */
+    run->num_recv[1] = fixture_run_receive(instance, fp, FIXTURE_POOL_SIZE * 2, msgs, &run->rstat[1]);
+    assert_int_equal(run->num_recv[1], FIXTURE_POOL_SIZE);
+    run->num_recv[2] = fixture_run_receive(instance, fp, 1, msgs + FIXTURE_POOL_SIZE, &run->rstat[2]);
+    for (unsigned i = 0; i < run->num_recv[1]; i++)
+        run->rvals[r++] = fixture_run_finalize(instance, fp, msgs[i], DAQ_VERDICT_IGNORE);
+
+    /* Injections queued from elsewhere are performed before the next receive */
+    assert_int_equal(daq_instance_queue_inject(instance, DAQ_MSG_TYPE_PACKET, &hdr, &payload, 1), DAQ_SUCCESS);
+    run->num_recv[3] = fixture_run_receive(instance, fp, 1, msgs, &run->rstat[3]);
+    assert_int_equal(run->num_recv[3], 1);
+    run->num_injects = fixture.num_injects;
+    run->rvals[r++] = fixture_run_finalize(instance, fp, msgs[0], DAQ_VERDICT_BLOCK);
+
+    run->received = fixture.received;
+    run->finalized = fixture.finalized;
+    memcpy(run->verdicts, fixture.verdicts, sizeof(run->verdicts));
+}
+
+static void test_fastpath_equivalence(void **state)
+{
+    DAQ_Instance_h instance = (DAQ_Instance_h) *state;
+    FixtureRun checked, fast;
+
+    assert_null(daq_instance_get_fastpath(NULL, DAQ_FASTPATH_VERSION));
+    assert_null(daq_instance_get_fastpath(instance, 0));
+    assert_null(daq_instance_get_fastpath(instance, DAQ_FASTPATH_VERSION + 1));
+
+    const DAQ_FastPath_t *fp = daq_instance_get_fastpath(instance, DAQ_FASTPATH_VERSION);
+    assert_non_null(fp);
+    assert_int_equal(fp->version, DAQ_FASTPATH_VERSION);
+    assert_int_equal(fp->size, sizeof(DAQ_FastPath_t));
+    assert_ptr_equal(fp->instance, instance);
+
+    fixture_run(instance, NULL, &checked);
+    fixture_run(instance, fp, &fast);
+    assert_memory_equal(&checked, &fast, sizeof(checked));
+
+    /* Spot check that the runs did what they were meant to. */
+    assert_int_equal(fast.rstat[2], DAQ_RSTAT_NOBUF);
+    assert_int_equal(fast.rvals[3], DAQ_ERROR);
+    assert_int_equal(fast.received, 3 + FIXTURE_POOL_SIZE + 1);
+    assert_int_equal(fast.finalized, 3 + FIXTURE_POOL_SIZE + 1);
+    assert_int_equal(fast.verdicts[DAQ_VERDICT_IGNORE], FIXTURE_POOL_SIZE);
+    assert_int_equal(fast.num_injects, 1);
+}
+
+static int fixture_bringup_no_inject(void **state)
+{
+    fixture.no_inject = true;
+    return fixture_bringup(state);
+}
+
+static void test_queued_injects_unsupported(void **state)
+{
+    DAQ_Instance_h instance = (DAQ_Instance_h) *state;
+    DAQ_InjectQueueStats_t stats;
+    DAQ_RecvStatus rstat;
+    DAQ_Msg_h msg;
+    DAQ_PktHdr_t hdr = { 0 };
+    uint8_t payload = 0;
+
+    /* Injections the module stack can't perform are turned away up front instead of being
+        counted as failed later. */
+    assert_int_equal(daq_instance_msg_receive(instance, 1, &msg, &rstat), 1);
+    assert_int_equal(daq_instance_queue_inject(instance, DAQ_MSG_TYPE_PACKET, &hdr, &payload, 1), DAQ_ERROR_NOTSUP);
+    assert_int_equal(daq_instance_queue_inject_relative(instance, msg, &payload, 1, 0), DAQ_ERROR_NOTSUP);
+    assert_int_equal(daq_instance_msg_finalize(instance, msg, DAQ_VERDICT_PASS), DAQ_SUCCESS);
+
+    assert_int_equal(daq_instance_get_inject_queue_stats(instance, &stats), DAQ_SUCCESS);
+    assert_int_equal(stats.queued, 0);
+    assert_int_equal(stats.failed, 0);
+}
+
 DIR *__wrap_opendir(const char *name);
 DIR *__wrap_opendir(const char *name)
 {
@@ -328,8 +765,13 @@ int main(void)
     const struct CMUnitTest tests[] = {
         cmocka_unit_test(test_verbosity),
         cmocka_unit_test(test_string_translation),
+        cmocka_unit_test(test_meta_types),
         cmocka_unit_test(test_non_existent_dynamic_path),
         cmocka_unit_test(test_daq_load_modules),
+        cmocka_unit_test_setup_teardown(test_queued_injects, fixture_bringup, fixture_teardown),
+        cmocka_unit_test_setup_teardown(test_queued_injects_destroy, fixture_bringup, fixture_teardown),
+        cmocka_unit_test_setup_teardown(test_queued_injects_unsupported, fixture_bringup_no_inject, fixture_teardown),
+        cmocka_unit_test_setup_teardown(test_fastpath_equivalence, fixture_bringup, fixture_teardown),
     };
 
     return cmocka_run_group_tests(tests, NULL, NULL);
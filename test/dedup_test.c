@@ -0,0 +1,181 @@
+/*
+** Copyright (C) 2021 Cisco and/or its affiliates. All rights reserved.
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation.  You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* The duplicate table and packet hashing of the Dedup module are private to it, so it is built into
+    the test. */
+#include "dedup/daq_dedup.c"
+
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+#include <cmocka.h>
+
+#define TEST_WINDOW     1000
+
+/* A content hash that lands in the given bucket with the given fingerprint */
+#define TEST_HASH(bucket, fingerprint)  (((uint64_t) (bucket) << 32) | (fingerprint))
+
+static int dedup_test_setup(void **state)
+{
+    DedupContext *dc = calloc(1, sizeof(*dc));
+    if (!dc)
+        return -1;
+    dc->window = TEST_WINDOW;
+    dc->num_entries = DEDUP_MIN_ENTRIES;
+    dc->bucket_mask = DEDUP_MIN_ENTRIES / DEDUP_BUCKET_ENTRIES - 1;
+    dc->dlt = DLT_EN10MB;
+    dc->table = calloc(DEDUP_MIN_ENTRIES, sizeof(DedupEntry));
+    if (!dc->table)
+    {
+        free(dc);
+        return -1;
+    }
+    *state = dc;
+    return 0;
+}
+
+static int dedup_test_teardown(void **state)
+{
+    dedup_daq_destroy(*state);
+    return 0;
+}
+
+static void test_check_window(void **state)
+{
+    DedupContext *dc = (DedupContext *) *state;
+
+    assert_false(dedup_check(dc, TEST_HASH(3, 0x1234), 0));
+    assert_true(dedup_check(dc, TEST_HASH(3, 0x1234), 500));
+    assert_true(dedup_check(dc, TEST_HASH(3, 0x1234), TEST_WINDOW));
+
+    /* A copy is matched against when the packet was first seen, not when it was last matched. */
+    assert_false(dedup_check(dc, TEST_HASH(3, 0x1234), TEST_WINDOW + 1));
+    assert_true(dedup_check(dc, TEST_HASH(3, 0x1234), 2 * TEST_WINDOW + 1));
+
+    /* Copies can arrive timestamped slightly earlier than the first one seen. */
+    assert_false(dedup_check(dc, TEST_HASH(4, 0x1234), 5000));
+    assert_true(dedup_check(dc, TEST_HASH(4, 0x1234), 5000 - TEST_WINDOW));
+    assert_false(dedup_check(dc, TEST_HASH(4, 0x1234), 5000 - TEST_WINDOW - 1));
+
+    /* The 32-bit microsecond timestamps wrap around about every 71 minutes. */
+    assert_false(dedup_check(dc, TEST_HASH(5, 0x1234), UINT32_MAX - 100));
+    assert_true(dedup_check(dc, TEST_HASH(5, 0x1234), 100));
+
+    /* Only the fingerprint within the bucket is compared, and a zero one is still remembered. */
+    assert_false(dedup_check(dc, TEST_HASH(3, 0x1235), TEST_WINDOW + 2));
+    assert_false(dedup_check(dc, TEST_HASH(6, 0), 0));
+    assert_true(dedup_check(dc, TEST_HASH(6, 0), 1));
+    assert_int_equal(dc->evictions, 0);
+}
+
+static void test_check_eviction(void **state)
+{
+    DedupContext *dc = (DedupContext *) *state;
+
+    /* With a full bucket of live entries, the oldest one makes way. */
+    for (uint32_t i = 1; i <= DEDUP_BUCKET_ENTRIES; i++)
+        assert_false(dedup_check(dc, TEST_HASH(7, i), i * 10));
+    assert_false(dedup_check(dc, TEST_HASH(7, 100), 500));
+    assert_int_equal(dc->evictions, 1);
+    for (uint32_t i = 2; i <= DEDUP_BUCKET_ENTRIES; i++)
+        assert_true(dedup_check(dc, TEST_HASH(7, i), 500));
+    assert_true(dedup_check(dc, TEST_HASH(7, 100), 500));
+    assert_false(dedup_check(dc, TEST_HASH(7, 1), 500));
+    assert_int_equal(dc->evictions, 2);
+
+    /* Expired entries are reused before live ones are evicted. */
+    assert_false(dedup_check(dc, TEST_HASH(7, 200), 1060));
+    assert_int_equal(dc->evictions, 2);
+    assert_true(dedup_check(dc, TEST_HASH(7, 100), 1060));
+
+    /* Other buckets are left alone. */
+    assert_false(dedup_check(dc, TEST_HASH(8, 1), 1060));
+    assert_int_equal(dc->evictions, 2);
+}
+
+static const uint8_t test_eth_ipv4_udp[] = {
+    0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x00, 0x66, 0x77, 0x88, 0x99, 0xaa, 0x08, 0x00,
+    0x45, 0x00, 0x00, 0x24, 0x12, 0x34, 0x40, 0x00, 0x40, 0x11, 0xab, 0xcd,
+    0xc0, 0xa8, 0x01, 0x0a, 0x0a, 0x00, 0x00, 0x01,
+    0x30, 0x39, 0x00, 0x35, 0x00, 0x10, 0xbe, 0xef,
+    'p', 'a', 'y', 'l', 'o', 'a', 'd', '!',
+};
+
+static uint64_t hash_packet(const DedupContext *dc, uint8_t *data, uint32_t len, uint32_t pktlen)
+{
+    DAQ_PktHdr_t hdr = { .pktlen = pktlen };
+    DAQ_Msg_t msg = { 0 };
+
+    msg.type = DAQ_MSG_TYPE_PACKET;
+    msg.hdr_len = sizeof(hdr);
+    msg.hdr = &hdr;
+    msg.data_len = len;
+    msg.data = data;
+
+    return dedup_hash_packet(dc, &msg);
+}
+
+static void test_hash_packet(void **state)
+{
+    DedupContext *dc = (DedupContext *) *state;
+    uint8_t pkt[sizeof(test_eth_ipv4_udp) + 4];
+    uint32_t len = sizeof(test_eth_ipv4_udp);
+
+    memcpy(pkt, test_eth_ipv4_udp, len);
+    uint64_t hash = hash_packet(dc, pkt, len, len);
+
+    /* The copy from another mirror port has different MAC addresses, TOS, TTL and checksums. */
+    pkt[0] = 0xff;
+    pkt[11] = 0xff;
+    pkt[15] = 0x10;
+    pkt[22] = 0x3f;
+    pkt[24] = pkt[25] = 0;
+    pkt[40] = pkt[41] = 0x55;
+    assert_true(hash_packet(dc, pkt, len, len) == hash);
+
+    /* It may also have picked up a VLAN tag. */
+    memmove(pkt + 16, pkt + 12, len - 12);
+    pkt[12] = 0x81;
+    pkt[13] = 0x00;
+    pkt[14] = 0x00;
+    pkt[15] = 0x64;
+    assert_true(hash_packet(dc, pkt, len + 4, len + 4) == hash);
+
+    /* Anything else that differs makes it a different packet. */
+    memcpy(pkt, test_eth_ipv4_udp, len);
+    pkt[len - 1] = '?';
+    assert_false(hash_packet(dc, pkt, len, len) == hash);
+    memcpy(pkt, test_eth_ipv4_udp, len);
+    pkt[19] = 0x35;
+    assert_false(hash_packet(dc, pkt, len, len) == hash);
+    memcpy(pkt, test_eth_ipv4_udp, len);
+    assert_false(hash_packet(dc, pkt, len, len + 100) == hash);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_check_window, dedup_test_setup, dedup_test_teardown),
+        cmocka_unit_test_setup_teardown(test_check_eviction, dedup_test_setup, dedup_test_teardown),
+        cmocka_unit_test_setup_teardown(test_hash_packet, dedup_test_setup, dedup_test_teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
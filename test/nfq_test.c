@@ -0,0 +1,789 @@
+/*
+** Copyright (C) 2021 Cisco and/or its affiliates. All rights reserved.
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation.  You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* The verdict batching and parsing of the NFQ module are private to it, so it is built into the
+    test.  None of these tests talk to netfilter; messages are exchanged with another netlink socket
+    instead. */
+#include "nfq/daq_nfq.c"
+
+#include "daq.h"
+
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+#include <cmocka.h>
+
+#define TEST_POOL_SIZE  8
+#define TEST_MAX_VERDICTS   16
+
+/* A verdict message as it would have been sent to the kernel */
+typedef struct
+{
+    uint8_t type;
+    uint16_t queue;
+    uint32_t id;
+    uint32_t verdict;
+    bool ct;
+    uint32_t ct_mark;
+    uint32_t ct_mask;
+    const uint8_t *payload;
+    uint32_t plen;
+} TestVerdict;
+
+static uint8_t sent[65536];
+
+static void test_set_errbuf(DAQ_ModuleInstance_h modinst, const char *format, ...)
+{
+}
+
+/* Set up a context the way instantiation does, minus the netlink socket, bound to queues 0 and 1. */
+static int nfq_test_setup(void **state)
+{
+    Nfq_Context_t *nfqc = calloc(1, sizeof(*nfqc));
+    if (!nfqc)
+        return -1;
+    nfqc->nlsock_fd = -1;
+    nfqc->snaplen = 2048;
+    nfqc->nlmsg_bufsize = nfqc->snaplen + MNL_SOCKET_BUFFER_SIZE;
+    nfqc->verdict_batch = DEFAULT_VERDICT_BATCH;
+    nfqc->verdict_send_max = sizeof(sent);
+    nfqc->nlmsg_buf = malloc(nfqc->nlmsg_bufsize);
+    nfqc->verdict_buf = malloc(nfqc->nlmsg_bufsize);
+    nfqc->verdict_iovs = calloc(IOV_MAX, sizeof(struct iovec));
+    if (!nfqc->nlmsg_buf || !nfqc->verdict_buf || !nfqc->verdict_iovs ||
+        nfq_parse_queues(nfqc, "0-1", 1, 0) != DAQ_SUCCESS ||
+        create_packet_pool(nfqc, TEST_POOL_SIZE) != DAQ_SUCCESS)
+    {
+        nfq_daq_destroy(nfqc);
+        return -1;
+    }
+    *state = nfqc;
+    return 0;
+}
+
+static int nfq_test_teardown(void **state)
+{
+    Nfq_Context_t *nfqc = (Nfq_Context_t *) *state;
+    if (nfqc->nlsock_fd != -1)
+        close(nfqc->nlsock_fd);
+    nfq_daq_destroy(nfqc);
+    return 0;
+}
+
+/* Hand out a packet from the given queue as if it had just been received. */
+static const DAQ_Msg_t *nfq_test_hold(Nfq_Context_t *nfqc, unsigned queue, uint32_t id)
+{
+    NfqPktDesc *desc = nfqc->pool.freelist;
+    assert_non_null(desc);
+    nfqc->pool.freelist = desc->next;
+
+    struct nfqnl_msg_packet_hdr *ph = (struct nfqnl_msg_packet_hdr *) desc->nlmsg_buf;
+    memset(ph, 0, sizeof(*ph));
+    ph->packet_id = htonl(id);
+    desc->nlmh = (const struct nlmsghdr *) desc->nlmsg_buf;
+    desc->nlph = ph;
+    desc->queue = &nfqc->queues[queue];
+    desc->offload.flags = 0;
+    desc->msg.data = desc->nlmsg_buf + 64;
+    desc->msg.data_len = 0;
+    desc->pkthdr.pktlen = 0;
+    nfq_outstanding_append(desc->queue, desc);
+    nfqc->pool.info.available--;
+
+    return &desc->msg;
+}
+
+/* Connect the context to a netlink socket that the test can send netfilter's messages to, returning
+    the socket to send them from or -1 if netlink isn't available. */
+static int nfq_test_connect(Nfq_Context_t *nfqc, struct sockaddr_nl *dst)
+{
+    struct sockaddr_nl snl = { .nl_family = AF_NETLINK };
+    struct timeval tv = { .tv_sec = 0, .tv_usec = 10000 };
+    socklen_t len = sizeof(*dst);
+
+    nfqc->nlsock_fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_USERSOCK);
+    if (nfqc->nlsock_fd == -1)
+        return -1;
+    int fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_USERSOCK);
+    if (fd == -1)
+        return -1;
+    assert_int_equal(bind(nfqc->nlsock_fd, (struct sockaddr *) &snl, sizeof(snl)), 0);
+    assert_int_equal(bind(fd, (struct sockaddr *) &snl, sizeof(snl)), 0);
+    assert_int_equal(getsockname(nfqc->nlsock_fd, (struct sockaddr *) dst, &len), 0);
+    assert_int_equal(setsockopt(nfqc->nlsock_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)), 0);
+
+    return fd;
+}
+
+/* Send a packet message the way netfilter queues one, with a payload of 'len' bytes of 'id' and any
+    non-zero NFQA_SKB_INFO flags. */
+static void nfq_test_send_packet(int fd, const struct sockaddr_nl *dst, uint16_t queue, uint32_t id, uint32_t len,
+        uint32_t skbinfo)
+{
+    char buf[MNL_SOCKET_BUFFER_SIZE];
+    uint8_t payload[256];
+    struct nfqnl_msg_packet_hdr ph = { .packet_id = htonl(id) };
+
+    assert_true(len <= sizeof(payload));
+    memset(payload, id, len);
+    struct nlmsghdr *nlh = nfq_hdr_put(buf, NFQNL_MSG_PACKET, queue);
+    mnl_attr_put(nlh, NFQA_PACKET_HDR, sizeof(ph), &ph);
+    mnl_attr_put(nlh, NFQA_PAYLOAD, len, payload);
+    if (skbinfo)
+        mnl_attr_put_u32(nlh, NFQA_SKB_INFO, htonl(skbinfo));
+    assert_int_equal(sendto(fd, buf, nlh->nlmsg_len, 0, (const struct sockaddr *) dst, sizeof(*dst)),
+            nlh->nlmsg_len);
+}
+
+/* Close the open runs and decode everything that the next flush would send. */
+static unsigned nfq_test_pending_verdicts(Nfq_Context_t *nfqc, TestVerdict *verdicts)
+{
+    for (unsigned i = 0; nfqc->open_runs > 0 && i < nfqc->num_queues; i++)
+        nfq_close_verdict_run(nfqc, &nfqc->queues[i]);
+    nfq_gather_verdict_buf(nfqc);
+
+    size_t len = 0;
+    for (unsigned i = 0; i < nfqc->verdict_iovcnt; i++)
+    {
+        assert_true(len + nfqc->verdict_iovs[i].iov_len <= sizeof(sent));
+        memcpy(sent + len, nfqc->verdict_iovs[i].iov_base, nfqc->verdict_iovs[i].iov_len);
+        len += nfqc->verdict_iovs[i].iov_len;
+    }
+
+    unsigned count = 0;
+    for (size_t off = 0; off < len; )
+    {
+        struct nlmsghdr *nlh = (struct nlmsghdr *) (sent + off);
+        assert_true(count < TEST_MAX_VERDICTS);
+        TestVerdict *v = &verdicts[count++];
+        memset(v, 0, sizeof(*v));
+        assert_int_equal(nlh->nlmsg_type >> 8, NFNL_SUBSYS_QUEUE);
+        v->type = nlh->nlmsg_type & 0xff;
+        const struct nfgenmsg *nfg = mnl_nlmsg_get_payload(nlh);
+        v->queue = ntohs(nfg->res_id);
+
+        struct nlattr *attr;
+        mnl_attr_for_each(attr, nlh, sizeof(struct nfgenmsg))
+        {
+            if (mnl_attr_get_type(attr) == NFQA_VERDICT_HDR)
+            {
+                const struct nfqnl_msg_verdict_hdr *vh = mnl_attr_get_payload(attr);
+                v->id = ntohl(vh->id);
+                v->verdict = ntohl(vh->verdict);
+            }
+            else if (mnl_attr_get_type(attr) == NFQA_PAYLOAD)
+            {
+                v->payload = mnl_attr_get_payload(attr);
+                v->plen = mnl_attr_get_payload_len(attr);
+            }
+            else if (mnl_attr_get_type(attr) == NFQA_CT)
+            {
+                struct nlattr *nested;
+                v->ct = true;
+                mnl_attr_for_each_nested(nested, attr)
+                {
+                    if (mnl_attr_get_type(nested) == CTA_MARK)
+                        v->ct_mark = ntohl(mnl_attr_get_u32(nested));
+                    else if (mnl_attr_get_type(nested) == CTA_MARK_MASK)
+                        v->ct_mask = ntohl(mnl_attr_get_u32(nested));
+                }
+            }
+        }
+        off += MNL_ALIGN(nlh->nlmsg_len);
+    }
+
+    return count;
+}
+
+static uint32_t csum_sum(uint32_t sum, const uint8_t *data, uint32_t len)
+{
+    for (uint32_t i = 0; i + 1 < len; i += 2)
+        sum += (data[i] << 8) | data[i + 1];
+    if (len & 1)
+        sum += data[len - 1] << 8;
+    return sum;
+}
+
+/* Whether the TCP or UDP checksum of an IPv4 or IPv6 packet verifies */
+static bool l4_checksum_ok(const uint8_t *pkt)
+{
+    const uint8_t *l4;
+    uint32_t l4len;
+    uint32_t sum;
+
+    if ((pkt[0] >> 4) == 4)
+    {
+        uint32_t hlen = (pkt[0] & 0x0f) * 4;
+        l4 = pkt + hlen;
+        l4len = ((pkt[2] << 8) | pkt[3]) - hlen;
+        sum = csum_sum(pkt[9], pkt + 12, 8);
+    }
+    else
+    {
+        l4 = pkt + 40;
+        l4len = (pkt[4] << 8) | pkt[5];
+        sum = csum_sum(pkt[6], pkt + 8, 32);
+    }
+    sum = csum_sum(sum + l4len, l4, l4len);
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+
+    return sum == 0xffff;
+}
+
+static void fill_l4(uint8_t *l4, uint32_t l4len)
+{
+    for (uint32_t i = 0; i < l4len; i++)
+        l4[i] = i * 7 + 3;
+}
+
+static uint32_t build_ipv4(uint8_t *pkt, uint8_t proto, uint32_t l4len, uint32_t options)
+{
+    static const uint8_t addrs[] = { 192, 168, 1, 10, 10, 0, 0, 1 };
+    uint32_t hlen = 20 + options;
+
+    memset(pkt, 0, hlen);
+    pkt[0] = 0x40 | (hlen / 4);
+    pkt[2] = (hlen + l4len) >> 8;
+    pkt[3] = (hlen + l4len) & 0xff;
+    pkt[8] = 64;
+    pkt[9] = proto;
+    memcpy(pkt + 12, addrs, sizeof(addrs));
+    fill_l4(pkt + hlen, l4len);
+
+    return hlen + l4len;
+}
+
+static uint32_t build_ipv6(uint8_t *pkt, uint8_t proto, uint32_t l4len)
+{
+    memset(pkt, 0, 40);
+    pkt[0] = 0x60;
+    pkt[4] = l4len >> 8;
+    pkt[5] = l4len & 0xff;
+    pkt[6] = proto;
+    pkt[7] = 64;
+    for (int i = 8; i < 40; i++)
+        pkt[i] = i;
+    fill_l4(pkt + 40, l4len);
+
+    return 40 + l4len;
+}
+
+static void check_no_checksum_fix(uint8_t *pkt, uint32_t len)
+{
+    uint8_t orig[256];
+
+    memcpy(orig, pkt, sizeof(orig));
+    assert_false(nfq_fix_l4_checksum(pkt, len));
+    assert_memory_equal(pkt, orig, sizeof(orig));
+}
+
+static void test_verdict_runs(void **state)
+{
+    Nfq_Context_t *nfqc = (Nfq_Context_t *) *state;
+    const DAQ_Msg_t *msgs[6];
+    TestVerdict verdicts[TEST_MAX_VERDICTS];
+
+    for (unsigned i = 0; i < 6; i++)
+        msgs[i] = nfq_test_hold(nfqc, 0, i + 1);
+
+    /* The three oldest packets make up a run, the fifth is finalized out of order and the fourth
+        starts a new run with a different verdict.  The sixth is still held, so nothing is sent. */
+    assert_int_equal(nfq_daq_msg_finalize(nfqc, msgs[0], DAQ_VERDICT_PASS), DAQ_SUCCESS);
+    assert_int_equal(nfq_daq_msg_finalize(nfqc, msgs[1], DAQ_VERDICT_WHITELIST), DAQ_SUCCESS);
+    assert_int_equal(nfq_daq_msg_finalize(nfqc, msgs[2], DAQ_VERDICT_IGNORE), DAQ_SUCCESS);
+    assert_int_equal(nfq_daq_msg_finalize(nfqc, msgs[4], DAQ_VERDICT_PASS), DAQ_SUCCESS);
+    assert_int_equal(nfq_daq_msg_finalize(nfqc, msgs[3], DAQ_VERDICT_BLOCK), DAQ_SUCCESS);
+    assert_int_equal(nfqc->verdicts_pending, 5);
+    assert_int_equal(nfqc->verdict_sends, 0);
+
+    assert_int_equal(nfq_test_pending_verdicts(nfqc, verdicts), 3);
+    assert_int_equal(verdicts[0].type, NFQNL_MSG_VERDICT);
+    assert_int_equal(verdicts[0].id, 5);
+    assert_int_equal(verdicts[0].verdict, NF_ACCEPT);
+    assert_int_equal(verdicts[1].type, NFQNL_MSG_VERDICT_BATCH);
+    assert_int_equal(verdicts[1].id, 3);
+    assert_int_equal(verdicts[1].verdict, NF_ACCEPT);
+    /* A run of one is sent as a plain verdict */
+    assert_int_equal(verdicts[2].type, NFQNL_MSG_VERDICT);
+    assert_int_equal(verdicts[2].id, 4);
+    assert_int_equal(verdicts[2].verdict, NF_DROP);
+
+    assert_int_equal(nfqc->verdict_msgs, 3);
+    assert_int_equal(nfqc->verdict_batches, 1);
+    assert_int_equal(nfqc->verdicts_batched, 3);
+    assert_int_equal(nfqc->queues[0].packets_accepted, 4);
+    assert_int_equal(nfqc->queues[0].packets_dropped, 1);
+}
+
+static void test_verdict_runs_per_queue(void **state)
+{
+    Nfq_Context_t *nfqc = (Nfq_Context_t *) *state;
+    const DAQ_Msg_t *msgs[4];
+    TestVerdict verdicts[TEST_MAX_VERDICTS];
+
+    /* Packet IDs are only ordered within a queue, so interleaved packets still make up one run per
+        queue. */
+    msgs[0] = nfq_test_hold(nfqc, 0, 10);
+    msgs[1] = nfq_test_hold(nfqc, 1, 20);
+    msgs[2] = nfq_test_hold(nfqc, 0, 11);
+    msgs[3] = nfq_test_hold(nfqc, 1, 21);
+    nfq_test_hold(nfqc, 0, 12);
+    for (unsigned i = 0; i < 4; i++)
+        assert_int_equal(nfq_daq_msg_finalize(nfqc, msgs[i], DAQ_VERDICT_PASS), DAQ_SUCCESS);
+    assert_int_equal(nfqc->open_runs, 2);
+
+    assert_int_equal(nfq_test_pending_verdicts(nfqc, verdicts), 2);
+    for (unsigned i = 0; i < 2; i++)
+    {
+        assert_int_equal(verdicts[i].type, NFQNL_MSG_VERDICT_BATCH);
+        assert_int_equal(verdicts[i].queue, i);
+        assert_int_equal(verdicts[i].verdict, NF_ACCEPT);
+    }
+    assert_int_equal(verdicts[0].id, 11);
+    assert_int_equal(verdicts[1].id, 21);
+    assert_int_equal(nfqc->open_runs, 0);
+}
+
+static void test_receive_batches(void **state)
+{
+    Nfq_Context_t *nfqc = (Nfq_Context_t *) *state;
+    const DAQ_Msg_t *msgs[TEST_POOL_SIZE];
+    DAQ_RecvStatus rstat;
+    struct sockaddr_nl dst;
+
+    int fd = nfq_test_connect(nfqc, &dst);
+    if (fd == -1)
+        skip();
+
+    /* Everything already queued is drained by a single call, and coming up short of what could be
+        taken means that the socket is empty. */
+    for (uint32_t id = 1; id <= 3; id++)
+        nfq_test_send_packet(fd, &dst, 0, id, id * 10, 0);
+    assert_int_equal(nfq_daq_msg_receive(nfqc, TEST_POOL_SIZE, msgs, &rstat), 3);
+    assert_int_equal(rstat, DAQ_RSTAT_WOULD_BLOCK);
+    assert_int_equal(nfqc->recv_calls, 1);
+    for (uint32_t i = 0; i < 3; i++)
+    {
+        const NfqPktDesc *desc = (const NfqPktDesc *) msgs[i]->priv;
+        assert_int_equal(ntohl(desc->nlph->packet_id), i + 1);
+        assert_int_equal(msgs[i]->data_len, (i + 1) * 10);
+        assert_int_equal(msgs[i]->data[0], i + 1);
+        assert_int_equal(desc->pkthdr.pktlen, (i + 1) * 10);
+        assert_ptr_equal(desc->queue, &nfqc->queues[0]);
+    }
+    assert_int_equal(nfqc->pool.info.available, TEST_POOL_SIZE - 3);
+
+    /* A receive stops at its maximum, then takes as many as there are free descriptors. */
+    for (uint32_t id = 4; id <= 7; id++)
+        nfq_test_send_packet(fd, &dst, id % 2, id, 20, 0);
+    assert_int_equal(nfq_daq_msg_receive(nfqc, 2, msgs, &rstat), 2);
+    assert_int_equal(rstat, DAQ_RSTAT_OK);
+    assert_int_equal(nfq_daq_msg_receive(nfqc, TEST_POOL_SIZE, msgs, &rstat), 2);
+    assert_int_equal(rstat, DAQ_RSTAT_WOULD_BLOCK);
+    assert_int_equal(nfqc->recv_calls, 3);
+    assert_int_equal(nfqc->queues[0].packets_received, 5);
+    assert_int_equal(nfqc->queues[1].packets_received, 2);
+
+    /* With nothing queued, the first datagram is waited for until the socket's receive timeout. */
+    assert_int_equal(nfq_daq_msg_receive(nfqc, TEST_POOL_SIZE, msgs, &rstat), 0);
+    assert_int_equal(rstat, DAQ_RSTAT_TIMEOUT);
+
+    /* A packet from a queue that isn't bound is an error and doesn't use up its descriptor. */
+    nfq_test_send_packet(fd, &dst, 7, 8, 20, 0);
+    assert_int_equal(nfq_daq_msg_receive(nfqc, TEST_POOL_SIZE, msgs, &rstat), 0);
+    assert_int_equal(rstat, DAQ_RSTAT_ERROR);
+    assert_int_equal(nfqc->pool.info.available, 1);
+
+    nfq_test_send_packet(fd, &dst, 1, 9, 20, 0);
+    assert_int_equal(nfq_daq_msg_receive(nfqc, TEST_POOL_SIZE, msgs, &rstat), 1);
+    assert_int_equal(rstat, DAQ_RSTAT_NOBUF);
+    assert_int_equal(nfq_daq_msg_receive(nfqc, TEST_POOL_SIZE, msgs, &rstat), 0);
+    assert_int_equal(rstat, DAQ_RSTAT_NOBUF);
+    assert_int_equal(nfqc->stats.packets_received, 8);
+
+    close(fd);
+}
+
+/* Parse a queue specification for one instance and check the queues it binds, in order. */
+static void check_queues(const char *input, unsigned total_instances, unsigned instance_id,
+        unsigned num_queues, const uint16_t *queues)
+{
+    Nfq_Context_t nfqc = { 0 };
+
+    assert_int_equal(nfq_parse_queues(&nfqc, input, total_instances, instance_id), DAQ_SUCCESS);
+    assert_int_equal(nfqc.num_queues, num_queues);
+    for (unsigned i = 0; i < num_queues; i++)
+        assert_int_equal(nfqc.queues[i].num, queues[i]);
+    free(nfqc.queues);
+}
+
+static void check_queues_invalid(const char *input, unsigned total_instances, unsigned instance_id)
+{
+    Nfq_Context_t nfqc = { 0 };
+
+    assert_int_equal(nfq_parse_queues(&nfqc, input, total_instances, instance_id), DAQ_ERROR_INVAL);
+    assert_int_equal(nfqc.num_queues, 0);
+    assert_null(nfqc.queues);
+}
+
+static void test_parse_queues(void **state)
+{
+    check_queues("3", 1, 0, 1, (const uint16_t[]) { 3 });
+    check_queues("0-3,7,9-10", 1, 0, 7, (const uint16_t[]) { 0, 1, 2, 3, 7, 9, 10 });
+    check_queues("5-5", 1, 0, 1, (const uint16_t[]) { 5 });
+    check_queues("65534-65535", 1, 0, 2, (const uint16_t[]) { 65534, 65535 });
+
+    /* Reversed and overflowing ranges */
+    check_queues_invalid("3-1", 1, 0);
+    check_queues_invalid("65536", 1, 0);
+    check_queues_invalid("65530-65536", 1, 0);
+    check_queues_invalid("18446744073709551616", 1, 0);
+    check_queues_invalid("-1", 1, 0);
+
+    /* Empty and malformed lists */
+    check_queues_invalid("", 1, 0);
+    check_queues_invalid(",", 1, 0);
+    check_queues_invalid("1,", 1, 0);
+    check_queues_invalid(",1", 1, 0);
+    check_queues_invalid("1,,2", 1, 0);
+    check_queues_invalid("1-", 1, 0);
+    check_queues_invalid("1-2-3", 1, 0);
+    check_queues_invalid("1:3", 1, 0);
+    check_queues_invalid("one", 1, 0);
+
+    /* Queues given more than once */
+    check_queues_invalid("1,1", 1, 0);
+    check_queues_invalid("0-3,2", 1, 0);
+}
+
+static void test_parse_queues_instances(void **state)
+{
+    /* Queues are dealt out among the instances in order. */
+    check_queues("0-5", 2, 1, 3, (const uint16_t[]) { 0, 2, 4 });
+    check_queues("0-5", 2, 2, 3, (const uint16_t[]) { 1, 3, 5 });
+    check_queues("0-4", 2, 2, 2, (const uint16_t[]) { 1, 3 });
+    check_queues("8,0-2,5", 3, 3, 1, (const uint16_t[]) { 1 });
+    check_queues("0-6", 3, 1, 3, (const uint16_t[]) { 0, 3, 6 });
+
+    /* Exactly one queue per instance */
+    check_queues("10-13", 4, 4, 1, (const uint16_t[]) { 13 });
+
+    /* Instance IDs past the number of instances wrap around. */
+    check_queues("0-5", 3, 4, 2, (const uint16_t[]) { 0, 3 });
+
+    /* A single queue is bound by every instance, and a single instance binds every queue. */
+    check_queues("3", 4, 2, 1, (const uint16_t[]) { 3 });
+    check_queues("0-3", 1, 0, 4, (const uint16_t[]) { 0, 1, 2, 3 });
+    check_queues("0-3", 1, 5, 4, (const uint16_t[]) { 0, 1, 2, 3 });
+
+    /* More instances than queues, and an instance that doesn't know which one it is */
+    check_queues_invalid("0-1", 3, 1);
+    check_queues_invalid("0-3", 2, 0);
+}
+
+static void test_parse_ct_mark(void **state)
+{
+    NfqCtMark ctmark = { 0 };
+
+    assert_true(nfq_parse_ct_mark("5", &ctmark));
+    assert_int_equal(ctmark.value, 5);
+    assert_int_equal(ctmark.mask, UINT32_MAX);
+    assert_true(ctmark.enabled);
+
+    assert_true(nfq_parse_ct_mark("0x10/0xf0", &ctmark));
+    assert_int_equal(ctmark.value, 0x10);
+    assert_int_equal(ctmark.mask, 0xf0);
+    assert_true(nfq_parse_ct_mark("010", &ctmark));
+    assert_int_equal(ctmark.value, 8);
+    assert_true(nfq_parse_ct_mark("0/0x1", &ctmark));
+    assert_int_equal(ctmark.value, 0);
+    assert_int_equal(ctmark.mask, 1);
+    assert_true(nfq_parse_ct_mark("0xffffffff", &ctmark));
+    assert_int_equal(ctmark.value, UINT32_MAX);
+
+    /* A failed parse leaves the previous setting alone */
+    assert_false(nfq_parse_ct_mark("0x100000000", &ctmark));
+    assert_false(nfq_parse_ct_mark("1/0x100000000", &ctmark));
+    assert_false(nfq_parse_ct_mark("-1", &ctmark));
+    assert_false(nfq_parse_ct_mark("", &ctmark));
+    assert_false(nfq_parse_ct_mark("/1", &ctmark));
+    assert_false(nfq_parse_ct_mark("1/", &ctmark));
+    assert_false(nfq_parse_ct_mark("1x", &ctmark));
+    assert_false(nfq_parse_ct_mark("1/2/3", &ctmark));
+    /* A zero mask, or a mark with bits outside of its mask */
+    assert_false(nfq_parse_ct_mark("0/0", &ctmark));
+    assert_false(nfq_parse_ct_mark("0x10/0x0f", &ctmark));
+    assert_int_equal(ctmark.value, UINT32_MAX);
+    assert_int_equal(ctmark.mask, UINT32_MAX);
+}
+
+static void test_verdict_ct_mark(void **state)
+{
+    Nfq_Context_t *nfqc = (Nfq_Context_t *) *state;
+    const DAQ_Msg_t *msgs[4];
+    TestVerdict verdicts[TEST_MAX_VERDICTS];
+
+    assert_true(nfq_parse_ct_mark("0x2/0x3", &nfqc->whitelist_mark));
+    for (unsigned i = 0; i < 4; i++)
+        msgs[i] = nfq_test_hold(nfqc, 0, i + 1);
+
+    /* Batch verdicts can't carry a mark, so a marked verdict on the oldest packet gets its own
+        message, leaving the open run alone.  Blacklisting without a mark is a plain drop. */
+    assert_int_equal(nfq_daq_msg_finalize(nfqc, msgs[0], DAQ_VERDICT_PASS), DAQ_SUCCESS);
+    assert_int_equal(nfq_daq_msg_finalize(nfqc, msgs[1], DAQ_VERDICT_WHITELIST), DAQ_SUCCESS);
+    assert_int_equal(nfq_daq_msg_finalize(nfqc, msgs[2], DAQ_VERDICT_BLACKLIST), DAQ_SUCCESS);
+
+    assert_int_equal(nfq_test_pending_verdicts(nfqc, verdicts), 3);
+    assert_int_equal(verdicts[0].id, 2);
+    assert_int_equal(verdicts[0].verdict, NF_ACCEPT);
+    assert_true(verdicts[0].ct);
+    assert_int_equal(verdicts[0].ct_mark, 0x2);
+    assert_int_equal(verdicts[0].ct_mask, 0x3);
+    assert_int_equal(verdicts[1].id, 1);
+    assert_false(verdicts[1].ct);
+    assert_int_equal(verdicts[2].id, 3);
+    assert_int_equal(verdicts[2].verdict, NF_DROP);
+    assert_false(verdicts[2].ct);
+    assert_int_equal(nfqc->whitelist_marked, 1);
+    assert_int_equal(nfqc->blacklist_marked, 0);
+}
+
+static void test_receive_offload(void **state)
+{
+    Nfq_Context_t *nfqc = (Nfq_Context_t *) *state;
+    const DAQ_Msg_t *msgs[TEST_POOL_SIZE];
+    DAQ_RecvStatus rstat;
+    struct sockaddr_nl dst;
+
+    int fd = nfq_test_connect(nfqc, &dst);
+    if (fd == -1)
+        skip();
+
+    nfq_test_send_packet(fd, &dst, 0, 1, 20, NFQA_SKB_GSO | NFQA_SKB_CSUMNOTREADY);
+    nfq_test_send_packet(fd, &dst, 0, 2, 20, NFQA_SKB_CSUM_NOTVERIFIED);
+    nfq_test_send_packet(fd, &dst, 0, 3, 20, 0);
+    assert_int_equal(nfq_daq_msg_receive(nfqc, TEST_POOL_SIZE, msgs, &rstat), 3);
+
+    const DAQ_PktOffloadInfo_t *offload = daq_msg_find_meta(msgs[0], offload_meta_type);
+    assert_non_null(offload);
+    assert_int_equal(offload->flags, DAQ_OFFLOAD_FLAG_GSO | DAQ_OFFLOAD_FLAG_CSUM_PARTIAL);
+    offload = daq_msg_find_meta(msgs[1], offload_meta_type);
+    assert_non_null(offload);
+    assert_int_equal(offload->flags, DAQ_OFFLOAD_FLAG_CSUM_NOT_VERIFIED);
+    assert_null(daq_msg_find_meta(msgs[2], offload_meta_type));
+    /* The timestamp is there either way. */
+    assert_non_null(daq_msg_find_meta(msgs[0], timestamp_meta_type));
+    assert_non_null(daq_msg_find_meta(msgs[2], timestamp_meta_type));
+    assert_int_equal(nfqc->gso_packets, 1);
+    assert_int_equal(nfqc->csum_partial_packets, 1);
+
+    close(fd);
+}
+
+static void test_fix_l4_checksum(void **state)
+{
+    uint8_t pkt[256];
+    uint32_t len;
+
+    len = build_ipv4(pkt, IPPROTO_TCP, 40, 0);
+    assert_true(nfq_fix_l4_checksum(pkt, len));
+    assert_true(l4_checksum_ok(pkt));
+
+    /* IPv4 options and an odd number of bytes */
+    len = build_ipv4(pkt, IPPROTO_UDP, 33, 8);
+    assert_true(nfq_fix_l4_checksum(pkt, len));
+    assert_true(l4_checksum_ok(pkt));
+
+    len = build_ipv6(pkt, IPPROTO_TCP, 20);
+    assert_true(nfq_fix_l4_checksum(pkt, len));
+    assert_true(l4_checksum_ok(pkt));
+
+    len = build_ipv6(pkt, IPPROTO_UDP, 9);
+    assert_true(nfq_fix_l4_checksum(pkt, len));
+    assert_true(l4_checksum_ok(pkt));
+
+    /* Padding past the end of the IP packet isn't part of the segment */
+    len = build_ipv4(pkt, IPPROTO_UDP, 20, 0);
+    memset(pkt + len, 0xaa, 6);
+    assert_true(nfq_fix_l4_checksum(pkt, len + 6));
+    assert_true(l4_checksum_ok(pkt));
+
+    /* A UDP checksum that comes out as zero is sent as all ones: make the rest of the segment add up
+        to the complement of the checksum by appending it. */
+    len = build_ipv4(pkt, IPPROTO_UDP, 12, 0);
+    pkt[28] = pkt[29] = 0;
+    assert_true(nfq_fix_l4_checksum(pkt, len));
+    pkt[28] = pkt[26];
+    pkt[29] = pkt[27];
+    assert_true(nfq_fix_l4_checksum(pkt, len));
+    assert_int_equal(pkt[26], 0xff);
+    assert_int_equal(pkt[27], 0xff);
+    assert_true(l4_checksum_ok(pkt));
+}
+
+static void test_fix_l4_checksum_unsupported(void **state)
+{
+    uint8_t pkt[256] = { 0 };
+    uint32_t len;
+
+    check_no_checksum_fix(pkt, 0);
+
+    /* Fragments, with more fragments to come or past the first */
+    len = build_ipv4(pkt, IPPROTO_UDP, 20, 0);
+    pkt[6] = 0x20;
+    check_no_checksum_fix(pkt, len);
+    len = build_ipv4(pkt, IPPROTO_UDP, 20, 0);
+    pkt[7] = 0x01;
+    check_no_checksum_fix(pkt, len);
+
+    /* Truncated packets and bad header lengths */
+    len = build_ipv4(pkt, IPPROTO_TCP, 20, 0);
+    check_no_checksum_fix(pkt, len - 1);
+    check_no_checksum_fix(pkt, 19);
+    pkt[0] = 0x44;
+    check_no_checksum_fix(pkt, len);
+    len = build_ipv6(pkt, IPPROTO_UDP, 8);
+    check_no_checksum_fix(pkt, len - 1);
+    check_no_checksum_fix(pkt, 39);
+
+    /* Transport headers that don't fit, other protocols and extension headers */
+    len = build_ipv4(pkt, IPPROTO_TCP, 19, 0);
+    check_no_checksum_fix(pkt, len);
+    len = build_ipv4(pkt, IPPROTO_UDP, 7, 0);
+    check_no_checksum_fix(pkt, len);
+    len = build_ipv4(pkt, IPPROTO_ICMP, 8, 0);
+    check_no_checksum_fix(pkt, len);
+    len = build_ipv6(pkt, IPPROTO_HOPOPTS, 16);
+    check_no_checksum_fix(pkt, len);
+
+    /* Not IP at all */
+    len = build_ipv4(pkt, IPPROTO_TCP, 20, 0);
+    pkt[0] = 0x55;
+    check_no_checksum_fix(pkt, len);
+}
+
+static void test_replace_fixes_checksum(void **state)
+{
+    Nfq_Context_t *nfqc = (Nfq_Context_t *) *state;
+    const DAQ_Msg_t *msgs[2];
+
+    for (unsigned i = 0; i < 2; i++)
+    {
+        msgs[i] = nfq_test_hold(nfqc, 0, i + 1);
+        NfqPktDesc *desc = (NfqPktDesc *) msgs[i]->priv;
+        desc->msg.data_len = desc->pkthdr.pktlen = build_ipv4(desc->msg.data, IPPROTO_TCP, 40, 0);
+    }
+    nfq_test_hold(nfqc, 0, 3);
+
+    /* Only a packet whose checksum was left to be finished on transmit has it finished. */
+    ((NfqPktDesc *) msgs[0]->priv)->offload.flags = DAQ_OFFLOAD_FLAG_CSUM_PARTIAL;
+    assert_int_equal(nfq_daq_msg_finalize(nfqc, msgs[0], DAQ_VERDICT_REPLACE), DAQ_SUCCESS);
+    assert_true(l4_checksum_ok(msgs[0]->data));
+    assert_int_equal(nfq_daq_msg_finalize(nfqc, msgs[1], DAQ_VERDICT_REPLACE), DAQ_SUCCESS);
+    assert_false(l4_checksum_ok(msgs[1]->data));
+    assert_int_equal(nfqc->replace_csum_fixed, 1);
+}
+
+static void test_replace_in_place(void **state)
+{
+    Nfq_Context_t *nfqc = (Nfq_Context_t *) *state;
+    const DAQ_Msg_t *msgs[3];
+    TestVerdict verdicts[TEST_MAX_VERDICTS];
+
+    for (unsigned i = 0; i < 3; i++)
+    {
+        msgs[i] = nfq_test_hold(nfqc, 0, i + 1);
+        NfqPktDesc *desc = (NfqPktDesc *) msgs[i]->priv;
+        desc->msg.data_len = desc->pkthdr.pktlen = 41;
+        memset(desc->msg.data, 'a' + i, desc->msg.data_len);
+    }
+    nfq_test_hold(nfqc, 0, 4);
+
+    /* The replacement payload isn't copied; the verdict message is gathered from the verdict buffer,
+        the packet buffer and padding out to the attribute alignment. */
+    assert_int_equal(nfq_daq_msg_finalize(nfqc, msgs[1], DAQ_VERDICT_REPLACE), DAQ_SUCCESS);
+    assert_int_equal(nfqc->verdict_iovcnt, 3);
+    assert_ptr_equal(nfqc->verdict_iovs[1].iov_base, msgs[1]->data);
+    assert_int_equal(nfqc->verdict_iovs[1].iov_len, 41);
+    assert_int_equal(nfqc->verdict_iovs[2].iov_len, 3);
+    assert_int_equal(nfqc->verdict_payload_len, 44);
+
+    /* Replacing the data of a truncated packet would cut it short, so it's passed as it was. */
+    ((NfqPktDesc *) msgs[2]->priv)->pkthdr.pktlen = 1500;
+    assert_int_equal(nfq_daq_msg_finalize(nfqc, msgs[2], DAQ_VERDICT_REPLACE), DAQ_SUCCESS);
+    assert_int_equal(nfqc->replace_truncated, 1);
+    assert_int_equal(nfq_daq_msg_finalize(nfqc, msgs[0], DAQ_VERDICT_PASS), DAQ_SUCCESS);
+
+    /* The payload is sent as it is when the verdicts are flushed, not when it was finalized. */
+    memset(msgs[1]->data, 'z', 41);
+
+    assert_int_equal(nfq_test_pending_verdicts(nfqc, verdicts), 3);
+    assert_int_equal(verdicts[0].id, 2);
+    assert_int_equal(verdicts[0].verdict, NF_ACCEPT);
+    assert_int_equal(verdicts[0].plen, 41);
+    assert_memory_equal(verdicts[0].payload, msgs[1]->data, 41);
+    assert_int_equal(verdicts[1].id, 3);
+    assert_int_equal(verdicts[1].verdict, NF_ACCEPT);
+    assert_null(verdicts[1].payload);
+    assert_int_equal(verdicts[2].id, 1);
+    assert_null(verdicts[2].payload);
+}
+
+static void test_replace_too_large(void **state)
+{
+    Nfq_Context_t *nfqc = (Nfq_Context_t *) *state;
+
+    const DAQ_Msg_t *msg = nfq_test_hold(nfqc, 0, 1);
+    NfqPktDesc *desc = (NfqPktDesc *) msg->priv;
+    desc->msg.data_len = desc->pkthdr.pktlen = 1500;
+    nfq_test_hold(nfqc, 0, 2);
+
+    /* A replacement that can't fit in a datagram is refused, but the packet is still released. */
+    nfqc->verdict_send_max = 1024;
+    assert_int_equal(nfq_daq_msg_finalize(nfqc, msg, DAQ_VERDICT_REPLACE), DAQ_ERROR);
+    assert_int_equal(nfqc->verdict_buf_len, 0);
+    assert_int_equal(nfqc->pool.info.available, TEST_POOL_SIZE - 1);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_verdict_runs, nfq_test_setup, nfq_test_teardown),
+        cmocka_unit_test_setup_teardown(test_verdict_runs_per_queue, nfq_test_setup, nfq_test_teardown),
+        cmocka_unit_test_setup_teardown(test_receive_batches, nfq_test_setup, nfq_test_teardown),
+        cmocka_unit_test(test_parse_queues),
+        cmocka_unit_test(test_parse_queues_instances),
+        cmocka_unit_test(test_parse_ct_mark),
+        cmocka_unit_test_setup_teardown(test_verdict_ct_mark, nfq_test_setup, nfq_test_teardown),
+        cmocka_unit_test_setup_teardown(test_receive_offload, nfq_test_setup, nfq_test_teardown),
+        cmocka_unit_test(test_fix_l4_checksum),
+        cmocka_unit_test(test_fix_l4_checksum_unsupported),
+        cmocka_unit_test_setup_teardown(test_replace_fixes_checksum, nfq_test_setup, nfq_test_teardown),
+        cmocka_unit_test_setup_teardown(test_replace_in_place, nfq_test_setup, nfq_test_teardown),
+        cmocka_unit_test_setup_teardown(test_replace_too_large, nfq_test_setup, nfq_test_teardown),
+    };
+
+    daq_base_api.set_errbuf = test_set_errbuf;
+    offload_meta_type = daq_meta_type_register(DAQ_META_TYPE_OFFLOAD_INFO, sizeof(DAQ_PktOffloadInfo_t));
+    timestamp_meta_type = daq_meta_type_register(DAQ_META_TYPE_TIMESTAMP, sizeof(DAQ_PktTimestamp_t));
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
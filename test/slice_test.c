@@ -0,0 +1,234 @@
+/*
+** Copyright (C) 2021 Cisco and/or its affiliates. All rights reserved.
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation.  You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* The transport header search of the Slice module is private to it, so it is built into the test. */
+#include "slice/daq_slice.c"
+
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+#include <cmocka.h>
+
+#define ETH_LEN     14
+#define IPV4_LEN    20
+#define IPV6_LEN    40
+
+typedef struct
+{
+    SliceContext sc;
+    uint8_t pkt[256];
+} SliceTest;
+
+static int slice_test_setup(void **state)
+{
+    SliceTest *st = calloc(1, sizeof(*st));
+    if (!st)
+        return -1;
+    st->sc.mode = SLICE_MODE_L4;
+    st->sc.dlt = DLT_EN10MB;
+    *state = st;
+    return 0;
+}
+
+static int slice_test_teardown(void **state)
+{
+    free(*state);
+    return 0;
+}
+
+/* Fill in an Ethernet header followed by an IPv4 header with the given header length in words */
+static uint8_t *build_ipv4(uint8_t *pkt, uint8_t ihl, uint8_t proto)
+{
+    pkt[12] = 0x08;
+    pkt[13] = 0x00;
+    pkt[ETH_LEN] = 0x40 | ihl;
+    pkt[ETH_LEN + 9] = proto;
+    return pkt + ETH_LEN + ihl * 4;
+}
+
+/* Fill in an Ethernet header followed by an IPv6 header */
+static uint8_t *build_ipv6(uint8_t *pkt, uint8_t next)
+{
+    pkt[12] = 0x86;
+    pkt[13] = 0xdd;
+    pkt[ETH_LEN] = 0x60;
+    pkt[ETH_LEN + 6] = next;
+    return pkt + ETH_LEN + IPV6_LEN;
+}
+
+static void test_ipv4(void **state)
+{
+    SliceTest *st = (SliceTest *) *state;
+    SliceContext *sc = &st->sc;
+    uint8_t *l4;
+
+    /* TCP with 12 bytes of options */
+    l4 = build_ipv4(st->pkt, 5, 6);
+    l4[12] = 8 << 4;
+    assert_int_equal(slice_l4_length(sc, st->pkt, 100), ETH_LEN + IPV4_LEN + 32);
+
+    /* The payload kept past it is capped at the packet */
+    sc->payload = 10;
+    assert_int_equal(slice_l4_length(sc, st->pkt, 100), ETH_LEN + IPV4_LEN + 42);
+    sc->payload = 1000;
+    assert_int_equal(slice_l4_length(sc, st->pkt, 100), 100);
+    sc->payload = 0;
+
+    /* A TCP header whose data offset wasn't captured is assumed to have no options */
+    assert_int_equal(slice_l4_length(sc, st->pkt, ETH_LEN + IPV4_LEN + 12), ETH_LEN + IPV4_LEN + 12);
+    sc->payload = 4;
+    assert_int_equal(slice_l4_length(sc, st->pkt, ETH_LEN + IPV4_LEN + 12), ETH_LEN + IPV4_LEN + 12);
+    sc->payload = 0;
+
+    /* UDP and ICMP behind IP options */
+    memset(st->pkt, 0, sizeof(st->pkt));
+    build_ipv4(st->pkt, 6, 17);
+    assert_int_equal(slice_l4_length(sc, st->pkt, 100), ETH_LEN + 24 + 8);
+    build_ipv4(st->pkt, 5, 1);
+    assert_int_equal(slice_l4_length(sc, st->pkt, 100), ETH_LEN + IPV4_LEN + 8);
+
+    /* Neither later fragments nor unknown protocols have a transport header to keep */
+    st->pkt[ETH_LEN + 9] = 17;
+    st->pkt[ETH_LEN + 7] = 1;
+    assert_int_equal(slice_l4_length(sc, st->pkt, 100), ETH_LEN + IPV4_LEN);
+    st->pkt[ETH_LEN + 7] = 0;
+    st->pkt[ETH_LEN + 6] = 0x20;     // More Fragments alone is still the first fragment
+    assert_int_equal(slice_l4_length(sc, st->pkt, 100), ETH_LEN + IPV4_LEN + 8);
+    st->pkt[ETH_LEN + 9] = 47;
+    assert_int_equal(slice_l4_length(sc, st->pkt, 100), ETH_LEN + IPV4_LEN);
+}
+
+static void test_ipv6(void **state)
+{
+    SliceTest *st = (SliceTest *) *state;
+    SliceContext *sc = &st->sc;
+    uint8_t *ext;
+
+    build_ipv6(st->pkt, 17);
+    assert_int_equal(slice_l4_length(sc, st->pkt, 100), ETH_LEN + IPV6_LEN + 8);
+    st->pkt[ETH_LEN + 6] = 58;
+    assert_int_equal(slice_l4_length(sc, st->pkt, 100), ETH_LEN + IPV6_LEN + 8);
+
+    /* Hop-by-Hop Options of 16 bytes, then UDP */
+    ext = build_ipv6(st->pkt, 0);
+    ext[0] = 17;
+    ext[1] = 1;
+    assert_int_equal(slice_l4_length(sc, st->pkt, 100), ETH_LEN + IPV6_LEN + 16 + 8);
+
+    /* A first fragment carries the transport header, later ones don't */
+    memset(st->pkt, 0, sizeof(st->pkt));
+    ext = build_ipv6(st->pkt, 44);
+    ext[0] = 17;
+    ext[3] = 0x01;
+    assert_int_equal(slice_l4_length(sc, st->pkt, 100), ETH_LEN + IPV6_LEN + 8 + 8);
+    ext[3] = 0x08;
+    assert_int_equal(slice_l4_length(sc, st->pkt, 100), ETH_LEN + IPV6_LEN + 8);
+
+    /* An Authentication Header of 24 bytes, then TCP without options */
+    memset(st->pkt, 0, sizeof(st->pkt));
+    ext = build_ipv6(st->pkt, 51);
+    ext[0] = 6;
+    ext[1] = 4;
+    ext[24 + 12] = 5 << 4;
+    assert_int_equal(slice_l4_length(sc, st->pkt, 150), ETH_LEN + IPV6_LEN + 24 + 20);
+
+    /* Extension headers that weren't captured end the search */
+    memset(st->pkt, 0, sizeof(st->pkt));
+    ext = build_ipv6(st->pkt, 60);
+    ext[0] = 17;
+    assert_int_equal(slice_l4_length(sc, st->pkt, ETH_LEN + IPV6_LEN + 1), ETH_LEN + IPV6_LEN);
+    st->pkt[ETH_LEN + 6] = 44;
+    assert_int_equal(slice_l4_length(sc, st->pkt, ETH_LEN + IPV6_LEN + 7), ETH_LEN + IPV6_LEN);
+
+    /* A header length running past the capture is capped at it */
+    st->pkt[ETH_LEN + 6] = 43;
+    ext[1] = 255;
+    assert_int_equal(slice_l4_length(sc, st->pkt, 100), 100);
+}
+
+static void test_link_layer(void **state)
+{
+    SliceTest *st = (SliceTest *) *state;
+    SliceContext *sc = &st->sc;
+
+    /* Stacked VLAN tags */
+    st->pkt[12] = 0x88;
+    st->pkt[13] = 0xa8;
+    st->pkt[16] = 0x81;
+    st->pkt[17] = 0x00;
+    st->pkt[20] = 0x08;
+    st->pkt[21] = 0x00;
+    st->pkt[22] = 0x45;
+    st->pkt[22 + 9] = 17;
+    assert_int_equal(slice_l4_length(sc, st->pkt, 100), 22 + IPV4_LEN + 8);
+
+    /* Raw IP */
+    memset(st->pkt, 0, sizeof(st->pkt));
+    sc->dlt = DLT_RAW;
+    st->pkt[0] = 0x45;
+    st->pkt[9] = 17;
+    assert_int_equal(slice_l4_length(sc, st->pkt, 100), IPV4_LEN + 8);
+    st->pkt[0] = 0x60;
+    st->pkt[6] = 17;
+    assert_int_equal(slice_l4_length(sc, st->pkt, 100), IPV6_LEN + 8);
+
+    /* Unknown datalink types are delivered whole */
+    sc->dlt = DLT_NULL;
+    assert_int_equal(slice_l4_length(sc, st->pkt, 100), 100);
+}
+
+static void test_not_sliced(void **state)
+{
+    SliceTest *st = (SliceTest *) *state;
+    SliceContext *sc = &st->sc;
+
+    /* Not IP */
+    st->pkt[12] = 0x08;
+    st->pkt[13] = 0x06;
+    assert_int_equal(slice_l4_length(sc, st->pkt, 60), 60);
+
+    /* Too short for the network layer header */
+    assert_int_equal(slice_l4_length(sc, st->pkt, 10), 10);
+    build_ipv4(st->pkt, 5, 17);
+    assert_int_equal(slice_l4_length(sc, st->pkt, ETH_LEN + IPV4_LEN - 1), ETH_LEN + IPV4_LEN - 1);
+    memset(st->pkt, 0, sizeof(st->pkt));
+    build_ipv6(st->pkt, 17);
+    assert_int_equal(slice_l4_length(sc, st->pkt, ETH_LEN + IPV6_LEN - 1), ETH_LEN + IPV6_LEN - 1);
+
+    /* A version that doesn't match the EtherType, or an impossible IPv4 header length */
+    memset(st->pkt, 0, sizeof(st->pkt));
+    build_ipv4(st->pkt, 5, 17);
+    st->pkt[ETH_LEN] = 0x65;
+    assert_int_equal(slice_l4_length(sc, st->pkt, 100), 100);
+    build_ipv4(st->pkt, 4, 17);
+    assert_int_equal(slice_l4_length(sc, st->pkt, 100), 100);
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_ipv4, slice_test_setup, slice_test_teardown),
+        cmocka_unit_test_setup_teardown(test_ipv6, slice_test_setup, slice_test_teardown),
+        cmocka_unit_test_setup_teardown(test_link_layer, slice_test_setup, slice_test_teardown),
+        cmocka_unit_test_setup_teardown(test_not_sliced, slice_test_setup, slice_test_teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,231 @@
+/*
+** Copyright (C) 2021 Cisco and/or its affiliates. All rights reserved.
+**
+** This program is free software; you can redistribute it and/or modify
+** it under the terms of the GNU General Public License Version 2 as
+** published by the Free Software Foundation.  You may not use, modify or
+** distribute this program under any other version of the GNU General
+** Public License.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+
+/* The packet selection of the Trace module is private to it, so it is built into the test. */
+#include "trace/daq_trace.c"
+#include "trace/trace_format.c"
+
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+
+#include <cmocka.h>
+
+static void test_set_errbuf(DAQ_ModuleInstance_h modinst, const char *format, ...)
+{
+}
+
+static int trace_test_setup(void **state)
+{
+    TraceContext *tc = calloc(1, sizeof(*tc));
+    if (!tc)
+        return -1;
+    daq_base_api.set_errbuf = test_set_errbuf;
+    *state = tc;
+    return 0;
+}
+
+static int trace_test_teardown(void **state)
+{
+    TraceContext *tc = (TraceContext *) *state;
+#ifdef LIBPCAP_AVAILABLE
+    pcap_freecode(&tc->fcode);
+#endif
+    free(tc);
+    return 0;
+}
+
+static void init_packet(DAQ_Msg_t *msg, DAQ_PktHdr_t *hdr, uint8_t *data, uint32_t len)
+{
+    memset(msg, 0, sizeof(*msg));
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->pktlen = len;
+    msg->type = DAQ_MSG_TYPE_PACKET;
+    msg->hdr_len = sizeof(*hdr);
+    msg->hdr = hdr;
+    msg->data_len = len;
+    msg->data = data;
+}
+
+static void test_parse_flow_ids(void **state)
+{
+    TraceContext *tc = (TraceContext *) *state;
+
+    assert_int_equal(trace_parse_flow_ids(tc, "1,4294967295,0"), DAQ_SUCCESS);
+    assert_int_equal(tc->num_flow_ids, 3);
+    assert_int_equal(tc->flow_ids[0], 1);
+    assert_int_equal(tc->flow_ids[1], UINT32_MAX);
+    assert_int_equal(tc->flow_ids[2], 0);
+
+    /* Out of range, malformed and empty lists */
+    tc->num_flow_ids = 0;
+    assert_int_equal(trace_parse_flow_ids(tc, "4294967296"), DAQ_ERROR_INVAL);
+    assert_int_equal(trace_parse_flow_ids(tc, "-1"), DAQ_ERROR_INVAL);
+    assert_int_equal(trace_parse_flow_ids(tc, "12a"), DAQ_ERROR_INVAL);
+    assert_int_equal(trace_parse_flow_ids(tc, ""), DAQ_ERROR_INVAL);
+    assert_int_equal(trace_parse_flow_ids(tc, ",,"), DAQ_ERROR_INVAL);
+    assert_int_equal(tc->num_flow_ids, 0);
+
+    /* The table holds TRACE_MAX_FLOW_IDS entries and no more */
+    char list[TRACE_MAX_FLOW_IDS * 4 + 8] = "";
+    for (int i = 0; i < TRACE_MAX_FLOW_IDS; i++)
+        sprintf(list + strlen(list), "%d,", i);
+    assert_int_equal(trace_parse_flow_ids(tc, list), DAQ_SUCCESS);
+    assert_int_equal(tc->num_flow_ids, TRACE_MAX_FLOW_IDS);
+    tc->num_flow_ids = 0;
+    strcat(list, "64");
+    assert_int_equal(trace_parse_flow_ids(tc, list), DAQ_ERROR_INVAL);
+}
+
+static void test_parse_verdicts(void **state)
+{
+    TraceContext *tc = (TraceContext *) *state;
+
+    assert_int_equal(trace_parse_verdicts(tc, "block,blacklist"), DAQ_SUCCESS);
+    assert_int_equal(tc->verdicts, TRACE_VERDICT(DAQ_VERDICT_BLOCK) | TRACE_VERDICT(DAQ_VERDICT_BLACKLIST));
+
+    assert_int_equal(trace_parse_verdicts(tc, "pass,block,replace,whitelist,blacklist,ignore"), DAQ_SUCCESS);
+    assert_int_equal(tc->verdicts, TRACE_ALL_VERDICTS);
+
+    /* A failed parse leaves the previous setting alone */
+    assert_int_equal(trace_parse_verdicts(tc, "pass,drop"), DAQ_ERROR_INVAL);
+    assert_int_equal(trace_parse_verdicts(tc, "PASS"), DAQ_ERROR_INVAL);
+    assert_int_equal(trace_parse_verdicts(tc, ""), DAQ_ERROR_INVAL);
+    assert_int_equal(trace_parse_verdicts(tc, ","), DAQ_ERROR_INVAL);
+    assert_int_equal(tc->verdicts, TRACE_ALL_VERDICTS);
+}
+
+static void test_select_all(void **state)
+{
+    TraceContext *tc = (TraceContext *) *state;
+    static uint8_t data[64];
+    DAQ_Msg_t msg;
+    DAQ_PktHdr_t hdr;
+
+    init_packet(&msg, &hdr, data, sizeof(data));
+    for (int i = 0; i < 10; i++)
+        assert_true(trace_select_packet(tc, &msg));
+    assert_int_equal(tc->messages_selected, 10);
+    assert_int_equal(tc->messages_filtered, 0);
+}
+
+static void test_select_flow_ids_and_flags(void **state)
+{
+    TraceContext *tc = (TraceContext *) *state;
+    static uint8_t data[64];
+    DAQ_Msg_t msg;
+    DAQ_PktHdr_t hdr;
+
+    assert_int_equal(trace_parse_flow_ids(tc, "7,9"), DAQ_SUCCESS);
+    tc->flagged = DAQ_PKT_FLAG_TRACE_ENABLED;
+    init_packet(&msg, &hdr, data, sizeof(data));
+
+    hdr.flow_id = 9;
+    assert_true(trace_select_packet(tc, &msg));
+    hdr.flow_id = 8;
+    assert_false(trace_select_packet(tc, &msg));
+
+    /* Either selector matching is enough */
+    hdr.flags = DAQ_PKT_FLAG_TRACE_ENABLED;
+    assert_true(trace_select_packet(tc, &msg));
+    hdr.flags = DAQ_PKT_FLAG_SIGNIFICANT_GROUPS;
+    assert_false(trace_select_packet(tc, &msg));
+
+    assert_int_equal(tc->messages_selected, 2);
+    assert_int_equal(tc->messages_filtered, 2);
+}
+
+#ifdef LIBPCAP_AVAILABLE
+static void test_select_filter(void **state)
+{
+    TraceContext *tc = (TraceContext *) *state;
+    DAQ_Msg_t msg;
+    DAQ_PktHdr_t hdr;
+    uint8_t data[14 + 20 + 8] = { 0 };
+
+    assert_int_equal(pcap_compile_nopcap(65535, DLT_EN10MB, &tc->fcode, "udp", 1, PCAP_NETMASK_UNKNOWN), 0);
+
+    data[12] = 0x08;    // IPv4
+    data[14] = 0x45;
+    data[16] = 0;
+    data[17] = 28;
+    data[23] = 17;      // UDP
+    init_packet(&msg, &hdr, data, sizeof(data));
+    assert_true(trace_select_packet(tc, &msg));
+
+    data[23] = 6;       // TCP
+    assert_false(trace_select_packet(tc, &msg));
+
+    /* A flow ID still selects packets the filter doesn't match */
+    assert_int_equal(trace_parse_flow_ids(tc, "3"), DAQ_SUCCESS);
+    hdr.flow_id = 3;
+    assert_true(trace_select_packet(tc, &msg));
+}
+#endif
+
+static void test_select_sample_and_rate(void **state)
+{
+    TraceContext *tc = (TraceContext *) *state;
+    static uint8_t data[64];
+    DAQ_Msg_t msg;
+    DAQ_PktHdr_t hdr;
+    unsigned selected = 0;
+
+    init_packet(&msg, &hdr, data, sizeof(data));
+
+    /* One out of every three, starting with the first */
+    tc->sample_rate = 3;
+    for (int i = 0; i < 9; i++)
+    {
+        if (trace_select_packet(tc, &msg))
+        {
+            assert_int_equal(i % 3, 0);
+            selected++;
+        }
+    }
+    assert_int_equal(selected, 3);
+    assert_int_equal(tc->messages_unsampled, 6);
+
+    /* The rate limit applies to the sampled packets, until the count is reset for the next second */
+    tc->sample_rate = 1;
+    tc->max_rate = 2;
+    tc->rate_count = 0;
+    assert_true(trace_select_packet(tc, &msg));
+    assert_true(trace_select_packet(tc, &msg));
+    assert_false(trace_select_packet(tc, &msg));
+    assert_int_equal(tc->messages_rate_limited, 1);
+    tc->rate_count = 0;
+    assert_true(trace_select_packet(tc, &msg));
+}
+
+int main(void)
+{
+    const struct CMUnitTest tests[] = {
+        cmocka_unit_test_setup_teardown(test_parse_flow_ids, trace_test_setup, trace_test_teardown),
+        cmocka_unit_test_setup_teardown(test_parse_verdicts, trace_test_setup, trace_test_teardown),
+        cmocka_unit_test_setup_teardown(test_select_all, trace_test_setup, trace_test_teardown),
+        cmocka_unit_test_setup_teardown(test_select_flow_ids_and_flags, trace_test_setup, trace_test_teardown),
+#ifdef LIBPCAP_AVAILABLE
+        cmocka_unit_test_setup_teardown(test_select_filter, trace_test_setup, trace_test_teardown),
+#endif
+        cmocka_unit_test_setup_teardown(test_select_sample_and_rate, trace_test_setup, trace_test_teardown),
+    };
+
+    return cmocka_run_group_tests(tests, NULL, NULL);
+}